@@ -5,6 +5,7 @@
 #include "factoryllm.h"
 #include "utils.h"
 #include "fstream"
+#include <thread>
 
 static factoryllm fllm;
 static int modeltype = 0;
@@ -27,6 +28,15 @@ struct BenchmarkConfig {
     int batch = -1; // batch数, -1时使用文件中的行数作为batch
     std::string file; // 输入文件
     std::string output; // 输出文件，如果不设定则输出到屏幕
+    int arrival = -1; // 连续批处理模式下相邻两个请求到达的间隔(ms)，< 0 时使用ResponseBatch
+    std::vector <int> prefill; // 测试prefill延迟的prompt长度(token数)
+    std::string profile; // 记录每个op的耗时并导出到这个文件(chrome://tracing格式)
+    fastllm::DataType kvDataType = fastllm::DataType::FLOAT32; // KV cache的存储类型
+    bool repack = false; // 加载时是否把int4权重重排成CPU kernel的格式
+};
+
+std::map <std::string, fastllm::DataType> kvDataTypeDict = {
+        {"float32", fastllm::DataType::FLOAT32}, {"float16", fastllm::DataType::FLOAT16}, {"int8", fastllm::DataType::INT8}
 };
 
 void Usage() {
@@ -38,6 +48,11 @@ void Usage() {
     std::cout << "<-l|--limit> <args>:          输出token数限制" << std::endl;
     std::cout << "<-b|--batch> <args>:          batch数"      << std::endl;
     std::cout << "<-f|--file> <args>:           输入文件，文件中每行一个prompt，如果行数不足batch则用之前的prompt补充"      << std::endl;
+    std::cout << "<-a|--arrival> <args>:        连续批处理模式，每隔args毫秒提交一个请求" << std::endl;
+    std::cout << "<--prefill> <args>:           测试prefill延迟，args为prompt的token数，可以用逗号分隔多个值，例如512,1024,2048" << std::endl;
+    std::cout << "<--profile> <args>:           统计每个op的耗时并输出汇总表，同时把trace导出到args文件中(用chrome://tracing查看)" << std::endl;
+    std::cout << "<--kv_dtype> <args>:          KV cache的存储类型，可以设置为float32, float16, int8" << std::endl;
+    std::cout << "<--repack>:                   加载时把int4权重重排成CPU kernel的格式，结果缓存到模型文件名.repack" << std::endl;
 }
 
 void ParseArgs(int argc, char **argv, BenchmarkConfig &config) {
@@ -70,6 +85,29 @@ void ParseArgs(int argc, char **argv, BenchmarkConfig &config) {
             config.file = sargv[++i];
         } else if (sargv[i] == "-o" || sargv[i] == "--output") {
             config.output = sargv[++i];
+        } else if (sargv[i] == "-a" || sargv[i] == "--arrival") {
+            config.arrival = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--profile") {
+            config.profile = sargv[++i];
+        } else if (sargv[i] == "--kv_dtype") {
+            if (kvDataTypeDict.find(sargv[i + 1]) == kvDataTypeDict.end()) {
+                Usage();
+                exit(-1);
+            }
+            config.kvDataType = kvDataTypeDict[sargv[++i]];
+        } else if (sargv[i] == "--repack") {
+            config.repack = true;
+        } else if (sargv[i] == "--prefill") {
+            std::string s = sargv[++i];
+            size_t pos = 0;
+            while (pos < s.size()) {
+                size_t next = s.find(',', pos);
+                if (next == std::string::npos) {
+                    next = s.size();
+                }
+                config.prefill.push_back(atoi(s.substr(pos, next - pos).c_str()));
+                pos = next + 1;
+            }
         } else {
             Usage();
             exit(-1);
@@ -113,9 +151,172 @@ void uninitLLM()
     }
 }
 
+void WriteOutputs(const std::vector <std::string> &inputs, const std::vector <std::string> &outputs,
+                  const BenchmarkConfig &config) {
+    if (config.output != "") {
+        FILE *fo = fopen(config.output.c_str(), "w");
+        for (int i = 0; i < outputs.size(); i++) {
+            fprintf(fo, "[ user: \"%s\", model: \"%s\"]\n", inputs[i].c_str(), outputs[i].c_str());
+        }
+        fclose(fo);
+    } else {
+        for (int i = 0; i < outputs.size(); i++) {
+            printf("[ user: \"%s\", model: \"%s\"]\n", inputs[i].c_str(), outputs[i].c_str());
+        }
+    }
+}
+
+// 连续批处理: 请求按固定间隔陆续到达，通过LaunchResponseTokens / FetchResponseTokens提交和取回结果
+void ContinuousBatching(fastllm::basellm *model, const std::vector <std::string> &inputs,
+                        std::vector <std::string> &outputs, const BenchmarkConfig &config) {
+    int n = inputs.size();
+    outputs.clear();
+    outputs.resize(n, "");
+    std::vector <int> handles = std::vector <int> (n, -1);
+    std::vector <bool> finished = std::vector <bool> (n, false);
+    std::vector <int> tokenCnt = std::vector <int> (n, 0);
+    std::vector <fastllm::DecodeStream> decodeStreams = std::vector <fastllm::DecodeStream> (n, fastllm::DecodeStream(&model->weight.tokenizer));
+    std::vector <std::chrono::system_clock::time_point> submitTimes(n), firstTimes(n), lastTimes(n);
+
+    auto st = std::chrono::system_clock::now();
+    int submitted = 0, finishCnt = 0;
+    while (finishCnt < n) {
+        auto now = std::chrono::system_clock::now();
+        while (submitted < n && fastllm::GetSpan(st, now) * 1000 >= (double)submitted * config.arrival) {
+            fastllm::Data tokens = model->weight.tokenizer.Encode(inputs[submitted]);
+            std::vector <int> ids;
+            for (int i = 0; i < tokens.Count(0); i++) {
+                ids.push_back((int)((float*)tokens.cpuData)[i]);
+            }
+            submitTimes[submitted] = std::chrono::system_clock::now();
+            handles[submitted] = model->LaunchResponseTokens(ids, config.limit);
+            submitted++;
+        }
+
+        bool got = false;
+        for (int i = 0; i < submitted; i++) {
+            if (finished[i]) {
+                continue;
+            }
+            int ret;
+            while ((ret = model->FetchResponseTokens(handles[i], false)) >= 0) {
+                auto cur = std::chrono::system_clock::now();
+                if (tokenCnt[i] == 0) {
+                    firstTimes[i] = cur;
+                }
+                lastTimes[i] = cur;
+                tokenCnt[i]++;
+                outputs[i] += decodeStreams[i].Put(ret);
+                got = true;
+            }
+            if (ret == -1 || ret == -3) {
+                outputs[i] += decodeStreams[i].Flush();
+                finished[i] = true;
+                finishCnt++;
+            }
+        }
+        if (!got) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    float spend = fastllm::GetSpan(st, std::chrono::system_clock::now());
+
+    int tokens = 0;
+    std::vector <float> firstLatencys, perTokenLatencys;
+    for (int i = 0; i < n; i++) {
+        tokens += tokenCnt[i];
+        if (tokenCnt[i] > 0) {
+            firstLatencys.push_back(fastllm::GetSpan(submitTimes[i], firstTimes[i]) * 1000);
+        }
+        if (tokenCnt[i] > 1) {
+            perTokenLatencys.push_back(fastllm::GetSpan(firstTimes[i], lastTimes[i]) * 1000 / (tokenCnt[i] - 1));
+        }
+    }
+    std::sort(firstLatencys.begin(), firstLatencys.end());
+    std::sort(perTokenLatencys.begin(), perTokenLatencys.end());
+
+    printf("requests: %d, arrival interval = %d ms\n", n, config.arrival);
+    printf("output %d tokens\nuse %f s\nspeed = %f tokens / s\n", tokens, spend, tokens / spend);
+    if (firstLatencys.size() > 0) {
+        printf("first token latency: p50 = %f ms, p90 = %f ms, max = %f ms\n",
+               firstLatencys[firstLatencys.size() / 2], firstLatencys[firstLatencys.size() * 9 / 10], firstLatencys.back());
+    }
+    if (perTokenLatencys.size() > 0) {
+        printf("per token latency: p50 = %f ms, p90 = %f ms, max = %f ms\n",
+               perTokenLatencys[perTokenLatencys.size() / 2], perTokenLatencys[perTokenLatencys.size() * 9 / 10], perTokenLatencys.back());
+    }
+}
+
+// prefill延迟: 把第一个prompt重复到指定的token数，统计生成第一个token的时间
+void PrefillLatency(fastllm::basellm *model, const std::vector <std::string> &inputs, const BenchmarkConfig &config) {
+    fastllm::Data tokens = model->weight.tokenizer.Encode(inputs[0]);
+    std::vector <int> promptIds;
+    for (int i = 0; i < tokens.Count(0); i++) {
+        promptIds.push_back((int)((float*)tokens.cpuData)[i]);
+    }
+    for (int len : config.prefill) {
+        len = std::min(len, model->max_positions - 2); // 给特殊token留出位置
+        std::vector <int> ids;
+        while (ids.size() < len) {
+            ids.push_back(promptIds[ids.size() % promptIds.size()]);
+        }
+        fastllm::ClearPrefixCache(); // 不同长度的输入有公共前缀，测试时不复用
+        auto st = std::chrono::system_clock::now();
+        int handle = model->LaunchResponseTokens(ids, 1);
+        model->FetchResponseTokens(handle);
+        float spend = fastllm::GetSpan(st, std::chrono::system_clock::now());
+        while (model->FetchResponseTokens(handle) >= 0) {
+        }
+        printf("prefill %d tokens: %f ms, %f tokens / s\n", len, spend * 1000, len / spend);
+    }
+}
+
+// 使用ResponseBatch一次处理所有输入
+void BatchResponse(fastllm::basellm *model, const std::vector <std::string> &inputs,
+                   std::vector <std::string> &outputs, const BenchmarkConfig &config) {
+    static int tokens = 0;
+    static std::vector <std::chrono::system_clock::time_point> stepTimes; // 每轮解码结束的时间
+    auto st = std::chrono::system_clock::now();
+    model->ResponseBatch(inputs, outputs, [](int index, std::vector <std::string> &contents) {
+        if (index != -1) {
+            stepTimes.push_back(std::chrono::system_clock::now());
+            for (int i = 0; i < contents.size(); i++) {
+                tokens += (contents[i].size() > 0);
+            }
+        }
+    });
+    float spend = fastllm::GetSpan(st, std::chrono::system_clock::now());
+
+    WriteOutputs(inputs, outputs, config);
+
+    printf("batch: %d\n", (int)inputs.size());
+    printf("output %d tokens\nuse %f s\nspeed = %f tokens / s\n", tokens, spend, tokens / spend);
+    if (stepTimes.size() > 0) {
+        // 第一轮包含了prompt的处理，单独统计
+        float first = fastllm::GetSpan(st, stepTimes[0]);
+        printf("first token latency = %f ms\n", first * 1000);
+        if (stepTimes.size() > 1) {
+            std::vector <float> latencys;
+            for (int i = 1; i < stepTimes.size(); i++) {
+                latencys.push_back(fastllm::GetSpan(stepTimes[i - 1], stepTimes[i]) * 1000);
+            }
+            std::sort(latencys.begin(), latencys.end());
+            float sum = 0;
+            for (float latency : latencys) {
+                sum += latency;
+            }
+            printf("per token latency: avg = %f ms, p50 = %f ms, p90 = %f ms, max = %f ms\n",
+                   sum / latencys.size(), latencys[latencys.size() / 2],
+                   latencys[latencys.size() * 9 / 10], latencys.back());
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     BenchmarkConfig config;
     ParseArgs(argc, argv, config);
+    fastllm::SetKVCacheDataType(config.kvDataType);
+    fastllm::SetWeightRepack(config.repack);
     initLLMConf(config.model, config.path.c_str(), config.threads);
     chatGlm->output_token_limit = config.limit;
 
@@ -145,30 +346,27 @@ int main(int argc, char **argv) {
     }
 
     std::vector <std::string> outputs;
-    static int tokens = 0;
-    auto st = std::chrono::system_clock::now();
-    chatGlm->ResponseBatch(inputs, outputs, [](int index, std::vector <std::string> &contents) {
-        if (index != -1) {
-            for (int i = 0; i < contents.size(); i++) {
-                tokens += (contents[i].size() > 0);
-            }
-        }
-    });
-    float spend = fastllm::GetSpan(st, std::chrono::system_clock::now());
-
-    if (config.output != "") {
-        FILE *fo = fopen(config.output.c_str(), "w");
-        for (int i = 0; i < outputs.size(); i++) {
-            fprintf(fo, "[ user: \"%s\", model: \"%s\"]\n", inputs[i].c_str(), outputs[i].c_str());
-        }
-        fclose(fo);
+    if (config.profile != "") {
+        fastllm::SetProfiling(true);
+    }
+    if (config.prefill.size() > 0) {
+        fastllm::basellm *model = (config.model == 1 ? moss : (config.model == 2 ? vicuna : chatGlm));
+        PrefillLatency(model, inputs, config);
+    } else if (config.arrival >= 0) {
+        fastllm::basellm *model = (config.model == 1 ? moss : (config.model == 2 ? vicuna : chatGlm));
+        ContinuousBatching(model, inputs, outputs, config);
+        WriteOutputs(inputs, outputs, config);
     } else {
-        for (int i = 0; i < outputs.size(); i++) {
-            printf("[ user: \"%s\", model: \"%s\"]\n", inputs[i].c_str(), outputs[i].c_str());
-        }
+        BatchResponse(chatGlm, inputs, outputs, config);
+    }
+    if (fastllm::GetKVCachePaged()) {
+        // 块池中的块用完后不释放，这里就是运行过程中KV cache占用的最大内存
+        printf("kv cache memory = %f MB\n", fastllm::GetKVCacheMemoryUsed() / 1e6);
+    }
+    if (config.profile != "") {
+        fastllm::SetProfiling(false);
+        fastllm::PrintProfiler();
+        fastllm::SaveProfilerTrace(config.profile);
     }
-
-    printf("batch: %d\n", (int)inputs.size());
-    printf("output %d tokens\nuse %f s\nspeed = %f tokens / s\n", tokens, spend, tokens / spend);
     return 0;
 }
\ No newline at end of file
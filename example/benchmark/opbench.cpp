@@ -0,0 +1,923 @@
+//
+// Created by huangyuyang on 7/10/23.
+//
+
+// 算子微基准: 对比Linear / MatMul算子和朴素标量实现的GFLOP/s, 以及融合的Attention算子和拆开计算的耗时
+// 还可以对比不同存储类型的KV cache的内存、解码耗时和误差, 解码时采样的耗时, 以及各指令集kernel(包括int8 / int4 Linear)的耗时和误差
+// 以及分词器在长prompt上的编码速度, 解码阶段小形状算子的调度开销
+
+#include "fastllm.h"
+#include "utils.h"
+#include "devices/cpu/cpudevice.h"
+#include "devices/cpu/cputhreadpool.h"
+#include "devices/cpu/cpukernels.h"
+
+#include <cmath>
+#include <cstring>
+
+struct OpBenchConfig {
+    int threads = 4; // 使用的线程数
+    int m = 4096; // 输入维度
+    int k = 4096; // 输出维度
+    std::vector <int> ns = {1, 4, 16, 64}; // 测试的输入行数
+    int repeat = 10; // 每组重复次数
+    std::string op = "all"; // 测试的算子: linear, attention, kvcache, sampling, kernels, quantlinear, tokenizer, dispatch, all
+    int heads = 32; // attention测试的头数
+    int headDim = 128; // attention测试的每个头的维度
+    std::vector <int> lens = {512, 1024, 2048}; // attention测试的prompt长度
+    int vocab = 130528; // 采样和分词测试的词表大小
+    std::vector <int> textLens = {1024, 8192, 65536}; // 分词测试的prompt字节数
+    std::string cpuLevel = "auto"; // CPU kernel的指令集
+};
+
+std::vector <int> ParseIntList(const std::string &s) {
+    std::vector <int> ret;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t next = s.find(',', pos);
+        if (next == std::string::npos) {
+            next = s.size();
+        }
+        ret.push_back(atoi(s.substr(pos, next - pos).c_str()));
+        pos = next + 1;
+    }
+    return ret;
+}
+
+void Usage() {
+    std::cout << "Usage:" << std::endl;
+    std::cout << "[-h|--help]:                  显示帮助" << std::endl;
+    std::cout << "<-t|--threads> <args>:        使用的线程数量" << std::endl;
+    std::cout << "<-m> <args>:                  Linear的输入维度" << std::endl;
+    std::cout << "<-k> <args>:                  Linear的输出维度" << std::endl;
+    std::cout << "<-n> <args>:                  输入行数，可以用逗号分隔多个值，例如1,16,64" << std::endl;
+    std::cout << "<-r|--repeat> <args>:         每组重复次数" << std::endl;
+    std::cout << "<--op> <args>:                测试的算子，可以设置为linear, attention, kvcache, sampling, kernels, quantlinear, tokenizer, dispatch, all" << std::endl;
+    std::cout << "<--heads> <args>:             attention的头数" << std::endl;
+    std::cout << "<--head_dim> <args>:          attention每个头的维度" << std::endl;
+    std::cout << "<-l|--lens> <args>:           attention的prompt长度，可以用逗号分隔多个值" << std::endl;
+    std::cout << "<--vocab> <args>:             采样和分词测试的词表大小" << std::endl;
+    std::cout << "<--text_lens> <args>:         分词测试的prompt字节数，可以用逗号分隔多个值" << std::endl;
+    std::cout << "<--cpu_level> <args>:         CPU kernel的指令集，可以设置为auto, generic, avx2, avxvnni, avx512, avx512vnni" << std::endl;
+}
+
+void ParseArgs(int argc, char **argv, OpBenchConfig &config) {
+    std::vector <std::string> sargv;
+    for (int i = 0; i < argc; i++) {
+        sargv.push_back(std::string(argv[i]));
+    }
+    for (int i = 1; i < argc; i++) {
+        if (sargv[i] == "-h" || sargv[i] == "--help") {
+            Usage();
+            exit(0);
+        } else if (sargv[i] == "-t" || sargv[i] == "--threads") {
+            config.threads = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-m") {
+            config.m = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-k") {
+            config.k = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-n") {
+            config.ns = ParseIntList(sargv[++i]);
+        } else if (sargv[i] == "-r" || sargv[i] == "--repeat") {
+            config.repeat = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--op") {
+            config.op = sargv[++i];
+        } else if (sargv[i] == "--heads") {
+            config.heads = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--head_dim") {
+            config.headDim = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-l" || sargv[i] == "--lens") {
+            config.lens = ParseIntList(sargv[++i]);
+        } else if (sargv[i] == "--vocab") {
+            config.vocab = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--text_lens") {
+            config.textLens = ParseIntList(sargv[++i]);
+        } else if (sargv[i] == "--cpu_level") {
+            config.cpuLevel = sargv[++i];
+        } else {
+            Usage();
+            exit(-1);
+        }
+    }
+}
+
+// 朴素实现，和优化前的FloatLinearPart / Float16LinearPart一致
+void NaiveLinear(float *inputData, void *weightData, fastllm::DataType dataType, float *outputData,
+                 int n, int m, int k) {
+    fastllm::GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+        for (int i = 0; i < n; i++) {
+            for (int j = st; j < end; j++) {
+                float now = 0.0f;
+                if (dataType == fastllm::DataType::FLOAT16) {
+                    uint16_t *weight = (uint16_t *) weightData + (uint64_t) j * m;
+                    for (int l = 0; l < m; l++) {
+                        now += inputData[i * m + l] * fastllm::half_to_float(weight[l]);
+                    }
+                } else {
+                    float *weight = (float *) weightData + (uint64_t) j * m;
+                    for (int l = 0; l < m; l++) {
+                        now += inputData[i * m + l] * weight[l];
+                    }
+                }
+                outputData[i * k + j] = now;
+            }
+        }
+    });
+}
+
+// 朴素实现，和优化前的MatMulSingle / MatMulTransBSingle一致
+// transB为false时output[n, k] = input0[n, m] * input1[m, k], 否则output[n, k] = input0[n, m] * input1[k, m]^T
+void NaiveMatMul(float *input0, float *input1, float *output, int batch, int n, int m, int k, bool transB) {
+    fastllm::GetCpuThreadPool()->ParallelFor(0, batch, [&](int st, int end) {
+        for (int b = st; b < end; b++) {
+            float *a = input0 + (uint64_t) b * n * m, *c = output + (uint64_t) b * n * k;
+            float *w = input1 + (uint64_t) b * m * k;
+            if (transB) {
+                for (int i = 0; i < n; i++) {
+                    for (int j = 0; j < k; j++) {
+                        float now = 0.0f;
+                        for (int l = 0; l < m; l++) {
+                            now += a[i * m + l] * w[j * m + l];
+                        }
+                        c[i * k + j] = now;
+                    }
+                }
+            } else {
+                std::fill(c, c + n * k, 0.0f);
+                for (int i = 0; i < n; i++) {
+                    for (int j = 0; j < m; j++) {
+                        float now = a[i * m + j];
+                        for (int l = 0; l < k; l++) {
+                            c[i * k + l] += now * w[j * k + l];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+std::vector <float> RandomValues(uint64_t len) {
+    std::vector <float> ret = std::vector <float> (len);
+    for (auto &v : ret) {
+        v = (float) rand() / RAND_MAX - 0.5f;
+    }
+    return ret;
+}
+
+void BenchLinear(const OpBenchConfig &config) {
+    int m = config.m, k = config.k;
+
+    std::vector <float> weightValues = RandomValues((uint64_t) k * m);
+
+    printf("Linear: m = %d, k = %d, threads = %d\n", m, k, config.threads);
+    for (fastllm::DataType dataType : {fastllm::DataType::FLOAT32, fastllm::DataType::FLOAT16}) {
+        fastllm::Data weight;
+        if (dataType == fastllm::DataType::FLOAT32) {
+            weight.CopyFrom(fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, weightValues));
+        } else {
+            weight = fastllm::Data(fastllm::DataType::FLOAT16, {k, m});
+            weight.Allocate();
+            for (uint64_t i = 0; i < weightValues.size(); i++) {
+                ((uint16_t *) weight.cpuData)[i] = fastllm::float_to_half(weightValues[i]);
+            }
+        }
+
+        for (int n : config.ns) {
+            std::vector <float> inputValues = RandomValues((uint64_t) n * m);
+            fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, inputValues);
+            fastllm::Data output;
+            std::vector <float> naiveOutput = std::vector <float> (n * k);
+
+            fastllm::Linear(input, weight, fastllm::Data(), output);
+            auto st = std::chrono::system_clock::now();
+            for (int r = 0; r < config.repeat; r++) {
+                fastllm::Linear(input, weight, fastllm::Data(), output);
+            }
+            float spend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+            NaiveLinear(inputValues.data(), weight.cpuData, dataType, naiveOutput.data(), n, m, k);
+            st = std::chrono::system_clock::now();
+            for (int r = 0; r < config.repeat; r++) {
+                NaiveLinear(inputValues.data(), weight.cpuData, dataType, naiveOutput.data(), n, m, k);
+            }
+            float naiveSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+            float maxDiff = 0;
+            for (int i = 0; i < n * k; i++) {
+                maxDiff = std::max(maxDiff, std::fabs(((float *) output.cpuData)[i] - naiveOutput[i]));
+            }
+            double flops = 2.0 * n * m * k;
+            printf("%s n = %d: linear %.2f GFLOP/s, naive %.2f GFLOP/s, speedup %.2fx, max diff = %g\n",
+                   dataType == fastllm::DataType::FLOAT32 ? "float32" : "float16", n,
+                   flops / spend / 1e9, flops / naiveSpend / 1e9, naiveSpend / spend, maxDiff);
+        }
+    }
+}
+
+// prefill阶段attention中的两个矩阵乘法: q * k^T和probs * v
+void BenchAttention(const OpBenchConfig &config) {
+    int heads = config.heads, d = config.headDim;
+    printf("Attention: heads = %d, head_dim = %d, threads = %d\n", heads, d, config.threads);
+    for (int len : config.lens) {
+        std::vector <float> qValues = RandomValues((uint64_t) heads * len * d);
+        std::vector <float> kValues = RandomValues((uint64_t) heads * len * d);
+        std::vector <float> vValues = RandomValues((uint64_t) heads * len * d);
+        fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, qValues);
+        fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, kValues);
+        fastllm::Data v = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, vValues);
+        fastllm::Data probs, output;
+
+        fastllm::MatMulTransB(q, k, probs);
+        fastllm::MatMul(probs, v, output);
+        auto st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            fastllm::MatMulTransB(q, k, probs);
+        }
+        float qkSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            fastllm::MatMul(probs, v, output);
+        }
+        float pvSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+        // 朴素实现很慢，只跑一次
+        std::vector <float> naiveProbs = std::vector <float> ((uint64_t) heads * len * len);
+        std::vector <float> naiveOutput = std::vector <float> ((uint64_t) heads * len * d);
+        st = std::chrono::system_clock::now();
+        NaiveMatMul(qValues.data(), kValues.data(), naiveProbs.data(), heads, len, d, len, true);
+        float naiveQkSpend = fastllm::GetSpan(st, std::chrono::system_clock::now());
+        st = std::chrono::system_clock::now();
+        NaiveMatMul((float *) probs.cpuData, vValues.data(), naiveOutput.data(), heads, len, len, d, false);
+        float naivePvSpend = fastllm::GetSpan(st, std::chrono::system_clock::now());
+
+        float maxDiff = 0;
+        for (uint64_t i = 0; i < naiveProbs.size(); i++) {
+            maxDiff = std::max(maxDiff, std::fabs(((float *) probs.cpuData)[i] - naiveProbs[i]));
+        }
+        for (uint64_t i = 0; i < naiveOutput.size(); i++) {
+            maxDiff = std::max(maxDiff, std::fabs(((float *) output.cpuData)[i] - naiveOutput[i]));
+        }
+        double flops = 2.0 * heads * len * len * d;
+        printf("len = %d: q * k^T %.2f ms (%.2f GFLOP/s, naive %.2f), probs * v %.2f ms (%.2f GFLOP/s, naive %.2f), "
+               "total %.2f ms, speedup %.2fx, max diff = %g\n", len,
+               qkSpend * 1000, flops / qkSpend / 1e9, flops / naiveQkSpend / 1e9,
+               pvSpend * 1000, flops / pvSpend / 1e9, flops / naivePvSpend / 1e9,
+               (qkSpend + pvSpend) * 1000, (naiveQkSpend + naivePvSpend) / (qkSpend + pvSpend), maxDiff);
+
+        // 融合的因果Attention算子，和拆开的MatMulTransB + AttentionMask + Softmax + MatMul对比
+        std::vector <float> vmask = std::vector <float> ((uint64_t) len * len, 0);
+        for (int i = 0; i < len; i++) {
+            for (int j = i + 1; j < len; j++) {
+                vmask[(uint64_t) i * len + j] = 1;
+            }
+        }
+        fastllm::Data mask = fastllm::Data(fastllm::DataType::FLOAT32, {len, len}, vmask);
+        float scale = 1.0 / sqrt(d);
+        fastllm::Data fusedOutput, unfusedOutput, pagedOutput;
+        fastllm::Attention(q, k, v, fastllm::Data(), fusedOutput, scale, -10000, true);
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            fastllm::Attention(q, k, v, fastllm::Data(), fusedOutput, scale, -10000, true);
+        }
+        float fusedSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            fastllm::MatMulTransB(q, k, probs, scale);
+            probs.Reshape({1, heads, len, len});
+            fastllm::AttentionMask(probs, mask, -10000);
+            fastllm::Softmax(probs, probs, -1);
+            probs.Reshape({heads, len, len});
+            fastllm::MatMul(probs, v, unfusedOutput);
+        }
+        float unfusedSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+        // 分页存储的KV cache
+        fastllm::Data pagedK = fastllm::Data(fastllm::DataType::FLOAT32), pagedV = fastllm::Data(fastllm::DataType::FLOAT32);
+        pagedK.SetPaged();
+        pagedV.SetPaged();
+        fastllm::CatDirect(pagedK, k, 1);
+        fastllm::CatDirect(pagedV, v, 1);
+        fastllm::Attention(q, pagedK, pagedV, fastllm::Data(), pagedOutput, scale, -10000, true);
+
+        float fusedDiff = 0, pagedDiff = 0;
+        for (uint64_t i = 0; i < unfusedOutput.Count(0); i++) {
+            float ref = ((float *) unfusedOutput.cpuData)[i];
+            fusedDiff = std::max(fusedDiff, std::fabs(((float *) fusedOutput.cpuData)[i] - ref));
+            pagedDiff = std::max(pagedDiff, std::fabs(((float *) pagedOutput.cpuData)[i] - ref));
+        }
+        printf("len = %d: fused causal attention %.2f ms, unfused %.2f ms (%.1f MB attention matrix), speedup %.2fx, "
+               "max diff = %g, paged max diff = %g\n", len, fusedSpend * 1000, unfusedSpend * 1000,
+               (double) heads * len * len * sizeof(float) / 1e6, unfusedSpend / fusedSpend, fusedDiff, pagedDiff);
+    }
+}
+
+// 分页KV cache使用float32, float16, int8存储时的每token字节数、解码一步attention的耗时，以及相对float32的误差
+void BenchKVCache(const OpBenchConfig &config) {
+    int heads = config.heads, d = config.headDim;
+    printf("KV cache: heads = %d, head_dim = %d, threads = %d\n", heads, d, config.threads);
+    std::vector <std::pair <fastllm::DataType, std::string> > types = {
+            {fastllm::DataType::FLOAT32, "float32"}, {fastllm::DataType::FLOAT16, "float16"}, {fastllm::DataType::INT8, "int8"}};
+    fastllm::DataType oldType = fastllm::GetKVCacheDataType();
+    for (int len : config.lens) {
+        std::vector <float> qValues = RandomValues((uint64_t) heads * len * d);
+        fastllm::Data k = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, RandomValues((uint64_t) heads * len * d));
+        fastllm::Data v = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, RandomValues((uint64_t) heads * len * d));
+        fastllm::Data q = fastllm::Data(fastllm::DataType::FLOAT32, {heads, len, d}, qValues);
+        std::vector <float> lastQ;
+        for (int h = 0; h < heads; h++) {
+            lastQ.insert(lastQ.end(), qValues.begin() + ((uint64_t) h * len + len - 1) * d,
+                         qValues.begin() + ((uint64_t) h * len + len) * d);
+        }
+        fastllm::Data decodeQ = fastllm::Data(fastllm::DataType::FLOAT32, {heads, 1, d}, lastQ);
+        float scale = 1.0 / sqrt(d);
+
+        fastllm::Data ref, decodeRef;
+        for (auto &type : types) {
+            fastllm::SetKVCacheDataType(type.first);
+            fastllm::Data pagedK, pagedV, prefillOutput, decodeOutput;
+            pagedK.SetPaged();
+            pagedV.SetPaged();
+            fastllm::CatDirect(pagedK, k, 1);
+            fastllm::CatDirect(pagedV, v, 1);
+            double bytesPerToken = (double) (pagedK.GetPageBytes() + pagedV.GetPageBytes()) / pagedK.pageLen;
+
+            fastllm::Attention(q, pagedK, pagedV, fastllm::Data(), prefillOutput, scale, -10000, true);
+            fastllm::Attention(decodeQ, pagedK, pagedV, fastllm::Data(), decodeOutput, scale, -10000, true);
+            auto st = std::chrono::system_clock::now();
+            for (int r = 0; r < config.repeat; r++) {
+                fastllm::Attention(decodeQ, pagedK, pagedV, fastllm::Data(), decodeOutput, scale, -10000, true);
+            }
+            float decodeSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+            if (type.first == fastllm::DataType::FLOAT32) {
+                ref.CopyFrom(prefillOutput);
+                decodeRef.CopyFrom(decodeOutput);
+            }
+            float maxDiff = 0;
+            double diffSum = 0, refSum = 0;
+            for (uint64_t i = 0; i < ref.Count(0); i++) {
+                float a = ((float *) prefillOutput.cpuData)[i], b = ((float *) ref.cpuData)[i];
+                maxDiff = std::max(maxDiff, std::fabs(a - b));
+                diffSum += (double) (a - b) * (a - b);
+                refSum += (double) b * b;
+            }
+            float decodeDiff = 0;
+            for (uint64_t i = 0; i < decodeRef.Count(0); i++) {
+                decodeDiff = std::max(decodeDiff, std::fabs(((float *) decodeOutput.cpuData)[i] - ((float *) decodeRef.cpuData)[i]));
+            }
+            printf("len = %d, %s: %.0f bytes / token (all heads, k + v), decode attention %.3f ms, "
+                   "max diff = %g, relative error = %g, decode max diff = %g\n", len, type.second.c_str(), bytesPerToken,
+                   decodeSpend * 1000, maxDiff, sqrt(diffSum / std::max(refSum, 1e-30)), decodeDiff);
+        }
+    }
+    fastllm::SetKVCacheDataType(oldType);
+}
+
+void BenchSampling(const OpBenchConfig &config) {
+    int vocab = config.vocab;
+    printf("Sampling: vocab = %d\n", vocab);
+    std::vector <float> logits = RandomValues(vocab);
+    for (auto &v : logits) {
+        v *= 20.0f;
+    }
+
+    // 朴素实现: 整个词表排序, 和原来MOSS的实现一致
+    auto st = std::chrono::system_clock::now();
+    std::vector <std::pair <float, int> > v;
+    for (int r = 0; r < config.repeat; r++) {
+        v.clear();
+        for (int i = 0; i < vocab; i++) {
+            v.push_back(std::make_pair(logits[i], i));
+        }
+        std::sort(v.begin(), v.end());
+        std::reverse(v.begin(), v.end());
+    }
+    printf("full sort: %.3f ms\n", fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat * 1000);
+
+    std::vector <std::pair <float, int> > topk;
+    fastllm::TopKSelect(logits.data(), vocab, 50, topk);
+    bool correct = true;
+    for (int i = 0; i < 50; i++) {
+        correct &= (topk[i].first == v[i].first);
+    }
+    printf("TopKSelect(k = 50) %s\n", correct ? "matches full sort" : "MISMATCH");
+
+    struct SamplingCase {
+        std::string name;
+        int topK;
+        float topP, temperature;
+    };
+    std::vector <SamplingCase> cases = {
+            {"greedy", 1, 1.0f, 1.0f}, {"top_k = 40", 40, 1.0f, 0.8f}, {"top_k = 40, top_p = 0.9", 40, 0.9f, 0.8f},
+            {"top_p = 0.9", 0, 0.9f, 0.8f}, {"temperature only", 0, 1.0f, 0.8f}};
+    for (auto &c : cases) {
+        fastllm::LLMSampler sampler;
+        sampler.Init(c.topK, c.topP, c.temperature, 0);
+        sampler.Sample(logits.data(), vocab);
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            sampler.Sample(logits.data(), vocab);
+        }
+        printf("%s: %.3f ms\n", c.name.c_str(), fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat * 1000);
+    }
+}
+
+// 朴素实现: 每个节点用std::map存储子节点的trie, 和原来的Tokenizer一致
+struct NaiveTrie {
+    struct Node {
+        int tokenId = -999999;
+        std::map <int, Node*> next;
+    };
+    std::vector <Node*> nodes;
+    Node *root;
+
+    NaiveTrie() {
+        root = new Node();
+        nodes.push_back(root);
+    }
+
+    ~NaiveTrie() {
+        for (Node *node : nodes) {
+            delete node;
+        }
+    }
+
+    void Insert(const std::string &s, int tokenId) {
+        Node *now = root;
+        for (int i = 0; i < s.size(); i++) {
+            if (now->next.find(s[i]) == now->next.end()) {
+                now->next[s[i]] = new Node();
+                nodes.push_back(now->next[s[i]]);
+            }
+            now = now->next[s[i]];
+        }
+        now->tokenId = tokenId;
+    }
+
+    std::vector <int> Encode(const std::string &s) {
+        std::vector <int> v;
+        for (int i = 0; i < s.size(); i++) {
+            int tokenId = -999999, pos = i - 1;
+            Node *now = root;
+            for (int j = i; j < s.size(); j++) {
+                if (now->next.find(s[j]) != now->next.end()) {
+                    now = now->next[s[j]];
+                    if (now->tokenId != -999999) {
+                        tokenId = now->tokenId;
+                        pos = j;
+                    }
+                } else {
+                    break;
+                }
+            }
+            if (pos >= i) {
+                i = pos;
+                v.push_back(tokenId);
+            }
+        }
+        return v;
+    }
+};
+
+// 朴素实现的BPE: 每次扫描所有相邻片段, 合并优先级最高(token id最小)的一对, 用来检查Tokenizer::EncodeBPE的结果
+std::vector <int> NaiveBPE(const fastllm::Tokenizer &tokenizer, const std::string &s) {
+    std::string blank = "\xE2\x96\x81", text = "";
+    for (char c : s) {
+        text += (c == ' ' ? blank : std::string(1, c));
+    }
+    std::vector <int> v;
+    for (int st = 0; st < text.size(); ) {
+        int end = st + 1;
+        while (end < text.size() && text.compare(end, blank.size(), blank) != 0) {
+            end++;
+        }
+        std::vector <std::string> symbols;
+        for (int i = st; i < end; ) {
+            uint8_t c = text[i];
+            int charLen = std::min(c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1, end - i);
+            symbols.push_back(text.substr(i, charLen));
+            i += charLen;
+        }
+        st = end;
+        while (true) {
+            int best = -1, bestRank = 0;
+            for (int i = 0; i + 1 < symbols.size(); i++) {
+                auto it = tokenizer.stringToTokenDict.find(symbols[i] + symbols[i + 1]);
+                if (it != tokenizer.stringToTokenDict.end() && (best == -1 || it->second < bestRank)) {
+                    best = i;
+                    bestRank = it->second;
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            symbols[best] += symbols[best + 1];
+            symbols.erase(symbols.begin() + best + 1);
+        }
+        for (auto &symbol : symbols) {
+            auto it = tokenizer.stringToTokenDict.find(symbol);
+            if (it != tokenizer.stringToTokenDict.end()) {
+                v.push_back(it->second);
+            }
+        }
+    }
+    return v;
+}
+
+// 随机生成的词表: 单字节和常用汉字各占一个token, 其余是由它们拼成的1 ~ 8个字的词
+// 每个词的前缀也在词表中并且id更小, 这样BPE可以从左到右合并出这个词
+void BenchTokenizer(const OpBenchConfig &config) {
+    std::vector <std::string> pieces;
+    for (int c = 32; c < 127; c++) {
+        pieces.push_back(std::string(1, (char) c));
+    }
+    for (int c = 0x4e00; c < 0x4e00 + 3000; c++) {
+        std::string s = "";
+        s += (char) (0xE0 | (c >> 12));
+        s += (char) (0x80 | ((c >> 6) & 0x3F));
+        s += (char) (0x80 | (c & 0x3F));
+        pieces.push_back(s);
+    }
+    std::vector <std::string> vocab = pieces;
+    std::set <std::string> seen(vocab.begin(), vocab.end());
+    while (vocab.size() < config.vocab) {
+        int len = rand() % 8 + 1;
+        bool chinese = rand() % 2;
+        std::string prefix = "";
+        for (int i = 0; i < len; i++) {
+            prefix += chinese ? pieces[95 + rand() % 300] : pieces[rand() % 95];
+            if (seen.insert(prefix).second) {
+                vocab.push_back(prefix);
+            }
+        }
+    }
+    // 单个字符的piece都要保留, 否则测试文本无法完整切分, --vocab太小时按单个字符的数目计算
+    vocab.resize(std::max((int) pieces.size(), config.vocab));
+    printf("Tokenizer: vocab = %d\n", (int) vocab.size());
+
+    NaiveTrie naive;
+    auto st = std::chrono::system_clock::now();
+    for (int i = 0; i < vocab.size(); i++) {
+        naive.Insert(vocab[i], i);
+    }
+    printf("map trie build: %.3f ms, %d nodes\n", fastllm::GetSpan(st, std::chrono::system_clock::now()) * 1000,
+           (int) naive.nodes.size());
+
+    fastllm::Tokenizer tokenizer;
+    st = std::chrono::system_clock::now();
+    for (int i = 0; i < vocab.size(); i++) {
+        tokenizer.Insert(vocab[i], i);
+    }
+    tokenizer.Build();
+    printf("double-array trie build: %.3f ms, %.2f MB\n", fastllm::GetSpan(st, std::chrono::system_clock::now()) * 1000,
+           tokenizer.check.size() * sizeof(int) * 3 / 1024.0 / 1024.0);
+
+    // BPE的词表中空格写成"▁"
+    fastllm::Tokenizer bpe;
+    for (int i = 0; i < vocab.size(); i++) {
+        std::string s = "";
+        for (char c : vocab[i]) {
+            s += (c == ' ' ? std::string("\xE2\x96\x81") : std::string(1, c));
+        }
+        bpe.Insert(s, i);
+    }
+    for (int i = 0; i < 256; i++) {
+        char name[8];
+        sprintf(name, "<0x%02X>", i);
+        bpe.Insert(name, vocab.size() + i);
+    }
+    bpe.type = fastllm::TOKENIZER_BPE;
+    bpe.Build();
+
+    for (int textLen : config.textLens) {
+        std::string text = "";
+        while (text.size() < textLen) {
+            text += (rand() % 3 == 0 ? vocab[rand() % vocab.size()] : pieces[rand() % pieces.size()]);
+        }
+
+        std::vector <int> ref;
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            ref = naive.Encode(text);
+        }
+        float naiveSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+        fastllm::Data tokens;
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            tokens.CopyFrom(tokenizer.Encode(text));
+        }
+        float spend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+
+        bool correct = (tokens.Count(0) == ref.size());
+        for (int i = 0; correct && i < ref.size(); i++) {
+            correct = ((int) ((float *) tokens.cpuData)[i] == ref[i]);
+        }
+        printf("%d bytes, %d tokens: map trie %.3f ms (%.2f MB/s), double-array trie %.3f ms (%.2f MB/s), %s\n",
+               (int) text.size(), (int) ref.size(), naiveSpend * 1000, text.size() / naiveSpend / 1e6,
+               spend * 1000, text.size() / spend / 1e6, correct ? "same tokens" : "MISMATCH");
+
+        std::vector <int> bpeRef = NaiveBPE(bpe, text);
+        for (int cacheLimit : {0, 4096}) {
+            bpe.bpeCacheLimit = cacheLimit;
+            std::vector <int> bpeTokens;
+            st = std::chrono::system_clock::now();
+            for (int r = 0; r < config.repeat; r++) {
+                bpeTokens = bpe.EncodeBPE(text);
+            }
+            float bpeSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+            printf("%d bytes, %d tokens: bpe (cache %d) %.3f ms (%.2f MB/s), %.2fx greedy tokens, %s\n",
+                   (int) text.size(), (int) bpeTokens.size(), cacheLimit, bpeSpend * 1000, text.size() / bpeSpend / 1e6,
+                   (float) bpeTokens.size() / ref.size(), bpeTokens == bpeRef ? "same tokens as naive bpe" : "MISMATCH");
+        }
+
+        // 逐个token解码: 每次构造Data调用Decode, 和DecodeStream对比
+        std::string decoded = "", streamDecoded = "";
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            decoded = "";
+            for (int id : ref) {
+                decoded += tokenizer.Decode(fastllm::Data(fastllm::DataType::FLOAT32, {1}, {(float) id}));
+            }
+        }
+        float decodeSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+        fastllm::DecodeStream decodeStream(&tokenizer);
+        st = std::chrono::system_clock::now();
+        for (int r = 0; r < config.repeat; r++) {
+            streamDecoded = "";
+            decodeStream.Reset();
+            for (int id : ref) {
+                streamDecoded += decodeStream.Put(id);
+            }
+            streamDecoded += decodeStream.Flush();
+        }
+        float streamSpend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / config.repeat;
+        printf("%d tokens: decode %.3f ms (%.2f M tokens/s), decode stream %.3f ms (%.2f M tokens/s), %s\n",
+               (int) ref.size(), decodeSpend * 1000, ref.size() / decodeSpend / 1e6, streamSpend * 1000,
+               ref.size() / streamSpend / 1e6, (decoded == text && streamDecoded == text) ? "same text" : "MISMATCH");
+    }
+
+    // 词表中没有的字符用<0xXX>表示, 流式解码时攒齐一个完整的UTF-8字符再输出
+    std::string emoji = "\xF0\x9F\x98\x80";
+    std::vector <int> emojiTokens = bpe.EncodeBPE(emoji + "a" + emoji);
+    fastllm::DecodeStream decodeStream(&bpe);
+    std::string streamPieces = "";
+    for (int id : emojiTokens) {
+        streamPieces += "[" + decodeStream.Put(id) + "]";
+    }
+    streamPieces += "[" + decodeStream.Flush() + "]";
+    printf("byte fallback: %d tokens, stream pieces %s, %s\n", (int) emojiTokens.size(), streamPieces.c_str(),
+           streamPieces == "[][][][" + emoji + "][a][][][][" + emoji + "][]" ? "complete characters" : "MISMATCH");
+}
+
+// batch = 1解码时的小形状算子, 计算量很小, 耗时主要是参数构造和调度的固定开销
+// 每个算子先和直接调用CpuDevice上的算子(不经过Executor)的结果对比, 确认调度确实执行了算子
+void BenchDispatch(const OpBenchConfig &config) {
+    int dim = 64, calls = std::max(1, config.repeat) * 10000;
+    printf("Dispatch: input [1, %d], %d calls\n", dim, calls);
+    std::vector <float> v(dim), w(dim * dim);
+    for (int i = 0; i < v.size(); i++) {
+        v[i] = (float) rand() / RAND_MAX;
+    }
+    for (int i = 0; i < w.size(); i++) {
+        w[i] = (float) rand() / RAND_MAX / dim;
+    }
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {1, dim}, v);
+    fastllm::Data gamma = fastllm::Data(fastllm::DataType::FLOAT32, {dim}, std::vector <float> (dim, 1.0f));
+    fastllm::Data weight = fastllm::Data(fastllm::DataType::FLOAT32, {dim, dim}, w);
+    fastllm::Data bias, output, other;
+
+    fastllm::BaseDevice *cpu = (fastllm::BaseDevice*) new fastllm::CpuDevice();
+    auto direct = [&](const std::string &opType, const fastllm::DataDict &datas,
+                      const fastllm::FloatDict &floatParams) {
+        cpu->Reshape(opType, datas, floatParams, {});
+        cpu->Run(opType, datas, floatParams, {});
+    };
+
+    struct DispatchCase {
+        std::string name;
+        std::function <void()> run, direct;
+        fastllm::Data *result;
+    };
+    std::vector <DispatchCase> ops = {
+            {"AddTo", [&]() { fastllm::AddTo(other, input, 0.5f); },
+             [&]() { direct("AddTo", {{"input0", &other}, {"input1", &input}}, {{"alpha", 0.5f}}); }, &other},
+            {"Mul", [&]() { fastllm::Mul(input, 2.0f, output); },
+             [&]() { direct("Mul", {{"input", &input}, {"output", &output}}, {{"v", 2.0f}}); }, &output},
+            {"Silu", [&]() { fastllm::Silu(input, output); },
+             [&]() { direct("Silu", {{"input", &input}, {"output", &output}}, {}); }, &output},
+            {"RMSNorm", [&]() { fastllm::RMSNorm(input, gamma, 1e-6, output); },
+             [&]() { direct("RMSNorm", {{"input", &input}, {"weight", &gamma}, {"output", &output}},
+                            {{"eps", 1e-6f}}); }, &output},
+            {"Linear", [&]() { fastllm::Linear(input, weight, bias, output); },
+             [&]() { direct("Linear", {{"input", &input}, {"weight", &weight}, {"bias", &bias}, {"output", &output}},
+                            {}); }, &output}
+    };
+    for (auto &op : ops) {
+        std::vector <std::vector <float> > results;
+        for (auto &run : {op.run, op.direct}) {
+            other.CopyFrom(input);
+            output = fastllm::Data();
+            run();
+            float *data = (float *) op.result->cpuData;
+            results.push_back(std::vector <float> (data, data + op.result->Count(0)));
+        }
+        float maxDiff = results[0].size() == results[1].size() ? 0 : INFINITY;
+        for (int i = 0; i < results[0].size() && i < results[1].size(); i++) {
+            maxDiff = std::max(maxDiff, std::fabs(results[0][i] - results[1][i]));
+        }
+
+        op.run();
+        auto st = std::chrono::system_clock::now();
+        for (int i = 0; i < calls; i++) {
+            op.run();
+        }
+        printf("%s: %.3f us / call, max diff to direct call = %g\n", op.name.c_str(),
+               fastllm::GetSpan(st, std::chrono::system_clock::now()) / calls * 1e6, maxDiff);
+    }
+    delete cpu;
+}
+
+// 依次强制使用每个可用的指令集(从minLevel开始)运行op, 输出耗时以及和第一个指令集的结果的最大误差
+void CompareCpuLevels(const std::string &name, const std::function <void(fastllm::Data &)> &op, int repeat,
+                      fastllm::CpuInstructLevel minLevel = fastllm::CPU_LEVEL_GENERIC, double flops = 0) {
+    std::string oldLevel = fastllm::GetCpuInstructLevel();
+    std::vector <float> ref;
+    std::string refName;
+    for (int level = minLevel; level < fastllm::CPU_LEVEL_COUNT; level++) {
+        if (!fastllm::IsCpuLevelSupported((fastllm::CpuInstructLevel) level)) {
+            continue;
+        }
+        fastllm::SetCpuInstructLevel(fastllm::GetCpuKernelsByLevel((fastllm::CpuInstructLevel) level)->name);
+        fastllm::Data output;
+        op(output);
+        auto st = std::chrono::system_clock::now();
+        for (int r = 0; r < repeat; r++) {
+            op(output);
+        }
+        float spend = fastllm::GetSpan(st, std::chrono::system_clock::now()) / repeat;
+        float *outputData = (float *) output.cpuData;
+        int len = output.Count(0);
+        if (ref.empty()) {
+            ref = std::vector <float> (outputData, outputData + len);
+            refName = fastllm::GetCpuInstructLevel();
+        }
+        float maxDiff = 0;
+        for (int i = 0; i < len; i++) {
+            maxDiff = std::max(maxDiff, std::fabs(outputData[i] - ref[i]));
+        }
+        if (flops > 0) {
+            printf("%s %s: %.3f ms (%.2f GOP/s), max diff with %s = %g\n", name.c_str(), fastllm::GetCpuInstructLevel().c_str(),
+                   spend * 1000, flops / spend / 1e9, refName.c_str(), maxDiff);
+        } else {
+            printf("%s %s: %.3f ms, max diff with %s = %g\n", name.c_str(), fastllm::GetCpuInstructLevel().c_str(),
+                   spend * 1000, refName.c_str(), maxDiff);
+        }
+    }
+    fastllm::SetCpuInstructLevel(oldLevel);
+}
+
+void BenchKernels(const OpBenchConfig &config) {
+    int rows = 16, dim = config.m;
+    printf("Kernels: rows = %d, dim = %d, supported = %s\n", rows, dim,
+           fastllm::GetCpuKernelsByLevel(fastllm::GetCpuSupportedLevel())->name);
+    fastllm::Data input = fastllm::Data(fastllm::DataType::FLOAT32, {rows, dim}, RandomValues((uint64_t) rows * dim));
+    fastllm::Data gamma = fastllm::Data(fastllm::DataType::FLOAT32, {dim}, RandomValues(dim));
+    fastllm::Data beta = fastllm::Data(fastllm::DataType::FLOAT32, {dim}, RandomValues(dim));
+    fastllm::Data weight = fastllm::Data(fastllm::DataType::FLOAT16, {config.k, dim});
+    weight.Allocate();
+    std::vector <float> weightValues = RandomValues((uint64_t) config.k * dim);
+    for (uint64_t i = 0; i < weightValues.size(); i++) {
+        ((uint16_t *) weight.cpuData)[i] = fastllm::float_to_half(weightValues[i]);
+    }
+
+    CompareCpuLevels("softmax", [&](fastllm::Data &output) { fastllm::Softmax(input, output, -1); }, config.repeat);
+    CompareCpuLevels("layernorm", [&](fastllm::Data &output) { fastllm::LayerNorm(input, gamma, beta, -1, output); }, config.repeat);
+    CompareCpuLevels("rmsnorm", [&](fastllm::Data &output) { fastllm::RMSNorm(input, gamma, 1e-6, output); }, config.repeat);
+    CompareCpuLevels("silu", [&](fastllm::Data &output) { fastllm::Silu(input, output); }, config.repeat);
+    CompareCpuLevels("float16 linear", [&](fastllm::Data &output) {
+        fastllm::Linear(input, weight, fastllm::Data(), output);
+    }, config.repeat);
+}
+
+// 按输出通道量化成int8或int4, groupSize > 0时int4每个通道再按groupSize个数分组, 和SaveLowBitModel的做法一致
+fastllm::Data QuantizeWeight(const std::vector <float> &values, int k, int m, int bit, int groupSize = -1) {
+    fastllm::DataType dataType = (bit == 8 ? fastllm::DataType::INT8 :
+                                  (groupSize > 0 ? fastllm::DataType::INT4_GROUP : fastllm::DataType::INT4));
+    fastllm::Data weight = fastllm::Data(dataType, {k, m});
+    weight.Allocate();
+    int groupLen = (groupSize > 0 ? groupSize : m);
+    int groupCnt = (m - 1) / groupLen + 1;
+    weight.perChannelAxis = 0;
+    if (groupSize > 0) {
+        weight.groupSize = groupSize;
+        weight.groupCnt = groupCnt;
+    }
+    weight.perChannelsConfigs.resize(k * groupCnt);
+    weight.zeros.resize(k * groupCnt);
+    weight.scales.resize(k * groupCnt);
+    uint8_t *weightData = (uint8_t *) weight.cpuData;
+    if (bit == 4) {
+        memset(weightData, 0, weight.GetBytes());
+    }
+    for (int i = 0; i < k; i++) {
+        for (int g = 0; g < groupCnt; g++) {
+            int st = g * groupLen, end = std::min(m, st + groupLen);
+            const float *row = values.data() + (uint64_t) i * m;
+            float minValue = *std::min_element(row + st, row + end), maxValue = *std::max_element(row + st, row + end);
+            fastllm::LowBitConfig &config = weight.perChannelsConfigs[i * groupCnt + g];
+            config = fastllm::LowBitConfig(minValue, maxValue, bit);
+            weight.zeros[i * groupCnt + g] = config.zeroPoint;
+            weight.scales[i * groupCnt + g] = config.scale;
+            for (int j = st; j < end; j++) {
+                uint8_t value = config.quantization(row[j]);
+                uint64_t id = (uint64_t) i * m + j;
+                if (bit == 8) {
+                    weightData[id] = value;
+                } else {
+                    weightData[id / 2] |= (id % 2 ? value : (value << 4));
+                }
+            }
+        }
+    }
+    return weight;
+}
+
+// int8 / int4 / 分组int4权重的Linear, 整数部分的计算是精确的, 不同指令集的结果应该(几乎)完全相同
+// 同时输出和float32权重结果的平均误差, 用来比较不同量化方式的精度
+void BenchQuantLinear(const OpBenchConfig &config) {
+    int m = config.m, k = config.k;
+    printf("Quantized linear: m = %d, k = %d, threads = %d\n", m, k, config.threads);
+    std::vector <float> weightValues = RandomValues((uint64_t) k * m);
+    fastllm::Data floatWeight = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, weightValues);
+    std::vector <std::pair <int, int> > types = {{8, -1}, {4, -1}, {4, 128}, {4, 32}};
+    for (auto &type : types) {
+        int bit = type.first, groupSize = type.second;
+        std::string name = "int" + std::to_string(bit) + (groupSize > 0 ? " group " + std::to_string(groupSize) : "");
+        fastllm::Data weight = QuantizeWeight(weightValues, k, m, bit, groupSize);
+        std::vector <fastllm::Data> inputs;
+        for (int n : config.ns) {
+            inputs.push_back(fastllm::Data(fastllm::DataType::FLOAT32, {n, m}, RandomValues((uint64_t) n * m)));
+        }
+        // int4权重再测一遍加载时重排成kernel格式之后的耗时
+        for (bool repack : {false, true}) {
+            if (repack) {
+                if (bit != 4) {
+                    break;
+                }
+                weight.RepackWeight();
+                name += " repacked";
+            }
+            for (int i = 0; i < config.ns.size(); i++) {
+                int n = config.ns[i];
+                fastllm::Data &input = inputs[i];
+                CompareCpuLevels(name + " n = " + std::to_string(n), [&](fastllm::Data &output) {
+                    fastllm::Linear(input, weight, fastllm::Data(), output);
+                }, config.repeat, fastllm::CPU_LEVEL_AVX2, 2.0 * n * m * k);
+
+                fastllm::Data output, floatOutput;
+                fastllm::Linear(input, weight, fastllm::Data(), output);
+                fastllm::Linear(input, floatWeight, fastllm::Data(), floatOutput);
+                double error = 0;
+                for (int j = 0; j < n * k; j++) {
+                    error += std::fabs(((float *) output.cpuData)[j] - ((float *) floatOutput.cpuData)[j]);
+                }
+                printf("%s n = %d: mean abs error with float32 = %g\n", name.c_str(), n, error / (n * k));
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    OpBenchConfig config;
+    ParseArgs(argc, argv, config);
+    fastllm::SetThreads(config.threads);
+    fastllm::SetCpuInstructLevel(config.cpuLevel);
+    printf("cpu kernels: %s\n", fastllm::GetCpuInstructLevel().c_str());
+    if (config.op == "linear" || config.op == "all") {
+        BenchLinear(config);
+    }
+    if (config.op == "attention" || config.op == "all") {
+        BenchAttention(config);
+    }
+    if (config.op == "kvcache" || config.op == "all") {
+        BenchKVCache(config);
+    }
+    if (config.op == "sampling" || config.op == "all") {
+        BenchSampling(config);
+    }
+    if (config.op == "kernels" || config.op == "all") {
+        BenchKernels(config);
+    }
+    if (config.op == "quantlinear" || config.op == "all") {
+        BenchQuantLinear(config);
+    }
+    if (config.op == "dispatch" || config.op == "all") {
+        BenchDispatch(config);
+    }
+    if (config.op == "tokenizer" || config.op == "all") {
+        BenchTokenizer(config);
+    }
+    return 0;
+}
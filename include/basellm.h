@@ -1,6 +1,13 @@
 #pragma once
 #include "fastllm.h"
 
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+
 
 // typedef void(*RuntimeResult) (int index, const char* content); //实时生成的内容回调 index: 0开始回复，-1本次回复结束
 // typedef void(*RuntimeResultBatch) (int index, std::vector <std::string> &contents); //实时生成的内容回调 index: 0开始回复，-1本次回复结束
@@ -9,10 +16,54 @@ using RuntimeResult = std::function<void(int index, const char* content)>;
 using RuntimeResultBatch = std::function<void(int index, std::vector <std::string> &contents)>;
 
 namespace fastllm {
+    // 连续批处理中的一个请求
+    struct ResponseContext {
+        bool isEnding = false; // 已经生成结束
+        bool isError = false; // 计算中出错而结束, 这时isEnding也为true
+        std::vector <float> promptTokens; // prompt编码后的token(不含特殊token)
+        int pastLen = 0; // 已经写入KV cache的token数，为0时表示prompt还没有处理
+        int currentToken = -1; // 下一轮要输入的token
+        int outputCnt = 0; // 已经生成的token数
+        int limit = -1; // 输出token数限制，< 0 代表无限制
+        std::queue <int> resultTokenQueue; // 已生成但还没有被取走的token
+        TokenPenaltyManager tokenPenaltyManager; // 重复惩罚，do_sample时使用
+        LLMSampler sampler; // 这个请求自己的采样器
+        std::vector <std::pair <Data, Data> > pastKeyValues; // 这个请求自己的KV cache
+    };
+
+    // 前缀KV cache的统计
+    struct PrefixCacheStats {
+        uint64_t hits = 0; // 复用到了前缀的请求数
+        uint64_t misses = 0; // 没有复用到前缀的请求数
+        uint64_t hitTokens = 0; // 复用的token总数, 这些token不需要再做prefill
+        uint64_t bytes = 0; // 当前缓存占用的字节数
+        int blocks = 0; // 当前缓存的块数
+    };
+
+    // 前缀KV cache: 所有请求和会话共享, 按token前缀的hash缓存prompt中每GetKVCachePageLen()个token的KV
+    // 新请求的prompt以缓存过的前缀开头时直接复制这些KV, 跳过这部分的prefill
+    void SetPrefixCacheMemoryLimit(uint64_t bytes); // 前缀KV cache的内存上限, 超出时按LRU淘汰, 0代表关闭
+    uint64_t GetPrefixCacheMemoryLimit();
+    PrefixCacheStats GetPrefixCacheStats();
+    void ClearPrefixCache(); // 清空前缀KV cache和统计
+
+    // 多轮对话的会话: 保存上一轮结束时的KV cache和对应的token序列
+    // 下一轮只需要计算新增的token
+    struct ChatSession {
+        std::vector <int> tokens; // 已经写入KV cache的token(含特殊token)
+        std::vector <std::pair <Data, Data> > pastKeyValues; // 每层的KV cache
+
+        void Clear(); // 清空会话, 释放KV cache
+    };
+
     class basellm {
     public:
         basellm() {};
-        ~basellm() {};
+        virtual ~basellm(); // 析构前应保证提交的请求都已经取完
+
+        // 停止并等待连续批处理的调度线程, 可以重复调用
+        // 调度线程会调用派生类的Forward, 而~basellm执行时派生类的成员已经析构, 所以派生类的析构函数需要先调用这个函数
+        void StopResponseLoop();
 
         virtual void LoadFromFile(const std::string &fileName) = 0; // 从文件读取
         // 推理
@@ -21,15 +72,53 @@ namespace fastllm {
                 const Data &attentionMask,
                 const Data &positionIds,
                 const Data &penaltyFactor,
-                std::vector <std::pair <Data, Data> > &pastKeyValues) = 0;
+                std::vector <std::pair <Data, Data> > &pastKeyValues,
+                LLMSampler *sampler = nullptr) = 0; // sampler为空或IsGreedy()时取最大值
 
         virtual std::string Response(const std::string& input, RuntimeResult retCb) = 0; // 根据给出的内容回复
 
+        // 在会话上回复: input为包含历史的完整prompt
+        // 和会话中已有token的最长公共前缀直接复用KV cache, 只对剩余的token做prefill
+        // 生成结束后回复的token也留在会话中, 下一轮的prompt包含这次回复时可以整体复用
+        std::string ResponseSession(ChatSession &session, const std::string &input, RuntimeResult retCb = nullptr);
+
+        virtual std::vector <int> GetPromptTokens(const std::string &input); // prompt编码成token, 默认为bos + prompt
+
+        // 是否可以按前缀复用KV cache, 需要模型是因果attention且positionIds为一维的连续位置
+        // 不可以复用时ResponseSession退化为Response
+        virtual bool CanReusePrefix() { return true; }
+
+        // 从前缀KV cache中恢复tokens最长的已缓存前缀(最多maxLen个token)到空的pastKeyValues中, 返回恢复的token数
+        int LoadPrefixCache(const std::vector <int> &tokens, int maxLen,
+                            std::vector <std::pair <Data, Data> > &pastKeyValues);
+
+        // 把pastKeyValues中tokens对应的完整块存入前缀KV cache
+        void SavePrefixCache(const std::vector <int> &tokens, const std::vector <std::pair <Data, Data> > &pastKeyValues);
+
         virtual void ResponseBatch(const std::vector <std::string> &inputs,
                                    std::vector <std::string> &outputs,
                                    RuntimeResultBatch retCb = nullptr) {} // 批量根据给出的内容回复
 
-        virtual void SaveLowBitModel(const std::string &fileName, int bit) {}; // 存储成量化模型
+        virtual void SaveLowBitModel(const std::string &fileName, int bit, int groupSize = -1) {}; // 存储成量化模型
+
+        // 连续批处理: 请求可以在任意一轮解码时加入或离开正在运行的batch
+        int LaunchResponseTokens(const std::vector <int> &inputTokens, int limit = -1); // 提交一个请求，返回句柄
+
+        // 取出句柄对应请求的下一个token，请求已经结束时返回-1
+        // wait为false且暂时没有新token时返回-2
+        // 请求在计算中出错时, 取完出错前生成的token后返回-3
+        int FetchResponseTokens(int handleId, bool wait = true);
+
+        // 构造一个请求本轮的输入: prompt还没有处理时输入prompt, 否则输入currentToken
+        // 默认实现为bos + prompt, 因果mask
+        virtual void FillLLMInputs(const ResponseContext &context,
+                                   Data &inputIds, Data &attentionMask, Data &positionIds);
+
+        virtual bool IsEndToken(int token); // 是否是结束符，默认读取模型中的eos
+
+        // 每个请求输入一个token，各自使用自己的KV cache做一轮解码，返回每个请求生成的token
+        // 默认实现为逐个调用Forward; ChatGLM, LLaMA类(Vicuna, Baichuan)和MOSS把所有请求合成一个batch计算
+        virtual std::vector <int> ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts);
 
         virtual void WarmUp() {}; // 预热
 
@@ -51,14 +140,32 @@ namespace fastllm {
         bool do_sample = false; // 是否进行采样，如不采样则直接取最大值
         int last_n = 64; // 末尾last_n个token计入重复惩罚
         float repeat_penalty = 1.0f; // 重复惩罚系数
-        int top_k = 1; // top_k采样
+        int top_k = 1; // top_k采样, <= 0代表不限制, 为1时直接取最大值
         float top_p = 1.0; // top_p采样
         float temperature = 1.0; // 温度参数，一般在0.1 ~ 1.0之间，设大这个参数可以带来结果的多样性
+        int seed = -1; // 采样的随机种子，每个请求都用这个种子初始化自己的采样器，< 0时每个请求随机生成
+
+        void InitSampler(LLMSampler &sampler); // 按do_sample, top_k, top_p, temperature和seed初始化一个请求的采样器
 
         std::vector <std::vector <float> > sin, cos;
 
         WeightMap weight; // 权重
 
         Data sinData, cosData;
+    private:
+        void ResponseLoop(); // 调度线程: 每一轮处理一个新请求的prompt，再把所有正在解码的请求合成一个batch
+
+        void AppendToken(ResponseContext *context, int token);
+
+        // 把这一轮出错的请求标记为出错结束并释放KV cache, 调度线程继续处理其它请求
+        void FailResponses(const std::vector <ResponseContext*> &contexts, std::exception_ptr error);
+
+        std::thread *mainLoop = nullptr;
+        bool mainLoopStop = false;
+        std::mutex dictLocker;
+        std::condition_variable loopCond; // 有新请求时唤醒调度线程
+        std::condition_variable resultCond; // 有新token时唤醒FetchResponseTokens
+        int nextHandle = 0;
+        std::map <int, ResponseContext*> responseContextDict;
     };
 }
\ No newline at end of file
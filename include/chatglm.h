@@ -11,9 +11,20 @@
 #include <iostream>
 
 namespace fastllm {
+    // 一层ChatGLMBlock的权重
+    struct ChatGLMLayerWeights {
+        Data *inputLNWeight, *inputLNBias;
+        Data *qkvWeight, *qkvBias;
+        Data *denseWeight, *denseBias;
+        Data *postLNWeight, *postLNBias;
+        Data *fcInWeight, *fcInBias;
+        Data *fcOutWeight, *fcOutBias;
+    };
+
     class ChatGLMModel: public basellm {
 	public:
         ChatGLMModel (); // 构造函数
+        ~ChatGLMModel(); // 析构函数, 先停止调度线程
 
 		virtual void LoadFromFile(const std::string &fileName); // 从文件读取
 
@@ -23,7 +34,8 @@ namespace fastllm {
                 const Data &attentionMask,
                 const Data &positionIds,
                 const Data &penaltyFactor,
-                std::vector <std::pair <Data, Data> > &pastKeyValues);
+                std::vector <std::pair <Data, Data> > &pastKeyValues,
+                LLMSampler *sampler = nullptr);
 
         std::vector <int> ForwardBatch(
                 int batch,
@@ -31,7 +43,19 @@ namespace fastllm {
                 const Data &attentionMask,
                 const Data &positionIds,
                 const Data &penaltyFactor,
-                std::vector <std::pair <Data, Data> > &pastKeyValues);
+                std::vector <std::pair <Data, Data> > &pastKeyValues,
+                const std::vector <LLMSampler*> &samplers = {});
+
+        // 连续批处理: 每个请求只输入一个token，线性层合成一个batch计算，attention按请求分别计算
+        virtual std::vector <int> ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts);
+
+        virtual void FillLLMInputs(const ResponseContext &context,
+                                   Data &inputIds, Data &attentionMask, Data &positionIds);
+
+        virtual bool IsEndToken(int token);
+
+        // prompt部分是双向attention, 且positionIds为二维, 不能按前缀复用KV cache
+        virtual bool CanReusePrefix() { return false; }
 
 		virtual std::string Response(const std::string& input, RuntimeResult retCb); // 根据给出的内容回复
 
@@ -39,11 +63,17 @@ namespace fastllm {
                                    std::vector <std::string> &outputs,
                                    RuntimeResultBatch retCb);
 
-		virtual void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型
+		virtual void SaveLowBitModel(const std::string &fileName, int bit, int groupSize = -1); // 存储成量化模型
 
 		virtual void WarmUp(); // 预热
     private:
 		virtual void CausalMask(Data &data, int start) {}; // 因果mask？
+
+        // 加载后按名字解析一次权重的指针, Forward中不再拼接名字和查找WeightMap; block_cnt需要在LoadFromFile前设置
+        void ResolveWeights();
+
+        Data *wordEmbeddings, *finalLNWeight, *finalLNBias, *lmHead;
+        std::vector <ChatGLMLayerWeights> layers;
     };
 }
 
@@ -7,10 +7,70 @@
 
 #include "fastllm.h"
 
+#include <cstring>
+#include <initializer_list>
+
 namespace fastllm {
-    typedef std::map <std::string, Data*> DataDict;
-    typedef std::map <std::string, float> FloatDict;
-    typedef std::map <std::string, int> IntDict;
+    // 内置算子的编号, Executor按编号找到每个device上的算子, 不再按名字查找
+    enum OpType {
+        OP_EMBEDDING = 0, OP_LAYERNORM, OP_RMSNORM, OP_LINEAR, OP_SPLIT, OP_CAT, OP_CATDIRECT, OP_MATMUL,
+        OP_MATMUL_TRANSB, OP_SOFTMAX, OP_SILU, OP_GELUNEW, OP_MUL, OP_MULTO, OP_ADDTO, OP_ATTENTIONMASK,
+        OP_ATTENTION, OP_TOPK, OP_PERMUTE, OP_PERMUTESELF, OP_ROTATEPOSITION2D, OP_REPEATPENALTY,
+        OP_COUNT
+    };
+
+    const std::string &GetOpTypeName(OpType op); // 算子注册到device.ops中的名字
+
+    OpType GetOpTypeByName(const std::string &name); // 不是内置算子时返回OP_COUNT
+
+    void ErrorInOpParamDict(int size); // 参数个数超过OpParamDict::MAX_SIZE时报错
+
+    // 算子的参数表: 最多MAX_SIZE个(名字, 值), 存在定长数组中, 构造时不分配内存
+    // 名字使用字符串常量, find按顺序比较, 用法和std::map的find / end / 遍历一致
+    template <typename T>
+    struct OpParamDict {
+        static const int MAX_SIZE = 8;
+        typedef std::pair <const char*, T> Item;
+
+        Item items[MAX_SIZE];
+        int size = 0;
+
+        OpParamDict () {}
+
+        OpParamDict (std::initializer_list <Item> list) {
+            if (list.size() > MAX_SIZE) {
+                ErrorInOpParamDict(list.size());
+            }
+            for (const Item &item : list) {
+                items[size++] = item;
+            }
+        }
+
+        const Item *begin() const {
+            return items;
+        }
+
+        const Item *end() const {
+            return items + size;
+        }
+
+        const Item *find(const char *key) const {
+            for (int i = 0; i < size; i++) {
+                if (strcmp(items[i].first, key) == 0) {
+                    return items + i;
+                }
+            }
+            return end();
+        }
+
+        const Item *find(const std::string &key) const {
+            return find(key.c_str());
+        }
+    };
+
+    typedef OpParamDict <Data*> DataDict;
+    typedef OpParamDict <float> FloatDict;
+    typedef OpParamDict <int> IntDict;
 
     class BaseOperator {
     public:
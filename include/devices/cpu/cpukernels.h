@@ -0,0 +1,84 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+// 按指令集分别编译的CPU kernel: 每个指令集一个翻译单元(src/devices/cpu/kernels), 用各自的编译选项编译
+// 启动时按cpuid选出当前CPU支持的最高级别, 同一个二进制可以在不同的CPU上运行
+// 这些翻译单元不能使用std中的模板和头文件中的inline函数, 否则链接时可能选中高级指令集编译的版本
+
+#ifndef FASTLLM_CPUKERNELS_H
+#define FASTLLM_CPUKERNELS_H
+
+#include <cstdint>
+
+namespace fastllm {
+    // 指令集级别, 从低到高排列; 高级别不一定包含低级别(例如有AVX512_VNNI的CPU不一定有AVX_VNNI)
+    enum CpuInstructLevel {
+        CPU_LEVEL_GENERIC = 0, // 标量实现(aarch64上为NEON), 任何CPU都可以运行
+        CPU_LEVEL_AVX2 = 1, // AVX2 + FMA + F16C
+        CPU_LEVEL_AVX_VNNI = 2, // AVX2 + AVX_VNNI
+        CPU_LEVEL_AVX512 = 3, // AVX512F + AVX512BW + AVX512VL
+        CPU_LEVEL_AVX512_VNNI = 4, // AVX512 + AVX512_VNNI
+        CPU_LEVEL_COUNT
+    };
+
+    struct CpuKernels {
+        const char *name;
+
+        // output[n, k]中[st, end)这些列 = input[n, m] * weight[k, m]^T + bias, bias可以为空
+        void (*floatLinear)(const float *input, const float *weight, const float *bias, float *output,
+                            int n, int m, int k, int st, int end);
+        void (*float16Linear)(const float *input, const uint16_t *weight, const float *bias, float *output,
+                              int n, int m, int k, int st, int end);
+
+        // c[n, k] = a[n, m] * (b[k, m] - u8WeightOffset)^T, uint8 * uint8累加到int32, c的行跨度为kstride
+        // VNNI只支持uint8 * int8, 所以把b看成b - 128, 调用者在零点修正里补偿
+        void (*multiplyU8)(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride);
+        int u8WeightOffset;
+        // 同上, b是int4, 每个字节的高4位在前; int4InterleaveInput为true时a需要预先用InterleaveInt4Input重排
+        // int4InterleaveInput为true代表kernel按RepackInt4Weight的格式读取权重, 此时重排过的权重可以直接和原始顺序的a相乘
+        void (*multiplyU4)(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride);
+        bool int4InterleaveInput;
+        // 分组量化的int4: c[n, k] = sum_g scales[i, g] * (a[:, g] * (b[i, g] - zeros[i, g])^T), float输出
+        // b的每行分成groupCnt组, 每组groupSize个(32的倍数, 最后一组可能不足); scales, zeros为[k, groupCnt]
+        // b - zero在[-15, 15]之间, 直接作为int8和a相乘; a的重排方式和multiplyU4相同
+        void (*multiplyU4Group)(const uint8_t *a, const uint8_t *b, float *c, int n, int m, int k, int kstride,
+                                int groupSize, int groupCnt, const float *scales, const int *zeros);
+
+        // output[n, k] += alpha * input0[n, m] * input1[m, k]
+        void (*matMul)(const float *input0, int input0Stride, const float *input1, int input1Stride,
+                       float *output, int n, int m, int k, float alpha);
+        // output[n, k] = alpha * input0[n, m] * input1[k, m]^T, output的行跨度为outputStride
+        void (*matMulTransB)(const float *input0, int input0Stride, const float *input1, int input1Stride,
+                             float *output, int outputStride, int n, int m, int k, float alpha);
+
+        // 以下都是对一行连续的数据
+        void (*softmax)(const float *input, float *output, int len);
+        void (*layerNorm)(const float *input, const float *gamma, const float *beta, float *output, int len);
+        void (*rmsNorm)(const float *input, const float *weight, float *output, int len, float eps);
+        void (*silu)(const float *input, float *output, int len);
+    };
+
+    // 各指令集的kernel, 编译器或平台不支持对应指令集时返回nullptr
+    const CpuKernels *GetCpuKernelsGeneric();
+    const CpuKernels *GetCpuKernelsAVX2();
+    const CpuKernels *GetCpuKernelsAVXVNNI();
+    const CpuKernels *GetCpuKernelsAVX512();
+    const CpuKernels *GetCpuKernelsAVX512VNNI();
+    const CpuKernels *GetCpuKernelsByLevel(CpuInstructLevel level);
+
+    bool IsCpuLevelSupported(CpuInstructLevel level); // 当前CPU和编译结果是否都支持这一级别
+    CpuInstructLevel GetCpuSupportedLevel(); // 当前CPU和编译结果都支持的最高级别
+    const CpuKernels *GetCpuKernels(); // 当前使用的kernel, 默认为GetCpuSupportedLevel()对应的一组
+
+    // int4 kernel要求的输入顺序: 每32个uint8一组, 前16个是奇数位置, 后16个是偶数位置, 和权重的低/高4位对应
+    void InterleaveInt4Input(uint8_t *input, int n, int m);
+    void DeinterleaveInt4Input(uint8_t *input, int n, int m); // InterleaveInt4Input的逆变换
+
+    // 把k行m列的int4权重重排成kernel的格式: 每行每32个数一组, 16个字节的低4位依次是前16个数, 高4位依次是后16个数
+    // 重排后int4InterleaveInput为true的kernel不再需要重排input, 为false的kernel需要用DeinterleaveInt4Input重排input
+    // m为奇数时不重排, 每行最后不足32个的部分保持原样
+    void RepackInt4Weight(uint8_t *weight, int k, int m);
+}
+
+#endif //FASTLLM_CPUKERNELS_H
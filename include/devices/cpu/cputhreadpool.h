@@ -0,0 +1,61 @@
+//
+// Created by huangyuyang on 7/5/23.
+//
+
+#ifndef FASTLLM_CPUTHREADPOOL_H
+#define FASTLLM_CPUTHREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fastllm {
+    // 常驻线程池，所有CPU算子共用
+    // worker在任务结束后先自旋等待一段时间，仍然没有新任务时再挂起
+    class CpuThreadPool {
+    public:
+        using RangeFunc = std::function <void(int st, int end)>;
+
+        CpuThreadPool (int threads); // threads为总线程数(包括调用线程)
+        ~CpuThreadPool ();
+
+        int GetThreads(); // 总线程数
+
+        // 把[st, end)切成threadNum段连续区间并行执行func, 调用线程执行最后一段
+        // threadNum <= 0时使用全部线程; 在池内任务中嵌套调用时会直接串行执行
+        // 任何一段抛出异常时, 等所有线程结束后在调用线程重新抛出
+        void ParallelFor(int st, int end, const RangeFunc &func, int threadNum = -1);
+    private:
+        void WorkerLoop(int id);
+
+        int threads;
+        int spinCount; // 挂起前的自旋次数
+        std::vector <std::thread> workers;
+
+        std::mutex submitLocker; // 保证同一时刻只有一个任务在池中执行
+        std::mutex sleepLocker;
+        std::condition_variable sleepCond;
+        std::atomic <int> sleepingCnt;
+
+        std::atomic <long long> epoch; // 每提交一次任务 + 1
+        std::atomic <int> finishCnt; // 本轮任务中已经结束的worker数
+        std::atomic <bool> stop;
+
+        // 当前任务, 只在epoch变化前写入
+        const RangeFunc *taskFunc;
+        std::vector <std::pair <int, int> > taskRanges;
+        std::mutex errorLocker;
+        std::exception_ptr taskError; // 本轮任务中worker抛出的第一个异常, 在ParallelFor结束时重新抛出
+    };
+
+    // 获取全局线程池，线程数由SetThreads决定
+    // 线程数变化时换成新的线程池, 旧的线程池在最后一个持有者(例如正在执行的ParallelFor)结束后才释放
+    std::shared_ptr <CpuThreadPool> GetCpuThreadPool();
+}
+
+#endif //FASTLLM_CPUTHREADPOOL_H
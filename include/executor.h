@@ -7,10 +7,47 @@
 
 #include "device.h"
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
 namespace fastllm {
+    // 一次op调用的记录
+    struct OpProfileEvent {
+        std::string opType;
+        std::string device;
+        std::string dataType; // 权重的类型, 没有权重时为第一个输入的类型
+        std::string shapes; // 所有参数的形状, 例如 input:float32[1,5,4096] weight:int4[4096,4096]
+        int threadId; // 调用线程的编号
+        long long start, duration; // 相对开始记录时刻的时间(us)和耗时(us)
+        uint64_t bytes; // 读写的字节数(估计值)
+        double flops; // 浮点运算次数(估计值)
+    };
+
+    // 实现了某个算子的一个device
+    struct OpDeviceEntry {
+        BaseDevice *device;
+        BaseOperator *op;
+        bool isCpu;
+    };
+
     class Executor {
     private:
         std::vector <BaseDevice*> devices;
+        std::vector <OpDeviceEntry> opDevices[OP_COUNT]; // 每个内置算子可以在哪些device上运行, 按devices的顺序; devices变化时更新
+
+        void UpdateOpDevices();
+
+        std::atomic <bool> profiling; // 关闭时Run中只多一次读
+        std::mutex profileLocker;
+        std::vector <OpProfileEvent> profileEvents;
+        std::map <std::thread::id, int> profileThreadIds;
+        std::chrono::system_clock::time_point profileStart;
+
+        void AddProfileEvent(const std::string &opType, BaseDevice *device, const DataDict &datas,
+                             const IntDict &intParams, std::chrono::system_clock::time_point st,
+                             std::chrono::system_clock::time_point end);
     public:
         Executor (); // 创建默认的Executor
 
@@ -20,9 +57,23 @@ namespace fastllm {
 
         void AddDevice(BaseDevice *device); // 增加一个device
 
-        // 运行一个op
+        // 运行一个内置算子: 依次尝试实现了这个算子的device, 直接调用它们的算子, 不经过BaseDevice::CanRun / Run
+        void Run(OpType op, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
+                 const fastllm::IntDict &intParams);
+
+        // 按名字运行一个op, 内置算子转换成编号后运行
         void Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                  const fastllm::IntDict &intParams);
+
+        void SetProfiling(bool profiling); // 开始/停止记录每个op的耗时
+
+        bool GetProfiling();
+
+        void ClearProfiler(); // 清空记录
+
+        void PrintProfiler(); // 按op类型汇总输出
+
+        void SaveProfilerTrace(const std::string &fileName); // 导出成chrome://tracing可以读取的json
     };
 }
 
@@ -9,21 +9,45 @@
 #include <cstdint>
 #include <string>
 #include <map>
+#include <memory>
 #include <set>
+#include <list>
 #include <queue>
 #include <unordered_map>
 #include <cmath>
 #include <algorithm>
 #include <iostream>
 #include <functional>
+#include <random>
+#include <mutex>
+#include <atomic>
 
 namespace fastllm {
     void SetThreads(int t);
     void SetLowMemMode(bool m);
+    void SetMmapMode(bool m); // 是否用mmap的方式加载模型
+    // 加载时是否把int4权重重排成CPU kernel的格式(省去每次Linear时重排input)
+    // cache为true时重排结果缓存到"模型文件名.repack"，之后加载同一个模型时直接读取缓存
+    void SetWeightRepack(bool repack, bool cache = true);
+    bool GetWeightRepack();
     void SetKVCacheInCPU(bool kvCacheInCPU);
     bool GetLowMemMode();
+    bool GetMmapMode();
     int GetThreads();
+    void SetCpuInstructLevel(const std::string &level); // 强制CPU kernel使用的指令集("generic", "avx2", "avx512"), "auto"为按cpuid自动选择
+    std::string GetCpuInstructLevel(); // 当前使用的CPU kernel
     bool GetKVCacheInCPU();
+    void SetKVCachePaged(bool paged); // KV cache是否使用分页存储
+    bool GetKVCachePaged();
+    void SetKVCachePageLen(int len); // 分页KV cache每一块存放的位置数
+    int GetKVCachePageLen();
+    void SetKVCacheMemoryLimit(uint64_t bytes); // 分页KV cache块池的内存上限，0代表不限制
+    uint64_t GetKVCacheMemoryUsed(); // 分页KV cache块池当前占用的字节数(包括空闲待复用的块)
+    void SetProfiling(bool profiling); // 是否记录每个op的耗时、形状、字节数和计算量，关闭时没有额外开销
+    bool GetProfiling();
+    void ClearProfiler(); // 清空记录
+    void PrintProfiler(); // 按op类型汇总输出
+    void SaveProfilerTrace(const std::string &fileName); // 导出成chrome://tracing可以读取的json
 
     struct LowBitConfig {
         int bit;
@@ -71,9 +95,15 @@ namespace fastllm {
 
     enum DataType {
         FLOAT32 = 0, BFLOAT16 = 1, INT16 = 2, INT8 = 3, INT4 = 4, INT2 = 5, BIT = 6, FLOAT16 = 7,
+        INT4_GROUP = 8, // 分组量化的int4, 存储和INT4相同, 每行每groupSize个数一组min, max
         INT32PARAM = 100 // int32的参数，这种类型的数据永远存在CPU上
     };
 
+    // 分页KV cache的存储类型: FLOAT32, FLOAT16, INT8(对称量化, 每个头每个位置一个scale)
+    // 只对分页存储生效，写入时量化，Attention中反量化
+    void SetKVCacheDataType(DataType type);
+    DataType GetKVCacheDataType();
+
     enum DataDevice {
         CPU = 0, CUDA = 1
     };
@@ -96,6 +126,7 @@ namespace fastllm {
         uint64_t expansionBytes = 0; // 扩容后的字节数
         std::vector <int> expansionDims; // 预扩容的形状
         uint8_t *cpuData = nullptr; // 数据指针
+        bool isExternalData = false; // cpuData是否指向外部内存(例如mmap映射的模型文件)，外部内存不由Data释放
 
 	    void *cudaData = nullptr;
         std::vector <void*> extraCudaData;
@@ -112,9 +143,21 @@ namespace fastllm {
         std::vector <int> zeros;
         std::vector <int> weightSum; // 作为权重时，有时候需要存一些和加速计算
 
+        // 分组量化(INT4_GROUP)时每行分成groupCnt组，每组groupSize个数(最后一组可能不足)
+        // 此时perChannelsConfigs, scales, zeros的第i * groupCnt + g项代表第i行第g组
+        int groupSize = -1, groupCnt = -1;
+        std::vector <float> floatWeightSum; // INT4_GROUP作为权重时，每行反量化后的权重和
+        bool isRepacked = false; // INT4, INT4_GROUP的权重已经用RepackInt4Weight重排成kernel的格式
+
         std::string fileName;
         long long filePos;
 
+        // 分页存储，用于KV cache: 形状为[outer, len, inner]，第1维每pageLen个位置存成一块
+        // 每一块的形状为[outer, pageLen, inner]，从全局的KV cache块池中申请
+        bool isPaged = false;
+        int pageLen = 0;
+        std::vector <uint8_t*> pages; // 块表
+
         Data () {};
 
         Data (DataType type);
@@ -143,6 +186,8 @@ namespace fastllm {
 
         void FreeSpace(); // 回收设备上的内存
 
+        void SetExternalData(uint8_t *data); // cpuData直接指向外部内存，不拷贝也不负责释放
+
         void UpdateUnitSize(); // 更新unitSize
 
         void Resize(const std::vector <int> &dims); // 更改尺寸
@@ -157,20 +202,65 @@ namespace fastllm {
 
         void CalcWeightSum(); // 计算WeightSum
 
+        void RepackWeight(); // INT4, INT4_GROUP的权重重排成kernel的格式，其余类型不变
+
         void ToDevice(DataDevice device); // 移动到指定device
 
         void ToDevice(void *device);
+
+        void SetPaged(); // 切换成分页存储，只能在还没有数据时调用；之后通过CatDirect追加数据
+
+        uint64_t GetPageBytes() const; // 分页存储中每一块的字节数
+
+        void ReservePages(int len); // 保证分页存储至少能放下len个位置
+
+        void FreePages(); // 把所有块还给块池
+
+        uint8_t *GetPagedData(int o, int pos) const; // 分页存储中[o, pos, 0]的地址, 同一块内的位置是连续存放的
+
+        float *GetPagedScales(int o, int pos) const; // INT8分页存储中[o, pos]这一行的scale, 存放在每一块的末尾
+
+        void SetPagedRows(int o, int pos, int len, const float *data); // 写入分页存储中[o, pos, pos + len)的数据, 按存储类型量化, 不能跨块
+
+        void GetPagedRows(int o, int pos, int len, float *data) const; // 读出分页存储中[o, pos, pos + len)的数据并转成float32, 不能跨块
+
+        void Truncate(int len); // KV cache只保留第1维的前len个位置, 分页存储时归还多余的块
+    };
+
+    enum TokenizerType {
+        TOKENIZER_GREEDY = 0, // 从左到右每次取最长的token
+        TOKENIZER_BPE = 1 // 按合并优先级合并相邻的片段, 和SentencePiece的BPE一致
     };
 
     struct Tokenizer {
-        struct TrieNode {
-            int tokenId;
-            std::map <int, TrieNode*> next;
-            TrieNode();
-        };
-        TrieNode *root;
+        TokenizerType type = TOKENIZER_GREEDY;
+
+        // BPE的参数, 读取模型时从key-value表中的tokenizer_type, tokenizer_merge_ranks, tokenizer_add_dummy_prefix设置
+        std::vector <int> mergeRanks; // 每个token的合并优先级, 越小越先合并, -1代表不参与合并; 为空时按token id
+        bool addDummyPrefix = false; // 开头补一个空格
+        int bpeCacheLimit = 4096; // 缓存最近的多少个词的BPE结果, 0代表不缓存
+
+        // 双数组trie: 状态now经过字节c转移到t = base[now] + c + 1, 要求check[t] == now; 根为状态0
+        std::vector <int> base, check;
+        std::vector <int> tokenIds; // 每个状态对应的token, 不是完整的token时为-999999
+        std::atomic <bool> dirty; // Insert之后trie需要重建
+        std::mutex locker;
 
         std::unordered_map <int, std::string> tokenToStringDict;
+        std::unordered_map <std::string, int> stringToTokenDict;
+        std::vector <std::string> decodeStrings; // 每个token解码后的字节(<n>, ▁, <|blank_n|>, <0xXX>已经替换), 由Build生成
+    private:
+        int byteTokens[256]; // 单个字节对应的<0xXX>形式的token, 不存在时为-1; BPE结果不在词表中时用它们表示
+
+        // BPE结果的LRU缓存, 最近用过的在最前面
+        std::list <std::pair <std::string, std::vector <int> > > bpeCacheList;
+        std::unordered_map <std::string, std::list <std::pair <std::string, std::vector <int> > >::iterator> bpeCacheDict;
+        std::mutex bpeCacheLocker;
+
+        void EncodeBPEWord(const char *word, int len, std::vector <int> &tokens); // 对一个词做BPE合并
+
+        void BuildIfDirty(); // Insert之后第一次使用前重建
+    public:
 
         Tokenizer ();
 
@@ -178,16 +268,69 @@ namespace fastllm {
 
         void Clear(); // 清空分词器
 
-        void Insert(const std::string &s, int tokenId); // 插入一个token
+        void Insert(const std::string &s, int tokenId); // 插入一个token, 之后第一次Encode前会重建trie
+
+        void Build(); // 根据stringToTokenDict重建trie, 读取模型时读完词表会调用
+
+        void SetConfig(const std::map <std::string, std::string> &dicts); // 从模型的key-value表中读取分词方式和BPE的参数
+
+        int GetTokenId(const char *s, int len); // 查找s[0, len)对应的token, 不存在时返回-999999
 
         Data Encode(const std::string &s); // 编码
 
+        std::vector <int> EncodeBPE(const std::string &s); // 按BPE编码, 文本中的空格替换成"▁"并按空格分词, 每个词分别合并
+
         std::string Decode(const Data &data); // 解码
+
+        const std::string &GetDecodeString(int tokenId); // 单个token解码后的字节, 可能是不完整的UTF-8字符
+    };
+
+    // 流式解码: 每次加入一个token, 只输出完整的UTF-8字符, 被拆到多个token中的字符(例如<0xXX>表示的汉字)攒齐后一起输出
+    // 每个输出流(每个请求)使用一个, 内部的缓冲区反复使用, 不为每个token分配内存
+    struct DecodeStream {
+        Tokenizer *tokenizer;
+        std::string pending; // 还没有输出的字节, 末尾是一个不完整的UTF-8字符
+        std::string current; // 最近一次Put / Flush输出的文本
+
+        DecodeStream (Tokenizer *tokenizer = nullptr);
+
+        void Reset(); // 清空缓冲区, 开始一个新的输出
+
+        const std::string &Put(int tokenId); // 加入一个token, 返回新增的完整字符(可能为空), 下次调用前有效
+
+        const std::string &Flush(); // 输出剩下的字节, 输出结束时调用
+    };
+
+    struct FileMmap {
+        uint8_t *data = nullptr; // 文件映射到的地址, 映射失败时为nullptr
+        uint64_t size = 0;
+#if defined(_WIN32) or defined(_WIN64)
+        void *fileHandle = nullptr;
+        void *mapHandle = nullptr;
+#endif
+
+        FileMmap (const std::string &fileName); // 以写时复制的方式映射整个文件
+
+        ~FileMmap();
+    };
+
+    // 最近一次WeightMap::LoadFromFile各阶段的耗时(秒), 各阶段内部是多线程的, 这里记录的是实际经过的时间
+    struct WeightLoadStats {
+        double indexTime = 0; // 读取文件头, 词表和权重索引
+        double metaTime = 0; // 创建权重, 解析量化参数, 分配空间
+        double ioTime = 0; // 读取权重数据
+        double decodeTime = 0; // 重排, 计算weightSum等预处理
+        double totalTime = 0; // 包括写重排缓存的时间
+        uint64_t bytes = 0; // 从文件读取的字节数, mmap模式和lowMemMode的embedding不计入
+        int weights = 0; // 权重个数
+        int threads = 1; // 加载使用的线程数
     };
 
     struct WeightMap {
         int versionId;
 
+        std::unique_ptr <FileMmap> fileMmap; // mmap模式下权重直接指向这里，需要和权重同生命周期; WeightMap因此不能复制
+
         Tokenizer tokenizer;
 
         std::map <std::string, std::string> dicts;
@@ -196,11 +339,39 @@ namespace fastllm {
 
         std::set <std::string> embeddingNames;
 
-        void LoadFromFile(const std::string &fileName); // 从文件读取
+        WeightLoadStats loadStats; // 最近一次LoadFromFile的耗时统计
+
+        ~WeightMap();
+
+        void LoadFromFile(const std::string &fileName); // 从文件读取, 开启了SetWeightRepack时读取或生成重排缓存; 结束时输出loadStats
+
+        void ReadFromFile(const std::string &fileName); // 从文件读取, 不处理重排缓存; 先读全部索引, 再用线程池并行读取数据
+
+        void RepackWeights(); // 所有权重重排成kernel的格式，多个权重并行处理
+
+        void CalcWeightSums(); // 预先计算所有量化权重的weightSum，多个权重并行处理; 加载时会自动调用
+
+        void SaveModel(const std::string &fileName); // 按权重当前的数据类型和格式存储(versionId = 3)，不做量化
 
-        void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型
+        void SaveLowBitModel(const std::string &fileName, int bit, int groupSize = -1); // 存储成量化模型, groupSize > 0时int4按组量化
+
+        // 从inputName逐个权重分段读取, 量化后写入fileName, 不需要把整个模型读入内存
+        // 权重类型按名字判断: embeddingNames中的是Embedding, 其它2维的".weight"是Linear, 剩下的原样复制
+        void SaveLowBitModelFromFile(const std::string &inputName, const std::string &fileName, int bit, int groupSize = -1);
+
+        void PrintLoadStats(); // 输出loadStats
 
         Data &operator [] (const std::string &key);
+
+        Data *FindWeight(const std::string &key); // 查找权重, 不存在时返回一个空的Data(不会插入新的权重), 模型加载后解析权重指针时使用
+    private:
+        Data emptyWeight;
+
+        void ReleaseMmap(); // 让指向映射的权重解除关系(不再有数据), 再释放映射
+
+        void LoadFromFileOrCache(const std::string &fileName);
+
+        void RepackWeightsTimed(); // RepackWeights, 耗时计入loadStats.decodeTime
     };
 
     struct TokenPenaltyManager {
@@ -217,6 +388,29 @@ namespace fastllm {
         void InsertToken(int token);
     };
 
+    // 解码时的采样器: 依次做temperature, top_k, top_p, 再按概率随机取一个token
+    // 每个请求各自持有一个, 随机数状态互不影响, 相同的种子得到相同的结果
+    struct LLMSampler {
+        int topK = 1; // <= 0代表不限制
+        float topP = 1.0f;
+        float temperature = 1.0f;
+        std::mt19937 rng;
+        std::vector <std::pair <float, int> > candidates; // 候选的(logit, token), 复用避免每次分配
+
+        void Init(int topK, float topP, float temperature, uint32_t seed);
+
+        bool IsGreedy() const; // topK == 1或temperature <= 0时直接取最大值
+
+        int Sample(const float *logits, int vocabSize); // 对一行logits采样, 对词表只做固定次数的线性扫描
+    };
+
+    int LLMSampling(LLMSampler *sampler, const float *logits, int vocabSize); // sampler为空时取最大值
+
+    bool NeedSampling(const std::vector <LLMSampler*> &samplers); // 是否有需要随机采样的行, 都不需要时可以直接用TopK取最大值
+
+    // 取data中最大的k个(值, 下标), 从大到小排列. 一遍扫描 + 大小为k的堆, 比堆顶小的元素按8个一组跳过
+    void TopKSelect(const float *data, int len, int k, std::vector <std::pair <float, int> > &result);
+
     void Embedding(const Data &input, Data &weight, Data &output);
 
     void RMSNorm(const Data &input, const Data &weight, float eps, Data &output);
@@ -249,6 +443,13 @@ namespace fastllm {
 
     void AttentionMask(Data &input, const Data &mask, float maskValue); // 把input里对应位置mask中为1的部分变成maskValue
 
+    // 融合的attention: output = softmax(q * k^T * scale) * v，不生成完整的attention矩阵
+    // q: [batch, qLen, dim], k: [batch, kvLen, dim], v: [batch, kvLen, vDim], output: [batch, qLen, vDim], k和v可以是分页存储的KV cache
+    // mask不为空时把mask中为1的位置变成maskValue, mask形状为[n, qLen, kvLen]或[qLen, kvLen], batch = n * heads
+    // causal为true时第i个query只能看到kv中前kvLen - qLen + i + 1个位置
+    void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
+                   float scale, float maskValue = -10000, bool causal = false);
+
     void Permute(const Data &input, const std::vector<int> &axis, Data &output); // 转置
 
     void PermuteSelf(const Data &input, const std::vector<int> &axis); // 转置
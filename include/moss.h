@@ -9,9 +9,18 @@
 #include "cmath"
 
 namespace fastllm {
+    // 一层MOSS block的权重
+    struct MOSSLayerWeights {
+        Data *lnWeight, *lnBias;
+        Data *qkvProj, *outProj;
+        Data *fcInWeight, *fcInBias;
+        Data *fcOutWeight, *fcOutBias;
+    };
+
     class MOSSModel: public basellm {
 	public:
         MOSSModel(); // 构造函数
+        ~MOSSModel(); // 析构函数, 先停止调度线程
 
 		virtual void LoadFromFile(const std::string &fileName); // 从文件读取
 
@@ -21,15 +30,30 @@ namespace fastllm {
                 const Data &attentionMask,
                 const Data &positionIds,
                 const Data &penaltyFactor,
-                std::vector <std::pair <Data, Data> > &pastKeyValues);
+                std::vector <std::pair <Data, Data> > &pastKeyValues,
+                LLMSampler *sampler = nullptr);
+
+		virtual void FillLLMInputs(const ResponseContext &context,
+                                   Data &inputIds, Data &attentionMask, Data &positionIds);
+
+		virtual bool IsEndToken(int token);
+
+		// 连续批处理的一轮解码: 所有请求合成[batch, 1]一起计算Linear, attention逐个请求计算
+		virtual std::vector <int> ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts);
+
+		virtual std::vector <int> GetPromptTokens(const std::string &input); // MOSS的prompt不加bos
 
 		virtual std::string Response(const std::string &input, RuntimeResult retCb); // 根据给出的内容回复
 
-		virtual void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型
+		virtual void SaveLowBitModel(const std::string &fileName, int bit, int groupSize = -1); // 存储成量化模型
     private:
 		virtual void RotatePosition2D(Data &data, const Data &positionIds); // 二维位置编码
 
-		virtual void CausalMask(Data &data, int start); // 因果mask？
+        // 加载后按名字解析一次权重的指针, Forward中不再拼接名字和查找WeightMap; block_cnt需要在LoadFromFile前设置
+        void ResolveWeights();
+
+        Data *wte, *lnFWeight, *lnFBias, *lmHeadWeight, *lmHeadBias;
+        std::vector <MOSSLayerWeights> layers;
     };
 }
 
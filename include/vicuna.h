@@ -11,9 +11,17 @@
 #include <iostream>
 
 namespace fastllm {
+    // 一层LLaMA decoder的权重
+    struct VicunaLayerWeights {
+        Data *inputLNWeight, *postLNWeight;
+        Data *qWeight, *kWeight, *vWeight, *oWeight;
+        Data *gateWeight, *upWeight, *downWeight;
+    };
+
     class VicunaModel: public basellm {
     public:
         VicunaModel (); // 构造函数
+        ~VicunaModel(); // 析构函数, 先停止调度线程
 
         virtual void LoadFromFile(const std::string &fileName); // 从文件读取
 
@@ -23,17 +31,27 @@ namespace fastllm {
                 const Data &attentionMask,
                 const Data &positionIds,
                 const Data &penaltyFactor,
-                std::vector <std::pair <Data, Data> > &pastKeyValues);
+                std::vector <std::pair <Data, Data> > &pastKeyValues,
+                LLMSampler *sampler = nullptr);
+
+        // 连续批处理的一轮解码: 所有请求合成[batch, 1]一起计算Linear, attention逐个请求计算
+        virtual std::vector <int> ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts);
 
         virtual std::string Response(const std::string& input, RuntimeResult retCb); // 根据给出的内容回复
 
-        virtual void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型
+        virtual void SaveLowBitModel(const std::string &fileName, int bit, int groupSize = -1); // 存储成量化模型
 
         virtual void WarmUp(); // 预热
     private:
         virtual void RotatePosition2D(Data &data, const Data &positionIds); // 二维位置编码
 
         virtual void CausalMask(Data &data, int start) {}; // 因果mask？
+
+        // 加载后按名字解析一次权重的指针, Forward中不再拼接名字和查找WeightMap; block_cnt需要在LoadFromFile前设置
+        void ResolveWeights();
+
+        Data *embedTokens, *normWeight, *lmHead;
+        std::vector <VicunaLayerWeights> layers;
     };
 }
 
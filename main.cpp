@@ -9,6 +9,7 @@ static fastllm::basellm* vicuna = fllm.createllm(LLM_TYPE_VICUNA);
 static fastllm::basellm* baichuan = fllm.createllm(LLM_TYPE_BAICHUAN);
 static int sRound = 0;
 static std::string history;
+static fastllm::ChatSession session; // 多轮对话复用上一轮的KV cache
 
 std::map <std::string, int> modelDict = {
         {"chatglm", 0}, {"moss", 1}, {"vicuna", 2}, {"baichuan", 3}
@@ -19,6 +20,19 @@ struct RunConfig {
 	std::string path = "chatglm-6b-int4.bin"; // 模型文件路径
 	int threads = 4; // 使用的线程数
 	bool lowMemMode = false; // 是否使用低内存模式
+	bool mmapMode = false; // 是否用mmap加载模型
+	bool repack = false; // 加载时是否把int4权重重排成CPU kernel的格式
+	fastllm::DataType kvDataType = fastllm::DataType::FLOAT32; // KV cache的存储类型
+	bool doSample = false; // 是否采样, 设置了下面任一参数时开启
+	int topK = 0; // top_k采样, 0代表不限制, 为1时直接取最大值
+	float topP = 1.0; // top_p采样
+	float temperature = 1.0; // 温度参数
+	int seed = -1; // 采样的随机种子, < 0时随机生成
+	std::string tokenizer = ""; // 分词方式, greedy或bpe, 为空时使用模型文件中的设置
+};
+
+std::map <std::string, fastllm::DataType> kvDataTypeDict = {
+        {"float32", fastllm::DataType::FLOAT32}, {"float16", fastllm::DataType::FLOAT16}, {"int8", fastllm::DataType::INT8}
 };
 
 void Usage() {
@@ -28,6 +42,14 @@ void Usage() {
 	std::cout << "<-p|--path> <args>:           模型文件的路径" << std::endl;
 	std::cout << "<-t|--threads> <args>:        使用的线程数量" << std::endl;
 	std::cout << "<-l|--low> <args>:            使用低内存模式" << std::endl;
+	std::cout << "<--mmap>:                     使用mmap加载模型，权重不拷贝，可以在多个进程间共享" << std::endl;
+	std::cout << "<--repack>:                   加载时把int4权重重排成CPU kernel的格式，结果缓存到模型文件名.repack" << std::endl;
+	std::cout << "<--kv_dtype> <args>:          KV cache的存储类型，可以设置为float32, float16, int8" << std::endl;
+	std::cout << "<--top_k> <args>:             top_k采样，默认不限制，为1时直接取最大值" << std::endl;
+	std::cout << "<--top_p> <args>:             top_p采样，默认为1.0" << std::endl;
+	std::cout << "<--temperature> <args>:       温度参数，默认为1.0" << std::endl;
+	std::cout << "<--seed> <args>:              采样的随机种子，默认每次随机生成" << std::endl;
+	std::cout << "<--tokenizer> <args>:         分词方式，可以设置为greedy(最长匹配), bpe(按合并优先级)，默认使用模型文件中的设置" << std::endl;
 }
 
 void ParseArgs(int argc, char **argv, RunConfig &config) {
@@ -55,6 +77,26 @@ void ParseArgs(int argc, char **argv, RunConfig &config) {
 
 		} else if (sargv[i] == "-l" || sargv[i] == "--low") {
 			config.lowMemMode = true;
+		} else if (sargv[i] == "--mmap") {
+			config.mmapMode = true;
+		} else if (sargv[i] == "--repack") {
+			config.repack = true;
+		} else if (sargv[i] == "--kv_dtype" && i + 1 < argc && kvDataTypeDict.find(sargv[i + 1]) != kvDataTypeDict.end()) {
+			config.kvDataType = kvDataTypeDict[sargv[++i]];
+		} else if (sargv[i] == "--top_k") {
+			config.doSample = true;
+			config.topK = atoi(sargv[++i].c_str());
+		} else if (sargv[i] == "--top_p") {
+			config.doSample = true;
+			config.topP = atof(sargv[++i].c_str());
+		} else if (sargv[i] == "--temperature") {
+			config.doSample = true;
+			config.temperature = atof(sargv[++i].c_str());
+		} else if (sargv[i] == "--seed") {
+			config.doSample = true;
+			config.seed = atoi(sargv[++i].c_str());
+		} else if (sargv[i] == "--tokenizer" && i + 1 < argc && (sargv[i + 1] == "greedy" || sargv[i + 1] == "bpe")) {
+			config.tokenizer = sargv[++i];
 		} else {
 			Usage();
 			exit(-1);
@@ -112,7 +154,7 @@ int chat(const char* prompt) {
 
 	if (modeltype == LLM_TYPE_MOSS) {
 		auto prompt = "You are an AI assistant whose name is MOSS. <|Human|>: " + (input) + "<eoh>";
-		ret = moss->Response(prompt, [](int index, const char* content) {
+		ret = moss->ResponseSession(session, prompt, [](int index, const char* content) {
 			if (index == 0) {
 				printf("MOSS:%s", content);
 			}
@@ -132,7 +174,7 @@ int chat(const char* prompt) {
 
         auto prompt = history + "USER: " + input + " ASSISTANT: ";
         // printf("prompt: %s\n", prompt.c_str());
-        ret = vicuna->Response(prompt, [](int index, const char* content) {
+        ret = vicuna->ResponseSession(session, prompt, [](int index, const char* content) {
             if (index == 0) {
                 printf("VICUNA:%s", content);
             }
@@ -143,7 +185,7 @@ int chat(const char* prompt) {
                 printf("\n");
             }
         });
-        history += (ret + "</s>");
+        history = prompt + ret + "</s>";
     }
 
     if (modeltype == LLM_TYPE_BAICHUAN) {
@@ -151,7 +193,7 @@ int chat(const char* prompt) {
 
         //printf("prompt: %s\n", prompt.c_str());
         history = prompt;
-        ret = baichuan->Response(prompt, [](int index, const char* content) {
+        ret = baichuan->ResponseSession(session, prompt, [](int index, const char* content) {
             if (index == 0) {
                 printf("BAICHUAN: %s", content);
             }
@@ -194,7 +236,24 @@ void uninitLLM()
 int main(int argc, char **argv) {
 	RunConfig config;
 	ParseArgs(argc, argv, config);
+	fastllm::SetMmapMode(config.mmapMode);
+	fastllm::SetWeightRepack(config.repack);
+	fastllm::SetKVCacheDataType(config.kvDataType);
 	initLLMConf(config.model, config.lowMemMode, config.path.c_str(), config.threads);
+	if (config.tokenizer != "") {
+		for (fastllm::basellm *model : {chatGlm, moss, vicuna, baichuan}) {
+			model->weight.tokenizer.type = (config.tokenizer == "bpe" ? fastllm::TOKENIZER_BPE : fastllm::TOKENIZER_GREEDY);
+		}
+	}
+	if (config.doSample) {
+		for (fastllm::basellm *model : {chatGlm, moss, vicuna, baichuan}) {
+			model->do_sample = true;
+			model->top_k = config.topK;
+			model->top_p = config.topP;
+			model->temperature = config.temperature;
+			model->seed = config.seed;
+		}
+	}
 
 	if (config.model == LLM_TYPE_MOSS) {
 		while (true) {
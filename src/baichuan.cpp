@@ -31,6 +31,11 @@ namespace fastllm {
         weight.embeddingNames.insert("model.embed_tokens.weight");
     }
 
+    BaichuanModel::~BaichuanModel() {
+        // 调度线程可能正在调用Forward, 需要在这个类的成员析构前停止
+        StopResponseLoop();
+    }
+
     void BaichuanModel::RotatePosition2D(fastllm::Data &data, const fastllm::Data &positionIds) {
         int outer = data.dims[0] * data.dims[1];
         int spatial = data.Count(2);
@@ -54,25 +59,43 @@ namespace fastllm {
 
     void BaichuanModel::LoadFromFile(const std::string &fileName) {
         this->weight.LoadFromFile(fileName);
+        ResolveWeights();
+    }
+
+    void BaichuanModel::ResolveWeights() {
+        embedTokens = weight.FindWeight("model.embed_tokens.weight");
+        normWeight = weight.FindWeight("model.norm.weight");
+        lmHead = weight.FindWeight("lm_head.weight");
+        layers.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            BaichuanLayerWeights &layer = layers[i];
+            layer.inputLNWeight = weight.FindWeight(pre + ".input_layernorm.weight");
+            layer.postLNWeight = weight.FindWeight(pre + ".post_attention_layernorm.weight");
+            layer.qkvWeight = weight.FindWeight(pre + ".self_attn.W_pack.weight");
+            layer.oWeight = weight.FindWeight(pre + ".self_attn.o_proj.weight");
+            layer.gateWeight = weight.FindWeight(pre + ".mlp.gate_proj.weight");
+            layer.upWeight = weight.FindWeight(pre + ".mlp.up_proj.weight");
+            layer.downWeight = weight.FindWeight(pre + ".mlp.down_proj.weight");
+        }
     }
 
     int BaichuanModel::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                              const fastllm::Data &positionIds, const Data &penaltyFactor,
-                             std::vector<std::pair<Data, Data>> &pastKeyValues) {
+                             std::vector<std::pair<Data, Data>> &pastKeyValues, LLMSampler *sampler) {
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
         Data hiddenStates;
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        Embedding(inputIds, *embedTokens, hiddenStates);
         for (int i = 0; i < block_cnt; i++) {
+            BaichuanLayerWeights &layer = layers[i];
             Data attenInput;
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    1e-6, attenInput);
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
+            RMSNorm(hiddenStates, *layer.inputLNWeight, 1e-6, attenInput);
 
             // 1.1 Get q, k, v
             Data qkv, q, k, v;
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
 
-            Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            Linear(attenInput, *layer.qkvWeight, Data(), qkv);
             int per = qkv.dims.back() / 3;
             Split(qkv, -1, 0, per, q);
             Split(qkv, -1, per, per * 2, k);
@@ -97,15 +120,20 @@ namespace fastllm {
 
             PermuteSelf(q, {1, 0, 2});
             PermuteSelf(k, {1, 0, 2});
-            PermuteSelf(v, {1, 2, 0});
+            PermuteSelf(v, {1, 0, 2});
 
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
+            if (GetKVCachePaged()) {
+                // 分页存储的KV cache在CatDirect时按块追加，不需要预扩容
+                pastKey.SetPaged();
+                pastValue.SetPaged();
+            }
             int unitLen = 64;
 #ifdef USE_CUDA
             unitLen = 128;
 #endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
+            while (!pastKey.isPaged && ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
                     newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
@@ -115,66 +143,198 @@ namespace fastllm {
                 }
                 pastKey.Expansion(newDims);
             }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[2] > pastValue.expansionDims[2]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[2] + v.dims[2] > pastValue.expansionDims[2])) {
+            while (!pastValue.isPaged && ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], v.dims[1], ((v.dims[2] - 1) / unitLen + 1) * unitLen};
+                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
                 } else {
                     newDims = pastValue.dims;
-                    newDims[2] += ((v.dims[2] - 1) / unitLen + 1) * unitLen;
+                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
                 }
                 pastValue.Expansion(newDims);
             }
 
             CatDirect(pastKey, k, 1);
-            CatDirect(pastValue, v, 2);
+            CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
-            // 1.2.0 q * k^T
-            Data attenWeights, attenOutput;
-            MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-            attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-            if (attentionMask.dims.size() != 0) {
-                AttentionMask(attenWeights, attentionMask, -1e100);
-            }
-            Softmax(attenWeights, attenWeights, -1);
-            MatMulTransB(attenWeights, pastValue, attenOutput);
-            attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
+            // LLaMA结构的mask就是因果mask，在Attention中隐式计算
+            Data attenOutput;
+            Attention(q, pastKey, pastValue, Data(), attenOutput, 1.0 / sqrt(head_dim), -10000, true);
             PermuteSelf(attenOutput, {1, 0, 2});
             attenOutput.Reshape({bsz, seqlen, -1});
 
             Data attenLastOutput;
-            Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
+            Linear(attenOutput, *layer.oWeight, Data(), attenLastOutput);
             AddTo(hiddenStates, attenLastOutput);
 
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
+            RMSNorm(hiddenStates, *layer.postLNWeight, 1e-6, attenInput);
             Data w1, w2, w3;
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
+            Linear(attenInput, *layer.gateWeight, Data(), w1);
+            Linear(attenInput, *layer.upWeight, Data(), w3);
             Silu(w1, w1);
             MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            Linear(w1, *layer.downWeight, Data(), w2);
             AddTo(hiddenStates, w2);
         }
 
-        RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-6, hiddenStates);
+        RMSNorm(hiddenStates, *normWeight, 1e-6, hiddenStates);
         Data logits;
-        Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+        Linear(hiddenStates, *lmHead, Data(), logits);
         logits.ToDevice(DataDevice::CPU);
         if (this->do_sample && penaltyFactor.dims == logits.dims) {
             RepeatPenalty(logits, penaltyFactor);
         }
 
-        std::pair <float, int> ret = std::make_pair(-1e9, -1);
         int base = logits.dims[1] - 1;
+        if (sampler != nullptr && !sampler->IsGreedy()) {
+            return sampler->Sample((float*)logits.cpuData + base * logits.dims.back(), logits.dims.back());
+        }
+
+        std::pair <float, int> ret = std::make_pair(-1e9, -1);
         for (int i = 0; i < logits.dims.back(); i++) {
             ret = max(ret, std::make_pair(((float*)logits.cpuData)[base * logits.dims.back() + i], i));
         }
         return ret.second;
     }
 
+    std::vector <int> BaichuanModel::ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts) {
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
+        int batch = contexts.size();
+        std::vector <float> ids, pids;
+        for (int b = 0; b < batch; b++) {
+            ids.push_back(contexts[b]->currentToken);
+            pids.push_back(contexts[b]->pastLen);
+        }
+        Data inputIds = Data(DataType::FLOAT32, {batch, 1}, ids);
+        Data positionIds = Data(DataType::FLOAT32, {batch, 1}, pids);
+
+        Data hiddenStates;
+        Embedding(inputIds, *embedTokens, hiddenStates);
+        for (int i = 0; i < block_cnt; i++) {
+            BaichuanLayerWeights &layer = layers[i];
+            Data attenInput;
+            RMSNorm(hiddenStates, *layer.inputLNWeight, 1e-6, attenInput);
+
+            // 1.1 Get q, k, v, 所有请求一起计算: [batch, 1, embed_dim]
+            Data qkv, q, k, v;
+            Linear(attenInput, *layer.qkvWeight, Data(), qkv);
+            int per = qkv.dims.back() / 3;
+            Split(qkv, -1, 0, per, q);
+            Split(qkv, -1, per, per * 2, k);
+            Split(qkv, -1, per * 2, per * 3, v);
+            std::vector <int> qkvSize = {batch, 1, num_attention_heads, -1};
+            q.Reshape(qkvSize);
+            k.Reshape(qkvSize);
+            v.Reshape(qkvSize);
+
+            q.ToDevice(DataDevice::CPU);
+            k.ToDevice(DataDevice::CPU);
+            RotatePosition2D(q, positionIds);
+            RotatePosition2D(k, positionIds);
+            q.ToDevice(DataDevice::CUDA);
+            k.ToDevice(DataDevice::CUDA);
+
+            // 1.2 Attention: 每个请求的KV cache长度不同，逐个请求计算
+            Data curQ, curK, curV, curOutput;
+            Data attenOutput = Data(DataType::FLOAT32);
+            attenOutput.Expansion({batch, 1, embed_dim});
+            for (int b = 0; b < batch; b++) {
+                Data &pastKey = contexts[b]->pastKeyValues[i].first, &pastValue = contexts[b]->pastKeyValues[i].second;
+                if (GetKVCachePaged()) {
+                    pastKey.SetPaged();
+                    pastValue.SetPaged();
+                }
+
+                // 只有一个位置, [1, 1, heads, head_dim]和[heads, 1, head_dim]的排列相同
+                Split(q, 0, b, b + 1, curQ);
+                Split(k, 0, b, b + 1, curK);
+                Split(v, 0, b, b + 1, curV);
+                curQ.Reshape({num_attention_heads, 1, -1});
+                curK.Reshape({num_attention_heads, 1, -1});
+                curV.Reshape({num_attention_heads, 1, -1});
+
+                // prompt已经处理过，KV cache一定非空
+                int unitLen = 64;
+#ifdef USE_CUDA
+                unitLen = 128;
+#endif
+                while (!pastKey.isPaged && pastKey.dims[1] + curK.dims[1] > pastKey.expansionDims[1]) {
+                    std::vector <int> newDims = pastKey.dims;
+                    newDims[1] += unitLen;
+                    pastKey.Expansion(newDims);
+                }
+                while (!pastValue.isPaged && pastValue.dims[1] + curV.dims[1] > pastValue.expansionDims[1]) {
+                    std::vector <int> newDims = pastValue.dims;
+                    newDims[1] += unitLen;
+                    pastValue.Expansion(newDims);
+                }
+                CatDirect(pastKey, curK, 1);
+                CatDirect(pastValue, curV, 1);
+
+                Attention(curQ, pastKey, pastValue, Data(), curOutput, 1.0 / sqrt(head_dim), -10000, true);
+                curOutput.Reshape({1, 1, embed_dim});
+                CatDirect(attenOutput, curOutput, 0);
+            }
+
+            Data attenLastOutput;
+            Linear(attenOutput, *layer.oWeight, Data(), attenLastOutput);
+            AddTo(hiddenStates, attenLastOutput);
+
+            // 2. mlp
+            RMSNorm(hiddenStates, *layer.postLNWeight, 1e-6, attenInput);
+            Data w1, w2, w3;
+            Linear(attenInput, *layer.gateWeight, Data(), w1);
+            Linear(attenInput, *layer.upWeight, Data(), w3);
+            Silu(w1, w1);
+            MulTo(w1, w3);
+            Linear(w1, *layer.downWeight, Data(), w2);
+            AddTo(hiddenStates, w2);
+        }
+
+        RMSNorm(hiddenStates, *normWeight, 1e-6, hiddenStates);
+        Data logits, topk;
+        Linear(hiddenStates, *lmHead, Data(), logits);
+        std::vector <LLMSampler*> samplers;
+        for (int b = 0; b < batch; b++) {
+            samplers.push_back(&contexts[b]->sampler);
+        }
+        std::vector <int> lastRet;
+        if (!this->do_sample && !NeedSampling(samplers)) {
+            TopK(logits, topk, 1);
+            topk.ToDevice(DataDevice::CPU);
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back((int)(((float *) topk.cpuData)[b * 2] + 1e-3));
+            }
+        } else {
+            logits.ToDevice(DataDevice::CPU);
+            int vocabSize = logits.dims.back();
+            if (this->do_sample) {
+                // 每个请求用自己的重复惩罚, 和RepeatPenalty相同
+                for (int b = 0; b < batch; b++) {
+                    Data &penalty = contexts[b]->tokenPenaltyManager.penalty;
+                    if (penalty.Count(0) != vocabSize) {
+                        continue;
+                    }
+                    float *curLogits = (float *) logits.cpuData + (uint64_t) b * vocabSize;
+                    float *penaltyData = (float *) penalty.cpuData;
+                    for (int j = 0; j < vocabSize; j++) {
+                        curLogits[j] = curLogits[j] < 0 ? curLogits[j] * penaltyData[j] : curLogits[j] / penaltyData[j];
+                    }
+                }
+            }
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back(LLMSampling(samplers[b], (float *) logits.cpuData + (uint64_t) b * vocabSize, vocabSize));
+            }
+        }
+        for (int b = 0; b < batch; b++) {
+            contexts[b]->pastLen++;
+        }
+        return lastRet;
+    }
+
     std::string BaichuanModel::Response(const std::string& input, RuntimeResult retCb) {
         int bos = atoi(this->weight.dicts["bos"].c_str());
         int eos = atoi(this->weight.dicts["eos"].c_str());
@@ -188,16 +348,12 @@ namespace fastllm {
         int seqLen = ids.size();
         inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, ids));
 
-        std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
         std::vector <float> vpids = std::vector <float> (seqLen, 0);
         for (int i = 0; i < seqLen; i++) {
             vpids[i] = i;
-            for (int j = i + 1; j < seqLen; j++) {
-                vmask[i * seqLen + j] = 1;
-            }
         }
 
-        Data attentionMask = Data(DataType::FLOAT32, {seqLen, seqLen}, vmask);
+        Data attentionMask; // 因果mask在Attention中隐式计算
         Data positionIds = Data(DataType::FLOAT32, {1, seqLen}, vpids);
 
         std::vector <std::pair <Data, Data> > pastKeyValues;
@@ -208,7 +364,7 @@ namespace fastllm {
 
         std::string retString = "";
         int len = seqLen;
-        std::vector <float> results;
+        DecodeStream decodeStream(&weight.tokenizer);
         int index = 0;
 
         int vocabSize = this->weight.tokenizer.tokenToStringDict.size();
@@ -220,26 +376,24 @@ namespace fastllm {
             }*/
         }
 
+        LLMSampler sampler;
+        InitSampler(sampler);
         while (true) {
             auto st = std::chrono::system_clock::now();
 
-            int ret = Forward(inputIds, attentionMask, positionIds, tokenPenaltyManager.penalty, pastKeyValues);
+            int ret = Forward(inputIds, attentionMask, positionIds, tokenPenaltyManager.penalty, pastKeyValues, &sampler);
             if (ret == eos) {
                 break;
             }
 
-            results.push_back(ret);
-            std::string curString = weight.tokenizer.Decode(Data(DataType::FLOAT32, {(int)results.size()}, results)).c_str();
+            const std::string &curString = decodeStream.Put(ret);
             retString += curString;
             if (retCb)
                 retCb(index++, curString.c_str());
             fflush(stdout);
-            results.clear();
 
-            attentionMask.ToDevice(DataDevice::CPU);
             positionIds.ToDevice(DataDevice::CPU);
             inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)ret}));
-            attentionMask = Data();
             positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)len}));
             if (do_sample) {
                 tokenPenaltyManager.InsertToken(ret);
@@ -248,6 +402,12 @@ namespace fastllm {
 
             //printf("spend %f s.\n", GetSpan(st, std::chrono::system_clock::now()));
         }
+        const std::string &restString = decodeStream.Flush();
+        if (!restString.empty()) {
+            retString += restString;
+            if (retCb)
+                retCb(index++, restString.c_str());
+        }
         if (retCb)
             retCb(-1, retString.c_str());
 
@@ -269,8 +429,8 @@ namespace fastllm {
         printf("finish.\n");
     }
 
-    void BaichuanModel::SaveLowBitModel(const std::string &fileName, int bit) {
+    void BaichuanModel::SaveLowBitModel(const std::string &fileName, int bit, int groupSize) {
         WarmUp();
-        this->weight.SaveLowBitModel(fileName, bit);
+        this->weight.SaveLowBitModel(fileName, bit, groupSize);
     }
 }
\ No newline at end of file
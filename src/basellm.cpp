@@ -0,0 +1,581 @@
+//
+// Created by huangyuyang on 7/7/23.
+//
+
+#include "utils.h"
+
+#include "basellm.h"
+
+#include <cstring>
+#include <list>
+
+namespace fastllm {
+    typedef std::pair <const basellm*, uint64_t> PrefixCacheKey; // (模型, token前缀的hash)
+
+    // 前缀KV cache中的一块: 某个token前缀最后blockLen个token的KV
+    struct PrefixCacheBlock {
+        std::vector <int> prefix; // 完整的token前缀, 用来排除hash冲突
+        DataType dataType = DataType::FLOAT32; // KV的存储类型
+        int outer = 0, keyInner = 0, valueInner = 0; // 每层这一块的K, V形状为[outer, blockLen, keyInner], [outer, blockLen, valueInner]
+        std::vector <std::vector <uint8_t> > keys, values; // 每层这一块的KV, 格式和分页存储中的一块相同
+        uint64_t bytes = 0;
+        std::list <PrefixCacheKey>::iterator lruIt;
+    };
+
+    struct PrefixCache {
+        std::mutex locker;
+        uint64_t limit = 256ULL << 20; // 内存上限, 0代表关闭
+        PrefixCacheStats stats;
+        std::map <PrefixCacheKey, PrefixCacheBlock> blocks;
+        std::list <PrefixCacheKey> lru; // 最近使用的在前面
+
+        void Erase(const PrefixCacheKey &key) {
+            auto it = blocks.find(key);
+            stats.bytes -= it->second.bytes;
+            stats.blocks--;
+            lru.erase(it->second.lruIt);
+            blocks.erase(it);
+        }
+
+        void Shrink(uint64_t bytes) {
+            while (stats.bytes > bytes && lru.size() > 0) {
+                Erase(lru.back());
+            }
+        }
+
+        // 按从后往前的顺序移到LRU的最前面, 保证前缀总是比后面的块晚淘汰
+        void Touch(const std::vector <PrefixCacheBlock*> &chain) {
+            for (int i = (int)chain.size() - 1; i >= 0; i--) {
+                lru.splice(lru.begin(), lru, chain[i]->lruIt);
+            }
+        }
+    };
+
+    static PrefixCache *GetPrefixCache() {
+        static PrefixCache *cache = new PrefixCache();
+        return cache;
+    }
+
+    void SetPrefixCacheMemoryLimit(uint64_t bytes) {
+        PrefixCache *cache = GetPrefixCache();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        cache->limit = bytes;
+        cache->Shrink(bytes);
+    }
+
+    uint64_t GetPrefixCacheMemoryLimit() {
+        PrefixCache *cache = GetPrefixCache();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        return cache->limit;
+    }
+
+    PrefixCacheStats GetPrefixCacheStats() {
+        PrefixCache *cache = GetPrefixCache();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        return cache->stats;
+    }
+
+    void ClearPrefixCache() {
+        PrefixCache *cache = GetPrefixCache();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        cache->blocks.clear();
+        cache->lru.clear();
+        cache->stats = PrefixCacheStats();
+    }
+
+    static uint64_t HashTokens(uint64_t hash, const int *tokens, int len) {
+        for (int i = 0; i < len; i++) {
+            hash = (hash ^ (uint32_t)tokens[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // 把KV cache第1维[st, st + blockLen)的位置按分页存储中一块的格式复制到dst中
+    static void ReadKVBlock(const Data &data, int st, int blockLen, std::vector <uint8_t> &dst) {
+        if (data.isPaged) {
+            // 块长度和分页长度相同，直接复制整块
+            const uint8_t *page = data.pages[st / blockLen];
+            dst.assign(page, page + data.GetPageBytes());
+            return;
+        }
+        int outer = data.dims[0];
+        uint64_t rowBytes = (uint64_t)data.dims[2] * data.unitSize;
+        dst.resize((uint64_t)outer * blockLen * rowBytes);
+        for (int o = 0; o < outer; o++) {
+            memcpy(dst.data() + (uint64_t)o * blockLen * rowBytes,
+                   data.cpuData + ((uint64_t)o * data.strides[0] + (uint64_t)st * data.strides[1]) * data.unitSize,
+                   blockLen * rowBytes);
+        }
+    }
+
+    int basellm::LoadPrefixCache(const std::vector <int> &tokens, int maxLen,
+                                 std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        PrefixCache *cache = GetPrefixCache();
+        int blockLen = GetKVCachePageLen();
+        bool paged = GetKVCachePaged();
+        DataType dataType = paged ? GetKVCacheDataType() : DataType::FLOAT32;
+        std::lock_guard <std::mutex> guard(cache->locker);
+        if (cache->limit == 0) {
+            return 0;
+        }
+        std::vector <PrefixCacheBlock*> chain;
+        uint64_t hash = 14695981039346656037ULL;
+        maxLen = std::min(maxLen, (int)tokens.size());
+        for (int st = 0; st + blockLen <= maxLen; st += blockLen) {
+            hash = HashTokens(hash, tokens.data() + st, blockLen);
+            auto it = cache->blocks.find(std::make_pair(this, hash));
+            if (it == cache->blocks.end() || it->second.keys.size() != pastKeyValues.size() ||
+                it->second.dataType != dataType || it->second.prefix.size() != st + blockLen ||
+                !std::equal(it->second.prefix.begin(), it->second.prefix.end(), tokens.begin())) {
+                break;
+            }
+            chain.push_back(&it->second);
+        }
+        if (chain.size() == 0) {
+            cache->stats.misses++;
+            return 0;
+        }
+
+        int len = chain.size() * blockLen;
+        int outer = chain[0]->outer;
+        for (int i = 0; i < pastKeyValues.size(); i++) {
+            for (int j = 0; j < 2; j++) {
+                Data &cur = (j == 0 ? pastKeyValues[i].first : pastKeyValues[i].second);
+                int inner = (j == 0 ? chain[0]->keyInner : chain[0]->valueInner);
+                if (paged) {
+                    // 每一块直接复制成分页存储中的一块
+                    cur.SetPaged();
+                    cur.Resize({outer, 0, inner});
+                    cur.ReservePages(len);
+                    for (int b = 0; b < chain.size(); b++) {
+                        const std::vector <uint8_t> &block = (j == 0 ? chain[b]->keys[i] : chain[b]->values[i]);
+                        memcpy(cur.pages[b], block.data(), block.size());
+                    }
+                    cur.Resize({outer, len, inner});
+                    continue;
+                }
+
+                uint64_t blockBytes = (uint64_t)blockLen * inner * sizeof(float);
+                Data merged = Data(DataType::FLOAT32, {outer, len, inner});
+                merged.Allocate();
+                for (int b = 0; b < chain.size(); b++) {
+                    const std::vector <uint8_t> &block = (j == 0 ? chain[b]->keys[i] : chain[b]->values[i]);
+                    for (int o = 0; o < outer; o++) {
+                        memcpy(merged.cpuData + ((uint64_t)o * chain.size() + b) * blockBytes,
+                               block.data() + o * blockBytes, blockBytes);
+                    }
+                }
+                cur.Expansion({outer, ((len - 1) / 64 + 1) * 64, inner});
+                CatDirect(cur, merged, 1);
+            }
+        }
+        cache->Touch(chain);
+        cache->stats.hits++;
+        cache->stats.hitTokens += len;
+        return len;
+    }
+
+    void basellm::SavePrefixCache(const std::vector <int> &tokens,
+                                  const std::vector <std::pair <Data, Data> > &pastKeyValues) {
+        PrefixCache *cache = GetPrefixCache();
+        int blockLen = GetKVCachePageLen();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        if (cache->limit == 0 || pastKeyValues.size() == 0) {
+            return;
+        }
+        int len = tokens.size();
+        for (auto &it : pastKeyValues) {
+            for (const Data *data : {&it.first, &it.second}) {
+                if (data->dims.size() != 3 || data->dataDevice != DataDevice::CPU ||
+                    (data->isPaged ? data->pageLen != blockLen : data->dataType != DataType::FLOAT32)) {
+                    return;
+                }
+                len = std::min(len, data->dims[1]);
+            }
+        }
+
+        std::vector <PrefixCacheBlock*> chain;
+        uint64_t hash = 14695981039346656037ULL;
+        for (int st = 0; st + blockLen <= len; st += blockLen) {
+            hash = HashTokens(hash, tokens.data() + st, blockLen);
+            PrefixCacheKey key = std::make_pair(this, hash);
+            auto it = cache->blocks.find(key);
+            if (it != cache->blocks.end()) {
+                if (it->second.prefix.size() != st + blockLen ||
+                    !std::equal(it->second.prefix.begin(), it->second.prefix.end(), tokens.begin())) {
+                    break; // hash冲突, 保留原有的块
+                }
+                chain.push_back(&it->second);
+                continue;
+            }
+
+            PrefixCacheBlock &block = cache->blocks[key];
+            block.prefix = std::vector <int> (tokens.begin(), tokens.begin() + st + blockLen);
+            block.dataType = pastKeyValues[0].first.dataType;
+            block.outer = pastKeyValues[0].first.dims[0];
+            block.keyInner = pastKeyValues[0].first.dims[2];
+            block.valueInner = pastKeyValues[0].second.dims[2];
+            block.keys.resize(pastKeyValues.size());
+            block.values.resize(pastKeyValues.size());
+            for (int i = 0; i < pastKeyValues.size(); i++) {
+                ReadKVBlock(pastKeyValues[i].first, st, blockLen, block.keys[i]);
+                ReadKVBlock(pastKeyValues[i].second, st, blockLen, block.values[i]);
+                block.bytes += block.keys[i].size() + block.values[i].size();
+            }
+            cache->lru.push_front(key);
+            block.lruIt = cache->lru.begin();
+            cache->stats.bytes += block.bytes;
+            cache->stats.blocks++;
+            chain.push_back(&block);
+        }
+        cache->Touch(chain);
+        cache->Shrink(cache->limit);
+    }
+
+    basellm::~basellm() {
+        StopResponseLoop();
+        for (auto &it : this->responseContextDict) {
+            delete it.second;
+        }
+        PrefixCache *cache = GetPrefixCache();
+        std::lock_guard <std::mutex> guard(cache->locker);
+        for (auto it = cache->blocks.begin(); it != cache->blocks.end(); ) {
+            auto cur = it++;
+            if (cur->first.first == this) {
+                cache->Erase(cur->first);
+            }
+        }
+    }
+
+    void basellm::StopResponseLoop() {
+        {
+            std::lock_guard <std::mutex> lock(this->dictLocker);
+            this->mainLoopStop = true;
+        }
+        this->loopCond.notify_all();
+        if (this->mainLoop != nullptr) {
+            this->mainLoop->join();
+            delete this->mainLoop;
+            this->mainLoop = nullptr;
+        }
+    }
+
+    void basellm::FillLLMInputs(const ResponseContext &context,
+                                Data &inputIds, Data &attentionMask, Data &positionIds) {
+        if (context.pastLen == 0) {
+            std::vector <float> ids;
+            ids.push_back(atoi(this->weight.dicts["bos"].c_str()));
+            ids.insert(ids.end(), context.promptTokens.begin(), context.promptTokens.end());
+            int seqLen = ids.size();
+            std::vector <float> vpids = std::vector <float> (seqLen, 0);
+            for (int i = 0; i < seqLen; i++) {
+                vpids[i] = i;
+            }
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, ids));
+            attentionMask = Data(); // 因果mask在Attention中隐式计算
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, vpids));
+        } else {
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)context.currentToken}));
+            attentionMask = Data();
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)context.pastLen}));
+        }
+    }
+
+    void ChatSession::Clear() {
+        this->tokens.clear();
+        this->pastKeyValues.clear();
+    }
+
+    std::vector <int> basellm::GetPromptTokens(const std::string &input) {
+        std::vector <int> ret;
+        ret.push_back(atoi(this->weight.dicts["bos"].c_str()));
+        Data inputIds = this->weight.tokenizer.Encode(input);
+        for (int i = 0; i < inputIds.Count(0); i++) {
+            ret.push_back((int)((float*)inputIds.cpuData)[i]);
+        }
+        return ret;
+    }
+
+    std::string basellm::ResponseSession(ChatSession &session, const std::string &input, RuntimeResult retCb) {
+        if (!CanReusePrefix()) {
+            session.Clear();
+            return Response(input, retCb);
+        }
+
+        std::vector <int> tokens = GetPromptTokens(input);
+        // 最长公共前缀, 至少留一个token做prefill来得到下一个token
+        int pastLen = 0;
+        while (pastLen < session.tokens.size() && pastLen + 1 < tokens.size() &&
+               session.tokens[pastLen] == tokens[pastLen]) {
+            pastLen++;
+        }
+        if (pastLen == 0 || session.pastKeyValues.size() != block_cnt) {
+            session.Clear();
+            for (int i = 0; i < block_cnt; i++) {
+                session.pastKeyValues.push_back(std::make_pair(Data(DataType::FLOAT32),
+                                                               Data(DataType::FLOAT32)));
+            }
+            pastLen = LoadPrefixCache(tokens, (int)tokens.size() - 1, session.pastKeyValues);
+        } else {
+            for (auto &it : session.pastKeyValues) {
+                it.first.Truncate(pastLen);
+                it.second.Truncate(pastLen);
+            }
+        }
+        session.tokens = std::vector <int> (tokens.begin(), tokens.begin() + pastLen);
+
+        TokenPenaltyManager tokenPenaltyManager;
+        if (this->do_sample) {
+            tokenPenaltyManager.Init(this->weight.tokenizer.tokenToStringDict.size(), this->last_n, this->repeat_penalty);
+        }
+        LLMSampler sampler;
+        InitSampler(sampler);
+
+        std::vector <float> ids = std::vector <float> (tokens.begin() + pastLen, tokens.end());
+        std::string retString = "";
+        DecodeStream decodeStream(&weight.tokenizer);
+        int index = 0;
+        while (true) {
+            int len = ids.size();
+            std::vector <float> vpids = std::vector <float> (len, 0);
+            for (int i = 0; i < len; i++) {
+                vpids[i] = session.tokens.size() + i;
+            }
+            Data inputIds = Data(DataType::FLOAT32, {1, len}, ids);
+            Data positionIds = Data(DataType::FLOAT32, {1, len}, vpids);
+            int ret = Forward(inputIds, Data(), positionIds, tokenPenaltyManager.penalty, session.pastKeyValues, &sampler);
+            // 先记录已经写入KV cache的token, 回调中途退出时会话仍然是一致的
+            for (float id : ids) {
+                session.tokens.push_back((int)id);
+            }
+            if (index == 0) {
+                SavePrefixCache(session.tokens, session.pastKeyValues);
+            }
+            if (IsEndToken(ret)) {
+                break;
+            }
+
+            const std::string &curString = decodeStream.Put(ret);
+            retString += curString;
+            if (retCb)
+                retCb(index, curString.c_str());
+            index++;
+            if (this->do_sample) {
+                tokenPenaltyManager.InsertToken(ret);
+            }
+            if (this->output_token_limit > 0 && index >= this->output_token_limit) {
+                break;
+            }
+            ids = std::vector <float> {(float)ret};
+        }
+        const std::string &restString = decodeStream.Flush();
+        if (!restString.empty()) {
+            retString += restString;
+            if (retCb)
+                retCb(index, restString.c_str());
+        }
+        if (retCb)
+            retCb(-1, retString.c_str());
+        return retString;
+    }
+
+    void basellm::InitSampler(LLMSampler &sampler) {
+        if (!this->do_sample) {
+            sampler.Init(1, 1.0f, 1.0f, 0);
+            return;
+        }
+        uint32_t seed = this->seed >= 0 ? (uint32_t)this->seed : std::random_device()();
+        sampler.Init(this->top_k, this->top_p, this->temperature, seed);
+    }
+
+    bool basellm::IsEndToken(int token) {
+        return token == atoi(this->weight.dicts["eos"].c_str());
+    }
+
+    std::vector <int> basellm::ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts) {
+        std::vector <int> ret;
+        for (ResponseContext *context : contexts) {
+            Data inputIds, attentionMask, positionIds;
+            FillLLMInputs(*context, inputIds, attentionMask, positionIds);
+            ret.push_back(Forward(inputIds, attentionMask, positionIds, context->tokenPenaltyManager.penalty,
+                                  context->pastKeyValues, &context->sampler));
+            context->pastLen += inputIds.dims[1];
+        }
+        return ret;
+    }
+
+    int basellm::LaunchResponseTokens(const std::vector <int> &inputTokens, int limit) {
+        std::lock_guard <std::mutex> lock(this->dictLocker);
+        if (this->mainLoop == nullptr) {
+            this->mainLoop = new std::thread(&basellm::ResponseLoop, this);
+        }
+
+        ResponseContext *context = new ResponseContext();
+        for (int token : inputTokens) {
+            context->promptTokens.push_back(token);
+        }
+        context->limit = limit;
+        if (this->do_sample) {
+            context->tokenPenaltyManager.Init(this->weight.tokenizer.tokenToStringDict.size(),
+                                              this->last_n, this->repeat_penalty);
+        }
+        InitSampler(context->sampler);
+        for (int i = 0; i < block_cnt; i++) {
+            context->pastKeyValues.push_back(std::make_pair(Data(DataType::FLOAT32),
+                                                            Data(DataType::FLOAT32)));
+        }
+        int handleId = this->nextHandle++;
+        this->responseContextDict[handleId] = context;
+        this->loopCond.notify_one();
+        return handleId;
+    }
+
+    int basellm::FetchResponseTokens(int handleId, bool wait) {
+        std::unique_lock <std::mutex> lock(this->dictLocker);
+        auto it = this->responseContextDict.find(handleId);
+        if (it == this->responseContextDict.end()) {
+            return -1;
+        }
+        ResponseContext *context = it->second;
+        while (true) {
+            if (!context->resultTokenQueue.empty()) {
+                int token = context->resultTokenQueue.front();
+                context->resultTokenQueue.pop();
+                return token;
+            }
+            if (context->isEnding) {
+                int ret = context->isError ? -3 : -1;
+                delete context;
+                this->responseContextDict.erase(handleId);
+                return ret;
+            }
+            if (!wait) {
+                return -2;
+            }
+            this->resultCond.wait(lock);
+        }
+    }
+
+    void basellm::AppendToken(ResponseContext *context, int token) {
+        std::lock_guard <std::mutex> lock(this->dictLocker);
+        if (IsEndToken(token)) {
+            context->isEnding = true;
+        } else {
+            context->resultTokenQueue.push(token);
+            context->currentToken = token;
+            context->outputCnt++;
+            if (this->do_sample) {
+                context->tokenPenaltyManager.InsertToken(token);
+            }
+            if (context->limit > 0 && context->outputCnt >= context->limit) {
+                context->isEnding = true;
+            }
+        }
+        if (context->isEnding) {
+            // 结束后立即释放KV cache，分页存储的块可以给后面的请求使用
+            context->pastKeyValues.clear();
+        }
+        this->resultCond.notify_all();
+    }
+
+    void basellm::FailResponses(const std::vector <ResponseContext*> &contexts, std::exception_ptr error) {
+        std::string message = "unknown error";
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::string &e) {
+            message = e;
+        } catch (const std::exception &e) {
+            message = e.what();
+        } catch (...) {
+        }
+        printf("FastLLM Error: %d request(s) failed in ResponseLoop: %s\n", (int)contexts.size(), message.c_str());
+
+        std::lock_guard <std::mutex> lock(this->dictLocker);
+        for (ResponseContext *context : contexts) {
+            context->isEnding = true;
+            context->isError = true;
+            context->pastKeyValues.clear();
+        }
+        this->resultCond.notify_all();
+    }
+
+    void basellm::ResponseLoop() {
+        while (true) {
+            ResponseContext *prefill = nullptr;
+            std::vector <ResponseContext*> decodes;
+            {
+                std::unique_lock <std::mutex> lock(this->dictLocker);
+                while (true) {
+                    if (this->mainLoopStop) {
+                        return;
+                    }
+                    for (auto &it : this->responseContextDict) {
+                        ResponseContext *context = it.second;
+                        if (context->isEnding) {
+                            continue;
+                        }
+                        if (context->pastLen > 0) {
+                            decodes.push_back(context);
+                        } else if (prefill == nullptr) {
+                            prefill = context;
+                        }
+                    }
+                    if (prefill != nullptr || decodes.size() > 0) {
+                        break;
+                    }
+                    this->loopCond.wait(lock);
+                }
+            }
+
+            // 每轮只处理一个新请求的prompt，避免正在解码的请求等待太久
+            if (prefill != nullptr) {
+                try {
+                    Data inputIds, attentionMask, positionIds;
+                    FillLLMInputs(*prefill, inputIds, attentionMask, positionIds);
+                    std::vector <int> tokens;
+                    if (CanReusePrefix()) {
+                        // 前缀KV cache中已有的部分直接复制过来，只计算剩余的token
+                        inputIds.ToDevice(DataDevice::CPU);
+                        positionIds.ToDevice(DataDevice::CPU);
+                        int len = inputIds.Count(0);
+                        for (int i = 0; i < len; i++) {
+                            tokens.push_back((int)((float*)inputIds.cpuData)[i]);
+                        }
+                        int cached = LoadPrefixCache(tokens, len - 1, prefill->pastKeyValues);
+                        if (cached > 0) {
+                            std::vector <float> ids, vpids;
+                            for (int i = cached; i < len; i++) {
+                                ids.push_back(((float*)inputIds.cpuData)[i]);
+                                vpids.push_back(((float*)positionIds.cpuData)[i]);
+                            }
+                            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, len - cached}, ids));
+                            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, len - cached}, vpids));
+                            attentionMask = Data(); // 因果mask在Attention中隐式计算
+                            prefill->pastLen = cached;
+                        }
+                    }
+                    int token = Forward(inputIds, attentionMask, positionIds, prefill->tokenPenaltyManager.penalty,
+                                        prefill->pastKeyValues, &prefill->sampler);
+                    prefill->pastLen += inputIds.dims[1];
+                    if (CanReusePrefix()) {
+                        SavePrefixCache(tokens, prefill->pastKeyValues);
+                    }
+                    AppendToken(prefill, token);
+                } catch (...) {
+                    FailResponses({prefill}, std::current_exception());
+                }
+            }
+            if (decodes.size() > 0) {
+                try {
+                    std::vector <int> tokens = ForwardDecodeBatch(decodes);
+                    for (int i = 0; i < decodes.size(); i++) {
+                        AppendToken(decodes[i], tokens[i]);
+                    }
+                } catch (...) {
+                    // 合成batch后无法区分是哪个请求出错, 这一轮的请求全部结束
+                    FailResponses(decodes, std::current_exception());
+                }
+            }
+        }
+    }
+}
@@ -47,14 +47,44 @@ namespace fastllm {
         weight.embeddingNames.insert("transformer.word_embeddings.weight");
     }
 
+    ChatGLMModel::~ChatGLMModel() {
+        // 调度线程可能正在调用Forward, 需要在这个类的成员析构前停止
+        StopResponseLoop();
+    }
+
     void ChatGLMModel::LoadFromFile(const std::string &fileName) {
         this->weight.LoadFromFile(fileName);
+        ResolveWeights();
+    }
+
+    void ChatGLMModel::ResolveWeights() {
+        wordEmbeddings = weight.FindWeight("transformer.word_embeddings.weight");
+        finalLNWeight = weight.FindWeight("transformer.final_layernorm.weight");
+        finalLNBias = weight.FindWeight("transformer.final_layernorm.bias");
+        lmHead = weight.FindWeight("lm_head.weight");
+        layers.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "transformer.layers." + std::to_string(i);
+            ChatGLMLayerWeights &layer = layers[i];
+            layer.inputLNWeight = weight.FindWeight(pre + ".input_layernorm.weight");
+            layer.inputLNBias = weight.FindWeight(pre + ".input_layernorm.bias");
+            layer.qkvWeight = weight.FindWeight(pre + ".attention.query_key_value.weight");
+            layer.qkvBias = weight.FindWeight(pre + ".attention.query_key_value.bias");
+            layer.denseWeight = weight.FindWeight(pre + ".attention.dense.weight");
+            layer.denseBias = weight.FindWeight(pre + ".attention.dense.bias");
+            layer.postLNWeight = weight.FindWeight(pre + ".post_attention_layernorm.weight");
+            layer.postLNBias = weight.FindWeight(pre + ".post_attention_layernorm.bias");
+            layer.fcInWeight = weight.FindWeight(pre + ".mlp.dense_h_to_4h.weight");
+            layer.fcInBias = weight.FindWeight(pre + ".mlp.dense_h_to_4h.bias");
+            layer.fcOutWeight = weight.FindWeight(pre + ".mlp.dense_4h_to_h.weight");
+            layer.fcOutBias = weight.FindWeight(pre + ".mlp.dense_4h_to_h.bias");
+        }
     }
 
     int ChatGLMModel::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                               const fastllm::Data &positionIds, const Data &penaltyFactor,
-                              std::vector<std::pair<Data, Data>> &pastKeyValues) {
-        return ForwardBatch(1, inputIds, attentionMask, positionIds, penaltyFactor, pastKeyValues)[0];
+                              std::vector<std::pair<Data, Data>> &pastKeyValues, LLMSampler *sampler) {
+        return ForwardBatch(1, inputIds, attentionMask, positionIds, penaltyFactor, pastKeyValues, {sampler})[0];
     }
 
     std::vector <int> ChatGLMModel::ForwardBatch(
@@ -63,48 +93,41 @@ namespace fastllm {
             const Data &attentionMask,
             const Data &positionIds,
             const Data &penaltyFactor,
-            std::vector <std::pair <Data, Data> > &pastKeyValues) {
-TimeRecord batchRecord;
-//batchRecord.Clear();
-//batchRecord.Record();
+            std::vector <std::pair <Data, Data> > &pastKeyValues,
+            const std::vector <LLMSampler*> &samplers) {
         int maxLen = inputIds.dims[1];
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
         Data inputEmbeddings;
-        Embedding(inputIds, this->weight["transformer.word_embeddings.weight"], inputEmbeddings);
+        Embedding(inputIds, *wordEmbeddings, inputEmbeddings);
         Data hiddenStates = inputEmbeddings;
         PermuteSelf(hiddenStates, {1, 0, 2});
 
         Data attenInput;
         Data qkv, q, k, v;
-        Data attnProbs;
         Data attnOutput;
         Data contextLayer;
         Data mlpInput;
         Data middle;
 
         // ChatGLMBlock
-//batchRecord.Record("Pre");
         for (int i = 0; i < block_cnt; i++) {
-            std::string inputLNWeightName = "transformer.layers." + std::to_string(i) + ".input_layernorm.weight";
-            std::string inputLNBiasName = "transformer.layers." + std::to_string(i) + ".input_layernorm.bias";
-            LayerNorm(hiddenStates, weight[inputLNWeightName], weight[inputLNBiasName], -1, attenInput);
-            std::string qkvWeightName = "transformer.layers." + std::to_string(i) + ".attention.query_key_value.weight";
-            std::string qkvBiasName = "transformer.layers." + std::to_string(i) + ".attention.query_key_value.bias";
-
-//batchRecord.Record("LayerNorm");
-            Linear(attenInput, weight[qkvWeightName], weight[qkvBiasName], qkv);
-//batchRecord.Record("Linear");
+            ChatGLMLayerWeights &layer = layers[i];
+            LayerNorm(hiddenStates, *layer.inputLNWeight, *layer.inputLNBias, -1, attenInput);
+
+            Linear(attenInput, *layer.qkvWeight, *layer.qkvBias, qkv);
             qkv.Reshape({qkv.dims[0], qkv.dims[1], num_attention_heads, -1});
             int per = qkv.dims.back() / 3;
             Split(qkv, -1, 0, per, q);
             Split(qkv, -1, per, per * 2, k);
             Split(qkv, -1, per * 2, per * 3, v);
-//batchRecord.Record("SplitQKV");
             fastllm::RotatePosition2D(q, positionIds, sinData, cosData, rotary_dim);
             fastllm::RotatePosition2D(k, positionIds, sinData, cosData, rotary_dim);
 
-//batchRecord.Record("RotateQKV");
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
-            if (GetKVCacheInCPU()) {
+            if (GetKVCachePaged()) {
+                pastKey.SetPaged();
+                pastValue.SetPaged();
+            } else if (GetKVCacheInCPU()) {
                 pastKey.lockInCPU = true;
                 pastValue.lockInCPU = true;
             } else {
@@ -122,8 +145,9 @@ TimeRecord batchRecord;
 #ifdef USE_CUDA
             unitLen = 128;
 #endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
+            // 分页存储的KV cache在CatDirect时按块追加，不需要预扩容
+            while (!pastKey.isPaged && ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
                     newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
@@ -137,8 +161,8 @@ TimeRecord batchRecord;
                 pastKey.Expansion(newDims);
             }
 
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
+            while (!pastValue.isPaged && ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
                     newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
@@ -151,85 +175,207 @@ TimeRecord batchRecord;
                 }
                 pastValue.Expansion(newDims);
             }
-//batchRecord.Record("PermuteQKV");
             CatDirect(pastKey, k, 1);
-//batchRecord.Record("CatK");
             CatDirect(pastValue, v, 1);
-//batchRecord.Record("CatV");
-            std::vector <int> outputSize = {q.dims[1], q.dims[2], q.dims[0], pastKey.dims[1]};
-
             q.Reshape({q.dims[0], q.dims[1] * q.dims[2], q.dims[3]});
             PermuteSelf(q, {1, 0, 2});
 
             // 1.2 Attention
-            // 1.2.0 q * k^T
-//batchRecord.Record("GetQKV");
-            MatMulTransB(q, pastKey, attnProbs, 1.0 / (scale_attn * (i + 1)));
-//batchRecord.Record("MatMulTransB");
-            attnProbs.Reshape(outputSize);
-            // 1.2.1 Mask
-            if (attentionMask.dims.size() != 0) {
-                AttentionMask(attnProbs, attentionMask, -10000);
-            }
-
-            // 1.2.2 softmax
-            Mul(attnProbs, i + 1, attnProbs);
-            Softmax(attnProbs, attnProbs, -1);
-            outputSize = {1, pastValue.dims[0], q.dims[1], pastValue.dims[1]};
-            attnProbs.Reshape({outputSize[0] * outputSize[1], outputSize[2], -1});
-            // 1.2.3 prob * v
-//batchRecord.Record("Softmax");
-            MatMul(attnProbs, pastValue, contextLayer);
-//batchRecord.Record("MatMulTransB");
+            // 原实现先除以(i + 1)再乘回来，被mask的位置相当于-10000 * (i + 1)
+            Attention(q, pastKey, pastValue, attentionMask, contextLayer, 1.0 / scale_attn, -10000 * (i + 1));
             contextLayer.Reshape({batch, num_attention_heads, maxLen, -1});
             PermuteSelf(contextLayer, {2, 0, 1, 3});
 
             contextLayer.Reshape({contextLayer.dims[0], contextLayer.dims[1], embed_dim});
             // 1.2.4 dense
-            std::string denseWeightName = "transformer.layers." + std::to_string(i) + ".attention.dense.weight";
-            std::string denseBiasName = "transformer.layers." + std::to_string(i) + ".attention.dense.bias";
-//batchRecord.Record("contextLayer");
-            Linear(contextLayer, weight[denseWeightName], weight[denseBiasName], attnOutput);
-//batchRecord.Record("Linear");
+            Linear(contextLayer, *layer.denseWeight, *layer.denseBias, attnOutput);
             // 1.3
             float alpha = sqrt(2 * block_cnt);
             Mul(attenInput, alpha, hiddenStates);
             AddTo(hiddenStates, attnOutput);
-//batchRecord.Record("Add");
-            std::string postLNWeightName = "transformer.layers." + std::to_string(i) + ".post_attention_layernorm.weight";
-            std::string postLNBiasName = "transformer.layers." + std::to_string(i) + ".post_attention_layernorm.bias";
-            LayerNorm(hiddenStates, weight[postLNWeightName], weight[postLNBiasName], -1, mlpInput);
+            LayerNorm(hiddenStates, *layer.postLNWeight, *layer.postLNBias, -1, mlpInput);
             // 1.4 MLP
-            std::string fcInKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_h_to_4h";
-            std::string fcOutKeyName = "transformer.layers." + std::to_string(i) + ".mlp.dense_4h_to_h";
-//batchRecord.Record("LayerNorm");
-            Linear(mlpInput, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
-//batchRecord.Record("Linear");
+            Linear(mlpInput, *layer.fcInWeight, *layer.fcInBias, middle);
+            GeluNew(middle, middle);
+            Linear(middle, *layer.fcOutWeight, *layer.fcOutBias, hiddenStates);
+            AddTo(hiddenStates, mlpInput, alpha);
+        }
+        LayerNorm(hiddenStates, *finalLNWeight, *finalLNBias, -1, hiddenStates);
+        Data logits, topk;
+        Linear(hiddenStates, *lmHead, Data(), logits);
+        std::vector <int> lastRet;
+        if (!NeedSampling(samplers)) {
+            TopK(logits, topk, 1);
+            topk.ToDevice(DataDevice::CPU);
+            for (int b = 0; b < batch; b++) {
+                int base = (maxLen - 1) * batch + b;
+                lastRet.push_back((int)(((float *) topk.cpuData)[base * 2] + 1e-3));
+            }
+        } else {
+            logits.ToDevice(DataDevice::CPU);
+            int vocabSize = logits.dims.back();
+            for (int b = 0; b < batch; b++) {
+                int base = (maxLen - 1) * batch + b;
+                lastRet.push_back(LLMSampling(b < samplers.size() ? samplers[b] : nullptr, (float *) logits.cpuData + (uint64_t) base * vocabSize, vocabSize));
+            }
+        }
+        return lastRet;
+    }
+
+    std::vector <int> ChatGLMModel::ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts) {
+        int batch = contexts.size();
+        std::vector <float> ids, pids;
+        for (int b = 0; b < batch; b++) {
+            int promptLen = contexts[b]->promptTokens.size();
+            ids.push_back(contexts[b]->currentToken);
+            pids.push_back(promptLen);
+            pids.push_back(contexts[b]->pastLen - promptLen);
+        }
+        Data inputIds = Data(DataType::FLOAT32, {batch, 1}, ids);
+        Data positionIds = Data(DataType::FLOAT32, {batch * 2, 1}, pids);
+
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
+        Data inputEmbeddings;
+        Embedding(inputIds, *wordEmbeddings, inputEmbeddings);
+        Data hiddenStates = inputEmbeddings;
+        PermuteSelf(hiddenStates, {1, 0, 2});
+
+        Data attenInput;
+        Data qkv, q, k, v;
+        Data curQ, curK, curV;
+        Data attnOutput;
+        Data curContext;
+        Data mlpInput;
+        Data middle;
+
+        for (int i = 0; i < block_cnt; i++) {
+            ChatGLMLayerWeights &layer = layers[i];
+            LayerNorm(hiddenStates, *layer.inputLNWeight, *layer.inputLNBias, -1, attenInput);
+            Linear(attenInput, *layer.qkvWeight, *layer.qkvBias, qkv);
+            qkv.Reshape({qkv.dims[0], qkv.dims[1], num_attention_heads, -1});
+            int per = qkv.dims.back() / 3;
+            Split(qkv, -1, 0, per, q);
+            Split(qkv, -1, per, per * 2, k);
+            Split(qkv, -1, per * 2, per * 3, v);
+            fastllm::RotatePosition2D(q, positionIds, sinData, cosData, rotary_dim);
+            fastllm::RotatePosition2D(k, positionIds, sinData, cosData, rotary_dim);
+            q.Reshape({batch, num_attention_heads, -1});
+            k.Reshape({batch, num_attention_heads, -1});
+            v.Reshape({batch, num_attention_heads, -1});
+
+            // 每个请求的KV cache长度不同，attention逐个请求计算
+            Data contextLayer = Data(DataType::FLOAT32);
+            contextLayer.Expansion({1, batch, embed_dim});
+            for (int b = 0; b < batch; b++) {
+                Data &pastKey = contexts[b]->pastKeyValues[i].first, &pastValue = contexts[b]->pastKeyValues[i].second;
+                if (GetKVCachePaged()) {
+                    pastKey.SetPaged();
+                    pastValue.SetPaged();
+                } else if (GetKVCacheInCPU()) {
+                    pastKey.lockInCPU = true;
+                    pastValue.lockInCPU = true;
+                } else {
+                    pastKey.ToDevice(DataDevice::CUDA);
+                    pastValue.ToDevice(DataDevice::CUDA);
+                }
+
+                Split(q, 0, b, b + 1, curQ);
+                Split(k, 0, b, b + 1, curK);
+                Split(v, 0, b, b + 1, curV);
+                PermuteSelf(curQ, {1, 0, 2});
+                PermuteSelf(curK, {1, 0, 2});
+                PermuteSelf(curV, {1, 0, 2});
+
+                // prompt已经处理过，KV cache一定非空
+                int unitLen = 64;
+#ifdef USE_CUDA
+                unitLen = 128;
+#endif
+                while (!pastKey.isPaged && pastKey.dims[1] + curK.dims[1] > pastKey.expansionDims[1]) {
+                    std::vector <int> newDims = pastKey.dims;
+                    newDims[1] += unitLen;
+                    pastKey.Expansion(newDims);
+                }
+                while (!pastValue.isPaged && pastValue.dims[1] + curV.dims[1] > pastValue.expansionDims[1]) {
+                    std::vector <int> newDims = pastValue.dims;
+                    newDims[1] += unitLen;
+                    pastValue.Expansion(newDims);
+                }
+                CatDirect(pastKey, curK, 1);
+                CatDirect(pastValue, curV, 1);
+
+                Attention(curQ, pastKey, pastValue, Data(), curContext, 1.0 / scale_attn);
+                curContext.Reshape({1, 1, embed_dim});
+                CatDirect(contextLayer, curContext, 1);
+            }
+
+            Linear(contextLayer, *layer.denseWeight, *layer.denseBias, attnOutput);
+            float alpha = sqrt(2 * block_cnt);
+            Mul(attenInput, alpha, hiddenStates);
+            AddTo(hiddenStates, attnOutput);
+            LayerNorm(hiddenStates, *layer.postLNWeight, *layer.postLNBias, -1, mlpInput);
+            Linear(mlpInput, *layer.fcInWeight, *layer.fcInBias, middle);
             GeluNew(middle, middle);
-//batchRecord.Record("Gelu");
-            Linear(middle, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
-//batchRecord.Record("Linear");
+            Linear(middle, *layer.fcOutWeight, *layer.fcOutBias, hiddenStates);
             AddTo(hiddenStates, mlpInput, alpha);
-//batchRecord.Record("Add");
         }
-        LayerNorm(hiddenStates, weight["transformer.final_layernorm.weight"], weight["transformer.final_layernorm.bias"], -1, hiddenStates);
+        LayerNorm(hiddenStates, *finalLNWeight, *finalLNBias, -1, hiddenStates);
         Data logits, topk;
-//batchRecord.Record("LayerNorm");
-        Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
-//batchRecord.Record("Linear");
-        TopK(logits, topk, 1);
-        topk.ToDevice(DataDevice::CPU);
-//batchRecord.Record("logit to cpu");
+        Linear(hiddenStates, *lmHead, Data(), logits);
+        std::vector <LLMSampler*> samplers;
+        for (int b = 0; b < batch; b++) {
+            samplers.push_back(&contexts[b]->sampler);
+        }
         std::vector <int> lastRet;
+        if (!NeedSampling(samplers)) {
+            TopK(logits, topk, 1);
+            topk.ToDevice(DataDevice::CPU);
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back((int)(((float *) topk.cpuData)[b * 2] + 1e-3));
+            }
+        } else {
+            logits.ToDevice(DataDevice::CPU);
+            int vocabSize = logits.dims.back();
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back(LLMSampling(b < samplers.size() ? samplers[b] : nullptr, (float *) logits.cpuData + (uint64_t) b * vocabSize, vocabSize));
+            }
+        }
         for (int b = 0; b < batch; b++) {
-            int base = (maxLen - 1) * batch + b;
-            lastRet.push_back((int)(((float *) topk.cpuData)[base * 2] + 1e-3));
+            contexts[b]->pastLen++;
         }
-//batchRecord.Record("last");
-//batchRecord.Print();
         return lastRet;
     }
 
+    void ChatGLMModel::FillLLMInputs(const ResponseContext &context,
+                                     Data &inputIds, Data &attentionMask, Data &positionIds) {
+        int promptLen = context.promptTokens.size();
+        if (context.pastLen == 0) {
+            std::vector <float> ids = context.promptTokens;
+            ids.push_back(130001);
+            ids.push_back(130004);
+            int seqLen = ids.size();
+            std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
+            std::vector <float> vpids = std::vector <float> (seqLen * 2, 0);
+            for (int i = 0; i < seqLen - 1; i++) {
+                vmask[i * seqLen + seqLen - 1] = 1;
+                vpids[i] = i;
+            }
+            vpids[seqLen - 1] = seqLen - 2;
+            vpids[seqLen * 2 - 1] = 1;
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, ids));
+            attentionMask.CopyFrom(Data(DataType::FLOAT32, {seqLen, seqLen}, vmask));
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {2, seqLen}, vpids));
+        } else {
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)context.currentToken}));
+            attentionMask = Data();
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {2, 1}, {(float)promptLen, (float)(context.pastLen - promptLen)}));
+        }
+    }
+
+    bool ChatGLMModel::IsEndToken(int token) {
+        return token == 130005;
+    }
+
     std::string ChatGLMModel::Response(const std::string& input, RuntimeResult retCb) {
 #ifdef USE_CUDA
         FastllmCudaClearBigBuffer();
@@ -264,22 +410,22 @@ TimeRecord batchRecord;
 
         std::string retString = "";
         int len = 1, maskIds = -1;
-        std::vector <float> results;
+        DecodeStream decodeStream(&weight.tokenizer);
 		int index = 0;
+        LLMSampler sampler;
+        InitSampler(sampler);
         while (true) {
             auto st = std::chrono::system_clock::now();
-            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues);
+            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues, &sampler);
             if (ret == 130005) {
                 break;
             }
 
-            results.push_back(ret);
-            std::string curString = weight.tokenizer.Decode(Data(DataType::FLOAT32, {(int)results.size()}, results)).c_str();
+            const std::string &curString = decodeStream.Put(ret);
             retString += curString;
 			if (retCb)
 				retCb(index++, curString.c_str());
             fflush(stdout);
-            results.clear();
 
             len++;
             if (maskIds == -1) {
@@ -293,6 +439,12 @@ TimeRecord batchRecord;
             positionIds.CopyFrom(Data(DataType::FLOAT32, {2, 1}, {(float)maskIds, (float)(len)}));
 
             // printf("len = %d, spend %f s.\n", len, GetSpan(st, std::chrono::system_clock::now()));
+        }
+        const std::string &restString = decodeStream.Flush();
+        if (!restString.empty()) {
+            retString += restString;
+            if (retCb)
+                retCb(index++, restString.c_str());
         }
 		if (retCb)
 			retCb(-1, retString.c_str());
@@ -364,12 +516,19 @@ TimeRecord batchRecord;
         int len = 1;
         std::vector <int> maskIds = std::vector <int> (batch, -1);
         std::vector <bool> isEnding = std::vector <bool> (batch, false);
+        std::vector <DecodeStream> decodeStreams = std::vector <DecodeStream> (batch, DecodeStream(&weight.tokenizer));
         int index = 0;
+        std::vector <LLMSampler> samplers = std::vector <LLMSampler> (batch);
+        std::vector <LLMSampler*> samplerPointers;
+        for (int i = 0; i < batch; i++) {
+            InitSampler(samplers[i]);
+            samplerPointers.push_back(&samplers[i]);
+        }
         while (true) {
             auto st = std::chrono::system_clock::now();
-            std::vector <int> ret = ForwardBatch(batch, inputIds, attentionMask, positionIds, Data(), pastKeyValues);
+            std::vector <int> ret = ForwardBatch(batch, inputIds, attentionMask, positionIds, Data(), pastKeyValues,
+                                                 samplerPointers);
             std::vector <float> fret;
-            std::vector <float> results;
             int endingCount = 0;
             std::vector <std::string> curStrings;
             for (int i = 0; i < batch; i++) {
@@ -382,12 +541,9 @@ TimeRecord batchRecord;
                     endingCount++;
                     continue;
                 }
-                results.push_back(ret[i]);
-                std::string curString = weight.tokenizer.Decode(
-                        Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+                const std::string &curString = decodeStreams[i].Put(ret[i]);
                 outputs[i] += curString;
                 curStrings.push_back(curString);
-                results.clear();
 
                 if (maskIds[i] == -1) {
                     maskIds[i] = seqLens[i];
@@ -419,6 +575,17 @@ TimeRecord batchRecord;
             }
         }
 
+        std::vector <std::string> restStrings;
+        bool hasRest = false;
+        for (int i = 0; i < batch; i++) {
+            restStrings.push_back(decodeStreams[i].Flush());
+            outputs[i] += restStrings.back();
+            hasRest |= !restStrings.back().empty();
+        }
+        if (hasRest) {
+            if (retCb)
+                retCb(index++, restStrings);
+        }
         if (retCb)
             retCb(-1, outputs);
     }
@@ -438,8 +605,8 @@ TimeRecord batchRecord;
 	    printf("finish.\n");
     }
 
-    void ChatGLMModel::SaveLowBitModel(const std::string &fileName, int bit) {
+    void ChatGLMModel::SaveLowBitModel(const std::string &fileName, int bit, int groupSize) {
         WarmUp();
-        this->weight.SaveLowBitModel(fileName, bit);
+        this->weight.SaveLowBitModel(fileName, bit, groupSize);
     }
 }
@@ -6,6 +6,35 @@
 #include "device.h"
 
 namespace fastllm {
+    // 名字表放在函数内的静态变量中: 全局的defaultExecutor构造时就会用到, 不能依赖其他编译单元中全局变量的初始化顺序
+    static const std::string *OpTypeNames() {
+        static const std::string names[OP_COUNT] = {
+            "Embedding", "LayerNorm", "RMSNorm", "Linear", "Split", "Cat", "CatDirect", "MatMul",
+            "MatMulTransB", "SoftMax", "Silu", "GeluNew", "Mul", "MulTo", "AddTo", "AttentionMask",
+            "Attention", "TopK", "Permute", "PermuteSelf", "RotatePosition2D", "RepeatPenalty"
+        };
+        return names;
+    }
+
+    const std::string &GetOpTypeName(OpType op) {
+        return OpTypeNames()[op];
+    }
+
+    OpType GetOpTypeByName(const std::string &name) {
+        const std::string *names = OpTypeNames();
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (names[i] == name) {
+                return (OpType)i;
+            }
+        }
+        return OP_COUNT;
+    }
+
+    void ErrorInOpParamDict(int size) {
+        ErrorInFastLLM("OpParamDict error: " + std::to_string(size) + " params, at most " +
+                       std::to_string(DataDict::MAX_SIZE) + " params are supported.\n");
+    }
+
     bool BaseDevice::Malloc(void **ret, Data &data) {
         return Malloc(ret, data.expansionBytes);
     }
@@ -15,8 +44,11 @@ namespace fastllm {
         AssertInFastLLM(data.deviceData == nullptr, "Copy data to " + this->deviceName + " from cpu failed: device's data is not null.\n");
         Malloc(&data.deviceData, data.expansionBytes);
         bool ret = CopyDataFromCPU(data.cudaData, data.cpuData, data.expansionBytes);
-        delete[] data.cpuData;
+        if (!data.isExternalData) {
+            delete[] data.cpuData;
+        }
         data.cpuData = nullptr;
+        data.isExternalData = false;
         return ret;
     }
 
@@ -24,6 +56,7 @@ namespace fastllm {
         AssertInFastLLM(data.cpuData == nullptr, "Copy data from " + this->deviceName + " to cpu failed: cpu's data is not null.\n");
         AssertInFastLLM(data.deviceData != nullptr, "Copy data from " + this->deviceName + " to cpu failed: device's data is null.\n");
         data.cpuData = new uint8_t [data.expansionBytes];
+        data.isExternalData = false;
         bool ret = CopyDataToCPU(data.cpuData, data.deviceData, data.expansionBytes);
         this->Free(data.deviceData);
         data.deviceData = nullptr;
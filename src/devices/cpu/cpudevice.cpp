@@ -3,11 +3,14 @@
 //
 
 #include "devices/cpu/cpudevice.h"
+#include "devices/cpu/cputhreadpool.h"
+#include "devices/cpu/cpukernels.h"
 
 #include <cstring>
 #include <thread>
 
 #include <cfloat>
+#include <limits>
 #include <cmath>
 
 #ifdef __aarch64__
@@ -36,6 +39,7 @@ namespace fastllm {
         this->ops["MulTo"] = (BaseOperator*)(new CpuMulToOp());
         this->ops["AddTo"] = (BaseOperator*)(new CpuAddToOp());
         this->ops["AttentionMask"] = (BaseOperator*)(new CpuAttentionMaskOp());
+        this->ops["Attention"] = (BaseOperator*)(new CpuAttentionOp());
         this->ops["TopK"] = (BaseOperator*)(new CpuTopKOp());
         this->ops["Permute"] = (BaseOperator*)(new CpuPermuteOp());
         this->ops["PermuteSelf"] = (BaseOperator*)(new CpuPermuteSelfOp());
@@ -61,67 +65,6 @@ namespace fastllm {
         return true;
     }
 
-#ifdef __AVX__
-    int DotU8U8(uint8_t *a, uint8_t *b, int n) {
-        __m256i acc = _mm256_setzero_si256();
-
-        int i = 0;
-        int ans = 0;
-        for (; i + 31 < n; i += 32) {
-            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
-            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
-
-            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
-            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
-
-            __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
-            __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
-
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
-        }
-        for (; i < n; i++) {
-            ans += a[i] * b[i];
-        }
-
-        return ans + I32sum(acc);
-    };
-
-    int DotU4U8(uint8_t *a, uint8_t *b, int n) {
-        int value = 0, j = 0;
-        for (; j + 1 < n; j += 2) {
-            value += (a[j / 2] >> 4) * b[j];
-            value += (a[j / 2] & 0xF) * b[j + 1];
-        }
-        //return value;
-
-        __m256i acc = _mm256_setzero_si256();
-
-        int i = 0;
-        int ans = 0;
-        const __m256i lowMask = _mm256_set1_epi8(0xf);
-        for (; i + 31 < n; i += 32) {
-            __m128i orix = _mm_loadu_si128((const __m128i *) (a + i / 2));
-            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
-            __m256i bx = _mm256_and_si256(lowMask, bytex);
-            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
-            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
-            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
-
-            __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
-            __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
-
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
-        }
-        for (; i < n; i++) {
-            ans += a[i] * b[i];
-        }
-
-        return ans + I32sum(acc);
-    };
-#endif
-
     void CpuEmbedding::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                                const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
@@ -154,7 +97,7 @@ namespace fastllm {
         uint64_t inputLen = input.Count(0);
         float *inputData = (float*)input.cpuData;
 
-        if (GetLowMemMode()) {
+        if (GetLowMemMode() && weight.cpuData == nullptr) {
             FILE *fi = fopen(weight.fileName.c_str(), "rb");
             if (weight.dataType == DataType::FLOAT32) {
                 float *outputData = (float *) output.cpuData;
@@ -232,46 +175,14 @@ namespace fastllm {
         float *betaData = (float *) beta.cpuData;
 
         if (inner == 1) {
+            auto layerNorm = GetCpuKernels()->layerNorm;
             for (int i = 0; i < outer; i++) {
-                float mean = 0.f, s2 = 0.f, var = 0.f;
-                int j = 0;
-#ifdef __aarch64__
-                float32x4_t sums = vdupq_n_f32(0.0);
-                    float32x4_t sums2 = vdupq_n_f32(0.0);
-                    for (; j + 3 < channels; j += 4) {
-                        float32x4_t vi = vld1q_f32(inputData + j);
-                        sums = vaddq_f32(sums, vi);
-                        sums2 = vaddq_f32(sums2, vmulq_f32(vi, vi));
-                    }
-                    mean = sums[0] + sums[1] + sums[2] + sums[3];
-                    s2 = sums2[0] + sums2[1] + sums2[2] + sums2[3];
-#endif
-                for (; j < channels; j++) {
-                    mean += inputData[j];
-                    s2 += inputData[j] * inputData[j];
-                }
-                mean /= channels;
-                var = s2 + mean * mean * channels - 2 * mean * channels * mean;
-                var = sqrt(var / channels + 1e-10);
-                j = 0;
-#ifdef __aarch64__
-                float32x4_t means = vdupq_n_f32(mean);
-                    float32x4_t vars = vdupq_n_f32(1.0 / var);
-                    for (; j + 3 < channels; j += 4) {
-                        float32x4_t va = vld1q_f32(gammaData + j), vb = vld1q_f32(betaData + j);
-                        float32x4_t vi = vld1q_f32(inputData + j);
-                        float32x4_t vo = vaddq_f32(vmulq_f32(vmulq_f32(vsubq_f32(vi, means), vars), va), vb);
-                        vst1q_f32(outputData + j, vo);
-                    }
-#endif
-                for (; j < channels; j++) {
-                    float a = gammaData[j], b = betaData[j];
-                    outputData[j] = (inputData[j] - mean) / var * a + b;
-                }
-
+                layerNorm(inputData, gammaData, betaData, outputData, channels);
                 inputData += channels;
                 outputData += channels;
             }
+            delete[] mean;
+            delete[] var;
             return;
         } else {
             for (int i = 0; i < outer; i++) {
@@ -331,39 +242,9 @@ namespace fastllm {
         float *outputData = (float *) output.cpuData;
         float *weightData = (float *) weight.cpuData;
 
+        auto rmsNorm = GetCpuKernels()->rmsNorm;
         for (int i = 0; i < outer; i++) {
-            float mean = 0.f;
-            int j = 0;
-#ifdef __aarch64__X
-            float32x4_t sums = vdupq_n_f32(0.0);
-            float32x4_t sums2 = vdupq_n_f32(0.0);
-            for (; j + 3 < channels; j += 4) {
-                float32x4_t vi = vld1q_f32(inputData + j);
-                sums = vaddq_f32(sums, vi);
-                sums2 = vaddq_f32(sums2, vmulq_f32(vi, vi));
-            }
-            mean = sums[0] + sums[1] + sums[2] + sums[3];
-            s2 = sums2[0] + sums2[1] + sums2[2] + sums2[3];
-#endif
-            for (; j < channels; j++) {
-                mean += inputData[j] * inputData[j];
-            }
-            float scale = 1.0 / sqrt(mean / channels + eps);
-            j = 0;
-#ifdef __aarch64__X
-            float32x4_t means = vdupq_n_f32(mean);
-            float32x4_t vars = vdupq_n_f32(1.0 / var);
-            for (; j + 3 < channels; j += 4) {
-                float32x4_t va = vld1q_f32(gammaData + j), vb = vld1q_f32(betaData + j);
-                float32x4_t vi = vld1q_f32(inputData + j);
-                float32x4_t vo = vaddq_f32(vmulq_f32(vmulq_f32(vsubq_f32(vi, means), vars), va), vb);
-                vst1q_f32(outputData + j, vo);
-            }
-#endif
-            for (; j < channels; j++) {
-                outputData[j] = inputData[j] * scale * weightData[j];
-            }
-
+            rmsNorm(inputData, weightData, outputData, channels, eps);
             inputData += channels;
             outputData += channels;
         }
@@ -386,42 +267,6 @@ namespace fastllm {
         output.Resize(dims);
     }
 
-    void FloatLinearPart(float *inputData, float *weightData, float *biasData, float *outputData,
-                         int n, int m, int k, int st, int end) {
-        for (int i = 0; i < n; i++) {
-            for (int j = st; j < end; j++) {
-                float now = biasData ? biasData[j] : 0.0f;
-                int l = 0;
-#ifdef __aarch64__
-                float32x4_t sum = {0, 0, 0, 0};
-                for (; l + 3 < m; l += 4) {
-                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vld1q_f32(weightData + j * m + l)));
-                }
-                now += sum[0] + sum[1] + sum[2] + sum[3];
-#endif
-                for (; l < m; l++) {
-                    now += inputData[i * m + l] * weightData[j * m + l];
-                }
-                outputData[i * k + j] = now;
-            }
-        }
-    }
-
-    // float的input, float16的weight, 直接计算得到float的output
-    void Float16LinearPart(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
-                           int n, int m, int k, int st, int end) {
-        for (int i = 0; i < n; i++) {
-            for (int j = st; j < end; j++) {
-                float now = biasData ? biasData[j] : 0.0f;
-                int l = 0;
-                for (; l < m; l++) {
-                    now += inputData[i * m + l] * half_to_float(weightData[j * m + l]);
-                }
-                outputData[i * k + j] = now;
-            }
-        }
-    }
-
     // float的input, int8的weight, 直接计算得到float的output
     void Int8LinearPart(float *inputData, uint8_t *weightData, float *biasData, float *outputData,
                         LowBitConfig *configs, int n, int m, int k, int st, int end) {
@@ -525,187 +370,15 @@ namespace fastllm {
         }
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void Multiply(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
-#ifdef __ARM_FEATURE_DOTPROD
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-                int j = 0;
-                uint32x4_t sum0 = {0, 0, 0, 0};
-                for (; j + 31 < m; j += 32) {
-                    uint8x16_t vi = vld1q_u8(inputWalk);
-                    uint8x16_t vi0 = vld1q_u8(inputWalk + 16);
-                    uint8x16_t vw = vld1q_u8(weightWalk);
-                    uint8x16_t vw0 = vld1q_u8(weightWalk + 16);
-                    sum0 = vdotq_u32(sum0, vi, vw);
-                    sum0 = vdotq_u32(sum0, vi0, vw0);
-                    inputWalk += 32;
-                    weightWalk += 32;
-                }
-
-                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-                for (; j < m; j++) {
-				    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-			    }
-                c[block * kstride + i] = value;
-            }
-        }
-#elif defined(__aarch64__)
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-
-                int per = 64;
-                int cnt = m / per;
-                int sur = m % per;
-
-                uint32x4_t sum = {0};
-                uint16x8_t temp = {0};
-                uint16x8_t temp1 = {0};
-                uint16x8_t temp2 = {0};
-                uint16x8_t temp3 = {0};
-                uint16x8_t temp4 = {0};
-                uint16x8_t temp5 = {0};
-                uint16x8_t temp6 = {0};
-                uint16x8_t temp7 = {0};
-
-                while (cnt--) {
-                    temp = vmull_u8(vld1_u8(inputWalk), vld1_u8(weightWalk));
-                    temp1 = vmull_u8(vld1_u8(inputWalk + 8), vld1_u8(weightWalk + 8));
-                    temp2 = vmull_u8(vld1_u8(inputWalk + 16), vld1_u8(weightWalk + 16));
-                    temp3 = vmull_u8(vld1_u8(inputWalk + 24), vld1_u8(weightWalk + 24));
-                    temp4 = vmull_u8(vld1_u8(inputWalk + 32), vld1_u8(weightWalk + 32));
-                    temp5 = vmull_u8(vld1_u8(inputWalk + 40), vld1_u8(weightWalk + 40));
-                    temp6 = vmull_u8(vld1_u8(inputWalk + 48), vld1_u8(weightWalk + 48));
-                    temp7 = vmull_u8(vld1_u8(inputWalk + 56), vld1_u8(weightWalk + 56));
-
-                    sum = vpadalq_u16(sum, temp);
-                    sum = vpadalq_u16(sum, temp1);
-                    sum = vpadalq_u16(sum, temp2);
-                    sum = vpadalq_u16(sum, temp3);
-                    sum = vpadalq_u16(sum, temp4);
-                    sum = vpadalq_u16(sum, temp5);
-                    sum = vpadalq_u16(sum, temp6);
-                    sum = vpadalq_u16(sum, temp7);
-
-                    inputWalk += per;
-                    weightWalk += per;
-                }
-
-                value += (sum[0] + sum[1] + sum[2] + sum[3]);
-                while (sur--) {
-                    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-                }
-
-                c[block * kstride + i] = value;
-            }
-        }
-#elif defined(__AVX__)
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-
-                c[block * kstride + i] = DotU8U8(inputWalk, weightWalk, m);
-                inputWalk += m;
-                weightWalk += m;
-            }
-        }
-#else
-        int block = 0;
-	    for (; block < n; block++) {
-		    uint8_t *weightWalk = b;
-		    uint8_t *inputStart = a + block * m;
-
-		    for (int i = 0; i < k; i++) {
-			    int value = 0;
-			    uint8_t *inputWalk = inputStart;
-			    for (int j = 0; j < m; j++) {
-				    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-			    }
-
-			    c[block * kstride + i] = value;
-		    }
-	    }
-#endif
-    }
-
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
     void MultiplyInt4(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
                       int *weightSums, int *weightZeros, float *scales, float *bias, LowBitConfig *config,
                       int *inputSums) {
-        int block = 0;
-        for (; block < n; block++) {
+        GetCpuKernels()->multiplyU4(a, b, c, n, m, k, kstride);
+        for (int block = 0; block < n; block++) {
             uint32_t inputSum = inputSums[block];
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
             for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-                int j = 0;
-#ifdef __ARM_FEATURE_DOTPROD
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x2_t sum0 = {0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vdot_u32(sum0, va, in.val[1]);
-                    sum0 = vdot_u32(sum0, vb, in.val[0]);
-                }
-                value += sum0[0] + sum0[1];
-#elif defined(__aarch64__)
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x4_t sum0 = {0, 0, 0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
-                    sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
-                }
-                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#elif defined(__AVX__)
-                value += DotU4U8(weightWalk + i * m / 2, inputWalk, m);
-                j += m;
-#endif
-                for (; j + 1 < m; j += 2) {
-                    int id = (i * m + j) / 2;
-                    value += (weightWalk[id] >> 4) * inputWalk[j];
-                    value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
-                }
-
-                for (; j < m; j++) {
-                    int id = (i * m + j) / 2;
-                    if ((i * m + j) % 2) {
-                        value += (weightWalk[id] & 0xF) * inputWalk[j];
-                    } else {
-                        value += (weightWalk[id] >> 4) * inputWalk[j];
-                    }
-                }
-
+                int value = c[block * kstride + i];
                 value -= weightSums[i] * config->zeroPoint;
                 value -= inputSum * weightZeros[i];
                 value += (int)config->zeroPoint * weightZeros[i] * m;
@@ -718,19 +391,10 @@ namespace fastllm {
 
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
     void MultiplyMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int threadNum) {
-        int per = k / threadNum;
-        int cur = 0;
-        std::vector <std::thread*> threads;
-        for (int i = 0; i < threadNum - 1; i++) {
-            int end = cur + per + (cur + per * (threadNum - i) < k);
-            threads.push_back(new std::thread(&Multiply, a, b + cur * m, c + cur, n, m, end - cur, k));
-            cur = end;
-        }
-        Multiply(a, b + cur * m, c + cur, n, m, k - cur, k);
-        for (int i = 0; i < threadNum - 1; i++) {
-            threads[i]->join();
-            delete threads[i];
-        }
+        auto multiply = GetCpuKernels()->multiplyU8;
+        GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+            multiply(a, b + (uint64_t)st * m, c + st, n, m, end - st, k);
+        }, threadNum);
     }
 
     //a = [n, m], b = [k, m], c = aT(b') = [n, k]
@@ -744,22 +408,21 @@ namespace fastllm {
             }
             inputSums.push_back(sum);
         }
-        int per = k / threadNum;
-        int cur = 0;
-        std::vector <std::thread*> threads;
-        for (int i = 0; i < threadNum - 1; i++) {
-            int end = cur + per + (cur + per * (threadNum - i) < k);
-            threads.push_back(new std::thread(&MultiplyInt4, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                              weightSums + cur, weightZeros + cur, scales + cur,
-                                              (bias == nullptr ? (float*)nullptr : bias + cur), &config, inputSums.data()));
-            cur = end;
-        }
-        MultiplyInt4(a, b + cur * m / 2, c + cur, n, m, k - cur, k,
-                     weightSums + cur, weightZeros + cur, scales + cur,
-                     (bias == nullptr ? (float*)nullptr : bias + cur), &config, inputSums.data());
-        for (int i = 0; i < threadNum - 1; i++) {
-            threads[i]->join();
-            delete threads[i];
+        GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+            MultiplyInt4(a, b + st * m / 2, c + st, n, m, end - st, k,
+                         weightSums + st, weightZeros + st, scales + st,
+                         (bias == nullptr ? (float*)nullptr : bias + st), &config, inputSums.data());
+        }, threadNum);
+    }
+
+    // 把量化后的input调整成和int4权重的格式对应的顺序: 原始格式的权重配合重排格式的kernel时需要重排input,
+    // 加载时已经重排过的权重配合原始格式的kernel时需要反过来重排input
+    static void PrepareInt4Input(uint8_t *input, int n, int m, const Data &weight) {
+        bool kernelLayout = GetCpuKernels()->int4InterleaveInput;
+        if (kernelLayout && !weight.isRepacked) {
+            InterleaveInt4Input(input, n, m);
+        } else if (!kernelLayout && weight.isRepacked) {
+            DeinterleaveInt4Input(input, n, m);
         }
     }
 
@@ -782,44 +445,20 @@ namespace fastllm {
             float *outputData = (float *) output.cpuData;
             float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
 
-            int threadNum = GetThreads();
-            int per = k / threadNum;
-            int cur = 0;
-            std::vector<std::thread *> threads;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < k);
-                threads.push_back(new std::thread(&FloatLinearPart, inputData, weightData, biasData, outputData,
-                                                  n, m, k, cur, end));
-                cur = end;
-            }
-
-            FloatLinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-            for (int i = 0; i < threadNum - 1; i++) {
-                threads[i]->join();
-                delete threads[i];
-            }
+            auto floatLinear = GetCpuKernels()->floatLinear;
+            GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+                floatLinear(inputData, weightData, biasData, outputData, n, m, k, st, end);
+            });
         } else if (weight.dataType == DataType::FLOAT16) {
             float *inputData = (float *) input.cpuData;
             uint16_t *weightData = (uint16_t *) weight.cpuData;
             float *outputData = (float *) output.cpuData;
             float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
 
-            int threadNum = GetThreads();
-            int per = k / threadNum;
-            int cur = 0;
-            std::vector<std::thread *> threads;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < k);
-                threads.push_back(new std::thread(&Float16LinearPart, inputData, weightData, biasData, outputData,
-                                                  n, m, k, cur, end));
-                cur = end;
-            }
-
-            Float16LinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-            for (int i = 0; i < threadNum - 1; i++) {
-                threads[i]->join();
-                delete threads[i];
-            }
+            auto float16Linear = GetCpuKernels()->float16Linear;
+            GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+                float16Linear(inputData, weightData, biasData, outputData, n, m, k, st, end);
+            });
         } else if (weight.dataType == DataType::INT8) {
             float *inputData = (float *) input.cpuData;
             uint8_t *weightData = (uint8_t *) weight.cpuData;
@@ -839,8 +478,10 @@ namespace fastllm {
                 uinput[i] = inputConfig.quantization(inputData[i]);
             }
             MultiplyMultiThread(uinput.data(), weightData, (int32_t*)outputData, n, m, k, GetThreads());
+            // kernel算出的是input * (weight - weightOffset), 补偿项合并到weight的零点中
+            int weightOffset = GetCpuKernels()->u8WeightOffset;
             for (int i = 0; i < n; i++) {
-                uint32_t inputSum = 0;
+                int inputSum = 0;
                 for (int j = 0; j < m; j++) {
                     inputSum += uinput[i * m + j];
                 }
@@ -848,7 +489,7 @@ namespace fastllm {
                 for (int j = 0; j < k; j++) {
                     int value = ((int32_t*)outputData)[i * k + j];
                     value -= weight.weightSum[j] * inputConfig.zeroPoint;
-                    value -= inputSum * weight.perChannelsConfigs[j].zeroPoint;
+                    value -= inputSum * ((int)weight.perChannelsConfigs[j].zeroPoint - weightOffset);
                     value += (int)inputConfig.zeroPoint * weight.perChannelsConfigs[j].zeroPoint * m;
 
                     outputData[i * k + j] = weight.perChannelsConfigs[j].scale * inputConfig.scale * value +
@@ -891,19 +532,7 @@ namespace fastllm {
             for (int i = 0; i < n * m; i++) {
                 uinput[i] = inputConfig.quantization(inputData[i]);
             }
-#ifdef __AVX__
-            uint8_t *temp = new uint8_t[32];
-            for (int i = 0; i < n; i++) {
-                for (int j = 0; j + 31 < m; j += 32) {
-                    memcpy(temp, uinput.data() + i * m + j, 32);
-                    for (int k = 0; k < 16; k++) {
-                        uinput[i * m + j + k] = temp[k * 2 + 1];
-                        uinput[i * m + j + k + 16] = temp[k * 2];
-                    }
-                }
-            }
-            delete[] temp;
-#endif
+            PrepareInt4Input(uinput.data(), n, m, weight);
             MultiplyInt4MultiThread(uinput.data(), weightData, (int32_t*)outputData, n, m, k,
                                     weight.weightSum.data(), weight.zeros.data(), weight.scales.data(), biasData,
                                     inputConfig, GetThreads());
@@ -925,6 +554,38 @@ namespace fastllm {
                 delete threads[i];
             }
              */
+        } else if (weight.dataType == DataType::INT4_GROUP) {
+            float *inputData = (float *) input.cpuData;
+            uint8_t *weightData = (uint8_t *) weight.cpuData;
+            float *outputData = (float *) output.cpuData;
+            float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
+            weight.CalcWeightSum();
+            float minValue = 1e9, maxValue = -1e9;
+            for (int i = 0; i < n * m; i++) {
+                minValue = std::min(minValue, inputData[i]);
+                maxValue = std::max(maxValue, inputData[i]);
+            }
+            std::vector <uint8_t> uinput;
+            uinput.resize(n * m);
+            LowBitConfig inputConfig = LowBitConfig(minValue, maxValue, 8);
+            for (int i = 0; i < n * m; i++) {
+                uinput[i] = inputConfig.quantization(inputData[i]);
+            }
+            PrepareInt4Input(uinput.data(), n, m, weight);
+            int groupSize = weight.groupSize, groupCnt = weight.groupCnt;
+            // kernel中每组减去各自的零点再乘上各自的scale, 输出 = inputScale * (c - inputZero * 反量化后的权重和) + bias
+            auto multiplyU4Group = GetCpuKernels()->multiplyU4Group;
+            GetCpuThreadPool()->ParallelFor(0, k, [&](int st, int end) {
+                multiplyU4Group(uinput.data(), weightData + (uint64_t)st * m / 2, outputData + st, n, m, end - st, k,
+                                groupSize, groupCnt, weight.scales.data() + st * groupCnt,
+                                weight.zeros.data() + st * groupCnt);
+                for (int i = 0; i < n; i++) {
+                    for (int j = st; j < end; j++) {
+                        float value = outputData[i * k + j] - (int)inputConfig.zeroPoint * weight.floatWeightSum[j];
+                        outputData[i * k + j] = inputConfig.scale * value + (biasData == nullptr ? 0.0 : biasData[j]);
+                    }
+                }
+            });
         } else {
             ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
         }
@@ -1065,10 +726,33 @@ namespace fastllm {
 
         int axis = intParams.find("axis") != intParams.end() ? intParams.find("axis")->second : -1;
 
-        AssertInFastLLM(input0.dataType == DataType::FLOAT32 && input1.dataType == DataType::FLOAT32,
+        AssertInFastLLM((input0.dataType == DataType::FLOAT32 || input0.isPaged) && input1.dataType == DataType::FLOAT32,
                         "Cat's input's type should be float32.\n");
         AssertInFastLLM(input0.dataDevice == input1.dataDevice, "CatDirect error: inputs should use same device.\n");
 
+        if (input0.isPaged) {
+            // 分页存储：按块追加，不需要提前扩容
+            AssertInFastLLM(input1.dims.size() == 3 && (axis == 1 || axis == -2),
+                            "CatDirect error: paged data only support 3-D input and axis = 1.\n");
+            if (input0.dims.size() == 0) {
+                input0.Resize({input1.dims[0], 0, input1.dims[2]});
+            }
+            AssertInFastLLM(input0.dims[0] == input1.dims[0] && input0.dims[2] == input1.dims[2],
+                            "CatDirect Error: input's shape doesn't match.\n");
+            int outer = input1.dims[0], oldLen = input0.dims[1], len = input1.dims[1], inner = input1.dims[2];
+            input0.ReservePages(oldLen + len);
+            for (int o = 0; o < outer; o++) {
+                for (int t = 0; t < len; ) {
+                    int pos = oldLen + t;
+                    int rows = std::min(len - t, input0.pageLen - pos % input0.pageLen);
+                    input0.SetPagedRows(o, pos, rows, (float*)input1.cpuData + ((uint64_t)o * len + t) * inner);
+                    t += rows;
+                }
+            }
+            input0.Resize({outer, oldLen + len, input1.dims[2]});
+            return;
+        }
+
         if (input0.dims.size() == 0) {
             input0.Resize(input1.dims);
             AssertInFastLLM(input0.expansionDims.size() == input1.dims.size() &&
@@ -1116,6 +800,19 @@ namespace fastllm {
         }
     }
 
+    // outputData[n, k] += alpha * input0Data[n, m] * input1Data[m, k]
+    void MatMulKernel(float *input0Data, int input0Stride, float *input1Data, int input1Stride,
+                      float *outputData, int n, int m, int k, float alpha) {
+        GetCpuKernels()->matMul(input0Data, input0Stride, input1Data, input1Stride, outputData, n, m, k, alpha);
+    }
+
+    // outputData[n, k] = alpha * input0Data[n, m] * input1Data[k, m]^T, output的行跨度为outputStride
+    void MatMulTransBKernel(float *input0Data, int input0Stride, float *input1Data, int input1Stride,
+                            float *outputData, int outputStride, int n, int m, int k, float alpha) {
+        GetCpuKernels()->matMulTransB(input0Data, input0Stride, input1Data, input1Stride,
+                                      outputData, outputStride, n, m, k, alpha);
+    }
+
     void MatMulSingle(float *input0Base, float *input1Base, float *outputBase,
                       int input0Spatial, int input1Spatial, int outputSpatial,
                       int input0Stride, int input1Stride,
@@ -1125,14 +822,7 @@ namespace fastllm {
             float *input1Data = input1Base + b * input1Spatial;
             float *outputData = outputBase + b * outputSpatial;
             std::fill(outputData, outputData + n * k, 0.0f);
-            for (int i = 0; i < n; i++) {
-                for (int j = 0; j < m; j++) {
-                    float now = input0Data[i * input0Stride + j] * alpha;
-                    for (int l = 0; l < k; l++) {
-                        outputData[i * k + l] += (now * input1Data[j * k + l]);
-                    }
-                }
-            }
+            MatMulKernel(input0Data, input0Stride, input1Data, k, outputData, n, m, k, alpha);
         }
     }
 
@@ -1144,31 +834,34 @@ namespace fastllm {
             float *input0Data = input0Base + b * input0Spatial;
             float *input1Data = input1Base + b * input1Spatial;
             float *outputData = outputBase + b * outputSpatial;
-            for (int i = 0; i < n; i++) {
-                for (int j = 0; j < k; j++) {
-                    float now = 0.0f;
-                    int l = 0;
-#ifdef __aarch64__
-                    float32x4_t sum = {0, 0, 0, 0};
-                    for (; l + 3 < m; l += 4) {
-                        sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(input0Data + i * input0Stride + l),
-                                                       vld1q_f32(input1Data + j * input1Stride + l)));
-                    }
-                    now += sum[0] + sum[1] + sum[2] + sum[3];
-#elif defined(__AVX__)
-                    __m256 vsum = _mm256_set1_ps(0.0f);
-                    for (; l + 7 < m; l += 8) {
-                        __m256 vx = _mm256_loadu_ps((const float *) (input0Data + i * input0Stride + l));
-                        __m256 vy = _mm256_loadu_ps((const float *) (input1Data + j * input1Stride + l));
-                        vsum = _mm256_add_ps(vsum, _mm256_mul_ps(vx, vy));
-                    }
-                    now += Floatsum(vsum);
-#endif
-                    for (; l < m; l++) {
-                        now += input0Data[i * input0Stride + l] * input1Data[j * input1Stride + l];
-                    }
-                    outputData[i * k + j] = now * alpha;
-                }
+            MatMulTransBKernel(input0Data, input0Stride, input1Data, input1Stride, outputData, k, n, m, k, alpha);
+        }
+    }
+
+    // input1为分页存储，每次取出一块中连续的若干行计算
+    void MatMulPagedSingle(float *input0Base, const Data &input1, float *outputBase,
+                           int input0Spatial, int outputSpatial, int input0Stride,
+                           int n, int m, int k, float alpha, int st, int end) {
+        for (int b = st; b < end; b++) {
+            float *input0Data = input0Base + b * input0Spatial;
+            float *outputData = outputBase + b * outputSpatial;
+            std::fill(outputData, outputData + n * k, 0.0f);
+            for (int pos = 0; pos < m; pos += input1.pageLen) {
+                MatMulKernel(input0Data + pos, input0Stride, (float*)input1.GetPagedData(b, pos), k,
+                             outputData, n, std::min(input1.pageLen, m - pos), k, alpha);
+            }
+        }
+    }
+
+    void MatMulTransBPagedSingle(float *input0Base, const Data &input1, float *outputBase,
+                                 int input0Spatial, int outputSpatial, int input0Stride,
+                                 int n, int m, int k, float alpha, int st, int end) {
+        for (int b = st; b < end; b++) {
+            float *input0Data = input0Base + b * input0Spatial;
+            float *outputData = outputBase + b * outputSpatial;
+            for (int pos = 0; pos < k; pos += input1.pageLen) {
+                MatMulTransBKernel(input0Data, input0Stride, (float*)input1.GetPagedData(b, pos), m,
+                                   outputData + pos, k, n, m, std::min(input1.pageLen, k - pos), alpha);
             }
         }
     }
@@ -1220,32 +913,21 @@ namespace fastllm {
 
         int outputSpatial = output.Count(output.dims.size() - 2);
         int threadNum = GetThreads();
-#ifdef _WIN64
-        threadNum = 1;
-#endif
         if (batch0 * n * m * k < 64 * 4096) {
             threadNum = 1;
         }
-        threadNum = std::min(threadNum, 4);
-        // TODO: 汇编优化
-        int per = batch0 / threadNum;
-        int cur = 0;
-        std::vector<std::thread *> threads;
-        for (int i = 0; i < threadNum - 1; i++) {
-            int end = cur + per + (cur + per * (threadNum - i) < batch0);
-            threads.push_back(new std::thread(&MatMulSingle,
-                                              (float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
-                                              input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                              n, m, k, alpha, cur, end));
-            cur = end;
-        }
-        MatMulSingle((float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
-                     input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                     n, m, k, alpha, cur, batch0);
-        for (int i = 0; i < threadNum - 1; i++) {
-            threads[i]->join();
-            delete threads[i];
+        if (input1.isPaged) {
+            GetCpuThreadPool()->ParallelFor(0, batch0, [&](int st, int end) {
+                MatMulPagedSingle((float*)input0.cpuData, input1, (float*)output.cpuData,
+                                  input0Spatial, outputSpatial, input0Stride, n, m, k, alpha, st, end);
+            }, threadNum);
+            return;
         }
+        GetCpuThreadPool()->ParallelFor(0, batch0, [&](int st, int end) {
+            MatMulSingle((float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
+                         input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
+                         n, m, k, alpha, st, end);
+        }, threadNum);
     }
 
     void CpuMatMulTransBOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -1294,31 +976,21 @@ namespace fastllm {
 
         int outputSpatial = output.Count(output.dims.size() - 2);
         int threadNum = GetThreads();
-#ifdef _WIN64
-        threadNum = 1;
-#endif
         if (batch0 * n * m * k < 64 * 4096) {
             threadNum = 1;
         }
-        threadNum = std::min(threadNum, 4);
-        int per = batch0 / threadNum;
-        int cur = 0;
-        std::vector<std::thread *> threads;
-        for (int i = 0; i < threadNum - 1; i++) {
-            int end = cur + per + (cur + per * (threadNum - i) < batch0);
-            threads.push_back(new std::thread(&MatMulTransBSingle,
-                                              (float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
-                                              input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                              n, m, k, alpha, cur, end));
-            cur = end;
-        }
-        MatMulTransBSingle((float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
-                           input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                           n, m, k, alpha, cur, batch0);
-        for (int i = 0; i < threadNum - 1; i++) {
-            threads[i]->join();
-            delete threads[i];
+        if (input1.isPaged) {
+            GetCpuThreadPool()->ParallelFor(0, batch0, [&](int st, int end) {
+                MatMulTransBPagedSingle((float*)input0.cpuData, input1, (float*)output.cpuData,
+                                        input0Spatial, outputSpatial, input0Stride, n, m, k, alpha, st, end);
+            }, threadNum);
+            return;
         }
+        GetCpuThreadPool()->ParallelFor(0, batch0, [&](int st, int end) {
+            MatMulTransBSingle((float*)input0.cpuData, (float*)input1.cpuData, (float*)output.cpuData,
+                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
+                               n, m, k, alpha, st, end);
+        }, threadNum);
     }
 
     void CpuSoftMaxOp::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -1340,48 +1012,9 @@ namespace fastllm {
         float *outputData = (float*)output.cpuData;
 
         if (inner == 1) {
+            auto softmax = GetCpuKernels()->softmax;
             for (int i = 0; i < outer; i++) {
-                float maxValue = 0;
-                int j = 0;
-#ifdef __aarch64__
-                float32x4_t vmax = vdupq_n_f32(-1e9);
-                for (; j + 3 < channels; j += 4) {
-                    vmax = vmaxq_f32(vmax, vld1q_f32(inputData + j));
-                }
-                for (int k = 0; k < 4; k++) {
-                    maxValue = std::max(maxValue, vmax[k]);
-                }
-#endif
-                for (; j < channels; j++) {
-                    maxValue = std::max(maxValue, inputData[j]);
-                }
-
-                j = 0;
-#ifdef __aarch64__
-                vmax = vdupq_n_f32(maxValue);
-                for (; j + 3 < channels; j += 4) {
-                    vst1q_f32(outputData + j, exp_ps(vsubq_f32(vld1q_f32(inputData + j), vmax)));
-                }
-#endif
-                for (; j < channels; j++) {
-                    outputData[j] = exp(inputData[j] - maxValue);
-                }
-                float sum = 0.0;
-                j = 0;
-                for (; j < channels; j++) {
-                    sum += outputData[j];
-                }
-
-                j = 0;
-#ifdef __aarch64__
-                float32x4_t fsum = vdupq_n_f32(sum);
-                for (j = 0; j + 3 < channels; j += 4) {
-                    vst1q_f32(outputData + j, vdivq_f32(vld1q_f32(outputData + j), fsum));
-                }
-#endif
-                for (; j < channels; j++) {
-                    outputData[j] = outputData[j] / sum;
-                }
+                softmax(inputData, outputData, channels);
                 inputData += channels;
                 outputData += channels;
             }
@@ -1423,11 +1056,7 @@ namespace fastllm {
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int i = 0;
-        for (; i < len; i++) {
-            float x = inputData[i];
-            outputData[i] = x / (1.0 + expf(-x));
-        }
+        GetCpuKernels()->silu(inputData, outputData, len);
     }
 
     void CpuGeluNewOp::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -1538,6 +1167,253 @@ namespace fastllm {
         }
     }
 
+    static const int ATTENTION_QBLOCK = 64; // 每个任务处理的query行数
+    static const int ATTENTION_KVBLOCK = 256; // 每次从kv中取出的行数
+
+    // kv中第b组从pos开始连续存放的行的地址, len返回连续的行数(不超过end - pos)
+    // 量化存储的分页KV cache每次反量化不超过一块到buffer中
+    static float *AttentionRows(const Data &data, int b, int pos, int end, int &len, std::vector <float> &buffer) {
+        if (data.isPaged) {
+            len = std::min(end - pos, data.pageLen - pos % data.pageLen);
+            if (data.dataType == DataType::FLOAT32) {
+                return (float*)data.GetPagedData(b, pos);
+            }
+            buffer.resize((uint64_t)len * data.dims[2]);
+            data.GetPagedRows(b, pos, len, buffer.data());
+            return buffer.data();
+        }
+        len = end - pos;
+        return (float*)data.cpuData + (uint64_t)b * data.Count(1) + (uint64_t)pos * data.strides[1];
+    }
+
+    // 量化存储的分页KV cache在解码(只有一行query)时不经过临时空间, 直接在寄存器中反量化
+    // output[j] = alpha * q · data[b, pos + j], [pos, pos + len)不能跨块
+    static void QuantizedKVDot(const Data &data, int b, int pos, int len, const float *q, float *output, float alpha) {
+        int dim = data.dims[2];
+        for (int j = 0; j < len; j++) {
+            float sum = 0.0f;
+            int i = 0;
+            if (data.dataType == DataType::INT8) {
+                const int8_t *row = (int8_t*)data.GetPagedData(b, pos + j);
+#if defined(__AVX2__) && defined(__FMA__)
+                __m256 vSum = _mm256_setzero_ps();
+                for (; i + 7 < dim; i += 8) {
+                    __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(row + i))));
+                    vSum = _mm256_fmadd_ps(x, _mm256_loadu_ps(q + i), vSum);
+                }
+                sum = Floatsum(vSum);
+#endif
+                for (; i < dim; i++) {
+                    sum += row[i] * q[i];
+                }
+                sum *= *data.GetPagedScales(b, pos + j);
+            } else {
+                const uint16_t *row = (uint16_t*)data.GetPagedData(b, pos + j);
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+                __m256 vSum = _mm256_setzero_ps();
+                for (; i + 7 < dim; i += 8) {
+                    vSum = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(row + i))), _mm256_loadu_ps(q + i), vSum);
+                }
+                sum = Floatsum(vSum);
+#endif
+                for (; i < dim; i++) {
+                    sum += half_to_float(row[i]) * q[i];
+                }
+            }
+            output[j] = sum * alpha;
+        }
+    }
+
+    // acc += p[j] * data[b, pos + j], [pos, pos + len)不能跨块
+    static void QuantizedKVAxpy(const Data &data, int b, int pos, int len, const float *p, float *acc) {
+        int dim = data.dims[2];
+        for (int j = 0; j < len; j++) {
+            int i = 0;
+            if (data.dataType == DataType::INT8) {
+                const int8_t *row = (int8_t*)data.GetPagedData(b, pos + j);
+                float w = p[j] * *data.GetPagedScales(b, pos + j);
+#if defined(__AVX2__) && defined(__FMA__)
+                __m256 vw = _mm256_set1_ps(w);
+                for (; i + 7 < dim; i += 8) {
+                    __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(row + i))));
+                    _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(x, vw, _mm256_loadu_ps(acc + i)));
+                }
+#endif
+                for (; i < dim; i++) {
+                    acc[i] += row[i] * w;
+                }
+            } else {
+                const uint16_t *row = (uint16_t*)data.GetPagedData(b, pos + j);
+                float w = p[j];
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+                __m256 vw = _mm256_set1_ps(w);
+                for (; i + 7 < dim; i += 8) {
+                    _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(row + i))), vw, _mm256_loadu_ps(acc + i)));
+                }
+#endif
+                for (; i < dim; i++) {
+                    acc[i] += half_to_float(row[i]) * w;
+                }
+            }
+        }
+    }
+
+    // 计算第b组中[q0, q0 + rows)这些query的attention
+    // 按块遍历kv，用online softmax累加结果，只需要[rows, ATTENTION_KVBLOCK]大小的临时空间
+    static void AttentionBlock(const Data &q, const Data &k, const Data &v, const float *maskData, Data &output,
+                               int b, int q0, int rows, float scale, float maskValue, bool causal) {
+        int qLen = q.dims[1], kvLen = k.dims[1], dim = q.dims[2], vDim = v.dims[2];
+        int qStride = q.strides[1];
+        int kStride = k.isPaged ? k.dims[2] : k.strides[1];
+        int vStride = v.isPaged ? v.dims[2] : v.strides[1];
+        float *qData = (float*)q.cpuData + (uint64_t)b * q.Count(1) + (uint64_t)q0 * qStride;
+
+        int blockLen = ATTENTION_KVBLOCK;
+        if (k.isPaged) {
+            blockLen = std::max(1, ATTENTION_KVBLOCK / k.pageLen) * k.pageLen;
+        }
+        thread_local std::vector <float> scores, acc, rowMax, rowSum, kvBuffer;
+        scores.resize(ATTENTION_QBLOCK * blockLen);
+        acc.resize(ATTENTION_QBLOCK * vDim);
+        rowMax.resize(ATTENTION_QBLOCK);
+        rowSum.resize(ATTENTION_QBLOCK);
+        std::fill(acc.begin(), acc.begin() + rows * vDim, 0.0f);
+        std::fill(rowMax.begin(), rowMax.begin() + rows, -std::numeric_limits<float>::infinity());
+        std::fill(rowSum.begin(), rowSum.begin() + rows, 0.0f);
+
+        // 只有一行query时反量化的结果不会被复用, 直接在寄存器中计算
+        bool directK = (rows == 1 && k.isPaged && k.dataType != DataType::FLOAT32);
+        bool directV = (rows == 1 && v.isPaged && v.dataType != DataType::FLOAT32);
+
+        int offset = kvLen - qLen; // causal时第i个query可以看到[0, i + offset]
+        int kvEnd = causal ? std::min(kvLen, q0 + rows + offset) : kvLen;
+        for (int st = 0; st < kvEnd; st += blockLen) {
+            int cols = std::min(blockLen, kvEnd - st);
+            // 1. scores = q * k^T * scale
+            for (int j = st, len; j < st + cols; j += len) {
+                if (directK) {
+                    len = std::min(st + cols - j, k.pageLen - j % k.pageLen);
+                    QuantizedKVDot(k, b, j, len, qData, scores.data() + (j - st), scale);
+                    continue;
+                }
+                float *kData = AttentionRows(k, b, j, st + cols, len, kvBuffer);
+                MatMulTransBKernel(qData, qStride, kData, kStride, scores.data() + (j - st), blockLen,
+                                   rows, dim, len, scale);
+            }
+
+            // 2. mask, 更新每行的最大值和指数和, scores变成未归一化的概率
+            for (int i = 0; i < rows; i++) {
+                float *s = scores.data() + i * blockLen;
+                int valid = causal ? std::max(0, std::min(cols, q0 + i + offset + 1 - st)) : cols;
+                if (maskData != nullptr) {
+                    const float *m = maskData + (uint64_t)(q0 + i) * kvLen + st;
+                    for (int j = 0; j < valid; j++) {
+                        if (m[j] > 0.99) {
+                            s[j] = maskValue;
+                        }
+                    }
+                }
+                std::fill(s + valid, s + cols, 0.0f);
+                if (valid == 0) {
+                    continue;
+                }
+                float maxValue = rowMax[i];
+                for (int j = 0; j < valid; j++) {
+                    maxValue = std::max(maxValue, s[j]);
+                }
+                float sum = 0.0f;
+                for (int j = 0; j < valid; j++) {
+                    s[j] = expf(s[j] - maxValue);
+                    sum += s[j];
+                }
+                float rescale = expf(rowMax[i] - maxValue);
+                if (rescale != 1.0f) {
+                    float *a = acc.data() + i * vDim;
+                    for (int j = 0; j < vDim; j++) {
+                        a[j] *= rescale;
+                    }
+                }
+                rowSum[i] = rowSum[i] * rescale + sum;
+                rowMax[i] = maxValue;
+            }
+
+            // 3. acc += scores * v
+            for (int j = st, len; j < st + cols; j += len) {
+                if (directV) {
+                    len = std::min(st + cols - j, v.pageLen - j % v.pageLen);
+                    QuantizedKVAxpy(v, b, j, len, scores.data() + (j - st), acc.data());
+                    continue;
+                }
+                float *vData = AttentionRows(v, b, j, st + cols, len, kvBuffer);
+                MatMulKernel(scores.data() + (j - st), blockLen, vData, vStride, acc.data(), rows, len, vDim, 1.0f);
+            }
+        }
+
+        float *outputData = (float*)output.cpuData + ((uint64_t)b * qLen + q0) * vDim;
+        for (int i = 0; i < rows; i++) {
+            float inv = 1.0f / rowSum[i];
+            for (int j = 0; j < vDim; j++) {
+                outputData[i * vDim + j] = acc[i * vDim + j] * inv;
+            }
+        }
+    }
+
+    void CpuAttentionOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                 const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &q = *(datas.find("q")->second);
+        Data &k = *(datas.find("k")->second);
+        Data &v = *(datas.find("v")->second);
+        Data &output = *(datas.find("output")->second);
+
+        AssertInFastLLM(q.dataType == DataType::FLOAT32 && (k.dataType == DataType::FLOAT32 || k.isPaged) &&
+                        (v.dataType == DataType::FLOAT32 || v.isPaged),
+                        "Attention's input's type should be float32.\n");
+        AssertInFastLLM(q.dims.size() == 3 && k.dims.size() == 3 && v.dims.size() == 3,
+                        "Attention's input's shape's size should be 3.\n");
+        AssertInFastLLM(q.dims[0] == k.dims[0] && k.dims[0] == v.dims[0] && q.dims[2] == k.dims[2] && k.dims[1] == v.dims[1],
+                        "Attention's shape error.\n");
+
+        output.dataType = q.dataType;
+        output.Resize({q.dims[0], q.dims[1], v.dims[2]});
+    }
+
+    void CpuAttentionOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                             const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &q = *(datas.find("q")->second);
+        Data &k = *(datas.find("k")->second);
+        Data &v = *(datas.find("v")->second);
+        Data &mask = *(datas.find("mask")->second);
+        Data &output = *(datas.find("output")->second);
+        output.Allocate();
+
+        float scale = floatParams.find("scale") != floatParams.end() ? floatParams.find("scale")->second : 1.0;
+        float maskValue = floatParams.find("maskValue") != floatParams.end() ? floatParams.find("maskValue")->second : -10000.0;
+        bool causal = intParams.find("causal") != intParams.end() ? intParams.find("causal")->second != 0 : false;
+
+        int batch = q.dims[0], qLen = q.dims[1], kvLen = k.dims[1];
+        int heads = batch;
+        if (mask.dims.size() > 0) {
+            int maskBatch = mask.Count(0) / ((uint64_t)qLen * kvLen);
+            AssertInFastLLM(mask.Count(0) == (uint64_t)maskBatch * qLen * kvLen && maskBatch > 0 && batch % maskBatch == 0,
+                            "Attention error: mask's shape error.\n");
+            heads = batch / maskBatch;
+        }
+        int qBlocks = (qLen - 1) / ATTENTION_QBLOCK + 1;
+        int threadNum = GetThreads();
+        if ((uint64_t)batch * qLen * kvLen * q.dims[2] < 64 * 4096) {
+            threadNum = 1;
+        }
+        GetCpuThreadPool()->ParallelFor(0, batch * qBlocks, [&](int st, int end) {
+            for (int t = st; t < end; t++) {
+                int b = t / qBlocks, q0 = (t % qBlocks) * ATTENTION_QBLOCK;
+                const float *maskData = mask.dims.size() > 0 ?
+                        (float*)mask.cpuData + (uint64_t)(b / heads) * qLen * kvLen : nullptr;
+                AttentionBlock(q, k, v, maskData, output, b, q0, std::min(ATTENTION_QBLOCK, qLen - q0),
+                               scale, maskValue, causal);
+            }
+        }, threadNum);
+    }
+
     void CpuTopKOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                             const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
@@ -1545,7 +1421,7 @@ namespace fastllm {
         int topk = intParams.find("topk") != intParams.end() ? intParams.find("topk")->second : 1;
 
         AssertInFastLLM(input.dataType == DataType::FLOAT32, "TopK error: Data's type should be float32.\n");
-        AssertInFastLLM(topk == 1, "Unsupport topk > 1.");
+        AssertInFastLLM(topk >= 1 && topk <= input.dims.back(), "TopK error: topk should be in [1, channels].\n");
 
         int dimsLen = input.dims.size();
         std::vector<int> dims = input.dims;
@@ -1584,7 +1460,16 @@ namespace fastllm {
                 outputData += 2;
             }
         } else {
-            ErrorInFastLLM("Unsupport topk > 1.");
+            std::vector <std::pair <float, int> > result;
+            for (int o = 0; o < outer; o++) {
+                TopKSelect(inputData, channels, topk, result);
+                for (int j = 0; j < topk; j++) {
+                    outputData[j * 2] = result[j].second;
+                    outputData[j * 2 + 1] = result[j].first;
+                }
+                inputData += channels;
+                outputData += topk * 2;
+            }
         }
     }
 
@@ -1684,20 +1569,13 @@ namespace fastllm {
             int n = input.dims[0];
             int m = input.Count(1);
 
-            int threadNum = 1;
-            int per = m / threadNum;
-            int cur = 0;
-            std::vector <std::thread*> threads;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < m);
-                threads.push_back(new std::thread(&Transpose, tmpData + cur * n, curData + cur, n, m, n, end - cur));
-                cur = end;
-            }
-            Transpose(tmpData + cur * n, curData + cur, n, m, n, m - cur);
-            for (int i = 0; i < threadNum - 1; i++) {
-                threads[i]->join();
-                delete threads[i];
+            int threadNum = GetThreads();
+            if (n * m < 64 * 4096) {
+                threadNum = 1;
             }
+            GetCpuThreadPool()->ParallelFor(0, m, [&](int st, int end) {
+                Transpose(tmpData + st * n, curData + st, n, m, n, end - st);
+            }, threadNum);
         } else if (axis == std::vector <int> {1, 0, 2}) {
             int n = input.dims[0];
             int m = input.dims[1];
@@ -0,0 +1,203 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+#include "devices/cpu/cpukernels.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FASTLLM_CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#include "fastllm.h"
+#include "utils.h"
+
+namespace fastllm {
+#ifdef FASTLLM_CPU_X86
+    static void CpuId(int leaf, int subLeaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+        int temp[4];
+        __cpuidex(temp, leaf, subLeaf);
+        for (int i = 0; i < 4; i++) {
+            regs[i] = (unsigned int)temp[i];
+        }
+#else
+        __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    static uint64_t XGetBV() {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        unsigned int eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif
+    }
+
+    // 除了cpuid的特性位, 还要检查操作系统是否保存了对应的寄存器(XCR0)
+    static void DetectCpuLevels(bool *supported) {
+        supported[CPU_LEVEL_GENERIC] = true;
+        unsigned int regs[4];
+        CpuId(0, 0, regs);
+        int maxLeaf = regs[0];
+        if (maxLeaf < 7) {
+            return;
+        }
+        CpuId(1, 0, regs);
+        unsigned int ecx1 = regs[2];
+        bool fma = (ecx1 >> 12) & 1, osxsave = (ecx1 >> 27) & 1, avx = (ecx1 >> 28) & 1, f16c = (ecx1 >> 29) & 1;
+        if (!(fma && osxsave && avx && f16c)) {
+            return;
+        }
+        uint64_t xcr0 = XGetBV();
+        if ((xcr0 & 0x6) != 0x6) {
+            return;
+        }
+        CpuId(7, 0, regs);
+        unsigned int ebx7 = regs[1], ecx7 = regs[2];
+        if (!((ebx7 >> 5) & 1)) {
+            return;
+        }
+        supported[CPU_LEVEL_AVX2] = true;
+        CpuId(7, 1, regs);
+        supported[CPU_LEVEL_AVX_VNNI] = (regs[0] >> 4) & 1;
+
+        bool avx512f = (ebx7 >> 16) & 1, avx512dq = (ebx7 >> 17) & 1;
+        bool avx512bw = (ebx7 >> 30) & 1, avx512vl = (ebx7 >> 31) & 1;
+        if (avx512f && avx512dq && avx512bw && avx512vl && (xcr0 & 0xE6) == 0xE6) {
+            supported[CPU_LEVEL_AVX512] = true;
+            supported[CPU_LEVEL_AVX512_VNNI] = (ecx7 >> 11) & 1;
+        }
+    }
+#else
+    static void DetectCpuLevels(bool *supported) {
+        supported[CPU_LEVEL_GENERIC] = true;
+    }
+#endif
+
+    const CpuKernels *GetCpuKernelsByLevel(CpuInstructLevel level) {
+        switch (level) {
+            case CPU_LEVEL_AVX512_VNNI: return GetCpuKernelsAVX512VNNI();
+            case CPU_LEVEL_AVX512: return GetCpuKernelsAVX512();
+            case CPU_LEVEL_AVX_VNNI: return GetCpuKernelsAVXVNNI();
+            case CPU_LEVEL_AVX2: return GetCpuKernelsAVX2();
+            default: return GetCpuKernelsGeneric();
+        }
+    }
+
+    bool IsCpuLevelSupported(CpuInstructLevel level) {
+        static bool *supported = [] {
+            static bool ret[CPU_LEVEL_COUNT] = {false};
+            DetectCpuLevels(ret);
+            for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+                ret[i] = ret[i] && GetCpuKernelsByLevel((CpuInstructLevel)i) != nullptr;
+            }
+            return ret;
+        } ();
+        return level >= 0 && level < CPU_LEVEL_COUNT && supported[level];
+    }
+
+    CpuInstructLevel GetCpuSupportedLevel() {
+        int level = CPU_LEVEL_COUNT - 1;
+        while (level > CPU_LEVEL_GENERIC && !IsCpuLevelSupported((CpuInstructLevel)level)) {
+            level--;
+        }
+        return (CpuInstructLevel)level;
+    }
+
+    static const CpuKernels *&CurrentCpuKernels() {
+        static const CpuKernels *kernels = GetCpuKernelsByLevel(GetCpuSupportedLevel());
+        return kernels;
+    }
+
+    const CpuKernels *GetCpuKernels() {
+        return CurrentCpuKernels();
+    }
+
+    void SetCpuInstructLevel(const std::string &level) {
+        if (level == "auto") {
+            CurrentCpuKernels() = GetCpuKernelsByLevel(GetCpuSupportedLevel());
+            return;
+        }
+        std::string names;
+        for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+            const CpuKernels *kernels = GetCpuKernelsByLevel((CpuInstructLevel)i);
+            if (kernels != nullptr && level == kernels->name) {
+                AssertInFastLLM(IsCpuLevelSupported((CpuInstructLevel)i),
+                                "SetCpuInstructLevel error: " + level + " is not supported by this cpu.\n");
+                CurrentCpuKernels() = kernels;
+                return;
+            }
+            if (kernels != nullptr) {
+                names += std::string(", ") + kernels->name;
+            }
+        }
+        ErrorInFastLLM("SetCpuInstructLevel error: unknown level " + level + ", should be auto" + names + ".\n");
+    }
+
+    std::string GetCpuInstructLevel() {
+        return GetCpuKernels()->name;
+    }
+
+    void InterleaveInt4Input(uint8_t *input, int n, int m) {
+        if (m % 2) {
+            return;
+        }
+        uint8_t temp[32];
+        for (int i = 0; i < n; i++) {
+            uint8_t *row = input + (uint64_t)i * m;
+            for (int j = 0; j + 31 < m; j += 32) {
+                memcpy(temp, row + j, 32);
+                for (int k = 0; k < 16; k++) {
+                    row[j + k] = temp[k * 2 + 1];
+                    row[j + k + 16] = temp[k * 2];
+                }
+            }
+        }
+    }
+
+    void DeinterleaveInt4Input(uint8_t *input, int n, int m) {
+        if (m % 2) {
+            return;
+        }
+        uint8_t temp[32];
+        for (int i = 0; i < n; i++) {
+            uint8_t *row = input + (uint64_t)i * m;
+            for (int j = 0; j + 31 < m; j += 32) {
+                memcpy(temp, row + j, 32);
+                for (int k = 0; k < 16; k++) {
+                    row[j + k * 2 + 1] = temp[k];
+                    row[j + k * 2] = temp[k + 16];
+                }
+            }
+        }
+    }
+
+    void RepackInt4Weight(uint8_t *weight, int k, int m) {
+        if (m % 2) {
+            return;
+        }
+        uint8_t values[32];
+        for (int i = 0; i < k; i++) {
+            uint8_t *row = weight + (uint64_t)i * m / 2;
+            for (int j = 0; j + 31 < m; j += 32) {
+                uint8_t *block = row + j / 2;
+                for (int t = 0; t < 16; t++) {
+                    values[t * 2] = block[t] >> 4;
+                    values[t * 2 + 1] = block[t] & 0xF;
+                }
+                for (int t = 0; t < 16; t++) {
+                    block[t] = values[t] | (values[t + 16] << 4);
+                }
+            }
+        }
+    }
+}
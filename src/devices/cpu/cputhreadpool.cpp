@@ -0,0 +1,164 @@
+//
+// Created by huangyuyang on 7/5/23.
+//
+
+#include "devices/cpu/cputhreadpool.h"
+
+#include <exception>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#include "fastllm.h"
+
+namespace fastllm {
+    static const int defaultSpinCount = 1 << 16; // worker自旋这么多次仍没有任务就挂起
+
+    static thread_local bool inPoolTask = false; // 当前线程是否正在执行池中的任务
+
+    static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    CpuThreadPool::CpuThreadPool(int threads) {
+        this->threads = std::max(1, threads);
+        this->sleepingCnt = 0;
+        this->epoch = 0;
+        this->finishCnt = 0;
+        this->stop = false;
+        this->taskFunc = nullptr;
+        // 线程数超过核数时自旋只会抢占干活的线程，直接挂起
+        int cores = (int)std::thread::hardware_concurrency();
+        this->spinCount = (cores > 0 && this->threads > cores) ? 1 : defaultSpinCount;
+        for (int i = 0; i < this->threads - 1; i++) {
+            this->workers.push_back(std::thread(&CpuThreadPool::WorkerLoop, this, i));
+        }
+    }
+
+    CpuThreadPool::~CpuThreadPool() {
+        {
+            std::lock_guard <std::mutex> lock(this->sleepLocker);
+            this->stop = true;
+        }
+        this->sleepCond.notify_all();
+        for (auto &worker : this->workers) {
+            worker.join();
+        }
+    }
+
+    int CpuThreadPool::GetThreads() {
+        return this->threads;
+    }
+
+    void CpuThreadPool::WorkerLoop(int id) {
+        inPoolTask = true;
+        long long seen = 0;
+        while (true) {
+            int spin = 0;
+            while (this->epoch.load() == seen && !this->stop.load()) {
+                if (++spin < this->spinCount) {
+                    CpuRelax();
+                    continue;
+                }
+                std::unique_lock <std::mutex> lock(this->sleepLocker);
+                this->sleepingCnt++;
+                this->sleepCond.wait(lock, [this, seen] {
+                    return this->epoch.load() != seen || this->stop.load();
+                });
+                this->sleepingCnt--;
+            }
+            if (this->stop.load()) {
+                return;
+            }
+
+            seen = this->epoch.load();
+            if (id + 1 < (int)this->taskRanges.size()) {
+                auto &range = this->taskRanges[id];
+                if (range.first < range.second) {
+                    try {
+                        (*this->taskFunc)(range.first, range.second);
+                    } catch (...) {
+                        std::lock_guard <std::mutex> lock(this->errorLocker);
+                        if (this->taskError == nullptr) {
+                            this->taskError = std::current_exception();
+                        }
+                    }
+                }
+            }
+            this->finishCnt++;
+        }
+    }
+
+    void CpuThreadPool::ParallelFor(int st, int end, const RangeFunc &func, int threadNum) {
+        if (threadNum <= 0 || threadNum > this->threads) {
+            threadNum = this->threads;
+        }
+        threadNum = std::min(threadNum, end - st);
+        if (threadNum <= 1 || inPoolTask) {
+            if (st < end) {
+                func(st, end);
+            }
+            return;
+        }
+
+        std::lock_guard <std::mutex> submitLock(this->submitLocker);
+        int len = end - st, per = len / threadNum, cur = 0;
+        this->taskRanges.clear();
+        for (int i = 0; i < threadNum - 1; i++) {
+            int next = cur + per + (cur + per * (threadNum - i) < len);
+            this->taskRanges.push_back(std::make_pair(st + cur, st + next));
+            cur = next;
+        }
+        this->taskRanges.push_back(std::make_pair(st + cur, end));
+        this->taskFunc = &func;
+        this->taskError = nullptr;
+        this->finishCnt = 0;
+
+        this->epoch++;
+        if (this->sleepingCnt.load() > 0) {
+            std::lock_guard <std::mutex> lock(this->sleepLocker);
+            this->sleepCond.notify_all();
+        }
+
+        std::exception_ptr error = nullptr;
+        inPoolTask = true;
+        try {
+            func(this->taskRanges.back().first, this->taskRanges.back().second);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        inPoolTask = false;
+
+        int workerCnt = (int)this->workers.size(), spin = 0;
+        while (this->finishCnt.load() < workerCnt) {
+            if (++spin < this->spinCount) {
+                CpuRelax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        // 调用线程的异常优先, 否则抛出第一个出错的worker的异常
+        if (error == nullptr) {
+            error = this->taskError;
+        }
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    static std::shared_ptr <CpuThreadPool> cpuThreadPool = nullptr;
+    static std::mutex cpuThreadPoolLocker;
+
+    std::shared_ptr <CpuThreadPool> GetCpuThreadPool() {
+        std::lock_guard <std::mutex> lock(cpuThreadPoolLocker);
+        if (cpuThreadPool == nullptr || cpuThreadPool->GetThreads() != std::max(1, GetThreads())) {
+            cpuThreadPool = std::make_shared <CpuThreadPool> (GetThreads());
+        }
+        return cpuThreadPool;
+    }
+}
@@ -0,0 +1,577 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+// AVX2 + FMA + F16C的kernel, 只有这个文件用-mavx2 -mfma -mf16c编译
+
+#include "devices/cpu/cpukernels.h"
+
+#include <cstring>
+#include <cmath>
+
+#if defined(__AVX2__) && (defined(_MSC_VER) || (defined(__FMA__) && defined(__F16C__)))
+#include <immintrin.h>
+
+namespace fastllm {
+    static inline int MinInt(int a, int b) {
+        return a < b ? a : b;
+    }
+
+    static inline float Floatsum(const __m256 a) {
+        __m128 res = _mm256_extractf128_ps(a, 1);
+        res = _mm_add_ps(res, _mm256_castps256_ps128(a));
+        res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+        res = _mm_add_ss(res, _mm_movehdup_ps(res));
+        return _mm_cvtss_f32(res);
+    }
+
+    static inline int I32sum(const __m256i a) {
+        const __m128i sum128 = _mm_add_epi32(_mm256_extractf128_si256(a, 0), _mm256_extractf128_si256(a, 1));
+        const __m128i hi64 = _mm_unpackhi_epi64(sum128, sum128);
+        const __m128i sum64 = _mm_add_epi32(hi64, sum128);
+        const __m128i hi32  = _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_cvtsi128_si32(_mm_add_epi32(sum64, hi32));
+    }
+
+    static inline __m256 LoadFloat8(const float *data) {
+        return _mm256_loadu_ps(data);
+    }
+
+    static inline float LoadFloat(const float *data) {
+        return *data;
+    }
+
+    static inline __m256 LoadFloat8(const uint16_t *data) {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) data));
+    }
+
+    static inline float LoadFloat(const uint16_t *data) {
+        return _cvtsh_ss(*data);
+    }
+
+    // exp(x), Cephes的多项式近似, 相对误差约1e-7
+    static inline __m256 Exp8(__m256 x) {
+        x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+        x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+        __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+        x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+        x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+        __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+        y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+        y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+        y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+        y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+        y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+        y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+        __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2n));
+    }
+
+    // 计算output的[i, i + ROWS)行, [j, j + COLS)列, 每次读入的weight被ROWS行input复用
+    template <int ROWS, int COLS, typename T>
+    static inline void LinearBlockAVX2(const float *inputData, const T *weightData, const float *biasData,
+                                       float *outputData, int m, int k, int i, int j) {
+        __m256 acc[ROWS][COLS];
+        for (int r = 0; r < ROWS; r++) {
+            for (int c = 0; c < COLS; c++) {
+                acc[r][c] = _mm256_setzero_ps();
+            }
+        }
+        int l = 0;
+        for (; l + 7 < m; l += 8) {
+            __m256 w[COLS];
+            for (int c = 0; c < COLS; c++) {
+                w[c] = LoadFloat8(weightData + (uint64_t)(j + c) * m + l);
+            }
+            for (int r = 0; r < ROWS; r++) {
+                __m256 x = _mm256_loadu_ps(inputData + (uint64_t)(i + r) * m + l);
+                for (int c = 0; c < COLS; c++) {
+                    acc[r][c] = _mm256_fmadd_ps(x, w[c], acc[r][c]);
+                }
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            for (int c = 0; c < COLS; c++) {
+                float now = Floatsum(acc[r][c]) + (biasData ? biasData[j + c] : 0.0f);
+                for (int t = l; t < m; t++) {
+                    now += inputData[(uint64_t)(i + r) * m + t] * LoadFloat(weightData + (uint64_t)(j + c) * m + t);
+                }
+                outputData[(uint64_t)(i + r) * k + j + c] = now;
+            }
+        }
+    }
+
+    template <int ROWS, typename T>
+    static void LinearRowsAVX2(const float *inputData, const T *weightData, const float *biasData,
+                               float *outputData, int m, int k, int i, int st, int end) {
+        int j = st;
+        for (; j + 2 < end; j += 3) {
+            LinearBlockAVX2 <ROWS, 3> (inputData, weightData, biasData, outputData, m, k, i, j);
+        }
+        for (; j < end; j++) {
+            LinearBlockAVX2 <ROWS, 1> (inputData, weightData, biasData, outputData, m, k, i, j);
+        }
+    }
+
+    // 4行input * 3行weight一组，12个累加器正好占满寄存器
+    template <typename T>
+    static void LinearPartAVX2(const float *inputData, const T *weightData, const float *biasData,
+                               float *outputData, int n, int m, int k, int st, int end) {
+        int i = 0;
+        for (; i + 3 < n; i += 4) {
+            LinearRowsAVX2 <4> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        }
+        if (n - i == 3) {
+            LinearRowsAVX2 <3> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        } else if (n - i == 2) {
+            LinearRowsAVX2 <2> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        } else if (n - i == 1) {
+            LinearRowsAVX2 <1> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        }
+    }
+
+    static void FloatLinearAVX2(const float *inputData, const float *weightData, const float *biasData, float *outputData,
+                                int n, int m, int k, int st, int end) {
+        LinearPartAVX2(inputData, weightData, biasData, outputData, n, m, k, st, end);
+    }
+
+    static void Float16LinearAVX2(const float *inputData, const uint16_t *weightData, const float *biasData, float *outputData,
+                                  int n, int m, int k, int st, int end) {
+        LinearPartAVX2(inputData, weightData, biasData, outputData, n, m, k, st, end);
+    }
+
+    static int DotU8U8(const uint8_t *a, const uint8_t *b, int n) {
+        __m256i acc = _mm256_setzero_si256();
+        int i = 0;
+        int ans = 0;
+        for (; i + 31 < n; i += 32) {
+            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+
+            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
+            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
+
+            __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
+            __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
+
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
+        }
+        for (; i < n; i++) {
+            ans += a[i] * b[i];
+        }
+        return ans + I32sum(acc);
+    }
+
+    static void MultiplyU8AVX2(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int block = 0; block < n; block++) {
+            for (int i = 0; i < k; i++) {
+                c[block * kstride + i] = DotU8U8(a + block * m, b + (uint64_t)i * m, m);
+            }
+        }
+    }
+
+    // 输入已经按InterleaveInt4Input重排: 每32个一组, 前16个和权重的低4位相乘, 后16个和高4位相乘
+    static void MultiplyU4AVX2(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        for (int block = 0; block < n; block++) {
+            const uint8_t *inputWalk = a + block * m;
+            for (int i = 0; i < k; i++) {
+                const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+                __m256i acc = _mm256_setzero_si256();
+                int j = 0;
+                for (; j < simdEnd; j += 32) {
+                    __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+                    __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
+                    __m256i bx = _mm256_and_si256(lowMask, bytex);
+                    __m256i by = _mm256_loadu_si256((const __m256i *) (inputWalk + j));
+                    __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
+                    __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
+                    __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
+                    __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
+                    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
+                    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
+                }
+                int value = I32sum(acc);
+                for (; j < m; j++) {
+                    uint64_t id = ((uint64_t)i * m + j) / 2;
+                    if (((uint64_t)i * m + j) % 2) {
+                        value += (b[id] & 0xF) * inputWalk[j];
+                    } else {
+                        value += (b[id] >> 4) * inputWalk[j];
+                    }
+                }
+                c[block * kstride + i] = value;
+            }
+        }
+    }
+
+    // 第i行权重的[st, end)减去零点后和input的点积, 这部分input没有重排
+    static inline int DotU4Tail(const uint8_t *inputWalk, const uint8_t *b, int m, int i, int st, int end, int zero) {
+        int value = 0;
+        for (int j = st; j < end; j++) {
+            uint64_t id = ((uint64_t)i * m + j) / 2;
+            if (((uint64_t)i * m + j) % 2) {
+                value += ((b[id] & 0xF) - zero) * inputWalk[j];
+            } else {
+                value += ((b[id] >> 4) - zero) * inputWalk[j];
+            }
+        }
+        return value;
+    }
+
+    // 分组量化: 权重减去这一组的零点后是int8, 用maddubs和uint8的input相乘(两两相加不会溢出int16)
+    // 每组的int32累加结果乘上scale累加到float向量中, 最后只做一次水平求和
+    template <int ROWS>
+    static inline void MultiplyU4GroupRowsAVX2(const uint8_t *a, const uint8_t *b, float *c, int m, int kstride,
+                                               int groupSize, int groupCnt, const float *scales, const int *zeros,
+                                               int block, int i) {
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        const __m256i ones = _mm256_set1_epi16(1);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+        __m256 accf[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            accf[r] = _mm256_setzero_ps();
+        }
+        for (int g = 0; g < groupCnt; g++) {
+            int st = g * groupSize, end = MinInt(m, st + groupSize);
+            int zero = zeros[i * groupCnt + g];
+            const __m256i zerox = _mm256_set1_epi8((char)zero);
+            __m256i acc[ROWS];
+            for (int r = 0; r < ROWS; r++) {
+                acc[r] = _mm256_setzero_si256();
+            }
+            int j = st;
+            for (; j < MinInt(end, simdEnd); j += 32) {
+                __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+                __m256i w = _mm256_sub_epi8(_mm256_and_si256(lowMask, _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix)), zerox);
+                for (int r = 0; r < ROWS; r++) {
+                    __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                    acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), ones));
+                }
+            }
+            if (j < end) {
+                for (int r = 0; r < ROWS; r++) {
+                    int value = DotU4Tail(a + (uint64_t)(block + r) * m, b, m, i, j, end, zero);
+                    acc[r] = _mm256_add_epi32(acc[r], _mm256_setr_epi32(value, 0, 0, 0, 0, 0, 0, 0));
+                }
+            }
+            __m256 scale = _mm256_set1_ps(scales[i * groupCnt + g]);
+            for (int r = 0; r < ROWS; r++) {
+                accf[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[r]), scale, accf[r]);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            c[(block + r) * kstride + i] = Floatsum(accf[r]);
+        }
+    }
+
+    static void MultiplyU4GroupAVX2(const uint8_t *a, const uint8_t *b, float *c, int n, int m, int k, int kstride,
+                                    int groupSize, int groupCnt, const float *scales, const int *zeros) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 3 < n; block += 4) {
+                MultiplyU4GroupRowsAVX2 <4> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU4GroupRowsAVX2 <1> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+        }
+    }
+
+    static const int GEMM_MR = 6, GEMM_NR = 16; // 微内核每次计算6行 * 16列, 12个累加器
+    static const int GEMM_MC = 96, GEMM_KC = 256, GEMM_NC = 2048; // 分块大小, A块放在L2, B块放在L3
+    static const int GEMM_MIN_ROWS = 8; // 行数少于这个值时(例如解码阶段)打包的开销比计算还大，不使用分块GEMM
+
+    // 把a[mc, kc]按GEMM_MR行一组打包, 每组内按列连续存放，不足的行补0，同时乘上alpha
+    static void GemmPackA(const float *a, int lda, int mc, int kc, float alpha, float *packed) {
+        for (int i = 0; i < mc; i += GEMM_MR) {
+            int rows = MinInt(GEMM_MR, mc - i);
+            for (int p = 0; p < kc; p++) {
+                for (int r = 0; r < GEMM_MR; r++) {
+                    *(packed++) = r < rows ? a[(uint64_t)(i + r) * lda + p] * alpha : 0.0f;
+                }
+            }
+        }
+    }
+
+    // 把b[kc, nc]按GEMM_NR列一组打包，不足的列补0
+    // transB为false时b[p, j] = b[p * ldb + j], 否则b[p, j] = b[j * ldb + p]
+    static void GemmPackB(const float *b, int ldb, bool transB, int kc, int nc, float *packed) {
+        for (int j = 0; j < nc; j += GEMM_NR) {
+            int cols = MinInt(GEMM_NR, nc - j);
+            if (!transB) {
+                for (int p = 0; p < kc; p++) {
+                    const float *src = b + (uint64_t)p * ldb + j;
+                    memcpy(packed + p * GEMM_NR, src, cols * sizeof(float));
+                    memset(packed + p * GEMM_NR + cols, 0, (GEMM_NR - cols) * sizeof(float));
+                }
+            } else {
+                for (int c = 0; c < GEMM_NR; c++) {
+                    const float *src = b + (uint64_t)(j + c) * ldb;
+                    for (int p = 0; p < kc; p++) {
+                        packed[p * GEMM_NR + c] = c < cols ? src[p] : 0.0f;
+                    }
+                }
+            }
+            packed += kc * GEMM_NR;
+        }
+    }
+
+    // c[rows, cols] += a[rows, kc] * b[kc, cols], a和b都是打包后的数据
+    static inline void GemmMicroKernel(int kc, const float *a, const float *b, float *c, int ldc, int rows, int cols) {
+        __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+        __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+        __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+        __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+        __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+        __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+        for (int p = 0; p < kc; p++) {
+            __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+            __m256 a0 = _mm256_broadcast_ss(a + 0);
+            c00 = _mm256_fmadd_ps(a0, b0, c00);
+            c01 = _mm256_fmadd_ps(a0, b1, c01);
+            a0 = _mm256_broadcast_ss(a + 1);
+            c10 = _mm256_fmadd_ps(a0, b0, c10);
+            c11 = _mm256_fmadd_ps(a0, b1, c11);
+            a0 = _mm256_broadcast_ss(a + 2);
+            c20 = _mm256_fmadd_ps(a0, b0, c20);
+            c21 = _mm256_fmadd_ps(a0, b1, c21);
+            a0 = _mm256_broadcast_ss(a + 3);
+            c30 = _mm256_fmadd_ps(a0, b0, c30);
+            c31 = _mm256_fmadd_ps(a0, b1, c31);
+            a0 = _mm256_broadcast_ss(a + 4);
+            c40 = _mm256_fmadd_ps(a0, b0, c40);
+            c41 = _mm256_fmadd_ps(a0, b1, c41);
+            a0 = _mm256_broadcast_ss(a + 5);
+            c50 = _mm256_fmadd_ps(a0, b0, c50);
+            c51 = _mm256_fmadd_ps(a0, b1, c51);
+            a += GEMM_MR;
+            b += GEMM_NR;
+        }
+
+        __m256 acc[GEMM_MR][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+        if (cols == GEMM_NR) {
+            for (int r = 0; r < rows; r++) {
+                float *cur = c + (uint64_t)r * ldc;
+                _mm256_storeu_ps(cur, _mm256_add_ps(_mm256_loadu_ps(cur), acc[r][0]));
+                _mm256_storeu_ps(cur + 8, _mm256_add_ps(_mm256_loadu_ps(cur + 8), acc[r][1]));
+            }
+        } else {
+            float temp[GEMM_NR];
+            for (int r = 0; r < rows; r++) {
+                _mm256_storeu_ps(temp, acc[r][0]);
+                _mm256_storeu_ps(temp + 8, acc[r][1]);
+                float *cur = c + (uint64_t)r * ldc;
+                for (int j = 0; j < cols; j++) {
+                    cur[j] += temp[j];
+                }
+            }
+        }
+    }
+
+    // 每个线程自己的打包空间, 线程池中的线程常驻, 只分配一次; 放在匿名namespace中, 避免和其它翻译单元的符号合并
+    namespace {
+    struct GemmBuffer {
+        float *packedA = new float[GEMM_MC * GEMM_KC];
+        float *packedB = new float[GEMM_KC * GEMM_NC];
+
+        ~GemmBuffer() {
+            delete[] packedA;
+            delete[] packedB;
+        }
+    };
+    }
+
+    // c[n, k] += alpha * a[n, m] * b, b为[m, k](transB = false)或[k, m](transB = true)
+    static void GemmAccumulate(const float *a, int lda, const float *b, int ldb, bool transB,
+                               float *c, int ldc, int n, int m, int k, float alpha) {
+        thread_local GemmBuffer buffer;
+        float *packedA = buffer.packedA, *packedB = buffer.packedB;
+        for (int jc = 0; jc < k; jc += GEMM_NC) {
+            int nc = MinInt(GEMM_NC, k - jc);
+            for (int pc = 0; pc < m; pc += GEMM_KC) {
+                int kc = MinInt(GEMM_KC, m - pc);
+                const float *bBlock = transB ? b + (uint64_t)jc * ldb + pc : b + (uint64_t)pc * ldb + jc;
+                GemmPackB(bBlock, ldb, transB, kc, nc, packedB);
+                for (int ic = 0; ic < n; ic += GEMM_MC) {
+                    int mc = MinInt(GEMM_MC, n - ic);
+                    GemmPackA(a + (uint64_t)ic * lda + pc, lda, mc, kc, alpha, packedA);
+                    for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                        for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                            GemmMicroKernel(kc, packedA + ir * kc, packedB + jr * kc,
+                                            c + (uint64_t)(ic + ir) * ldc + jc + jr, ldc,
+                                            MinInt(GEMM_MR, mc - ir), MinInt(GEMM_NR, nc - jr));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static void MatMulAVX2(const float *input0Data, int input0Stride, const float *input1Data, int input1Stride,
+                           float *outputData, int n, int m, int k, float alpha) {
+        if (n >= GEMM_MIN_ROWS) {
+            GemmAccumulate(input0Data, input0Stride, input1Data, input1Stride, false, outputData, k, n, m, k, alpha);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < m; j++) {
+                float now = input0Data[i * input0Stride + j] * alpha;
+                for (int l = 0; l < k; l++) {
+                    outputData[i * k + l] += (now * input1Data[j * input1Stride + l]);
+                }
+            }
+        }
+    }
+
+    static void MatMulTransBAVX2(const float *input0Data, int input0Stride, const float *input1Data, int input1Stride,
+                                 float *outputData, int outputStride, int n, int m, int k, float alpha) {
+        if (n >= GEMM_MIN_ROWS) {
+            for (int i = 0; i < n; i++) {
+                memset(outputData + (uint64_t)i * outputStride, 0, k * sizeof(float));
+            }
+            GemmAccumulate(input0Data, input0Stride, input1Data, input1Stride, true, outputData, outputStride, n, m, k, alpha);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < k; j++) {
+                float now = 0.0f;
+                int l = 0;
+                __m256 vsum = _mm256_set1_ps(0.0f);
+                for (; l + 7 < m; l += 8) {
+                    __m256 vx = _mm256_loadu_ps((const float *) (input0Data + i * input0Stride + l));
+                    __m256 vy = _mm256_loadu_ps((const float *) (input1Data + j * input1Stride + l));
+                    vsum = _mm256_add_ps(vsum, _mm256_mul_ps(vx, vy));
+                }
+                now += Floatsum(vsum);
+                for (; l < m; l++) {
+                    now += input0Data[i * input0Stride + l] * input1Data[j * input1Stride + l];
+                }
+                outputData[i * outputStride + j] = now * alpha;
+            }
+        }
+    }
+
+    static void SoftmaxAVX2(const float *inputData, float *outputData, int channels) {
+        int j = 0;
+        __m256 vmax = _mm256_set1_ps(-3.402823466e+38f);
+        for (; j + 7 < channels; j += 8) {
+            vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(inputData + j));
+        }
+        float temp[8];
+        _mm256_storeu_ps(temp, vmax);
+        float maxValue = temp[0];
+        for (int t = 1; t < 8; t++) {
+            maxValue = temp[t] > maxValue ? temp[t] : maxValue;
+        }
+        for (; j < channels; j++) {
+            maxValue = inputData[j] > maxValue ? inputData[j] : maxValue;
+        }
+
+        vmax = _mm256_set1_ps(maxValue);
+        __m256 vsum = _mm256_setzero_ps();
+        for (j = 0; j + 7 < channels; j += 8) {
+            __m256 e = Exp8(_mm256_sub_ps(_mm256_loadu_ps(inputData + j), vmax));
+            _mm256_storeu_ps(outputData + j, e);
+            vsum = _mm256_add_ps(vsum, e);
+        }
+        float sum = Floatsum(vsum);
+        for (; j < channels; j++) {
+            outputData[j] = expf(inputData[j] - maxValue);
+            sum += outputData[j];
+        }
+
+        __m256 vinv = _mm256_set1_ps(1.0f / sum);
+        for (j = 0; j + 7 < channels; j += 8) {
+            _mm256_storeu_ps(outputData + j, _mm256_mul_ps(_mm256_loadu_ps(outputData + j), vinv));
+        }
+        for (; j < channels; j++) {
+            outputData[j] = outputData[j] / sum;
+        }
+    }
+
+    static void LayerNormAVX2(const float *inputData, const float *gammaData, const float *betaData,
+                              float *outputData, int channels) {
+        __m256 sums = _mm256_setzero_ps(), sums2 = _mm256_setzero_ps();
+        int j = 0;
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_loadu_ps(inputData + j);
+            sums = _mm256_add_ps(sums, vi);
+            sums2 = _mm256_fmadd_ps(vi, vi, sums2);
+        }
+        float mean = Floatsum(sums), s2 = Floatsum(sums2);
+        for (; j < channels; j++) {
+            mean += inputData[j];
+            s2 += inputData[j] * inputData[j];
+        }
+        mean /= channels;
+        float var = s2 + mean * mean * channels - 2 * mean * channels * mean;
+        var = sqrtf(var / channels + 1e-10f);
+
+        __m256 means = _mm256_set1_ps(mean), vars = _mm256_set1_ps(1.0f / var);
+        for (j = 0; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(inputData + j), means), vars);
+            _mm256_storeu_ps(outputData + j, _mm256_fmadd_ps(vi, _mm256_loadu_ps(gammaData + j), _mm256_loadu_ps(betaData + j)));
+        }
+        for (; j < channels; j++) {
+            outputData[j] = (inputData[j] - mean) / var * gammaData[j] + betaData[j];
+        }
+    }
+
+    static void RMSNormAVX2(const float *inputData, const float *weightData, float *outputData, int channels, float eps) {
+        __m256 sums = _mm256_setzero_ps();
+        int j = 0;
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_loadu_ps(inputData + j);
+            sums = _mm256_fmadd_ps(vi, vi, sums);
+        }
+        float mean = Floatsum(sums);
+        for (; j < channels; j++) {
+            mean += inputData[j] * inputData[j];
+        }
+        float scale = 1.0f / sqrtf(mean / channels + eps);
+        __m256 vscale = _mm256_set1_ps(scale);
+        for (j = 0; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_mul_ps(_mm256_loadu_ps(inputData + j), vscale);
+            _mm256_storeu_ps(outputData + j, _mm256_mul_ps(vi, _mm256_loadu_ps(weightData + j)));
+        }
+        for (; j < channels; j++) {
+            outputData[j] = inputData[j] * scale * weightData[j];
+        }
+    }
+
+    static void SiluAVX2(const float *inputData, float *outputData, int len) {
+        int i = 0;
+        __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+        for (; i + 7 < len; i += 8) {
+            __m256 x = _mm256_loadu_ps(inputData + i);
+            __m256 e = Exp8(_mm256_sub_ps(zero, x));
+            _mm256_storeu_ps(outputData + i, _mm256_div_ps(x, _mm256_add_ps(one, e)));
+        }
+        for (; i < len; i++) {
+            float x = inputData[i];
+            outputData[i] = x / (1.0f + expf(-x));
+        }
+    }
+
+    const CpuKernels *GetCpuKernelsAVX2() {
+        static const CpuKernels kernels = {
+                "avx2",
+                FloatLinearAVX2, Float16LinearAVX2,
+                MultiplyU8AVX2, 0, MultiplyU4AVX2, true, MultiplyU4GroupAVX2,
+                MatMulAVX2, MatMulTransBAVX2,
+                SoftmaxAVX2, LayerNormAVX2, RMSNormAVX2, SiluAVX2
+        };
+        return &kernels;
+    }
+}
+#else
+namespace fastllm {
+    const CpuKernels *GetCpuKernelsAVX2() {
+        return nullptr;
+    }
+}
+#endif
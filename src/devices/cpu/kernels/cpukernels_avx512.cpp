@@ -0,0 +1,158 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+// AVX512F + AVX512BW + AVX512VL的kernel, 只有这个文件用-mavx512f -mavx512bw -mavx512vl编译
+// 没有单独实现的kernel沿用AVX2的版本
+
+#include "devices/cpu/cpukernels.h"
+
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+#include <immintrin.h>
+
+namespace fastllm {
+    static inline __mmask16 TailMask16(int len) {
+        return (__mmask16)((1u << len) - 1);
+    }
+
+    static inline __m512 LoadFloat16(const float *data) {
+        return _mm512_loadu_ps(data);
+    }
+
+    static inline __m512 LoadFloat16(const float *data, __mmask16 mask) {
+        return _mm512_maskz_loadu_ps(mask, data);
+    }
+
+    static inline __m512 LoadFloat16(const uint16_t *data) {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) data));
+    }
+
+    static inline __m512 LoadFloat16(const uint16_t *data, __mmask16 mask) {
+        return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(mask, data));
+    }
+
+    // 计算output的[i, i + ROWS)行, [j, j + COLS)列, 不足16个的尾部用掩码读取
+    template <int ROWS, int COLS, typename T>
+    static inline void LinearBlockAVX512(const float *inputData, const T *weightData, const float *biasData,
+                                         float *outputData, int m, int k, int i, int j) {
+        __m512 acc[ROWS][COLS];
+        for (int r = 0; r < ROWS; r++) {
+            for (int c = 0; c < COLS; c++) {
+                acc[r][c] = _mm512_setzero_ps();
+            }
+        }
+        int l = 0;
+        for (; l + 15 < m; l += 16) {
+            __m512 w[COLS];
+            for (int c = 0; c < COLS; c++) {
+                w[c] = LoadFloat16(weightData + (uint64_t)(j + c) * m + l);
+            }
+            for (int r = 0; r < ROWS; r++) {
+                __m512 x = _mm512_loadu_ps(inputData + (uint64_t)(i + r) * m + l);
+                for (int c = 0; c < COLS; c++) {
+                    acc[r][c] = _mm512_fmadd_ps(x, w[c], acc[r][c]);
+                }
+            }
+        }
+        if (l < m) {
+            __mmask16 mask = TailMask16(m - l);
+            __m512 w[COLS];
+            for (int c = 0; c < COLS; c++) {
+                w[c] = LoadFloat16(weightData + (uint64_t)(j + c) * m + l, mask);
+            }
+            for (int r = 0; r < ROWS; r++) {
+                __m512 x = _mm512_maskz_loadu_ps(mask, inputData + (uint64_t)(i + r) * m + l);
+                for (int c = 0; c < COLS; c++) {
+                    acc[r][c] = _mm512_fmadd_ps(x, w[c], acc[r][c]);
+                }
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            for (int c = 0; c < COLS; c++) {
+                outputData[(uint64_t)(i + r) * k + j + c] = _mm512_reduce_add_ps(acc[r][c]) + (biasData ? biasData[j + c] : 0.0f);
+            }
+        }
+    }
+
+    template <int ROWS, typename T>
+    static void LinearRowsAVX512(const float *inputData, const T *weightData, const float *biasData,
+                                 float *outputData, int m, int k, int i, int st, int end) {
+        int j = st;
+        for (; j + 3 < end; j += 4) {
+            LinearBlockAVX512 <ROWS, 4> (inputData, weightData, biasData, outputData, m, k, i, j);
+        }
+        for (; j < end; j++) {
+            LinearBlockAVX512 <ROWS, 1> (inputData, weightData, biasData, outputData, m, k, i, j);
+        }
+    }
+
+    // 4行input * 4行weight一组, 32个zmm寄存器放得下16个累加器
+    template <typename T>
+    static void LinearPartAVX512(const float *inputData, const T *weightData, const float *biasData,
+                                 float *outputData, int n, int m, int k, int st, int end) {
+        int i = 0;
+        for (; i + 3 < n; i += 4) {
+            LinearRowsAVX512 <4> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        }
+        if (n - i == 3) {
+            LinearRowsAVX512 <3> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        } else if (n - i == 2) {
+            LinearRowsAVX512 <2> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        } else if (n - i == 1) {
+            LinearRowsAVX512 <1> (inputData, weightData, biasData, outputData, m, k, i, st, end);
+        }
+    }
+
+    static void FloatLinearAVX512(const float *inputData, const float *weightData, const float *biasData, float *outputData,
+                                  int n, int m, int k, int st, int end) {
+        LinearPartAVX512(inputData, weightData, biasData, outputData, n, m, k, st, end);
+    }
+
+    static void Float16LinearAVX512(const float *inputData, const uint16_t *weightData, const float *biasData, float *outputData,
+                                    int n, int m, int k, int st, int end) {
+        LinearPartAVX512(inputData, weightData, biasData, outputData, n, m, k, st, end);
+    }
+
+    static int DotU8U8AVX512(const uint8_t *a, const uint8_t *b, int n) {
+        __m512i acc = _mm512_setzero_si512();
+        int i = 0;
+        int ans = 0;
+        for (; i + 31 < n; i += 32) {
+            __m512i mx = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (a + i)));
+            __m512i my = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (b + i)));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(mx, my));
+        }
+        for (; i < n; i++) {
+            ans += a[i] * b[i];
+        }
+        return ans + _mm512_reduce_add_epi32(acc);
+    }
+
+    static void MultiplyU8AVX512(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int block = 0; block < n; block++) {
+            for (int i = 0; i < k; i++) {
+                c[block * kstride + i] = DotU8U8AVX512(a + block * m, b + (uint64_t)i * m, m);
+            }
+        }
+    }
+
+    const CpuKernels *GetCpuKernelsAVX512() {
+        static const CpuKernels kernels = [] {
+            const CpuKernels *base = GetCpuKernelsAVX2();
+            CpuKernels ret = base ? *base : *GetCpuKernelsGeneric();
+            ret.name = "avx512";
+            ret.floatLinear = FloatLinearAVX512;
+            ret.float16Linear = Float16LinearAVX512;
+            ret.multiplyU8 = MultiplyU8AVX512;
+            return ret;
+        } ();
+        return &kernels;
+    }
+}
+#else
+namespace fastllm {
+    const CpuKernels *GetCpuKernelsAVX512() {
+        return nullptr;
+    }
+}
+#endif
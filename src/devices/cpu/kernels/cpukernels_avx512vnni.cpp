@@ -0,0 +1,258 @@
+//
+// Created by huangyuyang on 7/16/23.
+//
+
+// AVX512 + AVX512_VNNI的kernel, 只有这个文件用-mavx512f -mavx512bw -mavx512vl -mavx512vnni编译
+// vpdpbusd一条指令完成64个uint8 * int8累加到int32, 没有单独实现的kernel沿用AVX512的版本
+
+#include "devices/cpu/cpukernels.h"
+
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512VL__) && defined(__AVX512VNNI__)
+#include <immintrin.h>
+
+namespace fastllm {
+    static inline int I32sum(const __m256i a) {
+        const __m128i sum128 = _mm_add_epi32(_mm256_extractf128_si256(a, 0), _mm256_extractf128_si256(a, 1));
+        const __m128i hi64 = _mm_unpackhi_epi64(sum128, sum128);
+        const __m128i sum64 = _mm_add_epi32(hi64, sum128);
+        const __m128i hi32  = _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_cvtsi128_si32(_mm_add_epi32(sum64, hi32));
+    }
+
+    // c的[block, block + ROWS)行, 第i列; 不足64个的尾部用掩码读取, 补0的input不影响结果
+    template <int ROWS>
+    static inline void MultiplyU8RowsAVX512VNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int m, int kstride,
+                                                int block, int i) {
+        const __m512i offset = _mm512_set1_epi8((char)0x80);
+        const uint8_t *weightWalk = b + (uint64_t)i * m;
+        __m512i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm512_setzero_si512();
+        }
+        int j = 0;
+        for (; j + 63 < m; j += 64) {
+            __m512i w = _mm512_xor_si512(_mm512_loadu_si512((const void *) (weightWalk + j)), offset);
+            for (int r = 0; r < ROWS; r++) {
+                __m512i x = _mm512_loadu_si512((const void *) (a + (uint64_t)(block + r) * m + j));
+                acc[r] = _mm512_dpbusd_epi32(acc[r], x, w);
+            }
+        }
+        if (j < m) {
+            __mmask64 mask = ((__mmask64)-1) >> (64 - (m - j));
+            __m512i w = _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, weightWalk + j), offset);
+            for (int r = 0; r < ROWS; r++) {
+                __m512i x = _mm512_maskz_loadu_epi8(mask, a + (uint64_t)(block + r) * m + j);
+                acc[r] = _mm512_dpbusd_epi32(acc[r], x, w);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            c[(block + r) * kstride + i] = _mm512_reduce_add_epi32(acc[r]);
+        }
+    }
+
+    static void MultiplyU8AVX512VNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 7 < n; block += 8) {
+                MultiplyU8RowsAVX512VNNI <8> (a, b, c, m, kstride, block, i);
+            }
+            for (; block + 3 < n; block += 4) {
+                MultiplyU8RowsAVX512VNNI <4> (a, b, c, m, kstride, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU8RowsAVX512VNNI <1> (a, b, c, m, kstride, block, i);
+            }
+        }
+    }
+
+    // 输入已经按InterleaveInt4Input重排, 每32个一组: 前16个对应权重的低4位, 后16个对应高4位
+    // 一次处理两组: 32字节权重展开成[低0, 高0, 低1, 高1]四个128位
+    template <int ROWS>
+    static inline void MultiplyU4RowsAVX512VNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int m, int kstride,
+                                                int block, int i) {
+        const __m512i lowMask = _mm512_set1_epi8(0xf);
+        const __m512i lanes = _mm512_set_epi64(3, 2, 3, 2, 1, 0, 1, 0);
+        const __m512i shifts = _mm512_set_epi64(4, 4, 0, 0, 4, 4, 0, 0);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+        __m512i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm512_setzero_si512();
+        }
+        int j = 0;
+        for (; j + 63 < simdEnd; j += 64) {
+            __m512i orix = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) (weightWalk + j / 2)));
+            __m512i w = _mm512_and_si512(_mm512_srlv_epi64(_mm512_permutexvar_epi64(lanes, orix), shifts), lowMask);
+            for (int r = 0; r < ROWS; r++) {
+                __m512i x = _mm512_loadu_si512((const void *) (a + (uint64_t)(block + r) * m + j));
+                acc[r] = _mm512_dpbusd_epi32(acc[r], x, w);
+            }
+        }
+        __m256i acc256[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc256[r] = _mm256_setzero_si256();
+        }
+        if (j < simdEnd) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+            __m256i w = _mm256_and_si256(_mm512_castsi512_si256(lowMask), _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix));
+            for (int r = 0; r < ROWS; r++) {
+                __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                acc256[r] = _mm256_dpbusd_epi32(acc256[r], x, w);
+            }
+            j += 32;
+        }
+        for (int r = 0; r < ROWS; r++) {
+            const uint8_t *inputWalk = a + (uint64_t)(block + r) * m;
+            int value = _mm512_reduce_add_epi32(acc[r]) + I32sum(acc256[r]);
+            for (int t = j; t < m; t++) {
+                uint64_t id = ((uint64_t)i * m + t) / 2;
+                if (((uint64_t)i * m + t) % 2) {
+                    value += (b[id] & 0xF) * inputWalk[t];
+                } else {
+                    value += (b[id] >> 4) * inputWalk[t];
+                }
+            }
+            c[(block + r) * kstride + i] = value;
+        }
+    }
+
+    static void MultiplyU4AVX512VNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 7 < n; block += 8) {
+                MultiplyU4RowsAVX512VNNI <8> (a, b, c, m, kstride, block, i);
+            }
+            for (; block + 3 < n; block += 4) {
+                MultiplyU4RowsAVX512VNNI <4> (a, b, c, m, kstride, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU4RowsAVX512VNNI <1> (a, b, c, m, kstride, block, i);
+            }
+        }
+    }
+
+    static inline float Floatsum(const __m256 a) {
+        __m128 res = _mm256_extractf128_ps(a, 1);
+        res = _mm_add_ps(res, _mm256_castps256_ps128(a));
+        res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+        res = _mm_add_ss(res, _mm_movehdup_ps(res));
+        return _mm_cvtss_f32(res);
+    }
+
+    // 第i行权重的[st, end)减去零点后和input的点积, 这部分input没有重排
+    static inline int DotU4Tail(const uint8_t *inputWalk, const uint8_t *b, int m, int i, int st, int end, int zero) {
+        int value = 0;
+        for (int j = st; j < end; j++) {
+            uint64_t id = ((uint64_t)i * m + j) / 2;
+            if (((uint64_t)i * m + j) % 2) {
+                value += ((b[id] & 0xF) - zero) * inputWalk[j];
+            } else {
+                value += ((b[id] >> 4) - zero) * inputWalk[j];
+            }
+        }
+        return value;
+    }
+
+    // 分组量化: 组内每次处理64个, 权重减去这一组的零点后作为int8; 每组结束时把512位的累加结果折叠到256位,
+    // 再乘上scale累加到float向量中, 和AVX2版本的累加顺序相同, 结果完全一致
+    template <int ROWS>
+    static inline void MultiplyU4GroupRowsAVX512VNNI(const uint8_t *a, const uint8_t *b, float *c, int m, int kstride,
+                                                     int groupSize, int groupCnt, const float *scales, const int *zeros,
+                                                     int block, int i) {
+        const __m512i lowMask = _mm512_set1_epi8(0xf);
+        const __m512i lanes = _mm512_set_epi64(3, 2, 3, 2, 1, 0, 1, 0);
+        const __m512i shifts = _mm512_set_epi64(4, 4, 0, 0, 4, 4, 0, 0);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+        __m256 accf[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            accf[r] = _mm256_setzero_ps();
+        }
+        for (int g = 0; g < groupCnt; g++) {
+            int st = g * groupSize, end = st + groupSize < m ? st + groupSize : m;
+            int simdGroupEnd = end < simdEnd ? end : simdEnd;
+            int zero = zeros[i * groupCnt + g];
+            const __m512i zerox = _mm512_set1_epi8((char)zero);
+            __m512i acc[ROWS];
+            __m256i acc256[ROWS];
+            for (int r = 0; r < ROWS; r++) {
+                acc[r] = _mm512_setzero_si512();
+                acc256[r] = _mm256_setzero_si256();
+            }
+            int j = st;
+            for (; j + 63 < simdGroupEnd; j += 64) {
+                __m512i orix = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) (weightWalk + j / 2)));
+                __m512i w = _mm512_sub_epi8(_mm512_and_si512(_mm512_srlv_epi64(_mm512_permutexvar_epi64(lanes, orix), shifts), lowMask), zerox);
+                for (int r = 0; r < ROWS; r++) {
+                    __m512i x = _mm512_loadu_si512((const void *) (a + (uint64_t)(block + r) * m + j));
+                    acc[r] = _mm512_dpbusd_epi32(acc[r], x, w);
+                }
+            }
+            if (j < simdGroupEnd) {
+                __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+                __m256i w = _mm256_sub_epi8(_mm256_and_si256(_mm512_castsi512_si256(lowMask), _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix)),
+                                            _mm512_castsi512_si256(zerox));
+                for (int r = 0; r < ROWS; r++) {
+                    __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                    acc256[r] = _mm256_dpbusd_epi32(acc256[r], x, w);
+                }
+                j += 32;
+            }
+            for (int r = 0; r < ROWS; r++) {
+                acc256[r] = _mm256_add_epi32(acc256[r], _mm256_add_epi32(_mm512_castsi512_si256(acc[r]),
+                                                                          _mm512_extracti64x4_epi64(acc[r], 1)));
+            }
+            if (j < end) {
+                for (int r = 0; r < ROWS; r++) {
+                    int value = DotU4Tail(a + (uint64_t)(block + r) * m, b, m, i, j, end, zero);
+                    acc256[r] = _mm256_add_epi32(acc256[r], _mm256_setr_epi32(value, 0, 0, 0, 0, 0, 0, 0));
+                }
+            }
+            __m256 scale = _mm256_set1_ps(scales[i * groupCnt + g]);
+            for (int r = 0; r < ROWS; r++) {
+                accf[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(acc256[r]), scale, accf[r]);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            c[(block + r) * kstride + i] = Floatsum(accf[r]);
+        }
+    }
+
+    static void MultiplyU4GroupAVX512VNNI(const uint8_t *a, const uint8_t *b, float *c, int n, int m, int k, int kstride,
+                                          int groupSize, int groupCnt, const float *scales, const int *zeros) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 7 < n; block += 8) {
+                MultiplyU4GroupRowsAVX512VNNI <8> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+            for (; block + 3 < n; block += 4) {
+                MultiplyU4GroupRowsAVX512VNNI <4> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU4GroupRowsAVX512VNNI <1> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+        }
+    }
+
+    const CpuKernels *GetCpuKernelsAVX512VNNI() {
+        static const CpuKernels kernels = [] {
+            const CpuKernels *base = GetCpuKernelsAVX512();
+            CpuKernels ret = base ? *base : *GetCpuKernelsGeneric();
+            ret.name = "avx512vnni";
+            ret.multiplyU8 = MultiplyU8AVX512VNNI;
+            ret.u8WeightOffset = 128;
+            ret.multiplyU4 = MultiplyU4AVX512VNNI;
+            ret.int4InterleaveInput = true;
+            ret.multiplyU4Group = MultiplyU4GroupAVX512VNNI;
+            return ret;
+        } ();
+        return &kernels;
+    }
+}
+#else
+namespace fastllm {
+    const CpuKernels *GetCpuKernelsAVX512VNNI() {
+        return nullptr;
+    }
+}
+#endif
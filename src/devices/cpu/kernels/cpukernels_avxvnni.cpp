@@ -0,0 +1,212 @@
+//
+// Created by huangyuyang on 7/16/23.
+//
+
+// AVX2 + AVX_VNNI的kernel, 只有这个文件用-mavx2 -mfma -mf16c -mavxvnni编译
+// vpdpbusd一条指令完成uint8 * int8累加到int32, 没有单独实现的kernel沿用AVX2的版本
+
+#include "devices/cpu/cpukernels.h"
+
+#if defined(__AVX2__) && (defined(_MSC_VER) || defined(__AVXVNNI__))
+#include <immintrin.h>
+
+namespace fastllm {
+    static inline int I32sum(const __m256i a) {
+        const __m128i sum128 = _mm_add_epi32(_mm256_extractf128_si256(a, 0), _mm256_extractf128_si256(a, 1));
+        const __m128i hi64 = _mm_unpackhi_epi64(sum128, sum128);
+        const __m128i sum64 = _mm_add_epi32(hi64, sum128);
+        const __m128i hi32  = _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_cvtsi128_si32(_mm_add_epi32(sum64, hi32));
+    }
+
+    // c的[block, block + ROWS)行, 第i列; 每次读入的weight被ROWS行input复用
+    template <int ROWS>
+    static inline void MultiplyU8RowsAVXVNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int m, int kstride,
+                                             int block, int i) {
+        const __m256i offset = _mm256_set1_epi8((char)0x80);
+        const uint8_t *weightWalk = b + (uint64_t)i * m;
+        __m256i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm256_setzero_si256();
+        }
+        int j = 0;
+        for (; j + 31 < m; j += 32) {
+            __m256i w = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (weightWalk + j)), offset);
+            for (int r = 0; r < ROWS; r++) {
+                __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                acc[r] = _mm256_dpbusd_avx_epi32(acc[r], x, w);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            const uint8_t *inputWalk = a + (uint64_t)(block + r) * m;
+            int value = I32sum(acc[r]);
+            for (int t = j; t < m; t++) {
+                value += inputWalk[t] * ((int)weightWalk[t] - 128);
+            }
+            c[(block + r) * kstride + i] = value;
+        }
+    }
+
+    static void MultiplyU8AVXVNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 3 < n; block += 4) {
+                MultiplyU8RowsAVXVNNI <4> (a, b, c, m, kstride, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU8RowsAVXVNNI <1> (a, b, c, m, kstride, block, i);
+            }
+        }
+    }
+
+    // 输入已经按InterleaveInt4Input重排, int4的权重在[0, 15]之间, 直接作为int8使用
+    template <int ROWS>
+    static inline void MultiplyU4RowsAVXVNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int m, int kstride,
+                                             int block, int i) {
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+        __m256i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm256_setzero_si256();
+        }
+        int j = 0;
+        for (; j < simdEnd; j += 32) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+            __m256i w = _mm256_and_si256(lowMask, _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix));
+            for (int r = 0; r < ROWS; r++) {
+                __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                acc[r] = _mm256_dpbusd_avx_epi32(acc[r], x, w);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            const uint8_t *inputWalk = a + (uint64_t)(block + r) * m;
+            int value = I32sum(acc[r]);
+            for (int t = j; t < m; t++) {
+                uint64_t id = ((uint64_t)i * m + t) / 2;
+                if (((uint64_t)i * m + t) % 2) {
+                    value += (b[id] & 0xF) * inputWalk[t];
+                } else {
+                    value += (b[id] >> 4) * inputWalk[t];
+                }
+            }
+            c[(block + r) * kstride + i] = value;
+        }
+    }
+
+    static void MultiplyU4AVXVNNI(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 3 < n; block += 4) {
+                MultiplyU4RowsAVXVNNI <4> (a, b, c, m, kstride, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU4RowsAVXVNNI <1> (a, b, c, m, kstride, block, i);
+            }
+        }
+    }
+
+    static inline float Floatsum(const __m256 a) {
+        __m128 res = _mm256_extractf128_ps(a, 1);
+        res = _mm_add_ps(res, _mm256_castps256_ps128(a));
+        res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+        res = _mm_add_ss(res, _mm_movehdup_ps(res));
+        return _mm_cvtss_f32(res);
+    }
+
+    // 第i行权重的[st, end)减去零点后和input的点积, 这部分input没有重排
+    static inline int DotU4Tail(const uint8_t *inputWalk, const uint8_t *b, int m, int i, int st, int end, int zero) {
+        int value = 0;
+        for (int j = st; j < end; j++) {
+            uint64_t id = ((uint64_t)i * m + j) / 2;
+            if (((uint64_t)i * m + j) % 2) {
+                value += ((b[id] & 0xF) - zero) * inputWalk[j];
+            } else {
+                value += ((b[id] >> 4) - zero) * inputWalk[j];
+            }
+        }
+        return value;
+    }
+
+    // 分组量化: 权重减去这一组的零点后是int8, 每组的int32累加结果乘上scale累加到float向量中
+    // 和AVX2版本的累加顺序相同, 结果完全一致
+    template <int ROWS>
+    static inline void MultiplyU4GroupRowsAVXVNNI(const uint8_t *a, const uint8_t *b, float *c, int m, int kstride,
+                                                  int groupSize, int groupCnt, const float *scales, const int *zeros,
+                                                  int block, int i) {
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        int simdEnd = (m % 2 == 0) ? m / 32 * 32 : 0;
+        const uint8_t *weightWalk = b + (uint64_t)i * m / 2;
+        __m256 accf[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            accf[r] = _mm256_setzero_ps();
+        }
+        for (int g = 0; g < groupCnt; g++) {
+            int st = g * groupSize, end = st + groupSize < m ? st + groupSize : m;
+            int simdGroupEnd = end < simdEnd ? end : simdEnd;
+            int zero = zeros[i * groupCnt + g];
+            const __m256i zerox = _mm256_set1_epi8((char)zero);
+            __m256i acc[ROWS];
+            for (int r = 0; r < ROWS; r++) {
+                acc[r] = _mm256_setzero_si256();
+            }
+            int j = st;
+            for (; j < simdGroupEnd; j += 32) {
+                __m128i orix = _mm_loadu_si128((const __m128i *) (weightWalk + j / 2));
+                __m256i w = _mm256_sub_epi8(_mm256_and_si256(lowMask, _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix)), zerox);
+                for (int r = 0; r < ROWS; r++) {
+                    __m256i x = _mm256_loadu_si256((const __m256i *) (a + (uint64_t)(block + r) * m + j));
+                    acc[r] = _mm256_dpbusd_avx_epi32(acc[r], x, w);
+                }
+            }
+            if (j < end) {
+                for (int r = 0; r < ROWS; r++) {
+                    int value = DotU4Tail(a + (uint64_t)(block + r) * m, b, m, i, j, end, zero);
+                    acc[r] = _mm256_add_epi32(acc[r], _mm256_setr_epi32(value, 0, 0, 0, 0, 0, 0, 0));
+                }
+            }
+            __m256 scale = _mm256_set1_ps(scales[i * groupCnt + g]);
+            for (int r = 0; r < ROWS; r++) {
+                accf[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[r]), scale, accf[r]);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            c[(block + r) * kstride + i] = Floatsum(accf[r]);
+        }
+    }
+
+    static void MultiplyU4GroupAVXVNNI(const uint8_t *a, const uint8_t *b, float *c, int n, int m, int k, int kstride,
+                                       int groupSize, int groupCnt, const float *scales, const int *zeros) {
+        for (int i = 0; i < k; i++) {
+            int block = 0;
+            for (; block + 3 < n; block += 4) {
+                MultiplyU4GroupRowsAVXVNNI <4> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+            for (; block < n; block++) {
+                MultiplyU4GroupRowsAVXVNNI <1> (a, b, c, m, kstride, groupSize, groupCnt, scales, zeros, block, i);
+            }
+        }
+    }
+
+    const CpuKernels *GetCpuKernelsAVXVNNI() {
+        static const CpuKernels kernels = [] {
+            const CpuKernels *base = GetCpuKernelsAVX2();
+            CpuKernels ret = base ? *base : *GetCpuKernelsGeneric();
+            ret.name = "avxvnni";
+            ret.multiplyU8 = MultiplyU8AVXVNNI;
+            ret.u8WeightOffset = 128;
+            ret.multiplyU4 = MultiplyU4AVXVNNI;
+            ret.int4InterleaveInput = true;
+            ret.multiplyU4Group = MultiplyU4GroupAVXVNNI;
+            return ret;
+        } ();
+        return &kernels;
+    }
+}
+#else
+namespace fastllm {
+    const CpuKernels *GetCpuKernelsAVXVNNI() {
+        return nullptr;
+    }
+}
+#endif
@@ -0,0 +1,312 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+// 不依赖x86扩展指令集的kernel, 用基础编译选项编译, aarch64上使用NEON
+
+#include "devices/cpu/cpukernels.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#include "armMath.h"
+#endif
+
+namespace fastllm {
+    static void FloatLinearGeneric(const float *inputData, const float *weightData, const float *biasData, float *outputData,
+                                   int n, int m, int k, int st, int end) {
+        for (int i = 0; i < n; i++) {
+            for (int j = st; j < end; j++) {
+                float now = biasData ? biasData[j] : 0.0f;
+                int l = 0;
+#ifdef __aarch64__
+                float32x4_t sum = {0, 0, 0, 0};
+                for (; l + 3 < m; l += 4) {
+                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vld1q_f32(weightData + j * m + l)));
+                }
+                now += sum[0] + sum[1] + sum[2] + sum[3];
+#endif
+                for (; l < m; l++) {
+                    now += inputData[i * m + l] * weightData[j * m + l];
+                }
+                outputData[i * k + j] = now;
+            }
+        }
+    }
+
+    static void Float16LinearGeneric(const float *inputData, const uint16_t *weightData, const float *biasData, float *outputData,
+                                     int n, int m, int k, int st, int end) {
+        for (int i = 0; i < n; i++) {
+            for (int j = st; j < end; j++) {
+                float now = biasData ? biasData[j] : 0.0f;
+                for (int l = 0; l < m; l++) {
+                    now += inputData[i * m + l] * half_to_float(weightData[j * m + l]);
+                }
+                outputData[i * k + j] = now;
+            }
+        }
+    }
+
+    static void MultiplyU8Generic(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int block = 0; block < n; block++) {
+            const uint8_t *weightWalk = b;
+            const uint8_t *inputStart = a + block * m;
+
+            for (int i = 0; i < k; i++) {
+                int value = 0;
+                const uint8_t *inputWalk = inputStart;
+                int j = 0;
+#ifdef __ARM_FEATURE_DOTPROD
+                uint32x4_t sum0 = {0, 0, 0, 0};
+                for (; j + 31 < m; j += 32) {
+                    uint8x16_t vi = vld1q_u8(inputWalk);
+                    uint8x16_t vi0 = vld1q_u8(inputWalk + 16);
+                    uint8x16_t vw = vld1q_u8(weightWalk);
+                    uint8x16_t vw0 = vld1q_u8(weightWalk + 16);
+                    sum0 = vdotq_u32(sum0, vi, vw);
+                    sum0 = vdotq_u32(sum0, vi0, vw0);
+                    inputWalk += 32;
+                    weightWalk += 32;
+                }
+                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#elif defined(__aarch64__)
+                uint32x4_t sum = {0};
+                for (; j + 63 < m; j += 64) {
+                    for (int t = 0; t < 64; t += 8) {
+                        sum = vpadalq_u16(sum, vmull_u8(vld1_u8(inputWalk + t), vld1_u8(weightWalk + t)));
+                    }
+                    inputWalk += 64;
+                    weightWalk += 64;
+                }
+                value += (sum[0] + sum[1] + sum[2] + sum[3]);
+#endif
+                for (; j < m; j++) {
+                    value += (int)(*(weightWalk++)) * (*(inputWalk++));
+                }
+                c[block * kstride + i] = value;
+            }
+        }
+    }
+
+    static void MultiplyU4Generic(const uint8_t *a, const uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+        for (int block = 0; block < n; block++) {
+            const uint8_t *inputWalk = a + block * m;
+            for (int i = 0; i < k; i++) {
+                int value = 0;
+                int j = 0;
+#ifdef __ARM_FEATURE_DOTPROD
+                uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                uint8x8_t maskLow = vdup_n_u8(0xF);
+                uint32x2_t sum0 = {0, 0};
+
+                for (; j + 15 < m; j += 16) {
+                    uint8x8_t ori = vld1_u8(b + (i * m + j) / 2);
+                    uint8x8x2_t in = vld2_u8(inputWalk + j);
+                    uint8x8_t va = vand_u8(ori, maskLow);
+                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                    sum0 = vdot_u32(sum0, va, in.val[1]);
+                    sum0 = vdot_u32(sum0, vb, in.val[0]);
+                }
+                value += sum0[0] + sum0[1];
+#elif defined(__aarch64__)
+                uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                uint8x8_t maskLow = vdup_n_u8(0xF);
+                uint32x4_t sum0 = {0, 0, 0, 0};
+
+                for (; j + 15 < m; j += 16) {
+                    uint8x8_t ori = vld1_u8(b + (i * m + j) / 2);
+                    uint8x8x2_t in = vld2_u8(inputWalk + j);
+                    uint8x8_t va = vand_u8(ori, maskLow);
+                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                    sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
+                    sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
+                }
+                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#endif
+                for (; j < m; j++) {
+                    int id = (i * m + j) / 2;
+                    if ((i * m + j) % 2) {
+                        value += (b[id] & 0xF) * inputWalk[j];
+                    } else {
+                        value += (b[id] >> 4) * inputWalk[j];
+                    }
+                }
+                c[block * kstride + i] = value;
+            }
+        }
+    }
+
+    static void MultiplyU4GroupGeneric(const uint8_t *a, const uint8_t *b, float *c, int n, int m, int k, int kstride,
+                                       int groupSize, int groupCnt, const float *scales, const int *zeros) {
+        for (int block = 0; block < n; block++) {
+            const uint8_t *inputWalk = a + (uint64_t)block * m;
+            for (int i = 0; i < k; i++) {
+                float value = 0;
+                for (int g = 0; g < groupCnt; g++) {
+                    int st = g * groupSize, end = std::min(m, st + groupSize);
+                    int zero = zeros[i * groupCnt + g];
+                    int dot = 0;
+                    for (int j = st; j < end; j++) {
+                        uint64_t id = ((uint64_t)i * m + j) / 2;
+                        if (((uint64_t)i * m + j) % 2) {
+                            dot += ((b[id] & 0xF) - zero) * inputWalk[j];
+                        } else {
+                            dot += ((b[id] >> 4) - zero) * inputWalk[j];
+                        }
+                    }
+                    value += scales[i * groupCnt + g] * (float)dot;
+                }
+                c[block * kstride + i] = value;
+            }
+        }
+    }
+
+    static void MatMulGeneric(const float *input0Data, int input0Stride, const float *input1Data, int input1Stride,
+                              float *outputData, int n, int m, int k, float alpha) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < m; j++) {
+                float now = input0Data[i * input0Stride + j] * alpha;
+                for (int l = 0; l < k; l++) {
+                    outputData[i * k + l] += (now * input1Data[j * input1Stride + l]);
+                }
+            }
+        }
+    }
+
+    static void MatMulTransBGeneric(const float *input0Data, int input0Stride, const float *input1Data, int input1Stride,
+                                    float *outputData, int outputStride, int n, int m, int k, float alpha) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < k; j++) {
+                float now = 0.0f;
+                int l = 0;
+#ifdef __aarch64__
+                float32x4_t sum = {0, 0, 0, 0};
+                for (; l + 3 < m; l += 4) {
+                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(input0Data + i * input0Stride + l),
+                                                   vld1q_f32(input1Data + j * input1Stride + l)));
+                }
+                now += sum[0] + sum[1] + sum[2] + sum[3];
+#endif
+                for (; l < m; l++) {
+                    now += input0Data[i * input0Stride + l] * input1Data[j * input1Stride + l];
+                }
+                outputData[i * outputStride + j] = now * alpha;
+            }
+        }
+    }
+
+    static void SoftmaxGeneric(const float *inputData, float *outputData, int channels) {
+        float maxValue = -FLT_MAX;
+        int j = 0;
+#ifdef __aarch64__
+        float32x4_t vmax = vdupq_n_f32(-FLT_MAX);
+        for (; j + 3 < channels; j += 4) {
+            vmax = vmaxq_f32(vmax, vld1q_f32(inputData + j));
+        }
+        for (int k = 0; k < 4; k++) {
+            maxValue = std::max(maxValue, vmax[k]);
+        }
+#endif
+        for (; j < channels; j++) {
+            maxValue = std::max(maxValue, inputData[j]);
+        }
+
+        j = 0;
+#ifdef __aarch64__
+        vmax = vdupq_n_f32(maxValue);
+        for (; j + 3 < channels; j += 4) {
+            vst1q_f32(outputData + j, exp_ps(vsubq_f32(vld1q_f32(inputData + j), vmax)));
+        }
+#endif
+        for (; j < channels; j++) {
+            outputData[j] = exp(inputData[j] - maxValue);
+        }
+        float sum = 0.0;
+        for (j = 0; j < channels; j++) {
+            sum += outputData[j];
+        }
+
+        j = 0;
+#ifdef __aarch64__
+        float32x4_t fsum = vdupq_n_f32(sum);
+        for (; j + 3 < channels; j += 4) {
+            vst1q_f32(outputData + j, vdivq_f32(vld1q_f32(outputData + j), fsum));
+        }
+#endif
+        for (; j < channels; j++) {
+            outputData[j] = outputData[j] / sum;
+        }
+    }
+
+    static void LayerNormGeneric(const float *inputData, const float *gammaData, const float *betaData,
+                                 float *outputData, int channels) {
+        float mean = 0.f, s2 = 0.f, var = 0.f;
+        int j = 0;
+#ifdef __aarch64__
+        float32x4_t sums = vdupq_n_f32(0.0);
+        float32x4_t sums2 = vdupq_n_f32(0.0);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t vi = vld1q_f32(inputData + j);
+            sums = vaddq_f32(sums, vi);
+            sums2 = vaddq_f32(sums2, vmulq_f32(vi, vi));
+        }
+        mean = sums[0] + sums[1] + sums[2] + sums[3];
+        s2 = sums2[0] + sums2[1] + sums2[2] + sums2[3];
+#endif
+        for (; j < channels; j++) {
+            mean += inputData[j];
+            s2 += inputData[j] * inputData[j];
+        }
+        mean /= channels;
+        var = s2 + mean * mean * channels - 2 * mean * channels * mean;
+        var = sqrt(var / channels + 1e-10);
+        j = 0;
+#ifdef __aarch64__
+        float32x4_t means = vdupq_n_f32(mean);
+        float32x4_t vars = vdupq_n_f32(1.0 / var);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t va = vld1q_f32(gammaData + j), vb = vld1q_f32(betaData + j);
+            float32x4_t vi = vld1q_f32(inputData + j);
+            float32x4_t vo = vaddq_f32(vmulq_f32(vmulq_f32(vsubq_f32(vi, means), vars), va), vb);
+            vst1q_f32(outputData + j, vo);
+        }
+#endif
+        for (; j < channels; j++) {
+            float a = gammaData[j], b = betaData[j];
+            outputData[j] = (inputData[j] - mean) / var * a + b;
+        }
+    }
+
+    static void RMSNormGeneric(const float *inputData, const float *weightData, float *outputData, int channels, float eps) {
+        float mean = 0.f;
+        for (int j = 0; j < channels; j++) {
+            mean += inputData[j] * inputData[j];
+        }
+        float scale = 1.0 / sqrt(mean / channels + eps);
+        for (int j = 0; j < channels; j++) {
+            outputData[j] = inputData[j] * scale * weightData[j];
+        }
+    }
+
+    static void SiluGeneric(const float *inputData, float *outputData, int len) {
+        for (int i = 0; i < len; i++) {
+            float x = inputData[i];
+            outputData[i] = x / (1.0 + expf(-x));
+        }
+    }
+
+    const CpuKernels *GetCpuKernelsGeneric() {
+        static const CpuKernels kernels = {
+                "generic",
+                FloatLinearGeneric, Float16LinearGeneric,
+                MultiplyU8Generic, 0, MultiplyU4Generic, false, MultiplyU4GroupGeneric,
+                MatMulGeneric, MatMulTransBGeneric,
+                SoftmaxGeneric, LayerNormGeneric, RMSNormGeneric, SiluGeneric
+        };
+        return &kernels;
+    }
+}
@@ -95,6 +95,12 @@ namespace fastllm {
         if (weight.dataType == DataType::FLOAT32) {
             return false;
         }
+        if (weight.dataType == DataType::INT4_GROUP) {
+            return false; // 分组int4没有cuda kernel, 在cpu上计算
+        }
+        if (weight.isRepacked) {
+            return false; // 重排过的int4权重只有cpu kernel能读
+        }
         return true;
     }
 
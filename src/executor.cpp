@@ -3,6 +3,7 @@
 //
 
 #include "executor.h"
+#include "utils.h"
 
 #include "devices/cpu/cpudevice.h"
 
@@ -12,11 +13,13 @@
 
 namespace fastllm {
     Executor::Executor() {
+        this->profiling = false;
         this->devices.clear();
 #ifdef USE_CUDA
         this->devices.push_back((BaseDevice*) new CudaDevice());
 #endif
         this->devices.push_back((BaseDevice*) new CpuDevice());
+        UpdateOpDevices();
     }
 
     Executor::~Executor() {
@@ -27,14 +30,64 @@ namespace fastllm {
 
     void Executor::ClearDevices() {
         this->devices.clear();
+        UpdateOpDevices();
     }
 
     void Executor::AddDevice(fastllm::BaseDevice *device) {
         this->devices.push_back(device);
+        UpdateOpDevices();
+    }
+
+    void Executor::UpdateOpDevices() {
+        for (int op = 0; op < OP_COUNT; op++) {
+            opDevices[op].clear();
+            for (auto device : devices) {
+                auto it = device->ops.find(GetOpTypeName((OpType)op));
+                if (it != device->ops.end()) {
+                    opDevices[op].push_back(OpDeviceEntry {device, it->second, device->deviceType == "cpu"});
+                }
+            }
+        }
+    }
+
+    void Executor::Run(OpType op, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
+                       const fastllm::IntDict &intParams) {
+        bool lockInCPU = false;
+        for (auto &it : datas) {
+            lockInCPU |= it.second->lockInCPU;
+        }
+        const std::string &opType = GetOpTypeName(op);
+        for (const OpDeviceEntry &entry : opDevices[op]) {
+            if (lockInCPU && !entry.isCpu) {
+                continue;
+            }
+            if (entry.op->CanRun(opType, datas, floatParams, intParams)) {
+                bool profiling = this->profiling.load(std::memory_order_relaxed);
+                std::chrono::system_clock::time_point st;
+                if (profiling) {
+                    st = std::chrono::system_clock::now();
+                }
+                for (auto &it : datas) {
+                    it.second->ToDevice((void*)entry.device);
+                }
+                entry.op->Reshape(opType, datas, floatParams, intParams);
+                entry.op->Run(opType, datas, floatParams, intParams);
+                if (profiling) {
+                    AddProfileEvent(opType, entry.device, datas, intParams, st, std::chrono::system_clock::now());
+                }
+                return;
+            }
+        }
+        ErrorInFastLLM("Executor error: no device can run op " + opType + ".\n");
     }
 
     void Executor::Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                        const fastllm::IntDict &intParams) {
+        OpType op = GetOpTypeByName(opType);
+        if (op != OP_COUNT) {
+            Run(op, datas, floatParams, intParams);
+            return;
+        }
         bool lockInCPU = false;
         for (auto &it : datas) {
             lockInCPU |= it.second->lockInCPU;
@@ -44,13 +97,218 @@ namespace fastllm {
                 continue;
             }
             if (device->CanRun(opType, datas, floatParams, intParams)) {
+                bool profiling = this->profiling.load(std::memory_order_relaxed);
+                std::chrono::system_clock::time_point st;
+                if (profiling) {
+                    st = std::chrono::system_clock::now();
+                }
                 for (auto &it : datas) {
                     it.second->ToDevice((void*)device);
                 }
                 device->Reshape(opType, datas, floatParams, intParams);
                 device->Run(opType, datas, floatParams, intParams);
+                if (profiling) {
+                    AddProfileEvent(opType, device, datas, intParams, st, std::chrono::system_clock::now());
+                }
+                return;
+            }
+        }
+        ErrorInFastLLM("Executor error: no device can run op " + opType + ".\n");
+    }
+
+    static const char *DataTypeName(DataType type) {
+        switch (type) {
+            case DataType::FLOAT32: return "float32";
+            case DataType::BFLOAT16: return "bfloat16";
+            case DataType::INT16: return "int16";
+            case DataType::INT8: return "int8";
+            case DataType::INT4: return "int4";
+            case DataType::INT2: return "int2";
+            case DataType::BIT: return "bit";
+            case DataType::FLOAT16: return "float16";
+            case DataType::INT4_GROUP: return "int4_group";
+            case DataType::INT32PARAM: return "int32";
+        }
+        return "unknown";
+    }
+
+    // 按形状计算的字节数, 不包括预扩容的部分
+    static uint64_t ShapeBytes(const Data &data) {
+        if (data.dims.size() == 0) {
+            return 0;
+        }
+        uint64_t count = 1;
+        for (int dim : data.dims) {
+            count *= dim;
+        }
+        return count * data.unitSize / data.unitSizeDiv;
+    }
+
+    static uint64_t ShapeCount(const Data *data) {
+        if (data == nullptr || data->dims.size() == 0) {
+            return 0;
+        }
+        uint64_t count = 1;
+        for (int dim : data->dims) {
+            count *= dim;
+        }
+        return count;
+    }
+
+    static const Data *FindData(const DataDict &datas, const std::string &name) {
+        auto it = datas.find(name);
+        return it == datas.end() ? nullptr : it->second;
+    }
+
+    // 估计一次op的浮点运算次数, 逐元素的算子按每个元素一次计算
+    static double EstimateFlops(const std::string &opType, const DataDict &datas, const IntDict &intParams) {
+        const Data *input = FindData(datas, "input"), *input0 = FindData(datas, "input0");
+        const Data *weight = FindData(datas, "weight"), *output = FindData(datas, "output");
+        if (opType == "Linear") {
+            int m = input->dims.back(), k = weight->dims[0];
+            return 2.0 * (ShapeCount(input) / m) * m * k;
+        } else if (opType == "MatMul" || opType == "MatMulTransB") {
+            return 2.0 * ShapeCount(output) * input0->dims.back();
+        } else if (opType == "Attention") {
+            const Data *q = FindData(datas, "q"), *k = FindData(datas, "k"), *v = FindData(datas, "v");
+            double batch = q->dims[0], qLen = q->dims[1], kvLen = k->dims[1];
+            auto causal = intParams.find("causal");
+            if (causal != intParams.end() && causal->second != 0) {
+                kvLen -= (qLen - 1) / 2.0; // 平均每个query看到的位置数
+            }
+            return 2.0 * batch * qLen * kvLen * (q->dims[2] + v->dims[2]);
+        } else if (opType == "Embedding" || opType == "Split" || opType == "Cat" || opType == "CatDirect" ||
+                   opType == "Permute" || opType == "PermuteSelf") {
+            return 0;
+        }
+        return (double)ShapeCount(input != nullptr ? input : input0);
+    }
+
+    void Executor::AddProfileEvent(const std::string &opType, BaseDevice *device, const DataDict &datas,
+                                   const IntDict &intParams, std::chrono::system_clock::time_point st,
+                                   std::chrono::system_clock::time_point end) {
+        OpProfileEvent event;
+        event.opType = opType;
+        event.device = device->deviceType;
+        event.bytes = 0;
+        for (auto &it : datas) {
+            const Data &data = *it.second;
+            if (data.dims.size() == 0) {
+                continue;
+            }
+            if (event.shapes != "") {
+                event.shapes += " ";
+            }
+            event.shapes += std::string(it.first) + ":" + DataTypeName(data.dataType) + "[";
+            for (int i = 0; i < data.dims.size(); i++) {
+                event.shapes += (i == 0 ? "" : ",") + std::to_string(data.dims[i]);
+            }
+            event.shapes += "]";
+            event.bytes += ShapeBytes(data);
+        }
+        for (const std::string &name : {"weight", "input", "input0", "q"}) {
+            const Data *data = FindData(datas, name);
+            if (data != nullptr && data->dims.size() > 0) {
+                event.dataType = DataTypeName(data->dataType);
                 break;
             }
         }
+        // 下面几个算子只访问了参数中的一小部分
+        if (opType == "CatDirect") {
+            // input0是整个KV cache, 实际只写入了input1这么多数据
+            event.bytes = ShapeBytes(*FindData(datas, "input1")) * 2;
+        } else if (opType == "Embedding") {
+            event.bytes = ShapeBytes(*FindData(datas, "input")) + ShapeBytes(*FindData(datas, "output")) * 2;
+        } else if (opType == "RotatePosition2D") {
+            event.bytes = ShapeBytes(*FindData(datas, "input")) * 2 + ShapeBytes(*FindData(datas, "positionIds"));
+        }
+        event.flops = EstimateFlops(opType, datas, intParams);
+
+        std::lock_guard <std::mutex> lock(this->profileLocker);
+        auto tid = this->profileThreadIds.find(std::this_thread::get_id());
+        if (tid == this->profileThreadIds.end()) {
+            int id = this->profileThreadIds.size();
+            tid = this->profileThreadIds.insert(std::make_pair(std::this_thread::get_id(), id)).first;
+        }
+        event.threadId = tid->second;
+        event.start = std::chrono::duration_cast<std::chrono::microseconds> (st - this->profileStart).count();
+        event.duration = std::chrono::duration_cast<std::chrono::microseconds> (end - st).count();
+        this->profileEvents.push_back(event);
+    }
+
+    void Executor::SetProfiling(bool profiling) {
+        std::lock_guard <std::mutex> lock(this->profileLocker);
+        if (profiling && !this->profiling && this->profileEvents.empty()) {
+            this->profileStart = std::chrono::system_clock::now();
+        }
+        this->profiling = profiling;
+    }
+
+    bool Executor::GetProfiling() {
+        return this->profiling;
+    }
+
+    void Executor::ClearProfiler() {
+        std::lock_guard <std::mutex> lock(this->profileLocker);
+        this->profileEvents.clear();
+        this->profileThreadIds.clear();
+        this->profileStart = std::chrono::system_clock::now();
+    }
+
+    void Executor::PrintProfiler() {
+        struct OpSummary {
+            int calls = 0;
+            long long duration = 0;
+            uint64_t bytes = 0;
+            double flops = 0;
+        };
+        std::map <std::string, OpSummary> summarys;
+        long long total = 0;
+        {
+            std::lock_guard <std::mutex> lock(this->profileLocker);
+            for (auto &event : this->profileEvents) {
+                OpSummary &summary = summarys[event.opType + " (" + event.device + ", " + event.dataType + ")"];
+                summary.calls++;
+                summary.duration += event.duration;
+                summary.bytes += event.bytes;
+                summary.flops += event.flops;
+                total += event.duration;
+            }
+        }
+        std::vector <std::pair <std::string, OpSummary> > sorted(summarys.begin(), summarys.end());
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair <std::string, OpSummary> &a,
+                                                   const std::pair <std::string, OpSummary> &b) {
+            return a.second.duration > b.second.duration;
+        });
+        printf("%-36s %8s %12s %10s %7s %10s %10s\n", "op", "calls", "total(ms)", "avg(ms)", "ratio", "GFLOP/s", "GB/s");
+        for (auto &it : sorted) {
+            const OpSummary &summary = it.second;
+            double seconds = std::max(summary.duration, 1LL) / 1e6;
+            printf("%-36s %8d %12.3f %10.3f %6.2f%% %10.2f %10.2f\n", it.first.c_str(), summary.calls,
+                   summary.duration / 1e3, summary.duration / 1e3 / summary.calls,
+                   total > 0 ? summary.duration * 100.0 / total : 0.0,
+                   summary.flops / seconds / 1e9, summary.bytes / seconds / 1e9);
+        }
+        printf("Total: %.3f ms.\n", total / 1e3);
+    }
+
+    void Executor::SaveProfilerTrace(const std::string &fileName) {
+        FILE *fo = fopen(fileName.c_str(), "w");
+        if (fo == nullptr) {
+            ErrorInFastLLM("SaveProfilerTrace error: can't open file " + fileName + ".\n");
+        }
+        std::lock_guard <std::mutex> lock(this->profileLocker);
+        fprintf(fo, "{\"traceEvents\": [\n");
+        for (int i = 0; i < this->profileEvents.size(); i++) {
+            const OpProfileEvent &event = this->profileEvents[i];
+            fprintf(fo, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, "
+                        "\"pid\": 0, \"tid\": %d, \"args\": {\"shapes\": \"%s\", \"dtype\": \"%s\", "
+                        "\"bytes\": %llu, \"flops\": %.0f}}%s\n",
+                    event.opType.c_str(), event.device.c_str(), event.start, event.duration, event.threadId,
+                    event.shapes.c_str(), event.dataType.c_str(), (unsigned long long)event.bytes, event.flops,
+                    i + 1 < this->profileEvents.size() ? "," : "");
+        }
+        fprintf(fo, "], \"displayTimeUnit\": \"ms\"}\n");
+        fclose(fo);
     }
 }
\ No newline at end of file
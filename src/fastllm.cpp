@@ -7,11 +7,17 @@
 #include "fastllm.h"
 
 #include "executor.h"
+#include "devices/cpu/cpukernels.h"
+#include "devices/cpu/cputhreadpool.h"
 
 #include <cstring>
 #include <cmath>
 #include <cfloat>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <sys/stat.h>
 
 #ifdef __aarch64__
 #include <arm_neon.h>
@@ -26,13 +32,143 @@
 #include "fastllm-cuda.h"
 #endif
 
+#if defined(_WIN32) or defined(_WIN64)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace fastllm {
     Executor defaultExecutor;
     Executor *curExecutor = &defaultExecutor;
 
     static int threads = 4;
     static bool lowMemMode = false;
+    static bool mmapMode = false;
+    static bool weightRepack = false;
+    static bool weightRepackCache = true;
     static bool kvCacheInCPU = false;
+#ifdef USE_CUDA
+    static bool kvCachePaged = false; // 分页的KV cache只能在CPU上计算，使用CUDA时默认关闭
+#else
+    static bool kvCachePaged = true;
+#endif
+    static int kvCachePageLen = 16;
+    static DataType kvCacheDataType = DataType::FLOAT32;
+
+    // 分页KV cache的全局块池，释放的块按大小放进空闲列表复用
+    struct KVCacheBlockPool {
+        std::mutex locker;
+        uint64_t limit = 0; // 内存上限, 0代表不限制
+        uint64_t used = 0; // 正在被使用的字节数
+        uint64_t cached = 0; // 空闲列表中的字节数
+        std::map <uint64_t, std::vector <uint8_t*> > freeBlocks;
+
+        void ReleaseCached() {
+            for (auto &it : freeBlocks) {
+                for (uint8_t *block : it.second) {
+                    delete[] block;
+                }
+            }
+            freeBlocks.clear();
+            cached = 0;
+        }
+
+        uint8_t *Alloc(uint64_t bytes) {
+            std::lock_guard <std::mutex> guard(locker);
+            auto &blocks = freeBlocks[bytes];
+            if (blocks.size() > 0) {
+                uint8_t *ret = blocks.back();
+                blocks.pop_back();
+                cached -= bytes;
+                used += bytes;
+                return ret;
+            }
+            if (limit > 0 && used + cached + bytes > limit) {
+                ReleaseCached();
+                AssertInFastLLM(used + bytes <= limit, "KV cache error: out of memory limit (" +
+                                                       std::to_string(limit) + " bytes).\n");
+            }
+            used += bytes;
+            return new uint8_t[bytes];
+        }
+
+        void Free(uint8_t *block, uint64_t bytes) {
+            std::lock_guard <std::mutex> guard(locker);
+            used -= bytes;
+            freeBlocks[bytes].push_back(block);
+            cached += bytes;
+        }
+    };
+
+    static KVCacheBlockPool *GetKVCacheBlockPool() {
+        static KVCacheBlockPool *pool = new KVCacheBlockPool();
+        return pool;
+    }
+
+    void SetKVCachePaged(bool paged) {
+        kvCachePaged = paged;
+    }
+
+    bool GetKVCachePaged() {
+        return kvCachePaged;
+    }
+
+    void SetKVCachePageLen(int len) {
+        AssertInFastLLM(len > 0, "SetKVCachePageLen error: len should be > 0.\n");
+        kvCachePageLen = len;
+    }
+
+    int GetKVCachePageLen() {
+        return kvCachePageLen;
+    }
+
+    void SetKVCacheMemoryLimit(uint64_t bytes) {
+        KVCacheBlockPool *pool = GetKVCacheBlockPool();
+        std::lock_guard <std::mutex> guard(pool->locker);
+        pool->limit = bytes;
+        if (bytes > 0 && pool->used + pool->cached > bytes) {
+            pool->ReleaseCached();
+        }
+    }
+
+    void SetKVCacheDataType(DataType type) {
+        AssertInFastLLM(type == DataType::FLOAT32 || type == DataType::FLOAT16 || type == DataType::INT8,
+                        "SetKVCacheDataType error: only support float32, float16 and int8.\n");
+        kvCacheDataType = type;
+    }
+
+    DataType GetKVCacheDataType() {
+        return kvCacheDataType;
+    }
+
+    uint64_t GetKVCacheMemoryUsed() {
+        KVCacheBlockPool *pool = GetKVCacheBlockPool();
+        std::lock_guard <std::mutex> guard(pool->locker);
+        return pool->used + pool->cached;
+    }
+
+    void SetProfiling(bool profiling) {
+        curExecutor->SetProfiling(profiling);
+    }
+
+    bool GetProfiling() {
+        return curExecutor->GetProfiling();
+    }
+
+    void ClearProfiler() {
+        curExecutor->ClearProfiler();
+    }
+
+    void PrintProfiler() {
+        curExecutor->PrintProfiler();
+    }
+
+    void SaveProfilerTrace(const std::string &fileName) {
+        curExecutor->SaveProfilerTrace(fileName);
+    }
 
     void SetKVCacheInCPU(bool v) {
         kvCacheInCPU = v;
@@ -46,6 +182,23 @@ namespace fastllm {
     	lowMemMode = m;
     }
 
+    void SetMmapMode(bool m) {
+        mmapMode = m;
+    }
+
+    bool GetMmapMode() {
+        return mmapMode;
+    }
+
+    void SetWeightRepack(bool repack, bool cache) {
+        weightRepack = repack;
+        weightRepackCache = cache;
+    }
+
+    bool GetWeightRepack() {
+        return weightRepack;
+    }
+
     bool GetKVCacheInCPU() {
         return kvCacheInCPU;
     }
@@ -81,6 +234,14 @@ namespace fastllm {
             return v;
         }
 
+        uint64_t ReadUInt64() {
+            uint64_t v;
+            if (fread(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileBuffer.ReadUInt64 error.\n");
+            };
+            return v;
+        }
+
         std::string ReadString() {
             int len = ReadInt();
             std::string ret = "";
@@ -98,8 +259,29 @@ namespace fastllm {
             }
         }
 
+        uint64_t Tell() {
+#if defined(_WIN32) or defined(_WIN64)
+            return _ftelli64(f);
+#else
+            return ftello(f);
+#endif
+        }
+
+        void Seek(uint64_t pos) {
+#if defined(_WIN32) or defined(_WIN64)
+            int ret = _fseeki64(f, pos, SEEK_SET);
+#else
+            int ret = fseeko(f, pos, SEEK_SET);
+#endif
+            if (ret != 0) {
+                ErrorInFastLLM("FileBuffer.Seek error.\n");
+            }
+        }
+
         ~FileBuffer() {
-            fclose(f);
+            if (f != nullptr) {
+                fclose(f);
+            }
         }
     };
 
@@ -122,6 +304,12 @@ namespace fastllm {
             };
         }
 
+        void WriteUInt64(uint64_t v) {
+            if (fwrite(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileWriter.WriteUInt64 error.\n");
+            };
+        }
+
         void WriteString(const std::string &s) {
             WriteInt((int)s.size());
             if (fwrite(s.c_str(), 1, (int)s.size(), f) != (int)s.size()) {
@@ -135,6 +323,33 @@ namespace fastllm {
             }
         }
 
+        uint64_t Tell() {
+#if defined(_WIN32) or defined(_WIN64)
+            return _ftelli64(f);
+#else
+            return ftello(f);
+#endif
+        }
+
+        void Seek(uint64_t pos) {
+#if defined(_WIN32) or defined(_WIN64)
+            int ret = _fseeki64(f, pos, SEEK_SET);
+#else
+            int ret = fseeko(f, pos, SEEK_SET);
+#endif
+            if (ret != 0) {
+                ErrorInFastLLM("FileWriter.Seek error.\n");
+            }
+        }
+
+        void Align(int align) { // 用0补齐到align字节的整数倍
+            uint64_t pos = Tell();
+            if (pos % align != 0) {
+                std::vector <uint8_t> zeros(align - pos % align, 0);
+                WriteBytes(zeros.data(), zeros.size());
+            }
+        }
+
         ~FileWriter() {
             fclose(f);
         }
@@ -162,9 +377,32 @@ namespace fastllm {
     }
 
     void Data::CopyFrom(const Data &ori) {
+        if (this->isPaged) {
+            this->FreePages();
+            this->isPaged = false;
+            this->dims.clear();
+        }
+        if (ori.isPaged) {
+            // 分页存储的数据复制成连续存储的float32
+            this->dataType = DataType::FLOAT32;
+            this->UpdateUnitSize();
+            this->Resize(ori.dims);
+            this->Allocate();
+            int outer = ori.dims[0], len = ori.dims[1], inner = ori.dims[2];
+            for (int o = 0; o < outer; o++) {
+                for (int st = 0; st < len; st += ori.pageLen) {
+                    int rows = std::min(ori.pageLen, len - st);
+                    ori.GetPagedRows(o, st, rows, (float*)this->cpuData + ((uint64_t)o * len + st) * inner);
+                }
+            }
+            return;
+        }
         if (ori.dims != this->dims || this->cpuData == nullptr) {
             if (ori.dims.size() == 0) {
-                delete[] this->cpuData;
+                if (!this->isExternalData) {
+                    delete[] this->cpuData;
+                }
+                this->isExternalData = false;
                 this->dataType = ori.dataType;
                 this->UpdateUnitSize();
                 this->dims.resize(0);
@@ -200,7 +438,7 @@ namespace fastllm {
         } else if (this->dataType == DataType::INT8) {
             this->unitSize = 1;
             this->unitSizeDiv = 1;
-        } else if (this->dataType == DataType::INT4) {
+        } else if (this->dataType == DataType::INT4 || this->dataType == DataType::INT4_GROUP) {
             this->unitSize = 1;
             this->unitSizeDiv = 2;
         } else if (this->dataType == DataType::INT2) {
@@ -267,6 +505,7 @@ namespace fastllm {
         this->expansionBytes = (size * this->unitSize - 1) / this->unitSizeDiv + 1;
         if (this->dataDevice == DataDevice::CPU) {
             this->cpuData = new uint8_t[this->expansionBytes];
+            this->isExternalData = false;
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
             this->cudaData = FastllmCudaMalloc(this->expansionBytes);
@@ -280,7 +519,11 @@ namespace fastllm {
         this->expansionSize = 0;
         this->expansionBytes = 0;
         if (this->dataDevice == DataDevice::CPU) {
-            delete[] this->cpuData;
+            if (!this->isExternalData) {
+                delete[] this->cpuData;
+            }
+            this->cpuData = nullptr;
+            this->isExternalData = false;
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
             FastllmCudaFree(this->cudaData);
@@ -290,6 +533,15 @@ namespace fastllm {
         }
     }
 
+    void Data::SetExternalData(uint8_t *data) {
+        AssertInFastLLM(this->dataDevice == DataDevice::CPU, "SetExternalData error: Data should be on cpu.\n");
+        FreeSpace();
+        this->cpuData = data;
+        this->isExternalData = true;
+        this->expansionSize = Count(0);
+        this->expansionBytes = GetBytes();
+    }
+
     void Data::Allocate() {
         if (Count(0) > expansionSize) {
             FreeSpace();
@@ -345,6 +597,7 @@ namespace fastllm {
         if (this->expansionBytes != 0) {
             if (this->dataDevice == DataDevice::CPU) {
                 uint8_t *old = this->cpuData;
+                bool oldIsExternal = this->isExternalData;
                 MallocSpace(this->strides[0] * std::max(this->dims[0], dims[0]));
                 int outer = this->Count(0) / this->Count(axis);
                 int input0Stride = this->Count(axis);
@@ -355,7 +608,9 @@ namespace fastllm {
                            old + o * input1Stride * unitSize,
                            this->dims[axis] * inner * unitSize);
                 }
-                delete[] old;
+                if (!oldIsExternal) {
+                    delete[] old;
+                }
             } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
                 uint8_t *old = (uint8_t*)this->cudaData;
@@ -377,7 +632,12 @@ namespace fastllm {
     }
 
     Data::~Data() {
-        delete[] this->cpuData;
+        if (this->isPaged) {
+            this->FreePages();
+        }
+        if (!this->isExternalData) {
+            delete[] this->cpuData;
+        }
 #ifdef USE_CUDA
         if (this->cudaData != nullptr) {
             FastllmCudaFree(this->cudaData);
@@ -432,10 +692,28 @@ namespace fastllm {
     }
 
     void Data::CalcWeightSum() {
-        if (this->weightSum.size() > 0) {
+        if (this->weightSum.size() > 0 || this->floatWeightSum.size() > 0) {
             return;
         }
         int n = this->dims[0], m = this->dims[1];
+        if (this->dataType == DataType::INT4_GROUP) {
+            // 分组的零点不同，只能按组反量化后求和
+            floatWeightSum.resize(n);
+            for (int i = 0; i < n; i++) {
+                float sum = 0;
+                for (int g = 0; g < groupCnt; g++) {
+                    int st = g * groupSize, end = std::min(m, st + groupSize);
+                    int groupSum = 0;
+                    for (int j = st; j < end; j++) {
+                        uint64_t id = ((uint64_t)i * m + j) / 2;
+                        groupSum += ((uint64_t)i * m + j) % 2 ? (cpuData[id] & 0xF) : (cpuData[id] >> 4);
+                    }
+                    sum += scales[i * groupCnt + g] * (groupSum - zeros[i * groupCnt + g] * (end - st));
+                }
+                floatWeightSum[i] = sum;
+            }
+            return;
+        }
         if (this->dataType == DataType::INT8) {
             weightSum.resize(n);
             for (int i = 0; i < n; i++) {
@@ -519,6 +797,16 @@ namespace fastllm {
         }
     }
 
+    void Data::RepackWeight() {
+        if (this->isRepacked || this->cpuData == nullptr || this->dims.size() != 2 ||
+            (this->dataType != DataType::INT4 && this->dataType != DataType::INT4_GROUP)) {
+            return;
+        }
+        // mmap的数据是写时复制的，原地重排不会改到文件
+        RepackInt4Weight(this->cpuData, this->dims[0], this->dims[1]);
+        this->isRepacked = true;
+    }
+
     void Data::ToDevice(void *device) {
         BaseDevice *dev = (BaseDevice*)device;
         if (dev->deviceType == "cuda") {
@@ -529,7 +817,8 @@ namespace fastllm {
     }
 
     void Data::ToDevice(fastllm::DataDevice device) {
-        if (this->dataType == DataType::INT32PARAM) {
+        if (this->dataType == DataType::INT32PARAM || this->isPaged) {
+            // 分页存储的数据只放在CPU上
             return;
         }
 #ifndef USE_CUDA
@@ -546,8 +835,11 @@ namespace fastllm {
                 if (device == DataDevice::CUDA) {
                     this->cudaData = FastllmCudaMalloc(expansionBytes);
                     FastllmCudaCopyFromHostToDevice(this->cudaData, this->cpuData, expansionBytes);
-                    delete[] this->cpuData;
+                    if (!this->isExternalData) {
+                        delete[] this->cpuData;
+                    }
                     this->cpuData = nullptr;
+                    this->isExternalData = false;
                 }
             } else if (this->dataDevice == DataDevice::CUDA) {
                 if (device == DataDevice::CPU) {
@@ -562,126 +854,865 @@ namespace fastllm {
         this->dataDevice = device;
     }
 
-    Tokenizer::TrieNode::TrieNode() {
-        this->tokenId = -999999;
+    void Data::SetPaged() {
+        if (this->isPaged) {
+            return;
+        }
+        AssertInFastLLM(this->dims.size() == 0 && this->cpuData == nullptr && this->dataDevice == DataDevice::CPU,
+                        "SetPaged error: data should be empty and on cpu.\n");
+        this->isPaged = true;
+        this->pageLen = GetKVCachePageLen();
+        this->lockInCPU = true;
+        this->dataType = GetKVCacheDataType();
+        this->UpdateUnitSize();
+    }
+
+    uint64_t Data::GetPageBytes() const {
+        uint64_t bytes = (uint64_t)this->dims[0] * this->pageLen * this->dims[2] * this->unitSize;
+        if (this->dataType == DataType::INT8) {
+            bytes += (uint64_t)this->dims[0] * this->pageLen * sizeof(float); // 每一行的scale
+        }
+        return bytes;
+    }
+
+    void Data::ReservePages(int len) {
+        AssertInFastLLM(this->isPaged && this->dims.size() == 3, "ReservePages error: data should be paged and 3-D.\n");
+        KVCacheBlockPool *pool = GetKVCacheBlockPool();
+        uint64_t bytes = GetPageBytes();
+        while ((int)this->pages.size() * this->pageLen < len) {
+            this->pages.push_back(pool->Alloc(bytes));
+        }
+    }
+
+    void Data::FreePages() {
+        if (this->pages.size() == 0) {
+            return;
+        }
+        KVCacheBlockPool *pool = GetKVCacheBlockPool();
+        uint64_t bytes = GetPageBytes();
+        for (uint8_t *page : this->pages) {
+            pool->Free(page, bytes);
+        }
+        this->pages.clear();
+    }
+
+    void Data::Truncate(int len) {
+        if (this->dims.size() == 0 || len >= this->dims[1]) {
+            return;
+        }
+        AssertInFastLLM(this->dims.size() == 3 && len >= 0, "Truncate error: data should be 3-D.\n");
+        if (this->isPaged) {
+            KVCacheBlockPool *pool = GetKVCacheBlockPool();
+            uint64_t bytes = GetPageBytes();
+            int pageCnt = (len + this->pageLen - 1) / this->pageLen;
+            for (int i = pageCnt; i < this->pages.size(); i++) {
+                pool->Free(this->pages[i], bytes);
+            }
+            this->pages.resize(pageCnt);
+        } else {
+            // 预扩容过的数据跨度不随dims变化，直接改dims即可
+            AssertInFastLLM(this->expansionDims.size() > 0, "Truncate error: data should be expanded.\n");
+        }
+        this->dims[1] = len;
+    }
+
+    uint8_t *Data::GetPagedData(int o, int pos) const {
+        return this->pages[pos / this->pageLen] +
+               ((uint64_t)o * this->pageLen + pos % this->pageLen) * this->dims[2] * this->unitSize;
+    }
+
+    float *Data::GetPagedScales(int o, int pos) const {
+        return (float*)(this->pages[pos / this->pageLen] + (uint64_t)this->dims[0] * this->pageLen * this->dims[2]) +
+               (uint64_t)o * this->pageLen + pos % this->pageLen;
+    }
+
+    void Data::SetPagedRows(int o, int pos, int len, const float *data) {
+        int inner = this->dims[2];
+        uint64_t n = (uint64_t)len * inner;
+        if (this->dataType == DataType::FLOAT32) {
+            memcpy(GetPagedData(o, pos), data, n * sizeof(float));
+        } else if (this->dataType == DataType::FLOAT16) {
+            uint16_t *dst = (uint16_t*)GetPagedData(o, pos);
+            uint64_t i = 0;
+#ifdef __F16C__
+            for (; i + 7 < n; i += 8) {
+                _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(data + i), _MM_FROUND_TO_NEAREST_INT));
+            }
+#endif
+            for (; i < n; i++) {
+                dst[i] = float_to_half(data[i]);
+            }
+        } else if (this->dataType == DataType::INT8) {
+            int8_t *dst = (int8_t*)GetPagedData(o, pos);
+            float *scales = GetPagedScales(o, pos);
+            for (int r = 0; r < len; r++) {
+                const float *cur = data + (uint64_t)r * inner;
+                float maxValue = 0;
+                for (int i = 0; i < inner; i++) {
+                    maxValue = std::max(maxValue, fabsf(cur[i]));
+                }
+                float scale = maxValue / 127.0f, invScale = maxValue > 0 ? 127.0f / maxValue : 0.0f;
+                for (int i = 0; i < inner; i++) {
+                    dst[(uint64_t)r * inner + i] = (int8_t)roundf(cur[i] * invScale);
+                }
+                scales[r] = scale;
+            }
+        } else {
+            ErrorInFastLLM("SetPagedRows error: unsupport data type.\n");
+        }
+    }
+
+    void Data::GetPagedRows(int o, int pos, int len, float *data) const {
+        int inner = this->dims[2];
+        uint64_t n = (uint64_t)len * inner;
+        if (this->dataType == DataType::FLOAT32) {
+            memcpy(data, GetPagedData(o, pos), n * sizeof(float));
+        } else if (this->dataType == DataType::FLOAT16) {
+            const uint16_t *src = (uint16_t*)GetPagedData(o, pos);
+            uint64_t i = 0;
+#ifdef __F16C__
+            for (; i + 7 < n; i += 8) {
+                _mm256_storeu_ps(data + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+            }
+#endif
+            for (; i < n; i++) {
+                data[i] = half_to_float(src[i]);
+            }
+        } else if (this->dataType == DataType::INT8) {
+            const int8_t *src = (int8_t*)GetPagedData(o, pos);
+            const float *scales = GetPagedScales(o, pos);
+            for (int r = 0; r < len; r++) {
+                const int8_t *cur = src + (uint64_t)r * inner;
+                float *dst = data + (uint64_t)r * inner;
+                int i = 0;
+#ifdef __AVX2__
+                __m256 vScale = _mm256_set1_ps(scales[r]);
+                for (; i + 7 < inner; i += 8) {
+                    __m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(cur + i)));
+                    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), vScale));
+                }
+#endif
+                for (; i < inner; i++) {
+                    dst[i] = cur[i] * scales[r];
+                }
+            }
+        } else {
+            ErrorInFastLLM("GetPagedRows error: unsupport data type.\n");
+        }
     }
 
     Tokenizer::Tokenizer() {
-        root = new TrieNode();
+        Clear();
     }
 
     Tokenizer::~Tokenizer() {
-        Clear();
-        delete root;
     }
 
     void Tokenizer::Clear() {
-        std::vector <TrieNode*> q;
-        q.push_back(root);
-        for (int i = 0; i < q.size(); i++) {
-            TrieNode *now = q[i];
-            for (auto it : now->next) {
-                q.push_back(it.second);
-            }
-        }
-        root = new TrieNode();
+        base.assign(1, 0);
+        check.assign(1, 0);
+        tokenIds.assign(1, -999999);
+        dirty = false;
         tokenToStringDict.clear();
+        stringToTokenDict.clear();
+        decodeStrings.clear();
+        mergeRanks.clear();
+        for (int i = 0; i < 256; i++) {
+            byteTokens[i] = -1;
+        }
+        std::lock_guard <std::mutex> guard(bpeCacheLocker);
+        bpeCacheList.clear();
+        bpeCacheDict.clear();
     }
 
     void Tokenizer::Insert(const std::string &s, int tokenId) {
-        TrieNode *now = this->root;
-        for (int i = 0; i < s.size(); i++) {
-            if (now->next.find(s[i]) == now->next.end()) {
-                now->next[s[i]] = new TrieNode();
-            }
-            now = now->next[s[i]];
-        }
-        now->tokenId = tokenId;
+        stringToTokenDict[s] = tokenId;
         tokenToStringDict[tokenId] = s;
+        dirty = true;
     }
 
-    Data Tokenizer::Encode(const std::string &s) {
-        std::vector <float> v;
-        for (int i = 0; i < s.size(); i++) {
-            int tokenId = -999999, pos = i - 1;
-            TrieNode *now = this->root;
-            for (int j = i; j < s.size(); j++) {
-                if (now->next.find(s[j]) != now->next.end()) {
-                    now = now->next[s[j]];
-                    if (now->tokenId != -999999) {
-                        tokenId = now->tokenId;
-                        pos = j;
-                    }
-                } else {
+    void Tokenizer::Build() {
+        // 按字节序排好, 每个状态对应一段公共前缀相同的token, 它的子节点按字节从小到大排列
+        std::vector <std::pair <std::string, int> > keys(stringToTokenDict.begin(), stringToTokenDict.end());
+        std::sort(keys.begin(), keys.end());
+
+        int size = 1024;
+        base.assign(size, 0);
+        check.assign(size, -1);
+        tokenIds.assign(size, -999999);
+        check[0] = 0;
+        // nextFree[p]指向p之后(包括p)的第一个空闲位置, 按并查集的方式压缩路径, 找空位时跳过已经占用的位置
+        std::vector <int> nextFree(size + 1);
+        for (int i = 0; i <= size; i++) {
+            nextFree[i] = i;
+        }
+        nextFree[0] = 1;
+        auto grow = [&](int need) {
+            if (need >= size) {
+                int old = size;
+                size = std::max(need + 1, size * 2);
+                base.resize(size, 0);
+                check.resize(size, -1);
+                tokenIds.resize(size, -999999);
+                nextFree.resize(size + 1);
+                for (int i = old + 1; i <= size; i++) {
+                    nextFree[i] = i;
+                }
+            }
+        };
+        auto findFree = [&](int pos) {
+            int root = pos;
+            while (nextFree[root] != root) {
+                root = nextFree[root];
+            }
+            while (nextFree[pos] != root) {
+                int next = nextFree[pos];
+                nextFree[pos] = root;
+                pos = next;
+            }
+            return root;
+        };
+
+        struct TrieRange {
+            int state, st, end, depth; // 状态state对应keys[st, end), 前depth个字节相同
+        };
+        std::vector <TrieRange> q;
+        q.push_back(TrieRange {0, 0, (int)keys.size(), 0});
+        std::vector <std::pair <int, int> > children; // (字节 + 1, 子节点在keys中的起点)
+        int maxState = 0, scanStart = 1;
+        for (int qi = 0; qi < q.size(); qi++) {
+            TrieRange cur = q[qi];
+            int st = cur.st;
+            if (st < cur.end && keys[st].first.size() == cur.depth) {
+                tokenIds[cur.state] = keys[st].second;
+                st++;
+            }
+            children.clear();
+            for (int i = st; i < cur.end; i++) {
+                int c = (uint8_t)keys[i].first[cur.depth] + 1;
+                if (children.empty() || children.back().first != c) {
+                    children.push_back(std::make_pair(c, i));
+                }
+            }
+            if (children.empty()) {
+                continue;
+            }
+
+            // 第一个子节点依次尝试每个空位, 直到所有子节点的位置都空闲
+            // 多个子节点时尝试了很多次才放下, 说明前面只剩零散的空位, 之后的多子节点从放下的位置开始找, 零散的空位留给单个子节点
+            int first = children[0].first, b, tried = 0;
+            for (int pos = findFree(std::max(first + 1, children.size() > 1 ? scanStart : 1)); ; pos = findFree(pos + 1)) {
+                grow(pos + 257);
+                b = pos - first;
+                bool ok = true;
+                for (int i = 1; i < children.size() && ok; i++) {
+                    ok = (check[b + children[i].first] == -1);
+                }
+                if (ok) {
                     break;
                 }
+                tried++;
             }
-            if (pos >= i) {
-                i = pos;
-                v.push_back(tokenId);
-                //printf("%d ", tokenId);
+            if (tried >= 16) {
+                scanStart = std::max(scanStart, b + first);
+            }
+
+            base[cur.state] = b;
+            for (int i = 0; i < children.size(); i++) {
+                int t = b + children[i].first;
+                check[t] = cur.state;
+                nextFree[t] = t + 1;
+                maxState = std::max(maxState, t);
+                int end = (i + 1 < children.size() ? children[i + 1].second : cur.end);
+                q.push_back(TrieRange {t, children[i].second, end, cur.depth + 1});
             }
         }
-        //printf("\n");
 
-        return Data (DataType::FLOAT32, {1, (int)v.size()}, v);
-    }
+        // 转移时会检查t < check.size(), 末尾没用到的位置可以去掉
+        base.resize(maxState + 1);
+        check.resize(maxState + 1);
+        tokenIds.resize(maxState + 1);
+        base.shrink_to_fit();
+        check.shrink_to_fit();
+        tokenIds.shrink_to_fit();
 
-    std::string Tokenizer::Decode(const Data &data) {
-        std::string ret = "";
-        for (int i = 0; i < data.Count(0); i++) {
-            std::string &s = tokenToStringDict[(int) ((float *) data.cpuData)[i]];
+        // 和Decode单个token的结果一致
+        std::string blank = "";
+        blank += 226, blank += 150, blank += 129;
+        int maxTokenId = -1;
+        for (auto &it : tokenToStringDict) {
+            maxTokenId = std::max(maxTokenId, it.first);
+        }
+        decodeStrings.assign(maxTokenId + 1, "");
+        for (auto &it : tokenToStringDict) {
+            if (it.first < 0) {
+                continue;
+            }
+            const std::string &s = it.second;
+            std::string &ret = decodeStrings[it.first];
             if (s == "<n>") {
-                ret += "\n";
+                ret = "\n";
             } else if (s == "<|tab|>") {
-                s = "\t";
+                ret = "\t";
+            } else if (s.size() > 10 && s.compare(0, 8, "<|blank_") == 0) {
+                ret = std::string(atoi(s.substr(8, s.size() - 10).c_str()), ' ');
+            } else if (s.size() == 6 && s.compare(0, 3, "<0x") == 0 && s.back() == '>') {
+                ret = std::string(1, (char)strtol(s.substr(3, 2).c_str(), nullptr, 16));
             } else {
-                ret += s;
+                for (int i = 0; i < s.size(); i++) {
+                    if (s.compare(i, blank.size(), blank) == 0) {
+                        ret += ' ';
+                        i += blank.size() - 1;
+                    } else {
+                        ret += s[i];
+                    }
+                }
             }
         }
 
-        std::string blank = "";
-        blank += 226, blank += 150, blank += 129;
-        while (true) {
-            std::string::size_type pos(0);
-            if ((pos = ret.find(blank)) != std::string::npos)
-                ret.replace(pos, blank.length(), " ");
-            else break;
+        // SentencePiece的byte fallback: 词表中的<0x00> ~ <0xFF>
+        for (int i = 0; i < 256; i++) {
+            char name[8];
+            sprintf(name, "<0x%02X>", i);
+            auto it = stringToTokenDict.find(name);
+            byteTokens[i] = (it == stringToTokenDict.end() ? -1 : it->second);
         }
-	    int pos = ret.find("<|blank_");
-	    if (pos != -1) {
-		    int space_num = atoi(ret.substr(8, ret.size() - 10).c_str());
-		    return std::string(space_num, ' ');
-	    }
-        if (ret.size() == 6 && ret.substr(0, 3) == "<0x" && ret.back() == '>') {
-            int c = 0;
-            for (int i = 3; i < 5; i++) {
-                c *= 16;
-                if (ret[i] >= '0' && ret[i] <= '9') {
-                    c += (ret[i] - '0');
-                } else {
-                    c += (ret[i] - 'A' + 10);
+        {
+            std::lock_guard <std::mutex> guard(bpeCacheLocker);
+            bpeCacheList.clear();
+            bpeCacheDict.clear();
+        }
+        dirty = false;
+    }
+
+    void Tokenizer::SetConfig(const std::map <std::string, std::string> &dicts) {
+        auto it = dicts.find("tokenizer_type");
+        if (it != dicts.end()) {
+            if (it->second == "bpe") {
+                type = TOKENIZER_BPE;
+            } else if (it->second == "greedy") {
+                type = TOKENIZER_GREEDY;
+            } else {
+                ErrorInFastLLM("Tokenizer error: unknown tokenizer_type " + it->second + ".\n");
+            }
+        }
+        it = dicts.find("tokenizer_add_dummy_prefix");
+        if (it != dicts.end()) {
+            addDummyPrefix = (atoi(it->second.c_str()) != 0);
+        }
+        it = dicts.find("tokenizer_merge_ranks");
+        if (it != dicts.end()) {
+            mergeRanks.clear();
+            const char *cur = it->second.c_str();
+            while (true) {
+                char *end;
+                long rank = strtol(cur, &end, 10);
+                if (end == cur) {
+                    break;
                 }
+                mergeRanks.push_back((int)rank);
+                cur = end;
             }
-
-            ret = " ";
-            ret[0] = c;
         }
-        return ret;
     }
 
-    void WeightMap::LoadFromFile(const std::string &fileName) {
-        FileBuffer buffer(fileName);
-        this->versionId = buffer.ReadInt();
-
-        if (this->versionId == 1) {
-            // versionId = 1, 前置了一个key-value表
-            int keyValueLen = buffer.ReadInt();
-            for (int i = 0; i < keyValueLen; i++) {
-                std::string key = buffer.ReadString();
-                std::string value = buffer.ReadString();
-                //printf("%s %s\n", key.c_str(), value.c_str());
-                this->dicts[key] = value;
+    int Tokenizer::GetTokenId(const char *s, int len) {
+        const int *base = this->base.data(), *check = this->check.data();
+        int size = this->check.size(), now = 0;
+        for (int i = 0; i < len; i++) {
+            int t = base[now] + (uint8_t)s[i] + 1;
+            if (t >= size || check[t] != now) {
+                return -999999;
+            }
+            now = t;
+        }
+        return tokenIds[now];
+    }
+
+    void Tokenizer::EncodeBPEWord(const char *word, int len, std::vector <int> &tokens) {
+        struct Symbol {
+            int st, len, prev, next; // len = 0代表已经合并到左边的片段中
+        };
+        struct MergePair {
+            int rank, left, len; // 合并symbols[left]和它右边的片段, 合并后长度为len
+            bool operator < (const MergePair &b) const {
+                return rank > b.rank || (rank == b.rank && left > b.left); // 优先级相同时先合并左边的
+            }
+        };
+        if (len == 0) {
+            return;
+        }
+        std::vector <Symbol> symbols;
+        for (int i = 0; i < len; ) {
+            // 初始按UTF-8字符切分
+            uint8_t c = word[i];
+            int charLen = (c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1);
+            charLen = std::min(charLen, len - i);
+            symbols.push_back(Symbol {i, charLen, (int)symbols.size() - 1, (int)symbols.size() + 1});
+            i += charLen;
+        }
+        symbols.back().next = -1;
+
+        std::priority_queue <MergePair> heap;
+        auto tryPush = [&](int left) {
+            if (left < 0 || symbols[left].next < 0) {
+                return;
+            }
+            int mergeLen = symbols[left].len + symbols[symbols[left].next].len;
+            int tokenId = GetTokenId(word + symbols[left].st, mergeLen);
+            if (tokenId == -999999) {
+                return;
+            }
+            int rank = tokenId;
+            if (!mergeRanks.empty()) {
+                rank = (tokenId >= 0 && tokenId < mergeRanks.size()) ? mergeRanks[tokenId] : -1;
+            }
+            if (rank >= 0) {
+                heap.push(MergePair {rank, left, mergeLen});
+            }
+        };
+        for (int i = 0; i + 1 < symbols.size(); i++) {
+            tryPush(i);
+        }
+        while (!heap.empty()) {
+            MergePair top = heap.top();
+            heap.pop();
+            // 片段只会变长, 左边的片段还在并且和右边的长度和不变, 说明这个合并仍然有效
+            Symbol &left = symbols[top.left];
+            if (left.len == 0 || left.next < 0 || left.len + symbols[left.next].len != top.len) {
+                continue;
+            }
+            Symbol &right = symbols[left.next];
+            left.len = top.len;
+            left.next = right.next;
+            right.len = 0;
+            if (left.next >= 0) {
+                symbols[left.next].prev = top.left;
+            }
+            tryPush(left.prev);
+            tryPush(top.left);
+        }
+
+        for (int i = 0; i >= 0; i = symbols[i].next) {
+            int tokenId = GetTokenId(word + symbols[i].st, symbols[i].len);
+            if (tokenId != -999999) {
+                tokens.push_back(tokenId);
+                continue;
+            }
+            // 不在词表中的片段拆成字节, 没有对应的字节token时丢弃, 和贪心编码的行为一致
+            for (int j = 0; j < symbols[i].len; j++) {
+                int byteToken = byteTokens[(uint8_t)word[symbols[i].st + j]];
+                if (byteToken != -1) {
+                    tokens.push_back(byteToken);
+                }
+            }
+        }
+    }
+
+    void Tokenizer::BuildIfDirty() {
+        if (dirty) {
+            std::lock_guard <std::mutex> guard(locker);
+            if (dirty) {
+                Build();
+            }
+        }
+    }
+
+    std::vector <int> Tokenizer::EncodeBPE(const std::string &s) {
+        BuildIfDirty();
+        std::string blank = "";
+        blank += 226, blank += 150, blank += 129;
+        std::string text = (addDummyPrefix && !s.empty()) ? blank : "";
+        text.reserve(text.size() + s.size() * 2);
+        for (char c : s) {
+            if (c == ' ') {
+                text += blank;
+            } else {
+                text += c;
+            }
+        }
+
+        std::vector <int> tokens;
+        std::string word;
+        for (int st = 0; st < text.size(); ) {
+            // 每个"▁"开始一个新的词, 词之间不合并
+            int end = st + 1;
+            while (end < text.size() && text.compare(end, blank.size(), blank) != 0) {
+                end++;
+            }
+            if (bpeCacheLimit <= 0) {
+                EncodeBPEWord(text.data() + st, end - st, tokens);
+                st = end;
+                continue;
+            }
+
+            word.assign(text, st, end - st);
+            st = end;
+            {
+                std::lock_guard <std::mutex> guard(bpeCacheLocker);
+                auto it = bpeCacheDict.find(word);
+                if (it != bpeCacheDict.end()) {
+                    bpeCacheList.splice(bpeCacheList.begin(), bpeCacheList, it->second);
+                    tokens.insert(tokens.end(), it->second->second.begin(), it->second->second.end());
+                    continue;
+                }
+            }
+            int old = tokens.size();
+            EncodeBPEWord(word.data(), word.size(), tokens);
+            std::lock_guard <std::mutex> guard(bpeCacheLocker);
+            if (bpeCacheDict.find(word) == bpeCacheDict.end()) {
+                bpeCacheList.emplace_front(word, std::vector <int> (tokens.begin() + old, tokens.end()));
+                bpeCacheDict[word] = bpeCacheList.begin();
+                while (bpeCacheList.size() > bpeCacheLimit) {
+                    bpeCacheDict.erase(bpeCacheList.back().first);
+                    bpeCacheList.pop_back();
+                }
+            }
+        }
+        return tokens;
+    }
+
+    Data Tokenizer::Encode(const std::string &s) {
+        if (type == TOKENIZER_BPE) {
+            std::vector <int> tokens = EncodeBPE(s);
+            return Data (DataType::FLOAT32, {1, (int)tokens.size()}, std::vector <float> (tokens.begin(), tokens.end()));
+        }
+        BuildIfDirty();
+        const int *base = this->base.data(), *check = this->check.data(), *tokenIds = this->tokenIds.data();
+        int size = this->check.size(), len = s.size();
+        std::vector <float> v;
+        for (int i = 0; i < len; i++) {
+            int tokenId = -999999, pos = i - 1, now = 0;
+            for (int j = i; j < len; j++) {
+                int t = base[now] + (uint8_t)s[j] + 1;
+                if (t >= size || check[t] != now) {
+                    break;
+                }
+                now = t;
+                if (tokenIds[now] != -999999) {
+                    tokenId = tokenIds[now];
+                    pos = j;
+                }
+            }
+            if (pos >= i) {
+                i = pos;
+                v.push_back(tokenId);
+            }
+        }
+
+        return Data (DataType::FLOAT32, {1, (int)v.size()}, v);
+    }
+
+    std::string Tokenizer::Decode(const Data &data) {
+        std::string ret = "";
+        for (int i = 0; i < data.Count(0); i++) {
+            std::string &s = tokenToStringDict[(int) ((float *) data.cpuData)[i]];
+            if (s == "<n>") {
+                ret += "\n";
+            } else if (s == "<|tab|>") {
+                s = "\t";
+            } else {
+                ret += s;
+            }
+        }
+
+        std::string blank = "";
+        blank += 226, blank += 150, blank += 129;
+        while (true) {
+            std::string::size_type pos(0);
+            if ((pos = ret.find(blank)) != std::string::npos)
+                ret.replace(pos, blank.length(), " ");
+            else break;
+        }
+	    int pos = ret.find("<|blank_");
+	    if (pos != -1) {
+		    int space_num = atoi(ret.substr(8, ret.size() - 10).c_str());
+		    return std::string(space_num, ' ');
+	    }
+        if (ret.size() == 6 && ret.substr(0, 3) == "<0x" && ret.back() == '>') {
+            int c = 0;
+            for (int i = 3; i < 5; i++) {
+                c *= 16;
+                if (ret[i] >= '0' && ret[i] <= '9') {
+                    c += (ret[i] - '0');
+                } else {
+                    c += (ret[i] - 'A' + 10);
+                }
+            }
+
+            ret = " ";
+            ret[0] = c;
+        }
+        return ret;
+    }
+
+    const std::string &Tokenizer::GetDecodeString(int tokenId) {
+        static const std::string empty = "";
+        BuildIfDirty();
+        return (tokenId >= 0 && tokenId < decodeStrings.size()) ? decodeStrings[tokenId] : empty;
+    }
+
+    // s中完整的UTF-8字符的长度: 只有末尾的字符可能不完整, 非法的字节直接输出
+    static int CompleteUtf8Length(const std::string &s) {
+        int n = s.size();
+        for (int i = n - 1; i >= 0 && i >= n - 4; i--) {
+            uint8_t c = s[i];
+            if ((c & 0xC0) == 0x80) {
+                continue;
+            }
+            int charLen = (c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1);
+            return i + charLen <= n ? n : i;
+        }
+        return n;
+    }
+
+    DecodeStream::DecodeStream(Tokenizer *tokenizer) {
+        this->tokenizer = tokenizer;
+    }
+
+    void DecodeStream::Reset() {
+        pending.clear();
+        current.clear();
+    }
+
+    const std::string &DecodeStream::Put(int tokenId) {
+        pending += tokenizer->GetDecodeString(tokenId);
+        int len = CompleteUtf8Length(pending);
+        current.assign(pending, 0, len);
+        pending.erase(0, len);
+        return current;
+    }
+
+    const std::string &DecodeStream::Flush() {
+        current.swap(pending);
+        pending.clear();
+        return current;
+    }
+
+    FileMmap::FileMmap(const std::string &fileName) {
+#if defined(_WIN32) or defined(_WIN64)
+        HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = NULL;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        }
+        if (mapping == NULL) {
+            CloseHandle(file);
+            return;
+        }
+        void *addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        if (addr == NULL) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return;
+        }
+        this->fileHandle = file;
+        this->mapHandle = mapping;
+        this->data = (uint8_t*)addr;
+        this->size = fileSize.QuadPart;
+#else
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            // MAP_PRIVATE: 只读的页和page cache共享, 个别权重被原地修改时写时复制, 不会改到文件
+            void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                this->data = (uint8_t*)addr;
+                this->size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    FileMmap::~FileMmap() {
+        if (this->data == nullptr) {
+            return;
+        }
+#if defined(_WIN32) or defined(_WIN64)
+        UnmapViewOfFile(this->data);
+        CloseHandle((HANDLE)this->mapHandle);
+        CloseHandle((HANDLE)this->fileHandle);
+#else
+        munmap(this->data, this->size);
+#endif
+    }
+
+    WeightMap::~WeightMap() {
+        ReleaseMmap();
+    }
+
+    void WeightMap::ReleaseMmap() {
+        // 先让权重和映射解除关系，再释放映射
+        for (auto &it : this->weight) {
+            if (it.second.isExternalData) {
+                it.second.cpuData = nullptr;
+                it.second.isExternalData = false;
+            }
+        }
+        this->fileMmap.reset();
+    }
+
+    // v2格式中一个权重的索引项
+    struct FlmTensorIndex {
+        std::string name;
+        std::vector <int> dims;
+        DataType dataType = DataType::FLOAT32;
+        int perChannelAxis = -1; // 量化参数, 只对INT8, INT4, INT4_GROUP有效
+        int groupSize = -1; // 分组大小, 只对INT4_GROUP有效
+        bool repacked = false; // int4权重已经重排成kernel的格式, 只在versionId >= 3时存储
+        std::vector <float> mins, maxs; // INT4_GROUP时按[行, 组]存储
+        uint64_t offset = 0, bytes = 0; // 数据在文件中的位置和字节数
+    };
+
+    static const int flmDataAlign = 64; // v2格式中每个权重的数据都按这个字节数对齐
+    static const uint64_t flmLoadChunkBytes = 64 << 20; // 加载时大的权重按这个字节数切开, 分给多个线程读取
+
+    // 用线程池执行func(0), ..., func(cnt - 1); 任务大小不一, 每个线程依次领取下一个任务
+    // 任务中的错误在调用线程中重新抛出
+    static void ParallelForEachTask(int cnt, const std::function <void(int)> &func) {
+        std::atomic <int> next(0);
+        std::mutex locker;
+        std::exception_ptr error = nullptr;
+        GetCpuThreadPool()->ParallelFor(0, GetCpuThreadPool()->GetThreads(), [&](int st, int end) {
+            for (int i = next++; i < cnt; i = next++) {
+                try {
+                    func(i);
+                } catch (...) {
+                    std::lock_guard <std::mutex> guard(locker);
+                    if (error == nullptr) {
+                        error = std::current_exception();
+                    }
+                    next = cnt;
+                }
+            }
+        });
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    static void ReadTensorIndex(FileBuffer &buffer, FlmTensorIndex &index, int versionId) {
+        index.name = buffer.ReadString();
+        int dimsSize = buffer.ReadInt();
+        index.dims.resize(dimsSize);
+        for (int j = 0; j < dimsSize; j++) {
+            index.dims[j] = buffer.ReadInt();
+        }
+        index.dataType = (DataType)buffer.ReadInt();
+        index.perChannelAxis = buffer.ReadInt();
+        if (index.dataType == DataType::INT4_GROUP) {
+            index.groupSize = buffer.ReadInt();
+        }
+        if (versionId >= 3) {
+            index.repacked = buffer.ReadInt();
+        }
+        int k = buffer.ReadInt();
+        index.mins.resize(k);
+        index.maxs.resize(k);
+        for (int j = 0; j < k; j++) {
+            index.mins[j] = buffer.ReadFloat();
+            index.maxs[j] = buffer.ReadFloat();
+        }
+        index.offset = buffer.ReadUInt64();
+        index.bytes = buffer.ReadUInt64();
+    }
+
+    static void WriteTensorIndex(FileWriter &buffer, const FlmTensorIndex &index, int versionId) {
+        buffer.WriteString(index.name);
+        buffer.WriteInt((int)index.dims.size());
+        for (int i : index.dims) {
+            buffer.WriteInt(i);
+        }
+        buffer.WriteInt((int)index.dataType);
+        buffer.WriteInt(index.perChannelAxis);
+        if (index.dataType == DataType::INT4_GROUP) {
+            buffer.WriteInt(index.groupSize);
+        }
+        if (versionId >= 3) {
+            buffer.WriteInt((int)index.repacked);
+        }
+        buffer.WriteInt((int)index.mins.size());
+        for (int j = 0; j < index.mins.size(); j++) {
+            buffer.WriteFloat(index.mins[j]);
+            buffer.WriteFloat(index.maxs[j]);
+        }
+        buffer.WriteUInt64(index.offset);
+        buffer.WriteUInt64(index.bytes);
+    }
+
+    // 写入文件头: versionId, key-value表, 词表
+    static void WriteModelHeader(FileWriter &buffer, int versionId, const std::map <std::string, std::string> &dicts,
+                                 const Tokenizer &tokenizer) {
+        buffer.WriteInt(versionId);
+        buffer.WriteInt((int)dicts.size());
+        for (auto &it : dicts) {
+            buffer.WriteString(it.first);
+            buffer.WriteString(it.second);
+        }
+
+        // 写入词表
+        buffer.WriteInt((int)tokenizer.tokenToStringDict.size());
+        for (auto &it : tokenizer.tokenToStringDict) {
+            buffer.WriteInt((int)it.second.size());
+            for (int i = 0; i < it.second.size(); i++) {
+                buffer.WriteInt((int)it.second[i]);
+            }
+            buffer.WriteInt(it.first);
+        }
+    }
+
+    // 文件的大小和修改时间, 用来判断重排缓存是否过期; 文件不存在时返回空串
+    static std::string GetFileSignature(const std::string &fileName) {
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0) {
+            return "";
+        }
+        return std::to_string((long long)st.st_size) + "_" + std::to_string((long long)st.st_mtime);
+    }
+
+    static const char *repackSourceKey = "repack_source"; // 重排缓存的key-value表中记录原模型文件的签名
+
+    // 读取重排缓存中记录的原模型文件签名, 不是有效的缓存时返回空串
+    static std::string ReadRepackCacheSource(const std::string &cacheName) {
+        if (GetFileSignature(cacheName) == "") {
+            return "";
+        }
+        FileBuffer buffer(cacheName);
+        if (buffer.f == nullptr || buffer.ReadInt() != 3) {
+            return "";
+        }
+        std::string source = "";
+        int keyValueLen = buffer.ReadInt();
+        for (int i = 0; i < keyValueLen; i++) {
+            std::string key = buffer.ReadString();
+            std::string value = buffer.ReadString();
+            if (key == repackSourceKey) {
+                source = value;
+            }
+        }
+        return source;
+    }
+
+    // 读取文件头中versionId之后的key-value表和词表
+    static void ReadModelHeader(FileBuffer &buffer, int versionId, std::map <std::string, std::string> &dicts,
+                                Tokenizer &tokenizer) {
+        if (versionId >= 1) {
+            // versionId >= 1, 前置了一个key-value表
+            int keyValueLen = buffer.ReadInt();
+            for (int i = 0; i < keyValueLen; i++) {
+                std::string key = buffer.ReadString();
+                std::string value = buffer.ReadString();
+                //printf("%s %s\n", key.c_str(), value.c_str());
+                dicts[key] = value;
             }
         }
 
@@ -695,197 +1726,642 @@ namespace fastllm {
             int id = buffer.ReadInt();
             tokenizer.Insert(x, id);
         }
+        tokenizer.SetConfig(dicts);
+        tokenizer.Build();
+    }
 
+    // 读出全部权重的索引; versionId = 0 / 1时每个权重的信息和数据依次存放, 读索引时跳过数据
+    static std::vector <FlmTensorIndex> ReadTensorIndexs(FileBuffer &buffer, int versionId) {
         int len = buffer.ReadInt();
+        std::vector <FlmTensorIndex> indexs;
+        indexs.resize(len);
         for (int i = 0; i < len; i++) {
-            std::string name = buffer.ReadString();
-            //printf("%s\n", name.c_str());
+            FlmTensorIndex &index = indexs[i];
+            if (versionId >= 2) {
+                ReadTensorIndex(buffer, index, versionId);
+                continue;
+            }
+            index.name = buffer.ReadString();
             int dimsSize = buffer.ReadInt();
-            //printf("size = %d\n", dimsSize);
-            std::vector <int> dims;
             for (int j = 0; j < dimsSize; j++) {
-                int x = buffer.ReadInt();
-                dims.push_back(x);
-                //printf("%d\n", x);
+                index.dims.push_back(buffer.ReadInt());
             }
-            DataType dataType = (DataType)buffer.ReadInt();
-            weight[name] = Data(dataType, dims);
+            index.dataType = (DataType)buffer.ReadInt();
+            if (index.dataType == DataType::INT8 || index.dataType == DataType::INT4) {
+                index.perChannelAxis = buffer.ReadInt();
+                int k = index.perChannelAxis == -1 ? 1 : index.dims[index.perChannelAxis];
+                index.mins.resize(k);
+                index.maxs.resize(k);
+                for (int j = 0; j < k; j++) {
+                    index.mins[j] = buffer.ReadFloat();
+                    index.maxs[j] = buffer.ReadFloat();
+                }
+            }
+            index.offset = buffer.Tell();
+            index.bytes = Data(index.dataType, index.dims).GetBytes();
+            buffer.Seek(index.offset + index.bytes);
+        }
+        return indexs;
+    }
 
-            if (lowMemMode && this->embeddingNames.find(name) != this->embeddingNames.end()) {
-	            if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
-	            	weight[name].fileName = fileName;
-#if defined(_WIN32) or defined(_WIN64)
-	            	weight[name].filePos = _ftelli64(buffer.f);
-#else
-                    weight[name].filePos = ftell(buffer.f);
-#endif
-	            	fseek(buffer.f, weight[name].GetBytes(), SEEK_CUR);
-	            } else {
-	            	ErrorInFastLLM("Error: embedding's type should be float32 or bfloat16.\n");
-	            }
+    void WeightMap::LoadFromFile(const std::string &fileName) {
+        auto st = std::chrono::system_clock::now();
+        this->loadStats = WeightLoadStats();
+        this->loadStats.threads = GetCpuThreadPool()->GetThreads();
+        LoadFromFileOrCache(fileName);
+        this->loadStats.totalTime = GetSpan(st, std::chrono::system_clock::now());
+        PrintLoadStats();
+    }
+
+    void WeightMap::LoadFromFileOrCache(const std::string &fileName) {
+        if (!weightRepack) {
+            ReadFromFile(fileName);
+            return;
+        }
+        std::string cacheName = fileName + ".repack";
+        std::string source = GetFileSignature(fileName);
+        if (weightRepackCache && source != "" && ReadRepackCacheSource(cacheName) == source) {
+            ReadFromFile(cacheName);
+            this->dicts.erase(repackSourceKey);
+            RepackWeightsTimed(); // 缓存中的权重已经重排过, 这里只是保证其它int4权重也重排
+            return;
+        }
+        ReadFromFile(fileName);
+        RepackWeightsTimed();
+        if (weightRepackCache && source != "") {
+            // 先写到临时文件再改名，写到一半退出时不会留下不完整的缓存
+            std::string tempName = cacheName + ".tmp";
+            FILE *test = fopen(tempName.c_str(), "wb");
+            if (test == nullptr) {
+                printf("Warning: can't write repack cache %s.\n", cacheName.c_str());
+                return;
+            }
+            fclose(test);
+            this->dicts[repackSourceKey] = source;
+            SaveModel(tempName);
+            this->dicts.erase(repackSourceKey);
+            remove(cacheName.c_str());
+            if (rename(tempName.c_str(), cacheName.c_str()) != 0) {
+                printf("Warning: can't write repack cache %s.\n", cacheName.c_str());
+                remove(tempName.c_str());
+            }
+        }
+    }
+
+    void WeightMap::RepackWeightsTimed() {
+        auto st = std::chrono::system_clock::now();
+        RepackWeights();
+        this->loadStats.decodeTime += GetSpan(st, std::chrono::system_clock::now());
+    }
+
+    void WeightMap::PrintLoadStats() {
+        const WeightLoadStats &stats = this->loadStats;
+        printf("Load %d weights, %.2f MB in %.3f s (index %.3f s, meta %.3f s, io %.3f s, %.2f MB/s, decode %.3f s, %d threads)\n",
+               stats.weights, stats.bytes / 1024.0 / 1024.0, stats.totalTime, stats.indexTime, stats.metaTime,
+               stats.ioTime, stats.ioTime > 0 ? stats.bytes / 1024.0 / 1024.0 / stats.ioTime : 0.0,
+               stats.decodeTime, stats.threads);
+        fflush(stdout);
+    }
+
+    void WeightMap::ReadFromFile(const std::string &fileName) {
+        auto indexStart = std::chrono::system_clock::now();
+        FileBuffer buffer(fileName);
+        AssertInFastLLM(buffer.f != nullptr, "Load error: can't open " + fileName + ".\n");
+        this->versionId = buffer.ReadInt();
+        AssertInFastLLM(this->versionId >= 0 && this->versionId <= 3,
+                        "Load error: unsupport model file version " + std::to_string(this->versionId) + ".\n");
+
+        // 上一次加载的权重可能还指向旧的映射, 释放映射前先解除关系, 这些权重会被这次加载的数据覆盖
+        ReleaseMmap();
+        if (mmapMode) {
+            this->fileMmap.reset(new FileMmap(fileName));
+            if (this->fileMmap->data == nullptr) {
+                printf("Warning: mmap %s failed, load weights by reading the file.\n", fileName.c_str());
+                this->fileMmap.reset();
+            }
+        }
+
+        ReadModelHeader(buffer, this->versionId, this->dicts, this->tokenizer);
+        std::vector <FlmTensorIndex> indexs = ReadTensorIndexs(buffer, this->versionId);
+        int len = indexs.size();
+        auto metaStart = std::chrono::system_clock::now();
+        this->loadStats.indexTime += GetSpan(indexStart, metaStart);
+
+        // 创建权重, std::map的插入只能串行
+        std::vector <Data*> datas;
+        std::set <std::string> names;
+        for (auto &index : indexs) {
+            AssertInFastLLM(names.insert(index.name).second, "Load error: " + index.name + " is duplicated.\n");
+            weight[index.name] = Data(index.dataType, index.dims);
+            datas.push_back(&weight[index.name]);
+        }
+
+        // 解析量化参数并分配空间, 多个权重并行处理; needRead记录需要从文件读取数据的权重
+        std::vector <char> needRead(len, 0);
+        ParallelForEachTask(len, [&](int id) {
+            const FlmTensorIndex &index = indexs[id];
+            const std::string &name = index.name;
+            DataType dataType = index.dataType;
+            Data &data = *datas[id];
+            AssertInFastLLM(index.bytes == data.GetBytes(), "Load error: " + name + "'s size mismatch.\n");
+            AssertInFastLLM(!index.repacked || dataType == DataType::INT4 || dataType == DataType::INT4_GROUP,
+                            "Load error: " + name + " has wrong layout.\n");
+            if (dataType == DataType::INT8 || dataType == DataType::INT4) {
+                int bit = (dataType == DataType::INT4 ? 4 : 8);
+                int k = index.mins.size();
+                data.perChannelAxis = index.perChannelAxis;
+                data.perChannelsConfigs.resize(k);
+                data.zeros.resize(k);
+                data.scales.resize(k);
+                for (int i = 0; i < k; i++) {
+                    data.perChannelsConfigs[i] = LowBitConfig(index.mins[i], index.maxs[i], bit);
+                    data.zeros[i] = data.perChannelsConfigs[i].zeroPoint;
+                    data.scales[i] = data.perChannelsConfigs[i].scale;
+                }
+            } else if (dataType == DataType::INT4_GROUP) {
+                AssertInFastLLM(index.dims.size() == 2 && index.groupSize > 0 && index.groupSize % 32 == 0,
+                                "Load error: " + name + " has wrong group config.\n");
+                int k = index.dims[0], m = index.dims[1];
+                data.perChannelAxis = index.perChannelAxis;
+                data.groupSize = index.groupSize;
+                data.groupCnt = (m - 1) / data.groupSize + 1;
+                AssertInFastLLM(index.mins.size() == (uint64_t)k * data.groupCnt,
+                                "Load error: " + name + "'s group count mismatch.\n");
+                data.perChannelsConfigs.resize(index.mins.size());
+                data.zeros.resize(index.mins.size());
+                data.scales.resize(index.mins.size());
+                for (int i = 0; i < index.mins.size(); i++) {
+                    data.perChannelsConfigs[i] = LowBitConfig(index.mins[i], index.maxs[i], 4);
+                    data.zeros[i] = data.perChannelsConfigs[i].zeroPoint;
+                    data.scales[i] = data.perChannelsConfigs[i].scale;
+                }
+            } else if (dataType != DataType::FLOAT32 && dataType != DataType::BFLOAT16 && dataType != DataType::FLOAT16) {
+                ErrorInFastLLM("Load error: " + name + " has unsupport dataType.\n");
+            }
+
+            if (lowMemMode && this->fileMmap == nullptr &&
+                this->embeddingNames.find(name) != this->embeddingNames.end()) {
+                if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
+                    data.fileName = fileName;
+                    data.filePos = index.offset;
+                } else {
+                    ErrorInFastLLM("Error: embedding's type should be float32 or bfloat16.\n");
+                }
+            } else if (this->fileMmap != nullptr) {
+                // mmap模式下直接指向映射好的文件
+                AssertInFastLLM(index.offset + index.bytes <= this->fileMmap->size, "Load error: model file is truncated.\n");
+                data.SetExternalData(this->fileMmap->data + index.offset);
             } else {
-	            weight[name].Allocate();
-	            if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
-		            buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
-	            } else if (dataType == DataType::INT8 || dataType == DataType::INT4) {
-		            int bit = (dataType == DataType::INT4 ? 4 : 8);
-		            weight[name].perChannelAxis = buffer.ReadInt();
-		            int k = weight[name].perChannelAxis == -1 ? 1 : dims[weight[name].perChannelAxis];
-		            weight[name].perChannelsConfigs.resize(k);
-		            weight[name].zeros.resize(k);
-		            weight[name].scales.resize(k);
-		            for (int i = 0; i < k; i++) {
-			            float minValue = buffer.ReadFloat();
-			            float maxValue = buffer.ReadFloat();
-			            weight[name].perChannelsConfigs[i] = LowBitConfig(minValue, maxValue, bit);
-			            weight[name].zeros[i] = weight[name].perChannelsConfigs[i].zeroPoint;
-			            weight[name].scales[i] = weight[name].perChannelsConfigs[i].scale;
-		            }
-		            buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
-	            }
+                data.Allocate();
+                needRead[id] = 1;
             }
+            data.isRepacked = index.repacked;
+        });
+        auto ioStart = std::chrono::system_clock::now();
+        this->loadStats.metaTime += GetSpan(metaStart, ioStart);
 
-            printf("Load (%d / %d) \r", (i + 1), len);
-            fflush(stdout);
+        // 读取数据: 大的权重切成多段, 每段由一个线程用自己的文件句柄读取
+        std::vector <std::pair <int, uint64_t> > chunks; // (权重编号, 段的起始位置)
+        for (int i = 0; i < len; i++) {
+            if (needRead[i]) {
+                for (uint64_t st = 0; st < indexs[i].bytes; st += flmLoadChunkBytes) {
+                    chunks.push_back(std::make_pair(i, st));
+                }
+                this->loadStats.bytes += indexs[i].bytes;
+            }
         }
-        printf("\n");
-        fflush(stdout);
-        return;
+        ParallelForEachTask(chunks.size(), [&](int id) {
+            const FlmTensorIndex &index = indexs[chunks[id].first];
+            uint64_t st = chunks[id].second;
+            uint64_t bytes = std::min(flmLoadChunkBytes, index.bytes - st);
+            FileBuffer file(fileName);
+            AssertInFastLLM(file.f != nullptr, "Load error: can't open " + fileName + ".\n");
+            file.Seek(index.offset + st);
+            file.ReadBytes(datas[chunks[id].first]->cpuData + st, bytes);
+        });
+        auto decodeStart = std::chrono::system_clock::now();
+        this->loadStats.ioTime += GetSpan(ioStart, decodeStart);
+        this->loadStats.weights += len;
+
+        // 量化权重的weightSum在这里一次算好，否则第一次Linear时才计算，第一个请求会慢很多
+        CalcWeightSums();
+        this->loadStats.decodeTime += GetSpan(decodeStart, std::chrono::system_clock::now());
     }
 
-    void WeightMap::SaveLowBitModel(const std::string &fileName, int bit) {
+    static void AssertLowBitArgs(const std::string &fileName, int bit, int groupSize) {
         AssertInFastLLM(fileName != "", "Error: output's name shouldn't be empty.\n");
         AssertInFastLLM(bit == 4 || bit == 8 || bit == 16, "Error: only support 16 bit or 8 bit or 4 bit model.\n");
-        FileWriter buffer(fileName);
-        buffer.WriteInt(this->versionId);
-        if (this->versionId == 1) {
-            // versionId = 1, 前置了一个key-value表
-            buffer.WriteInt((int)dicts.size());
-            for (auto &it : dicts) {
-                buffer.WriteString(it.first);
-                buffer.WriteString(it.second);
+        AssertInFastLLM(groupSize <= 0 || (bit == 4 && groupSize % 32 == 0),
+                        "Error: group quantization only support 4 bit model and groupSize should be a multiple of 32.\n");
+    }
+
+    // 把k行m列的权重按行量化, 每行再按groupLen个数分组(groupLen >= m时每行一组), 多行并行处理
+    // configs按[行, 组]存储; int4时第(i * m + j)个数的位置和整个权重一起编号, 偶数位置存在高4位
+    static void QuantizeLowBit(const float *f, uint8_t *u8, LowBitConfig *configs, int k, int m, int bit, int groupLen) {
+        int groupCnt = (m - 1) / groupLen + 1;
+        // 每个线程分到的行从偶数行开始, m为奇数时int4的同一个字节不会被两个线程同时改写
+        GetCpuThreadPool()->ParallelFor(0, (k + 1) / 2, [=](int pairSt, int pairEnd) {
+            int st = pairSt * 2, end = std::min(k, pairEnd * 2);
+            for (int i = st; i < end; i++) {
+                for (int g = 0; g < groupCnt; g++) {
+                    int gst = g * groupLen, gend = std::min(m, gst + groupLen);
+                    LowBitConfig &config = configs[(uint64_t)i * groupCnt + g];
+                    const float *row = f + (uint64_t)i * m;
+                    float minValue = 1e9, maxValue = -1e9;
+                    for (int j = gst; j < gend; j++) {
+                        minValue = std::min(minValue, row[j]);
+                        maxValue = std::max(maxValue, row[j]);
+                    }
+                    if (bit == 8) {
+                        config = LowBitConfig(minValue, maxValue, 8);
+                        for (int j = gst; j < gend; j++) {
+                            u8[(uint64_t)i * m + j] = config.quantization(row[j]);
+                        }
+                    } else {
+                        config = LowBitConfig(minValue, maxValue, 4);
+                        for (int j = gst; j < gend; j++) {
+                            uint64_t id = ((uint64_t)i * m + j) / 2;
+                            uint8_t value = config.quantization(row[j]);
+                            if (((uint64_t)i * m + j) % 2) {
+                                u8[id] = (u8[id] & 0xF0) | value;
+                            } else {
+                                u8[id] = (u8[id] & 0xF) | (value << 4);
+                            }
+                        }
+                    }
+                }
             }
-        }
+        });
+    }
 
-        // 写入词表
-        buffer.WriteInt((int)tokenizer.tokenToStringDict.size());
-        for (auto &it : tokenizer.tokenToStringDict) {
-            buffer.WriteInt((int)it.second.size());
-            for (int i = 0; i < it.second.size(); i++) {
-                buffer.WriteInt((int)it.second[i]);
+    // 量化模型中一个权重的索引项, 位置和量化参数留空
+    static FlmTensorIndex MakeLowBitIndex(const std::string &name, const std::vector <int> &dims, WeightType weightType,
+                                          int bit, int groupSize) {
+        FlmTensorIndex index;
+        index.name = name;
+        index.dims = dims;
+        if (weightType == WeightType::NONE) {
+            index.dataType = DataType::FLOAT32;
+        } else if (weightType == WeightType::EMBEDDING) {
+            index.dataType = DataType::BFLOAT16;
+        } else if (weightType == WeightType::LINEAR) {
+            index.dataType = (bit == 16 ? DataType::FLOAT16 : (bit == 8 ? DataType::INT8 : DataType::INT4));
+            if (bit != 16) {
+                index.perChannelAxis = 0; // 按通道0分通道量化
+                int groupCnt = 1;
+                if (groupSize > 0) {
+                    index.dataType = DataType::INT4_GROUP;
+                    index.groupSize = groupSize;
+                    groupCnt = (index.dims[1] - 1) / groupSize + 1;
+                }
+                index.mins.resize((uint64_t)index.dims[0] * groupCnt);
+                index.maxs.resize((uint64_t)index.dims[0] * groupCnt);
             }
-            buffer.WriteInt(it.first);
+        }
+        return index;
+    }
+
+    void WeightMap::SaveLowBitModel(const std::string &fileName, int bit, int groupSize) {
+        AssertLowBitArgs(fileName, bit, groupSize);
+        FileWriter buffer(fileName);
+        WriteModelHeader(buffer, 2, dicts, tokenizer); // 统一存储成versionId = 2的格式
+
+        // 先确定每个权重的存储格式，写入占位的索引，数据写完后再回填位置和量化参数
+        std::vector <FlmTensorIndex> indexs;
+        for (auto &it : weight) {
+            indexs.push_back(MakeLowBitIndex(it.first, it.second.dims, it.second.weightType, bit, groupSize));
+        }
+        buffer.WriteInt((int)indexs.size());
+        uint64_t indexPos = buffer.Tell();
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 2);
         }
 
         // 写入权重
-        buffer.WriteInt((int)weight.size());
+        int tensorId = 0;
         for (auto &it : weight) {
-            buffer.WriteString(it.first);
+            FlmTensorIndex &index = indexs[tensorId++];
             Data &data = it.second;
-            buffer.WriteInt((int)data.dims.size());
-            for (int i : data.dims) {
-                buffer.WriteInt(i);
-            }
             data.ToDevice(DataDevice::CPU);
+            buffer.Align(flmDataAlign);
+            index.offset = buffer.Tell();
 
             if (data.weightType == WeightType::NONE) {
                 // 普通权重，直接写入浮点数据
-                buffer.WriteInt((int)DataType::FLOAT32);
+                index.bytes = data.GetBytes();
                 buffer.WriteBytes(data.cpuData, data.GetBytes());
             } else if (data.weightType == WeightType::EMBEDDING) {
                 // Embedding权重，存储成BF16
-                buffer.WriteInt((int)DataType::BFLOAT16);
                 int len = data.Count(0);
                 std::vector <uint16_t> uDatas;
                 uDatas.resize(len);
                 for (int i = 0; i < len; i++) {
                     uDatas[i] = ((uint16_t *)data.cpuData)[i * 2 + 1];
                 }
+                index.bytes = len * sizeof(uint16_t);
                 buffer.WriteBytes((uint8_t*)uDatas.data(), len * sizeof(uint16_t));
             } else if (data.weightType == WeightType::LINEAR) {
                 if (bit == 16) {
                     // fp16, 直接转换
-                    buffer.WriteInt((int)DataType::FLOAT16);
                     int len = data.Count(0);
                     std::vector <uint16_t> uDatas;
                     uDatas.resize(len);
                     for (int i = 0; i < len; i++) {
                         uDatas[i] = float_to_half(((float *)data.cpuData)[i]);
                     }
+                    index.bytes = len * sizeof(uint16_t);
                     buffer.WriteBytes((uint8_t*)uDatas.data(), len * sizeof(uint16_t));
                 } else {
-                    // Linear层权重，分通道量化之
+                    // Linear层权重，分通道量化之; 分组量化时每个通道再按groupSize个数分组
                     int k = data.dims[0], m = data.dims[1];
-                    int threadNum = 8;
-                    int per = k / threadNum;
-                    int cur = 0;
-                    std::vector<std::thread *> threads;
+                    int groupLen = (index.dataType == DataType::INT4_GROUP ? groupSize : m);
+                    int groupCnt = (m - 1) / groupLen + 1;
                     std::vector<LowBitConfig> configs;
                     std::vector<uint8_t> uDatas;
-                    configs.resize(k);
+                    configs.resize((uint64_t)k * groupCnt);
 
-                    int bytes = k * m;
+                    uint64_t bytes = (uint64_t)k * m;
                     if (bit == 4) {
-                        bytes = (k * m + 1) / 2;
+                        bytes = ((uint64_t)k * m + 1) / 2;
                     }
                     uDatas.resize(bytes);
-                    for (int i = 0; i < threadNum; i++) {
-                        int end = cur + per;
-                        if (i == threadNum - 1) {
-                            end = k;
-                        }
-                        threads.push_back(new std::thread([&bit](int st, int end, int m,
-                                                                 float *f, uint8_t *u8, LowBitConfig *configs) {
-                            for (int i = st; i < end; i++) {
-                                float minValue = 1e9, maxValue = -1e9;
-                                for (int j = 0; j < m; j++) {
-                                    minValue = std::min(minValue, f[i * m + j]);
-                                    maxValue = std::max(maxValue, f[i * m + j]);
-                                }
-                                if (bit == 8) {
-                                    configs[i] = LowBitConfig(minValue, maxValue, 8);
-                                    for (int j = 0; j < m; j++) {
-                                        u8[i * m + j] = configs[i].quantization(f[i * m + j]);
-                                    }
-                                } else {
-                                    configs[i] = LowBitConfig(minValue, maxValue, 4);
-                                    for (int j = 0; j < m; j++) {
-                                        int id = (i * m + j) / 2;
-                                        uint8_t value = configs[i].quantization(f[i * m + j]);
-                                        if ((i * m + j) % 2) {
-                                            u8[id] = (u8[id] & 0xF0) | value;
-                                        } else {
-                                            u8[id] = (u8[id] & 0xF) | (value << 4);
-                                        }
-                                    }
-                                }
-                            }
-                        }, cur, end, m, (float *) data.cpuData, uDatas.data(), configs.data()));
-                        cur = end;
-                    }
-                    for (int i = 0; i < threadNum; i++) {
-                        threads[i]->join();
-                        delete threads[i];
-                    }
+                    QuantizeLowBit((float *) data.cpuData, uDatas.data(), configs.data(), k, m, bit, groupLen);
 
-                    buffer.WriteInt(bit == 8 ? (int) DataType::INT8 : (int) DataType::INT4);
-                    buffer.WriteInt(0); // 按通道0分通道量化
-                    for (int i = 0; i < k; i++) {
-                        buffer.WriteFloat(configs[i].min);
-                        buffer.WriteFloat(configs[i].max);
+                    for (int i = 0; i < configs.size(); i++) {
+                        index.mins[i] = configs[i].min;
+                        index.maxs[i] = configs[i].max;
                     }
+                    index.bytes = bytes;
                     buffer.WriteBytes(uDatas.data(), bytes);
                 }
             }
         }
 
+        // 回填索引
+        buffer.Seek(indexPos);
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 2);
+        }
         return;
     }
 
+    // 流式量化时按名字判断权重的类型: embeddingNames中的是Embedding, 其它2维的".weight"是Linear
+    static WeightType GuessWeightType(const FlmTensorIndex &index, const std::set <std::string> &embeddingNames) {
+        const std::string suffix = ".weight";
+        if (embeddingNames.find(index.name) != embeddingNames.end()) {
+            return WeightType::EMBEDDING;
+        }
+        if (index.dims.size() == 2 && index.name.size() >= suffix.size() &&
+            index.name.compare(index.name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return WeightType::LINEAR;
+        }
+        return WeightType::NONE;
+    }
+
+    // 把len个dataType类型的浮点数转换成float32
+    static void ToFloat32(const uint8_t *src, DataType dataType, float *dst, uint64_t len) {
+        if (dataType == DataType::FLOAT32) {
+            memcpy(dst, src, len * sizeof(float));
+        } else if (dataType == DataType::FLOAT16) {
+            for (uint64_t i = 0; i < len; i++) {
+                dst[i] = half_to_float(((uint16_t *) src)[i]);
+            }
+        } else {
+            for (uint64_t i = 0; i < len; i++) {
+                uint32_t v = (uint32_t)((uint16_t *) src)[i] << 16;
+                memcpy(dst + i, &v, sizeof(float));
+            }
+        }
+    }
+
+    void WeightMap::SaveLowBitModelFromFile(const std::string &inputName, const std::string &fileName, int bit, int groupSize) {
+        AssertLowBitArgs(fileName, bit, groupSize);
+        auto st = std::chrono::system_clock::now();
+        double readTime = 0, quantTime = 0, writeTime = 0;
+        uint64_t inputBytes = 0, outputBytes = 0;
+
+        FileBuffer input(inputName);
+        AssertInFastLLM(input.f != nullptr, "Quant error: can't open " + inputName + ".\n");
+        int inputVersion = input.ReadInt();
+        AssertInFastLLM(inputVersion >= 0 && inputVersion <= 3,
+                        "Quant error: unsupport model file version " + std::to_string(inputVersion) + ".\n");
+        ReadModelHeader(input, inputVersion, this->dicts, this->tokenizer);
+        this->dicts.erase(repackSourceKey);
+        std::vector <FlmTensorIndex> inputIndexs = ReadTensorIndexs(input, inputVersion);
+
+        std::vector <FlmTensorIndex> indexs;
+        std::vector <WeightType> weightTypes;
+        for (auto &inputIndex : inputIndexs) {
+            weightTypes.push_back(GuessWeightType(inputIndex, this->embeddingNames));
+            indexs.push_back(MakeLowBitIndex(inputIndex.name, inputIndex.dims, weightTypes.back(), bit, groupSize));
+            if (weightTypes.back() == WeightType::NONE) {
+                indexs.back().dataType = inputIndex.dataType; // 其它权重原样复制
+                indexs.back().perChannelAxis = inputIndex.perChannelAxis;
+                indexs.back().groupSize = inputIndex.groupSize;
+                indexs.back().mins = inputIndex.mins;
+                indexs.back().maxs = inputIndex.maxs;
+            } else {
+                AssertInFastLLM(inputIndex.dataType == DataType::FLOAT32 || inputIndex.dataType == DataType::FLOAT16 ||
+                                inputIndex.dataType == DataType::BFLOAT16,
+                                "Quant error: " + inputIndex.name + " should be float32, float16 or bfloat16.\n");
+            }
+        }
+
+        FileWriter buffer(fileName);
+        AssertInFastLLM(buffer.f != nullptr, "Quant error: can't open " + fileName + ".\n");
+        WriteModelHeader(buffer, 2, dicts, tokenizer);
+        buffer.WriteInt((int)indexs.size());
+        uint64_t indexPos = buffer.Tell();
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 2);
+        }
+
+        // 每次读入不超过flmLoadChunkBytes的一段数据, 处理完写出后复用缓冲区
+        std::vector <uint8_t> raw, output;
+        std::vector <float> floats;
+        std::vector <LowBitConfig> configs;
+        for (int t = 0; t < (int)indexs.size(); t++) {
+            const FlmTensorIndex &inputIndex = inputIndexs[t];
+            FlmTensorIndex &index = indexs[t];
+            buffer.Align(flmDataAlign);
+            index.offset = buffer.Tell();
+            index.bytes = 0;
+            inputBytes += inputIndex.bytes;
+            printf("Quant (%d / %d) %s\r", t + 1, (int)indexs.size(), index.name.c_str());
+            fflush(stdout);
+
+            if (weightTypes[t] == WeightType::NONE) {
+                for (uint64_t pos = 0; pos < inputIndex.bytes; pos += flmLoadChunkBytes) {
+                    uint64_t bytes = std::min(flmLoadChunkBytes, inputIndex.bytes - pos);
+                    auto readStart = std::chrono::system_clock::now();
+                    raw.resize(bytes);
+                    input.Seek(inputIndex.offset + pos);
+                    input.ReadBytes(raw.data(), bytes);
+                    auto writeStart = std::chrono::system_clock::now();
+                    buffer.WriteBytes(raw.data(), bytes);
+                    readTime += GetSpan(readStart, writeStart);
+                    writeTime += GetSpan(writeStart, std::chrono::system_clock::now());
+                    index.bytes += bytes;
+                }
+                continue;
+            }
+
+            // Embedding和Linear权重按行切段, 每段的行数为偶数, int4的一个字节不会跨段
+            int k = index.dims[0], m = index.dims[1];
+            int unitSize = (inputIndex.dataType == DataType::FLOAT32 ? 4 : 2);
+            int rows = std::max(2, (int)(flmLoadChunkBytes / ((uint64_t)m * sizeof(float))) / 2 * 2);
+            int groupLen = (index.dataType == DataType::INT4_GROUP ? groupSize : m);
+            int groupCnt = (m - 1) / groupLen + 1;
+            if (index.dataType == DataType::INT8 || index.dataType == DataType::INT4 || index.dataType == DataType::INT4_GROUP) {
+                configs.resize((uint64_t)k * groupCnt);
+            }
+            for (int row = 0; row < k; row += rows) {
+                int cnt = std::min(rows, k - row);
+                uint64_t len = (uint64_t)cnt * m;
+                auto readStart = std::chrono::system_clock::now();
+                raw.resize(len * unitSize);
+                floats.resize(len);
+                input.Seek(inputIndex.offset + (uint64_t)row * m * unitSize);
+                input.ReadBytes(raw.data(), len * unitSize);
+                auto quantStart = std::chrono::system_clock::now();
+                ToFloat32(raw.data(), inputIndex.dataType, floats.data(), len);
+
+                uint64_t bytes;
+                if (index.dataType == DataType::BFLOAT16 || index.dataType == DataType::FLOAT16) {
+                    // Embedding存储成BF16, bit = 16时Linear存储成FP16
+                    bytes = len * sizeof(uint16_t);
+                    output.resize(bytes);
+                    uint16_t *u16 = (uint16_t *) output.data();
+                    for (uint64_t i = 0; i < len; i++) {
+                        u16[i] = (index.dataType == DataType::BFLOAT16 ? ((uint16_t *) floats.data())[i * 2 + 1]
+                                                                       : float_to_half(floats[i]));
+                    }
+                } else {
+                    bytes = (bit == 4 ? (len + 1) / 2 : len);
+                    output.assign(bytes, 0);
+                    QuantizeLowBit(floats.data(), output.data(), configs.data() + (uint64_t)row * groupCnt,
+                                   cnt, m, bit, groupLen);
+                }
+                auto writeStart = std::chrono::system_clock::now();
+                buffer.WriteBytes(output.data(), bytes);
+                readTime += GetSpan(readStart, quantStart);
+                quantTime += GetSpan(quantStart, writeStart);
+                writeTime += GetSpan(writeStart, std::chrono::system_clock::now());
+                index.bytes += bytes;
+            }
+            for (int i = 0; i < (int)configs.size() && i < (int)index.mins.size(); i++) {
+                index.mins[i] = configs[i].min;
+                index.maxs[i] = configs[i].max;
+            }
+            configs.clear();
+        }
+        outputBytes = buffer.Tell();
+
+        // 回填索引
+        buffer.Seek(indexPos);
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 2);
+        }
+        double totalTime = GetSpan(st, std::chrono::system_clock::now());
+        printf("\nQuant %d weights, %.2f MB -> %.2f MB in %.3f s, %.2f MB/s (read %.3f s, quant %.3f s, write %.3f s, %d threads)\n",
+               (int)indexs.size(), inputBytes / 1024.0 / 1024.0, outputBytes / 1024.0 / 1024.0, totalTime,
+               totalTime > 0 ? inputBytes / 1024.0 / 1024.0 / totalTime : 0.0, readTime, quantTime, writeTime,
+               GetCpuThreadPool()->GetThreads());
+        fflush(stdout);
+    }
+
+    // 对每个权重并行执行func
+    static void ParallelForEachWeight(std::map <std::string, Data> &weight, const std::function <void(Data &)> &func) {
+        std::vector <Data*> datas;
+        for (auto &it : weight) {
+            datas.push_back(&it.second);
+        }
+        ParallelForEachTask(datas.size(), [&](int id) {
+            func(*datas[id]);
+        });
+    }
+
+    void WeightMap::RepackWeights() {
+        ParallelForEachWeight(weight, [](Data &data) {
+            data.RepackWeight();
+        });
+    }
+
+    void WeightMap::CalcWeightSums() {
+        ParallelForEachWeight(weight, [](Data &data) {
+            if ((data.dataType == DataType::INT8 || data.dataType == DataType::INT4 || data.dataType == DataType::INT4_GROUP) &&
+                data.dims.size() == 2 && data.cpuData != nullptr && data.dataDevice == DataDevice::CPU) {
+                data.CalcWeightSum();
+            }
+        });
+    }
+
+    void WeightMap::SaveModel(const std::string &fileName) {
+        AssertInFastLLM(fileName != "", "Error: output's name shouldn't be empty.\n");
+        FileWriter buffer(fileName);
+        AssertInFastLLM(buffer.f != nullptr, "Error: can't open " + fileName + ".\n");
+        WriteModelHeader(buffer, 3, dicts, tokenizer);
+
+        std::vector <FlmTensorIndex> indexs;
+        for (auto &it : weight) {
+            Data &data = it.second;
+            FlmTensorIndex index;
+            index.name = it.first;
+            index.dims = data.dims;
+            index.dataType = data.dataType;
+            index.repacked = data.isRepacked;
+            if (data.dataType == DataType::INT8 || data.dataType == DataType::INT4 || data.dataType == DataType::INT4_GROUP) {
+                index.perChannelAxis = data.perChannelAxis;
+                index.groupSize = data.groupSize;
+                for (auto &config : data.perChannelsConfigs) {
+                    index.mins.push_back(config.min);
+                    index.maxs.push_back(config.max);
+                }
+            }
+            indexs.push_back(index);
+        }
+        buffer.WriteInt((int)indexs.size());
+        uint64_t indexPos = buffer.Tell();
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 3);
+        }
+
+        int tensorId = 0;
+        for (auto &it : weight) {
+            FlmTensorIndex &index = indexs[tensorId++];
+            Data &data = it.second;
+            data.ToDevice(DataDevice::CPU);
+            buffer.Align(flmDataAlign);
+            index.offset = buffer.Tell();
+            index.bytes = data.GetBytes();
+            if (data.cpuData != nullptr) {
+                buffer.WriteBytes(data.cpuData, index.bytes);
+            } else {
+                // lowMemMode下没有读入内存的embedding, 从原文件中复制
+                std::vector <uint8_t> bytes(index.bytes);
+                FileBuffer source(data.fileName);
+                source.Seek(data.filePos);
+                source.ReadBytes(bytes.data(), index.bytes);
+                buffer.WriteBytes(bytes.data(), index.bytes);
+            }
+        }
+
+        // 回填索引
+        buffer.Seek(indexPos);
+        for (auto &index : indexs) {
+            WriteTensorIndex(buffer, index, 3);
+        }
+    }
+
     Data &WeightMap::operator[](const std::string &key) {
         return weight[key];
     }
 
+    Data *WeightMap::FindWeight(const std::string &key) {
+        auto it = weight.find(key);
+        return it == weight.end() ? &emptyWeight : &it->second;
+    }
+
     void TokenPenaltyManager::Init(int vocabSize, int lastN, float value) {
         this->vocabSize = vocabSize;
         this->lastN = lastN;
@@ -902,6 +2378,9 @@ namespace fastllm {
     }
 
     void TokenPenaltyManager::InsertToken(int token) {
+        if (token < 0 || token >= vocabSize) {
+            return; // 词表外的token(模型输出维度可能比tokenizer大)不计入惩罚
+        }
         if (q.size() >= this->lastN) {
             int now = q.front();
             if ((--cnt[now]) == 0) {
@@ -917,109 +2396,291 @@ namespace fastllm {
         }
     }
 
+    void TopKSelect(const float *data, int len, int k, std::vector <std::pair <float, int> > &result) {
+        k = std::min(k, len);
+        result.clear();
+        if (k <= 0) {
+            return;
+        }
+        // 小顶堆, 堆顶是当前第k大的值
+        auto cmp = [](const std::pair <float, int> &a, const std::pair <float, int> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        };
+        for (int i = 0; i < k; i++) {
+            result.push_back(std::make_pair(data[i], i));
+        }
+        std::make_heap(result.begin(), result.end(), cmp);
+        float threshold = result[0].first;
+        int i = k;
+#ifdef __AVX__
+        __m256 vt = _mm256_set1_ps(threshold);
+        for (; i + 7 < len; i += 8) {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(data + i), vt, _CMP_GT_OQ));
+            if (mask == 0) {
+                continue;
+            }
+            for (int j = 0; j < 8; j++) {
+                if (((mask >> j) & 1) && data[i + j] > threshold) {
+                    std::pop_heap(result.begin(), result.end(), cmp);
+                    result.back() = std::make_pair(data[i + j], i + j);
+                    std::push_heap(result.begin(), result.end(), cmp);
+                    threshold = result[0].first;
+                }
+            }
+            vt = _mm256_set1_ps(threshold);
+        }
+#endif
+        for (; i < len; i++) {
+            if (data[i] > threshold) {
+                std::pop_heap(result.begin(), result.end(), cmp);
+                result.back() = std::make_pair(data[i], i);
+                std::push_heap(result.begin(), result.end(), cmp);
+                threshold = result[0].first;
+            }
+        }
+        std::sort_heap(result.begin(), result.end(), cmp);
+    }
+
+    void LLMSampler::Init(int topK, float topP, float temperature, uint32_t seed) {
+        this->topK = topK;
+        this->topP = topP;
+        this->temperature = temperature;
+        this->rng.seed(seed);
+    }
+
+    bool LLMSampler::IsGreedy() const {
+        return topK == 1 || temperature <= 0.0f;
+    }
+
+    int LLMSampler::Sample(const float *logits, int vocabSize) {
+        if (IsGreedy()) {
+            TopKSelect(logits, vocabSize, 1, candidates);
+            return candidates[0].second;
+        }
+        float invTemp = 1.0f / temperature;
+        std::uniform_real_distribution <double> dis(0.0, 1.0);
+        double fullSum = 0.0; // 不做top_k时, top_p按整个词表的概率和计算, 而不是过滤后剩下的候选的概率和
+        if (topK > 0 && topK < vocabSize) {
+            // 一遍扫描取出topK个候选
+            TopKSelect(logits, vocabSize, topK, candidates);
+        } else {
+            float maxValue = *std::max_element(logits, logits + vocabSize);
+            double sum = 0.0;
+            for (int i = 0; i < vocabSize; i++) {
+                sum += exp((logits[i] - maxValue) * invTemp);
+            }
+            if (topP >= 1.0f) {
+                // 在整个词表上按概率取, 不需要排序
+                double r = dis(rng) * sum;
+                for (int i = 0; i < vocabSize; i++) {
+                    r -= exp((logits[i] - maxValue) * invTemp);
+                    if (r <= 0.0) {
+                        return i;
+                    }
+                }
+                return (int)(std::max_element(logits, logits + vocabSize) - logits);
+            }
+            // 概率小于(1 - topP) / vocabSize的token加起来不到1 - topP, 一定不在top_p的集合中, 先过滤掉再排序
+            fullSum = sum;
+            float minValue = maxValue + temperature * (float)log((1.0 - topP) / vocabSize * sum);
+            candidates.clear();
+            for (int i = 0; i < vocabSize; i++) {
+                if (logits[i] >= minValue) {
+                    candidates.push_back(std::make_pair(logits[i], i));
+                }
+            }
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const std::pair <float, int> &a, const std::pair <float, int> &b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            });
+        }
+
+        // candidates从大到小排列, 做softmax和top_p截断
+        int n = candidates.size();
+        std::vector <double> probs = std::vector <double> (n);
+        double sum = 0.0;
+        for (int i = 0; i < n; i++) {
+            probs[i] = exp((candidates[i].first - candidates[0].first) * invTemp);
+            sum += probs[i];
+        }
+        if (topP < 1.0f) {
+            // 最大值没有被过滤, probs和fullSum都按同一个最大值归一化
+            double total = (fullSum > 0.0 ? fullSum : sum);
+            double cur = 0.0;
+            for (int i = 0; i < n; i++) {
+                cur += probs[i];
+                if (cur >= topP * total) {
+                    n = i + 1;
+                    sum = cur;
+                    break;
+                }
+            }
+        }
+        double r = dis(rng) * sum;
+        for (int i = 0; i < n; i++) {
+            r -= probs[i];
+            if (r <= 0.0) {
+                return candidates[i].second;
+            }
+        }
+        return candidates[n - 1].second;
+    }
+
+    int LLMSampling(LLMSampler *sampler, const float *logits, int vocabSize) {
+        if (sampler == nullptr) {
+            std::vector <std::pair <float, int> > result;
+            TopKSelect(logits, vocabSize, 1, result);
+            return result[0].second;
+        }
+        return sampler->Sample(logits, vocabSize);
+    }
+
+    bool NeedSampling(const std::vector <LLMSampler*> &samplers) {
+        for (LLMSampler *sampler : samplers) {
+            if (sampler != nullptr && !sampler->IsGreedy()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void Embedding(const Data &input, Data &weight, Data &output) {
-        curExecutor->Run("Embedding", {
+        curExecutor->Run(OP_EMBEDDING, {
                 {"input", (Data*)&input}, {"weight", &weight}, {"output", &output}
         }, {}, {});
     }
 
     void RMSNorm(const Data &input, const Data &weight, float eps, Data &output) {
-        curExecutor->Run("RMSNorm", {
+        curExecutor->Run(OP_RMSNORM, {
                 {"input", (Data*)&input}, {"weight", (Data*)&weight}, {"output", &output}
         }, {{"eps", eps}}, {});
     }
 
     void LayerNorm(Data &input, Data &gamma, Data &beta, int axis, Data &output) {
-        curExecutor->Run("LayerNorm", {
+        curExecutor->Run(OP_LAYERNORM, {
             {"input", &input}, {"gamma", &gamma}, {"beta", &beta}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
     void Linear(Data &input, Data &weight, const Data &bias, Data &output) {
-        curExecutor->Run("Linear", {
+        curExecutor->Run(OP_LINEAR, {
                 {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"output", &output}
         }, {}, {});
     }
 
     void Split(const Data &input, int axis, int start, int end, Data &output) {
-        curExecutor->Run("Split", {
+        curExecutor->Run(OP_SPLIT, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"axis", axis}, {"start", start}, {"end", end}});
     }
 
     void Cat(const Data &input0, const Data &input1, int axis, Data &output) {
-        curExecutor->Run("Cat", {
+        curExecutor->Run(OP_CAT, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
     void CatDirect(Data &input0, const Data &input1, int axis) {
-        curExecutor->Run("CatDirect", {
+        curExecutor->Run(OP_CATDIRECT, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}
         }, {}, {{"axis", axis}});
     }
 
     void MatMul(const Data &input0, const Data &input1, Data &output, float alpha) {
-        curExecutor->Run("MatMul", {
+        curExecutor->Run(OP_MATMUL, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
         }, {{"alpha", alpha}}, {});
     }
 
     void MatMulTransB(const Data &input0, const Data &input1, Data &output, float alpha) {
-        curExecutor->Run("MatMulTransB", {
+        curExecutor->Run(OP_MATMUL_TRANSB, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
         }, {{"alpha", alpha}}, {});
     }
 
     void Softmax(const Data &input, Data &output, int axis) {
-        curExecutor->Run("SoftMax", {
+        curExecutor->Run(OP_SOFTMAX, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
     void Silu(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("Silu", {
+        curExecutor->Run(OP_SILU, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void GeluNew(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("GeluNew", {
+        curExecutor->Run(OP_GELUNEW, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void Mul(const fastllm::Data &input, float v, fastllm::Data &output) {
-        curExecutor->Run("Mul", {
+        curExecutor->Run(OP_MUL, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {{"v", v}}, {});
     }
 
     void MulTo(Data &input0, const Data &input1) {
-        curExecutor->Run("MulTo", {
+        curExecutor->Run(OP_MULTO, {
                 {"input0", &input0}, {"input1", (Data*)&input1}
         }, {}, {});
     }
 
     void AddTo(Data &input0, const Data &input1, float alpha) {
-        curExecutor->Run("AddTo", {
+        curExecutor->Run(OP_ADDTO, {
                 {"input0", &input0}, {"input1", (Data*)&input1}
         }, {{"alpha", alpha}}, {});
     }
 
     void AttentionMask(Data &input, const Data &mask, float maskValue) {
-        curExecutor->Run("AttentionMask", {
+        curExecutor->Run(OP_ATTENTIONMASK, {
                 {"input", &input}, {"mask", (Data*)&mask}
         }, {{"maskValue", maskValue}}, {});
     }
 
+    void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
+                   float scale, float maskValue, bool causal) {
+        if (k.dataDevice != DataDevice::CPU) {
+            // KV cache不在内存中时拆成几个算子计算，避免把KV cache拷回内存
+            int batch = q.dims[0], qLen = q.dims[1], kvLen = k.dims[1];
+            Data attnProbs, causalMask;
+            const Data *curMask = &mask;
+            if (mask.dims.size() == 0 && causal && qLen > 1) {
+                std::vector <float> vmask = std::vector <float> ((uint64_t)qLen * kvLen, 0);
+                for (int i = 0; i < qLen; i++) {
+                    for (int j = kvLen - qLen + i + 1; j < kvLen; j++) {
+                        vmask[(uint64_t)i * kvLen + j] = 1;
+                    }
+                }
+                causalMask.CopyFrom(Data(DataType::FLOAT32, {qLen, kvLen}, vmask));
+                curMask = &causalMask;
+                maskValue = -FLT_MAX;
+            }
+            MatMulTransB(q, k, attnProbs, scale);
+            if (curMask->dims.size() > 0) {
+                int maskBatch = curMask->Count(0) / ((uint64_t)qLen * kvLen);
+                attnProbs.Reshape({maskBatch, batch / maskBatch, qLen, kvLen});
+                AttentionMask(attnProbs, *curMask, maskValue);
+                attnProbs.Reshape({batch, qLen, kvLen});
+            }
+            Softmax(attnProbs, attnProbs, -1);
+            MatMul(attnProbs, v, output);
+            return;
+        }
+        curExecutor->Run(OP_ATTENTION, {
+                {"q", (Data*)&q}, {"k", (Data*)&k}, {"v", (Data*)&v}, {"mask", (Data*)&mask}, {"output", &output}
+        }, {{"scale", scale}, {"maskValue", maskValue}}, {{"causal", (int)causal}});
+    }
+
     void Permute(const Data &input, const std::vector<int> &axis, Data &output) {
         Data axisData = Data(DataType::INT32PARAM, {(int)axis.size()});
         axisData.Allocate();
         for (int i = 0; i < axisData.Count(0); i++) {
             ((int32_t*)axisData.cpuData)[i] = axis[i];
         }
-        curExecutor->Run("Permute", {
+        curExecutor->Run(OP_PERMUTE, {
                 {"input", (Data*)&input}, {"axis", &axisData}, {"output", (Data*)&output}
         }, {}, {});
     }
@@ -1030,25 +2691,25 @@ namespace fastllm {
         for (int i = 0; i < axisData.Count(0); i++) {
             ((int32_t*)axisData.cpuData)[i] = axis[i];
         }
-        curExecutor->Run("PermuteSelf", {
+        curExecutor->Run(OP_PERMUTESELF, {
                 {"input", (Data*)&input}, {"axis", &axisData}
         }, {}, {});
     }
 
     void TopK(const Data &input, Data &output, int topk) {
-        curExecutor->Run("TopK", {
+        curExecutor->Run(OP_TOPK, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"topk", topk}});
     };
 
     void RotatePosition2D(Data &input, const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim) {
-        curExecutor->Run("RotatePosition2D", {
+        curExecutor->Run(OP_ROTATEPOSITION2D, {
                 {"input", &input}, {"positionIds", (Data*)&positionIds}, {"sin", &sinData}, {"cos", &cosData}
         }, {}, {{"rotaryDim", rotaryDim}});
     }
 
     void RepeatPenalty(Data &input, const Data &penalty) {
-        curExecutor->Run("RepeatPenalty", {
+        curExecutor->Run(OP_REPEATPENALTY, {
                 {"input", &input}, {"penalty", (Data*)&penalty}
         }, {}, {});
     }
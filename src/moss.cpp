@@ -39,21 +39,34 @@ namespace fastllm {
         this->weight.embeddingNames.insert("transformer.wte.weight");
     }
 
+    MOSSModel::~MOSSModel() {
+        // 调度线程可能正在调用Forward, 需要在这个类的成员析构前停止
+        StopResponseLoop();
+    }
+
     void MOSSModel::LoadFromFile(const std::string &fileName) {
         this->weight.LoadFromFile(fileName);
+        ResolveWeights();
     }
 
-    void MOSSModel::CausalMask(Data &data, int start) {
-        int outer = data.dims[0] * data.dims[1];
-        int spatial = data.Count(2);
-        int n = data.dims[2], m = data.dims[3];
-        for (int o = 0; o < outer; o++) {
-            float *d = (float*)data.cpuData + o * spatial;
-            for (int i = 0; i < n; i++) {
-                if (i + start + 1 < m) {
-                    std::fill(d + i * m + i + start + 1, d + (i + 1) * m, -std::numeric_limits<float>::max());
-                }
-            }
+    void MOSSModel::ResolveWeights() {
+        wte = weight.FindWeight("transformer.wte.weight");
+        lnFWeight = weight.FindWeight("transformer.ln_f.weight");
+        lnFBias = weight.FindWeight("transformer.ln_f.bias");
+        lmHeadWeight = weight.FindWeight("lm_head.weight");
+        lmHeadBias = weight.FindWeight("lm_head.bias");
+        layers.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "transformer.h." + std::to_string(i);
+            MOSSLayerWeights &layer = layers[i];
+            layer.lnWeight = weight.FindWeight(pre + ".ln_1.weight");
+            layer.lnBias = weight.FindWeight(pre + ".ln_1.bias");
+            layer.qkvProj = weight.FindWeight(pre + ".attn.qkv_proj.weight");
+            layer.outProj = weight.FindWeight(pre + ".attn.out_proj.weight");
+            layer.fcInWeight = weight.FindWeight(pre + ".mlp.fc_in.weight");
+            layer.fcInBias = weight.FindWeight(pre + ".mlp.fc_in.bias");
+            layer.fcOutWeight = weight.FindWeight(pre + ".mlp.fc_out.weight");
+            layer.fcOutBias = weight.FindWeight(pre + ".mlp.fc_out.bias");
         }
     }
 
@@ -80,25 +93,24 @@ namespace fastllm {
 
     int MOSSModel::Forward(const Data &inputIds, const Data &attentionMask,
                             const Data &positionIds, const Data &penaltyFactor,
-                            std::vector <std::pair <Data, Data> > &pastKeyValues) {
+                            std::vector <std::pair <Data, Data> > &pastKeyValues, LLMSampler *sampler) {
         auto st = std::chrono::system_clock::now();
 
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
         Data inputEmbeddings;
-        Embedding(inputIds, this->weight["transformer.wte.weight"], inputEmbeddings);
+        Embedding(inputIds, *wte, inputEmbeddings);
         Data hiddenStates = inputEmbeddings;
 
         // MossBlock
         for (int i = 0; i < block_cnt; i++) {
             // 1.0 LayerNorm
+            MOSSLayerWeights &layer = layers[i];
             Data residual = hiddenStates;
-            std::string lnWeightName = "transformer.h." + std::to_string(i) + ".ln_1.weight";
-            std::string lnBiasName = "transformer.h." + std::to_string(i) + ".ln_1.bias";
-            LayerNorm(residual, weight[lnWeightName], weight[lnBiasName], -1, hiddenStates);
+            LayerNorm(residual, *layer.lnWeight, *layer.lnBias, -1, hiddenStates);
 
             // 1.1 Get query, key, value
-            std::string qkvProjName = "transformer.h." + std::to_string(i) + ".attn.qkv_proj.weight";
             Data qkv, q, k, v;
-            Linear(hiddenStates, weight[qkvProjName], Data(), qkv);
+            Linear(hiddenStates, *layer.qkvProj, Data(), qkv);
 
             qkv.Reshape({qkv.dims[0], qkv.dims[1], 4, -1});
             int per = qkv.dims.back() / 3;
@@ -117,60 +129,76 @@ namespace fastllm {
             PermuteSelf(k, {0, 2, 1, 3});
             PermuteSelf(v, {0, 2, 1, 3});
 
-            Data pastKey = pastKeyValues[i].first, pastValue = pastKeyValues[i].second;
-            Cat(pastKey, k, -2, pastKeyValues[i].first);
-            Cat(pastValue, v, -2, pastKeyValues[i].second);
+            int bsz = q.dims[0], heads = q.dims[1], seqlen = q.dims[2];
+            q.Reshape({bsz * heads, seqlen, head_dim});
+            k.Reshape({bsz * heads, seqlen, head_dim});
+            v.Reshape({bsz * heads, seqlen, head_dim});
 
-            k.CopyFrom(pastKeyValues[i].first);
-            v.CopyFrom(pastKeyValues[i].second);
+            Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
+            if (GetKVCachePaged()) {
+                // 分页存储的KV cache在CatDirect时按块追加，不需要预扩容
+                pastKey.SetPaged();
+                pastValue.SetPaged();
+            }
+            int unitLen = 64;
+            while (!pastKey.isPaged && ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
+                std::vector <int> newDims;
+                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
+                    newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
+                } else {
+                    newDims = pastKey.dims;
+                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
+                }
+                pastKey.Expansion(newDims);
+            }
+            while (!pastValue.isPaged && ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
+                std::vector <int> newDims;
+                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
+                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
+                } else {
+                    newDims = pastValue.dims;
+                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
+                }
+                pastValue.Expansion(newDims);
+            }
+            CatDirect(pastKey, k, 1);
+            CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
-            // 1.2.0 q * k^T
-            Data attnWeights;
-            MatMulTransB(q, k, attnWeights, 1.0 / scale_attn);
-
-            // 1.2.1 causal_mask
-            CausalMask(attnWeights, k.dims[2] - q.dims[2]);
-
-            // 1.2.2 attentionMask
-            // TODO: attentionMask, 这里似乎都是1, 暂且跳过了
-
-            // 1.2.3 softmax
-            Softmax(attnWeights, attnWeights, -1);
-
-            // 1.2.4 headMask
-            // TODO: headMask, 这里似乎都是None, 暂且跳过了
-
-            // 1.2.5 attention_weights * v
+            // TODO: attentionMask和headMask, 这里似乎都是1和None, 暂且跳过了
             Data attnOutput;
-            PermuteSelf(v, {0, 1, 3, 2});
-            MatMulTransB(attnWeights, v, attnOutput);
+            Attention(q, pastKey, pastValue, Data(), attnOutput, 1.0 / scale_attn, -10000, true);
+            attnOutput.Reshape({bsz, heads, seqlen, head_dim});
 
             // 1.3
             PermuteSelf(attnOutput, {0, 2, 1, 3});
             attnOutput.Reshape({attnOutput.dims[0], attnOutput.dims[1], -1});
-            std::string outProjName = "transformer.h." + std::to_string(i) + ".attn.out_proj.weight";
             Data realOutput;
-            Linear(attnOutput, weight[outProjName], Data(), realOutput);
+            Linear(attnOutput, *layer.outProj, Data(), realOutput);
 
             // 1.4 MLP
-            std::string fcInKeyName = "transformer.h." + std::to_string(i) + ".mlp.fc_in";
-            std::string fcOutKeyName = "transformer.h." + std::to_string(i) + ".mlp.fc_out";
             Data middle;
-            Linear(hiddenStates, weight[fcInKeyName + ".weight"], weight[fcInKeyName + ".bias"], middle);
+            Linear(hiddenStates, *layer.fcInWeight, *layer.fcInBias, middle);
             GeluNew(middle, middle);
-            Linear(middle, weight[fcOutKeyName + ".weight"], weight[fcOutKeyName + ".bias"], hiddenStates);
+            Linear(middle, *layer.fcOutWeight, *layer.fcOutBias, hiddenStates);
 
             AddTo(hiddenStates, residual);
             AddTo(hiddenStates, realOutput);
         }
 
-        LayerNorm(hiddenStates, weight["transformer.ln_f.weight"], weight["transformer.ln_f.bias"], -1, hiddenStates);
+        LayerNorm(hiddenStates, *lnFWeight, *lnFBias, -1, hiddenStates);
         Data logits;
-        Linear(hiddenStates, weight["lm_head.weight"], weight["lm_head.bias"], logits);
+        Linear(hiddenStates, *lmHeadWeight, *lmHeadBias, logits);
 
-        std::vector <std::pair <float, int> > v;
         int base = logits.dims[logits.dims.size() - 2] - 1;
+        if (sampler != nullptr && !sampler->IsGreedy()) {
+            logits.ToDevice(DataDevice::CPU);
+            return sampler->Sample((float*)logits.cpuData + base * logits.dims.back(), logits.dims.back());
+        }
+
+        std::vector <std::pair <float, int> > v;
         for (int i = 0; i < logits.dims.back(); i++) {
             v.push_back(std::make_pair(((float*)logits.cpuData)[base * logits.dims.back() + i], i));
         }
@@ -182,6 +210,156 @@ namespace fastllm {
         return v[0].second;
     }
 
+    std::vector <int> MOSSModel::ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts) {
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
+        int batch = contexts.size();
+        std::vector <float> ids, pids;
+        for (int b = 0; b < batch; b++) {
+            ids.push_back(contexts[b]->currentToken);
+            pids.push_back(contexts[b]->pastLen);
+        }
+        Data inputIds = Data(DataType::FLOAT32, {batch, 1}, ids);
+        Data positionIds = Data(DataType::FLOAT32, {batch, 1}, pids);
+
+        Data hiddenStates;
+        Embedding(inputIds, *wte, hiddenStates);
+
+        for (int i = 0; i < block_cnt; i++) {
+            // 1.0 LayerNorm
+            MOSSLayerWeights &layer = layers[i];
+            Data residual = hiddenStates;
+            LayerNorm(residual, *layer.lnWeight, *layer.lnBias, -1, hiddenStates);
+
+            // 1.1 Get query, key, value, 所有请求一起计算: [batch, 1, embed_dim]
+            Data qkv, q, k, v;
+            Linear(hiddenStates, *layer.qkvProj, Data(), qkv);
+
+            qkv.Reshape({qkv.dims[0], qkv.dims[1], 4, -1});
+            int per = qkv.dims.back() / 3;
+            Split(qkv, -1, 0, per, q);
+            Split(qkv, -1, per, per * 2, v);
+            Split(qkv, -1, per * 2, per * 3, k);
+
+            q.Reshape({batch, 1, -1, head_dim});
+            k.Reshape({batch, 1, -1, head_dim});
+            v.Reshape({batch, 1, -1, head_dim});
+
+            RotatePosition2D(q, positionIds);
+            RotatePosition2D(k, positionIds);
+
+            // 1.2 Attention: 每个请求的KV cache长度不同，逐个请求计算
+            int heads = q.dims[2];
+            Data curQ, curK, curV, curOutput;
+            Data attnOutput = Data(DataType::FLOAT32);
+            attnOutput.Expansion({batch, 1, heads * head_dim});
+            for (int b = 0; b < batch; b++) {
+                Data &pastKey = contexts[b]->pastKeyValues[i].first, &pastValue = contexts[b]->pastKeyValues[i].second;
+                if (GetKVCachePaged()) {
+                    pastKey.SetPaged();
+                    pastValue.SetPaged();
+                }
+
+                // 只有一个位置, [1, 1, heads, head_dim]和[heads, 1, head_dim]的排列相同
+                Split(q, 0, b, b + 1, curQ);
+                Split(k, 0, b, b + 1, curK);
+                Split(v, 0, b, b + 1, curV);
+                curQ.Reshape({heads, 1, head_dim});
+                curK.Reshape({heads, 1, head_dim});
+                curV.Reshape({heads, 1, head_dim});
+
+                // prompt已经处理过，KV cache一定非空
+                int unitLen = 64;
+                while (!pastKey.isPaged && pastKey.dims[1] + curK.dims[1] > pastKey.expansionDims[1]) {
+                    std::vector <int> newDims = pastKey.dims;
+                    newDims[1] += unitLen;
+                    pastKey.Expansion(newDims);
+                }
+                while (!pastValue.isPaged && pastValue.dims[1] + curV.dims[1] > pastValue.expansionDims[1]) {
+                    std::vector <int> newDims = pastValue.dims;
+                    newDims[1] += unitLen;
+                    pastValue.Expansion(newDims);
+                }
+                CatDirect(pastKey, curK, 1);
+                CatDirect(pastValue, curV, 1);
+
+                Attention(curQ, pastKey, pastValue, Data(), curOutput, 1.0 / scale_attn, -10000, true);
+                curOutput.Reshape({1, 1, heads * head_dim});
+                CatDirect(attnOutput, curOutput, 0);
+            }
+
+            // 1.3
+            Data realOutput;
+            Linear(attnOutput, *layer.outProj, Data(), realOutput);
+
+            // 1.4 MLP
+            Data middle;
+            Linear(hiddenStates, *layer.fcInWeight, *layer.fcInBias, middle);
+            GeluNew(middle, middle);
+            Linear(middle, *layer.fcOutWeight, *layer.fcOutBias, hiddenStates);
+
+            AddTo(hiddenStates, residual);
+            AddTo(hiddenStates, realOutput);
+        }
+
+        LayerNorm(hiddenStates, *lnFWeight, *lnFBias, -1, hiddenStates);
+        Data logits, topk;
+        Linear(hiddenStates, *lmHeadWeight, *lmHeadBias, logits);
+        std::vector <LLMSampler*> samplers;
+        for (int b = 0; b < batch; b++) {
+            samplers.push_back(&contexts[b]->sampler);
+        }
+        std::vector <int> lastRet;
+        if (!NeedSampling(samplers)) {
+            TopK(logits, topk, 1);
+            topk.ToDevice(DataDevice::CPU);
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back((int)(((float *) topk.cpuData)[b * 2] + 1e-3));
+            }
+        } else {
+            logits.ToDevice(DataDevice::CPU);
+            int vocabSize = logits.dims.back();
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back(LLMSampling(samplers[b], (float *) logits.cpuData + (uint64_t) b * vocabSize, vocabSize));
+            }
+        }
+        for (int b = 0; b < batch; b++) {
+            contexts[b]->pastLen++;
+        }
+        return lastRet;
+    }
+
+    void MOSSModel::FillLLMInputs(const ResponseContext &context,
+                                  Data &inputIds, Data &attentionMask, Data &positionIds) {
+        if (context.pastLen == 0) {
+            int len = context.promptTokens.size();
+            std::vector <float> vpids = std::vector <float> (len, 0);
+            for (int i = 0; i < len; i++) {
+                vpids[i] = i;
+            }
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, len}, context.promptTokens));
+            attentionMask.CopyFrom(Data(DataType::FLOAT32, {1, len}, std::vector <float> (len, 1.0f)));
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, len}, vpids));
+        } else {
+            int len = context.pastLen + 1;
+            inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float) context.currentToken}));
+            attentionMask.CopyFrom(Data(DataType::FLOAT32, {1, len}, std::vector <float> (len, 1.0f)));
+            positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float) (len - 1)}));
+        }
+    }
+
+    bool MOSSModel::IsEndToken(int token) {
+        return token == 106068;
+    }
+
+    std::vector <int> MOSSModel::GetPromptTokens(const std::string &input) {
+        Data inputIds = this->weight.tokenizer.Encode(input);
+        std::vector <int> ret;
+        for (int i = 0; i < inputIds.Count(0); i++) {
+            ret.push_back((int)((float*)inputIds.cpuData)[i]);
+        }
+        return ret;
+    }
+
     std::string MOSSModel::Response(const std::string &input, RuntimeResult retCb) {
         Data inputIds = this->weight.tokenizer.Encode(input);
         Data attentionMask = inputIds;
@@ -197,23 +375,22 @@ namespace fastllm {
             ((float *) positionIds.cpuData)[i] = i;
         }
 
-        std::vector<float> results;
+        DecodeStream decodeStream(&weight.tokenizer);
         std::string retString = "";
 		int index = 0;
+        LLMSampler sampler;
+        InitSampler(sampler);
         while (true) {
-            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues);
+            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues, &sampler);
             if (ret == 106068) {
                 break;
             }
 
-            results.push_back(ret);
-            std::string current = weight.tokenizer.Decode(
-                    Data(DataType::FLOAT32, {(int) results.size()}, results)).c_str();
+            const std::string &current = decodeStream.Put(ret);
             retString += current;
 			if (retCb)
 				retCb(index++, current.c_str());
             fflush(stdout);
-            results.clear();
 
             len++;
             inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float) ret}));
@@ -221,13 +398,19 @@ namespace fastllm {
             positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float) (len - 1)}));
         }
 
+        const std::string &restString = decodeStream.Flush();
+        if (!restString.empty()) {
+            retString += restString;
+            if (retCb)
+                retCb(index++, restString.c_str());
+        }
 		if (retCb)
 			retCb(index++, retString.c_str());
         // printf("%s\n", weight.tokenizer.Decode(Data(DataType::FLOAT32, {(int)results.size()}, results)).c_str());
         return retString;
     }
 
-    void MOSSModel::SaveLowBitModel(const std::string &fileName, int bit) {
+    void MOSSModel::SaveLowBitModel(const std::string &fileName, int bit, int groupSize) {
         Data inputIds = Data(DataType::FLOAT32, {1, 1}, {(float) 1});
         Data attentionMask = Data(DataType::FLOAT32, {1, 1}, std::vector<float>(1, 1.0f));
         Data positionIds = Data(DataType::FLOAT32, {1, 1}, {(float) (0)});
@@ -236,6 +419,6 @@ namespace fastllm {
             pastKeyValues.push_back(std::make_pair(Data(), Data()));
         }
         Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues);
-        this->weight.SaveLowBitModel(fileName, bit);
+        this->weight.SaveLowBitModel(fileName, bit, groupSize);
     }
 }
\ No newline at end of file
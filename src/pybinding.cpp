@@ -21,7 +21,11 @@ PYBIND11_MODULE(pyfastllm, m) {
   m.def("set_threads", &fastllm::SetThreads)
     .def("get_threads", &fastllm::GetThreads)
     .def("set_low_memory", &fastllm::SetLowMemMode)
-    .def("get_low_memory", &fastllm::GetLowMemMode);
+    .def("get_low_memory", &fastllm::GetLowMemMode)
+    .def("set_mmap", &fastllm::SetMmapMode)
+    .def("get_mmap", &fastllm::GetMmapMode)
+    .def("set_weight_repack", &fastllm::SetWeightRepack, py::arg("repack"), py::arg("cache") = true)
+    .def("get_weight_repack", &fastllm::GetWeightRepack);
 
 
   py::class_<fastllm::ChatGLMModel>(m, "ChatGLMModel")
@@ -29,20 +33,23 @@ PYBIND11_MODULE(pyfastllm, m) {
     .def("load_weights", &fastllm::ChatGLMModel::LoadFromFile)
     .def("response", &fastllm::ChatGLMModel::Response)
     .def("warmup", &fastllm::ChatGLMModel::WarmUp)
-    .def("save_lowbit_model", &fastllm::ChatGLMModel::SaveLowBitModel);
+    .def("save_lowbit_model", &fastllm::ChatGLMModel::SaveLowBitModel,
+         py::arg("fileName"), py::arg("bit"), py::arg("groupSize") = -1);
 
   py::class_<fastllm::MOSSModel>(m, "MOSSModel")
     .def(py::init<>())
     .def("load_weights", &fastllm::MOSSModel::LoadFromFile)
     .def("response", &fastllm::MOSSModel::Response)
-    .def("save_lowbit_model", &fastllm::MOSSModel::SaveLowBitModel);
+    .def("save_lowbit_model", &fastllm::MOSSModel::SaveLowBitModel,
+         py::arg("fileName"), py::arg("bit"), py::arg("groupSize") = -1);
 
   py::class_<fastllm::VicunaModel>(m, "VicunaModel")
     .def(py::init<>())
     .def("load_weights", &fastllm::VicunaModel::LoadFromFile)
     .def("response", &fastllm::VicunaModel::Response)
     .def("warmup", &fastllm::VicunaModel::WarmUp)
-    .def("save_lowbit_model", &fastllm::VicunaModel::SaveLowBitModel);
+    .def("save_lowbit_model", &fastllm::VicunaModel::SaveLowBitModel,
+         py::arg("fileName"), py::arg("bit"), py::arg("groupSize") = -1);
 
 #ifdef VERSION_INFO
     m.attr("__version__") = VERSION_INFO;
@@ -28,6 +28,11 @@ namespace fastllm {
         weight.embeddingNames.insert("model.embed_tokens.weight");
     }
 
+    VicunaModel::~VicunaModel() {
+        // 调度线程可能正在调用Forward, 需要在这个类的成员析构前停止
+        StopResponseLoop();
+    }
+
     void VicunaModel::RotatePosition2D(fastllm::Data &data, const fastllm::Data &positionIds) {
         int outer = data.dims[0] * data.dims[1];
         int spatial = data.Count(2);
@@ -51,39 +56,52 @@ namespace fastllm {
 
     void VicunaModel::LoadFromFile(const std::string &fileName) {
         this->weight.LoadFromFile(fileName);
+        ResolveWeights();
+    }
+
+    void VicunaModel::ResolveWeights() {
+        embedTokens = weight.FindWeight("model.embed_tokens.weight");
+        normWeight = weight.FindWeight("model.norm.weight");
+        lmHead = weight.FindWeight("lm_head.weight");
+        layers.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            VicunaLayerWeights &layer = layers[i];
+            layer.inputLNWeight = weight.FindWeight(pre + ".input_layernorm.weight");
+            layer.postLNWeight = weight.FindWeight(pre + ".post_attention_layernorm.weight");
+            layer.qWeight = weight.FindWeight(pre + ".self_attn.q_proj.weight");
+            layer.kWeight = weight.FindWeight(pre + ".self_attn.k_proj.weight");
+            layer.vWeight = weight.FindWeight(pre + ".self_attn.v_proj.weight");
+            layer.oWeight = weight.FindWeight(pre + ".self_attn.o_proj.weight");
+            layer.gateWeight = weight.FindWeight(pre + ".mlp.gate_proj.weight");
+            layer.upWeight = weight.FindWeight(pre + ".mlp.up_proj.weight");
+            layer.downWeight = weight.FindWeight(pre + ".mlp.down_proj.weight");
+        }
     }
 
     int VicunaModel::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                               const fastllm::Data &positionIds, const Data &penaltyFactor,
-                              std::vector<std::pair<Data, Data>> &pastKeyValues) {
-TimeRecord timeRecord;
-timeRecord.Clear();
-timeRecord.Record();
+                              std::vector<std::pair<Data, Data>> &pastKeyValues, LLMSampler *sampler) {
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
         Data hiddenStates;
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        Embedding(inputIds, *embedTokens, hiddenStates);
         for (int i = 0; i < block_cnt; i++) {
+            VicunaLayerWeights &layer = layers[i];
             Data attenInput;
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    1e-6, attenInput);
-timeRecord.Record("rms");
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
+            RMSNorm(hiddenStates, *layer.inputLNWeight, 1e-6, attenInput);
 
             // 1.1 Get q, k, v
             Data q, k, v;
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
 
-            Linear(attenInput, weight[qWeightName], Data(), q);
-            Linear(attenInput, weight[kWeightName], Data(), k);
-            Linear(attenInput, weight[vWeightName], Data(), v);
+            Linear(attenInput, *layer.qWeight, Data(), q);
+            Linear(attenInput, *layer.kWeight, Data(), k);
+            Linear(attenInput, *layer.vWeight, Data(), v);
 
             std::vector <int> qkvSize = {bsz, seqlen, num_attention_heads, -1};
             q.Reshape(qkvSize);
             k.Reshape(qkvSize);
             v.Reshape(qkvSize);
-timeRecord.Record("qkv");
 
             q.ToDevice(DataDevice::CPU);
             k.ToDevice(DataDevice::CPU);
@@ -99,15 +117,20 @@ timeRecord.Record("qkv");
 
             PermuteSelf(q, {1, 0, 2});
             PermuteSelf(k, {1, 0, 2});
-            PermuteSelf(v, {1, 2, 0});
+            PermuteSelf(v, {1, 0, 2});
 
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
+            if (GetKVCachePaged()) {
+                // 分页存储的KV cache在CatDirect时按块追加，不需要预扩容
+                pastKey.SetPaged();
+                pastValue.SetPaged();
+            }
             int unitLen = 64;
 #ifdef USE_CUDA
             unitLen = 128;
 #endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
+            while (!pastKey.isPaged && ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
                     newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
@@ -117,72 +140,177 @@ timeRecord.Record("qkv");
                 }
                 pastKey.Expansion(newDims);
             }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[2] > pastValue.expansionDims[2]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[2] + v.dims[2] > pastValue.expansionDims[2])) {
+            while (!pastValue.isPaged && ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1]))) {
                 std::vector <int> newDims;
                 if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], v.dims[1], ((v.dims[2] - 1) / unitLen + 1) * unitLen};
+                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
                 } else {
                     newDims = pastValue.dims;
-                    newDims[2] += ((v.dims[2] - 1) / unitLen + 1) * unitLen;
+                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
                 }
                 pastValue.Expansion(newDims);
             }
 
             CatDirect(pastKey, k, 1);
-            CatDirect(pastValue, v, 2);
+            CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
-            // 1.2.0 q * k^T
-            Data attenWeights, attenOutput;
-            MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
-            attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
-            if (attentionMask.dims.size() != 0) {
-                AttentionMask(attenWeights, attentionMask, -1e100);
-            }
-            Softmax(attenWeights, attenWeights, -1);
-            MatMulTransB(attenWeights, pastValue, attenOutput);
-
-            attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
+            // LLaMA结构的mask就是因果mask，在Attention中隐式计算
+            Data attenOutput;
+            Attention(q, pastKey, pastValue, Data(), attenOutput, 1.0 / sqrt(head_dim), -10000, true);
             PermuteSelf(attenOutput, {1, 0, 2});
             attenOutput.Reshape({bsz, seqlen, -1});
 
             Data attenLastOutput;
-            Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
+            Linear(attenOutput, *layer.oWeight, Data(), attenLastOutput);
             AddTo(hiddenStates, attenLastOutput);
-timeRecord.Record("attn");
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-6, attenInput);
-timeRecord.Record("rms");
+            RMSNorm(hiddenStates, *layer.postLNWeight, 1e-6, attenInput);
             Data w1, w2, w3;
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-timeRecord.Record("mlp linerar");
+            Linear(attenInput, *layer.gateWeight, Data(), w1);
+            Linear(attenInput, *layer.upWeight, Data(), w3);
             Silu(w1, w1);
-timeRecord.Record("mlp silu");
             MulTo(w1, w3);
-timeRecord.Record("mlp mul");
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
-timeRecord.Record("mlp linerar");
+            Linear(w1, *layer.downWeight, Data(), w2);
             AddTo(hiddenStates, w2);
-timeRecord.Record("mlp add");
         }
 
-        RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-6, hiddenStates);
-timeRecord.Record("rms");
+        RMSNorm(hiddenStates, *normWeight, 1e-6, hiddenStates);
         Data logits;
-        Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+        Linear(hiddenStates, *lmHead, Data(), logits);
         logits.ToDevice(DataDevice::CPU);
-timeRecord.Record("logits");
-//timeRecord.Print();
-        std::pair <float, int> ret = std::make_pair(-1e9, -1);
         int base = logits.dims[1] - 1;
+        if (sampler != nullptr && !sampler->IsGreedy()) {
+            return sampler->Sample((float*)logits.cpuData + base * logits.dims.back(), logits.dims.back());
+        }
+
+        std::pair <float, int> ret = std::make_pair(-1e9, -1);
         for (int i = 0; i < logits.dims.back(); i++) {
             ret = max(ret, std::make_pair(((float*)logits.cpuData)[base * logits.dims.back() + i], i));
         }
         return ret.second;
     }
 
+    std::vector <int> VicunaModel::ForwardDecodeBatch(const std::vector <ResponseContext*> &contexts) {
+        AssertInFastLLM(layers.size() == block_cnt, "Forward error: block_cnt should be set before LoadFromFile.\n");
+        int batch = contexts.size();
+        std::vector <float> ids, pids;
+        for (int b = 0; b < batch; b++) {
+            ids.push_back(contexts[b]->currentToken);
+            pids.push_back(contexts[b]->pastLen);
+        }
+        Data inputIds = Data(DataType::FLOAT32, {batch, 1}, ids);
+        Data positionIds = Data(DataType::FLOAT32, {batch, 1}, pids);
+
+        Data hiddenStates;
+        Embedding(inputIds, *embedTokens, hiddenStates);
+        for (int i = 0; i < block_cnt; i++) {
+            VicunaLayerWeights &layer = layers[i];
+            Data attenInput;
+            RMSNorm(hiddenStates, *layer.inputLNWeight, 1e-6, attenInput);
+
+            // 1.1 Get q, k, v, 所有请求一起计算: [batch, 1, embed_dim]
+            Data q, k, v;
+            Linear(attenInput, *layer.qWeight, Data(), q);
+            Linear(attenInput, *layer.kWeight, Data(), k);
+            Linear(attenInput, *layer.vWeight, Data(), v);
+            std::vector <int> qkvSize = {batch, 1, num_attention_heads, -1};
+            q.Reshape(qkvSize);
+            k.Reshape(qkvSize);
+            v.Reshape(qkvSize);
+
+            q.ToDevice(DataDevice::CPU);
+            k.ToDevice(DataDevice::CPU);
+            RotatePosition2D(q, positionIds);
+            RotatePosition2D(k, positionIds);
+            q.ToDevice(DataDevice::CUDA);
+            k.ToDevice(DataDevice::CUDA);
+
+            // 1.2 Attention: 每个请求的KV cache长度不同，逐个请求计算
+            Data curQ, curK, curV, curOutput;
+            Data attenOutput = Data(DataType::FLOAT32);
+            attenOutput.Expansion({batch, 1, embed_dim});
+            for (int b = 0; b < batch; b++) {
+                Data &pastKey = contexts[b]->pastKeyValues[i].first, &pastValue = contexts[b]->pastKeyValues[i].second;
+                if (GetKVCachePaged()) {
+                    pastKey.SetPaged();
+                    pastValue.SetPaged();
+                }
+
+                // 只有一个位置, [1, 1, heads, head_dim]和[heads, 1, head_dim]的排列相同
+                Split(q, 0, b, b + 1, curQ);
+                Split(k, 0, b, b + 1, curK);
+                Split(v, 0, b, b + 1, curV);
+                curQ.Reshape({num_attention_heads, 1, -1});
+                curK.Reshape({num_attention_heads, 1, -1});
+                curV.Reshape({num_attention_heads, 1, -1});
+
+                // prompt已经处理过，KV cache一定非空
+                int unitLen = 64;
+#ifdef USE_CUDA
+                unitLen = 128;
+#endif
+                while (!pastKey.isPaged && pastKey.dims[1] + curK.dims[1] > pastKey.expansionDims[1]) {
+                    std::vector <int> newDims = pastKey.dims;
+                    newDims[1] += unitLen;
+                    pastKey.Expansion(newDims);
+                }
+                while (!pastValue.isPaged && pastValue.dims[1] + curV.dims[1] > pastValue.expansionDims[1]) {
+                    std::vector <int> newDims = pastValue.dims;
+                    newDims[1] += unitLen;
+                    pastValue.Expansion(newDims);
+                }
+                CatDirect(pastKey, curK, 1);
+                CatDirect(pastValue, curV, 1);
+
+                Attention(curQ, pastKey, pastValue, Data(), curOutput, 1.0 / sqrt(head_dim), -10000, true);
+                curOutput.Reshape({1, 1, embed_dim});
+                CatDirect(attenOutput, curOutput, 0);
+            }
+
+            Data attenLastOutput;
+            Linear(attenOutput, *layer.oWeight, Data(), attenLastOutput);
+            AddTo(hiddenStates, attenLastOutput);
+
+            // 2. mlp
+            RMSNorm(hiddenStates, *layer.postLNWeight, 1e-6, attenInput);
+            Data w1, w2, w3;
+            Linear(attenInput, *layer.gateWeight, Data(), w1);
+            Linear(attenInput, *layer.upWeight, Data(), w3);
+            Silu(w1, w1);
+            MulTo(w1, w3);
+            Linear(w1, *layer.downWeight, Data(), w2);
+            AddTo(hiddenStates, w2);
+        }
+
+        RMSNorm(hiddenStates, *normWeight, 1e-6, hiddenStates);
+        Data logits, topk;
+        Linear(hiddenStates, *lmHead, Data(), logits);
+        std::vector <LLMSampler*> samplers;
+        for (int b = 0; b < batch; b++) {
+            samplers.push_back(&contexts[b]->sampler);
+        }
+        std::vector <int> lastRet;
+        if (!NeedSampling(samplers)) {
+            TopK(logits, topk, 1);
+            topk.ToDevice(DataDevice::CPU);
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back((int)(((float *) topk.cpuData)[b * 2] + 1e-3));
+            }
+        } else {
+            logits.ToDevice(DataDevice::CPU);
+            int vocabSize = logits.dims.back();
+            for (int b = 0; b < batch; b++) {
+                lastRet.push_back(LLMSampling(samplers[b], (float *) logits.cpuData + (uint64_t) b * vocabSize, vocabSize));
+            }
+        }
+        for (int b = 0; b < batch; b++) {
+            contexts[b]->pastLen++;
+        }
+        return lastRet;
+    }
+
     std::string VicunaModel::Response(const std::string& input, RuntimeResult retCb) {
         int bos = atoi(this->weight.dicts["bos"].c_str());
         int eos = atoi(this->weight.dicts["eos"].c_str());
@@ -197,16 +325,12 @@ timeRecord.Record("logits");
         int seqLen = ids.size();
         inputIds.CopyFrom(Data(DataType::FLOAT32, {1, seqLen}, ids));
 
-        std::vector <float> vmask = std::vector <float> (seqLen * seqLen, 0);
         std::vector <float> vpids = std::vector <float> (seqLen, 0);
         for (int i = 0; i < seqLen; i++) {
             vpids[i] = i;
-            for (int j = i + 1; j < seqLen; j++) {
-                vmask[i * seqLen + j] = 1;
-            }
         }
 
-        Data attentionMask = Data(DataType::FLOAT32, {seqLen, seqLen}, vmask);
+        Data attentionMask; // 因果mask在Attention中隐式计算
         Data positionIds = Data(DataType::FLOAT32, {1, seqLen}, vpids);
 
         std::vector <std::pair <Data, Data> > pastKeyValues;
@@ -217,33 +341,37 @@ timeRecord.Record("logits");
 
         std::string retString = "";
         int len = seqLen;
-        std::vector <float> results;
+        DecodeStream decodeStream(&weight.tokenizer);
         int index = 0;
+        LLMSampler sampler;
+        InitSampler(sampler);
         while (true) {
             auto st = std::chrono::system_clock::now();
 
-            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues);
+            int ret = Forward(inputIds, attentionMask, positionIds, Data(), pastKeyValues, &sampler);
             if (ret == eos) {
                 break;
             }
 
-            results.push_back(ret);
-            std::string curString = weight.tokenizer.Decode(Data(DataType::FLOAT32, {(int)results.size()}, results)).c_str();
+            const std::string &curString = decodeStream.Put(ret);
             retString += curString;
             if (retCb)
                 retCb(index++, curString.c_str());
             fflush(stdout);
-            results.clear();
 
-            attentionMask.ToDevice(DataDevice::CPU);
             positionIds.ToDevice(DataDevice::CPU);
             inputIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)ret}));
-            attentionMask = Data();
             positionIds.CopyFrom(Data(DataType::FLOAT32, {1, 1}, {(float)len}));
             len++;
 
             //printf("spend %f s.\n", GetSpan(st, std::chrono::system_clock::now()));
         }
+        const std::string &restString = decodeStream.Flush();
+        if (!restString.empty()) {
+            retString += restString;
+            if (retCb)
+                retCb(index++, restString.c_str());
+        }
         if (retCb)
             retCb(-1, retString.c_str());
 
@@ -265,8 +393,8 @@ timeRecord.Record("logits");
         printf("finish.\n");
     }
 
-    void VicunaModel::SaveLowBitModel(const std::string &fileName, int bit) {
+    void VicunaModel::SaveLowBitModel(const std::string &fileName, int bit, int groupSize) {
         WarmUp();
-        this->weight.SaveLowBitModel(fileName, bit);
+        this->weight.SaveLowBitModel(fileName, bit, groupSize);
     }
 }
\ No newline at end of file
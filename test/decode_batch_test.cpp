@@ -0,0 +1,214 @@
+//
+// Created by huangyuyang on 7/14/23.
+//
+
+// 连续批处理的ForwardDecodeBatch测试: 用随机的小模型, 检查合成batch解码和逐个请求调用Forward得到的token一致
+
+#include "fastllm.h"
+#include "vicuna.h"
+#include "baichuan.h"
+#include "moss.h"
+
+#include <memory>
+
+static int failed = 0;
+
+static const int vocabSize = 97, dim = 64, heads = 4, inter = 128, layerCnt = 2;
+
+static void AddWeight(fastllm::WeightMap &weights, const std::string &name, const std::vector <int> &dims,
+                      std::mt19937 &rng, float base = 0.0f, float range = 0.2f) {
+    int len = 1;
+    for (int d : dims) {
+        len *= d;
+    }
+    std::uniform_real_distribution <float> dis(-range, range);
+    std::vector <float> values(len);
+    for (int i = 0; i < len; i++) {
+        values[i] = base + dis(rng);
+    }
+    weights.weight[name].CopyFrom(fastllm::Data(fastllm::DataType::FLOAT32, dims, values));
+}
+
+// 写入随机权重后按模型自己的LoadFromFile读回, 保证权重指针已经解析
+static void LoadRandomWeights(fastllm::basellm *model, const std::string &name,
+                              const std::function <void(fastllm::WeightMap&, std::mt19937&)> &addWeights) {
+    std::string fileName = "decode_batch_test_" + name + ".flm";
+    {
+        fastllm::WeightMap weights;
+        std::mt19937 rng(1234);
+        addWeights(weights, rng);
+        weights.SaveModel(fileName);
+    }
+    model->embed_dim = dim;
+    model->num_attention_heads = heads;
+    model->head_dim = dim / heads;
+    model->block_cnt = layerCnt;
+    model->LoadFromFile(fileName);
+    remove(fileName.c_str());
+}
+
+static void InitContext(fastllm::ResponseContext &context, int blockCnt) {
+    for (int i = 0; i < blockCnt; i++) {
+        context.pastKeyValues.push_back(std::make_pair(fastllm::Data(fastllm::DataType::FLOAT32),
+                                                       fastllm::Data(fastllm::DataType::FLOAT32)));
+    }
+}
+
+static int ForwardOne(fastllm::basellm *model, const std::vector <float> &ids, int start,
+                      std::vector <std::pair <fastllm::Data, fastllm::Data> > &pastKeyValues) {
+    int len = ids.size();
+    std::vector <float> pids(len);
+    for (int i = 0; i < len; i++) {
+        pids[i] = start + i;
+    }
+    return model->Forward(fastllm::Data(fastllm::DataType::FLOAT32, {1, len}, ids), fastllm::Data(),
+                          fastllm::Data(fastllm::DataType::FLOAT32, {1, len}, pids), fastllm::Data(), pastKeyValues);
+}
+
+// 几个不同长度的prompt先各自prefill, 再用ForwardDecodeBatch和逐个Forward分别解码steps轮, 比较每一轮的token
+static void CheckDecodeBatch(const std::string &name, fastllm::basellm *model, int steps = 4) {
+    std::vector <int> promptLens = {3, 7, 12, 5};
+    int batch = promptLens.size();
+    std::vector <fastllm::ResponseContext> contexts(batch);
+    std::vector <std::vector <std::pair <fastllm::Data, fastllm::Data> > > singleKVs(batch);
+    std::vector <int> singleTokens(batch);
+    std::vector <fastllm::ResponseContext*> pointers;
+    for (int b = 0; b < batch; b++) {
+        std::vector <float> ids;
+        for (int i = 0; i < promptLens[b]; i++) {
+            ids.push_back((b * 31 + i * 7) % vocabSize);
+        }
+        InitContext(contexts[b], model->block_cnt);
+        contexts[b].currentToken = ForwardOne(model, ids, 0, contexts[b].pastKeyValues);
+        contexts[b].pastLen = promptLens[b];
+        fastllm::ResponseContext single;
+        InitContext(single, model->block_cnt);
+        singleKVs[b] = single.pastKeyValues;
+        singleTokens[b] = ForwardOne(model, ids, 0, singleKVs[b]);
+        pointers.push_back(&contexts[b]);
+    }
+
+    bool ok = true;
+    for (int step = 0; step < steps; step++) {
+        std::vector <int> tokens = model->ForwardDecodeBatch(pointers);
+        for (int b = 0; b < batch; b++) {
+            int single = ForwardOne(model, {(float) singleTokens[b]}, promptLens[b] + step, singleKVs[b]);
+            if (tokens[b] != single || contexts[b].pastLen != promptLens[b] + step + 1) {
+                printf("%s: step %d, request %d: batch token %d, single token %d.\n",
+                       name.c_str(), step, b, tokens[b], single);
+                ok = false;
+            }
+            contexts[b].currentToken = tokens[b];
+            singleTokens[b] = single;
+        }
+    }
+    printf("%s: %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    failed += !ok;
+}
+
+// prompt中含有badToken时prefill抛出异常, 用来检查调度线程出错后的处理
+class FailingVicunaModel : public fastllm::VicunaModel {
+public:
+    static const int badToken = vocabSize - 1;
+
+    int Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask, const fastllm::Data &positionIds,
+                const fastllm::Data &penaltyFactor, std::vector <std::pair <fastllm::Data, fastllm::Data> > &pastKeyValues,
+                fastllm::LLMSampler *sampler = nullptr) override {
+        fastllm::Data ids;
+        ids.CopyFrom(inputIds);
+        ids.ToDevice(fastllm::DataDevice::CPU);
+        for (int i = 0; i < ids.Count(0); i++) {
+            if ((int)((float*)ids.cpuData)[i] == badToken) {
+                throw std::string("bad token");
+            }
+        }
+        return VicunaModel::Forward(inputIds, attentionMask, positionIds, penaltyFactor, pastKeyValues, sampler);
+    }
+};
+
+// 出错的请求返回-3, 同时在运行的请求和之后提交的请求不受影响
+static void CheckResponseLoopError(fastllm::basellm *model) {
+    int good = model->LaunchResponseTokens({1, 2, 3}, 4);
+    int bad = model->LaunchResponseTokens({4, FailingVicunaModel::badToken, 5}, 4);
+    int ret;
+    while ((ret = model->FetchResponseTokens(bad)) >= 0) {
+    }
+    bool ok = (ret == -3);
+    int next = model->LaunchResponseTokens({6, 7}, 4);
+    for (int handle : {good, next}) {
+        while ((ret = model->FetchResponseTokens(handle)) >= 0) {
+        }
+        ok &= (ret == -1);
+    }
+    printf("response loop error: %s\n", ok ? "ok" : "FAILED");
+    failed += !ok;
+}
+
+int main() {
+    fastllm::SetThreads(4);
+
+    auto addVicunaWeights = [](fastllm::WeightMap &weights, std::mt19937 &rng) {
+        AddWeight(weights, "model.embed_tokens.weight", {vocabSize, dim}, rng, 0.0f, 1.0f);
+        AddWeight(weights, "model.norm.weight", {dim}, rng, 1.0f);
+        AddWeight(weights, "lm_head.weight", {vocabSize, dim}, rng);
+        for (int i = 0; i < layerCnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            AddWeight(weights, pre + ".input_layernorm.weight", {dim}, rng, 1.0f);
+            AddWeight(weights, pre + ".post_attention_layernorm.weight", {dim}, rng, 1.0f);
+            for (const char *proj : {"q_proj", "k_proj", "v_proj", "o_proj"}) {
+                AddWeight(weights, pre + ".self_attn." + proj + ".weight", {dim, dim}, rng);
+            }
+            AddWeight(weights, pre + ".mlp.gate_proj.weight", {inter, dim}, rng);
+            AddWeight(weights, pre + ".mlp.up_proj.weight", {inter, dim}, rng);
+            AddWeight(weights, pre + ".mlp.down_proj.weight", {dim, inter}, rng);
+        }
+    };
+    std::unique_ptr <fastllm::VicunaModel> vicuna(new fastllm::VicunaModel());
+    LoadRandomWeights(vicuna.get(), "vicuna", addVicunaWeights);
+    CheckDecodeBatch("vicuna", vicuna.get());
+
+    std::unique_ptr <FailingVicunaModel> failing(new FailingVicunaModel());
+    LoadRandomWeights(failing.get(), "failing", addVicunaWeights);
+    CheckResponseLoopError(failing.get());
+    failing.reset(); // 析构时调度线程仍在等待新请求
+
+    std::unique_ptr <fastllm::BaichuanModel> baichuan(new fastllm::BaichuanModel());
+    LoadRandomWeights(baichuan.get(), "baichuan", [](fastllm::WeightMap &weights, std::mt19937 &rng) {
+        AddWeight(weights, "model.embed_tokens.weight", {vocabSize, dim}, rng, 0.0f, 1.0f);
+        AddWeight(weights, "model.norm.weight", {dim}, rng, 1.0f);
+        AddWeight(weights, "lm_head.weight", {vocabSize, dim}, rng);
+        for (int i = 0; i < layerCnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            AddWeight(weights, pre + ".input_layernorm.weight", {dim}, rng, 1.0f);
+            AddWeight(weights, pre + ".post_attention_layernorm.weight", {dim}, rng, 1.0f);
+            AddWeight(weights, pre + ".self_attn.W_pack.weight", {dim * 3, dim}, rng);
+            AddWeight(weights, pre + ".self_attn.o_proj.weight", {dim, dim}, rng);
+            AddWeight(weights, pre + ".mlp.gate_proj.weight", {inter, dim}, rng);
+            AddWeight(weights, pre + ".mlp.up_proj.weight", {inter, dim}, rng);
+            AddWeight(weights, pre + ".mlp.down_proj.weight", {dim, inter}, rng);
+        }
+    });
+    CheckDecodeBatch("baichuan", baichuan.get());
+
+    std::unique_ptr <fastllm::MOSSModel> moss(new fastllm::MOSSModel());
+    LoadRandomWeights(moss.get(), "moss", [](fastllm::WeightMap &weights, std::mt19937 &rng) {
+        AddWeight(weights, "transformer.wte.weight", {vocabSize, dim}, rng, 0.0f, 1.0f);
+        AddWeight(weights, "transformer.ln_f.weight", {dim}, rng, 1.0f);
+        AddWeight(weights, "transformer.ln_f.bias", {dim}, rng);
+        AddWeight(weights, "lm_head.weight", {vocabSize, dim}, rng);
+        AddWeight(weights, "lm_head.bias", {vocabSize}, rng);
+        for (int i = 0; i < layerCnt; i++) {
+            std::string pre = "transformer.h." + std::to_string(i);
+            AddWeight(weights, pre + ".ln_1.weight", {dim}, rng, 1.0f);
+            AddWeight(weights, pre + ".ln_1.bias", {dim}, rng);
+            AddWeight(weights, pre + ".attn.qkv_proj.weight", {dim * 3, dim}, rng);
+            AddWeight(weights, pre + ".attn.out_proj.weight", {dim, dim}, rng);
+            AddWeight(weights, pre + ".mlp.fc_in.weight", {inter, dim}, rng);
+            AddWeight(weights, pre + ".mlp.fc_in.bias", {inter}, rng);
+            AddWeight(weights, pre + ".mlp.fc_out.weight", {dim, inter}, rng);
+            AddWeight(weights, pre + ".mlp.fc_out.bias", {dim}, rng);
+        }
+    });
+    CheckDecodeBatch("moss", moss.get());
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+//
+// Created by huangyuyang on 7/12/23.
+//
+
+// LLMSampler的采样分布测试: 多次采样, 检查每个token出现的频率和期望的概率一致
+
+#include "fastllm.h"
+
+#include <cmath>
+
+static int failed = 0;
+
+// 对logits采样draws次, 检查每个token的频率和expected相差不超过tolerance, expected中没有的token不能被采到
+void CheckDistribution(const std::string &name, const std::vector <float> &logits, int topK, float topP,
+                       const std::map <int, double> &expected, int draws = 20000, double tolerance = 0.01) {
+    fastllm::LLMSampler sampler;
+    sampler.Init(topK, topP, 1.0f, 42);
+    std::map <int, int> counts;
+    for (int i = 0; i < draws; i++) {
+        counts[sampler.Sample(logits.data(), logits.size())]++;
+    }
+    bool ok = true;
+    for (auto &it : counts) {
+        if (expected.find(it.first) == expected.end()) {
+            printf("%s: token %d is sampled %d times, but it should not be sampled.\n", name.c_str(), it.first, it.second);
+            ok = false;
+        }
+    }
+    for (auto &it : expected) {
+        double freq = (double) counts[it.first] / draws;
+        if (std::fabs(freq - it.second) > tolerance) {
+            printf("%s: token %d frequency %.4f, expected %.4f.\n", name.c_str(), it.first, freq, it.second);
+            ok = false;
+        }
+    }
+    printf("%s: %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    failed += !ok;
+}
+
+int main() {
+    // p0 = 0.85, p1 = 0.06, 剩下的0.09平均分给其余998个token
+    int vocabSize = 1000;
+    std::vector <float> logits(vocabSize, (float) log(0.09 / (vocabSize - 2)));
+    logits[0] = (float) log(0.85);
+    logits[1] = (float) log(0.06);
+
+    // top_p = 0.9: 0.85 < 0.9 <= 0.91, 保留token 0和1, 再按0.85 : 0.06归一化
+    CheckDistribution("top_p", logits, 0, 0.9f, {{0, 0.85 / 0.91}, {1, 0.06 / 0.91}});
+    // top_p = 0.8: 只保留token 0
+    CheckDistribution("top_p single", logits, 0, 0.8f, {{0, 1.0}});
+    // top_k = 2后的概率是0.85 : 0.06, top_p在这两个token上计算, 0.9 * 0.91 <= 0.85, 只保留token 0
+    CheckDistribution("top_k + top_p", logits, 2, 0.9f, {{0, 1.0}});
+    // 不截断时在整个词表上采样, token 0和1的频率和概率一致
+    std::map <int, double> full = {{0, 0.85}, {1, 0.06}};
+    for (int i = 2; i < vocabSize; i++) {
+        full[i] = 0.09 / (vocabSize - 2);
+    }
+    CheckDistribution("full vocab", logits, 0, 1.0f, full);
+    return failed == 0 ? 0 : 1;
+}
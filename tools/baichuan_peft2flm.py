@@ -31,15 +31,30 @@ if __name__ == "__main__":
     # 0. version id
     fo.write(struct.pack('i', 1));
 
-    # 0.1 bos, eos
-    fo.write(struct.pack('i', 2));
+    # 0.1 bos, eos, 分词方式
+    # sentencepiece的BPE按分数从高到低合并, 分数相同的优先级相同; 控制符, 未知字符和<0xXX>不参与合并
+    piece_size = tokenizer.sp_model.piece_size();
+    scores = sorted(set([tokenizer.sp_model.get_score(i) for i in range(piece_size)]), reverse = True);
+    score_rank = {score : i for i, score in enumerate(scores)};
+    merge_ranks = [];
+    for i in range(piece_size):
+        if tokenizer.sp_model.is_control(i) or tokenizer.sp_model.is_unknown(i) or tokenizer.sp_model.is_byte(i):
+            merge_ranks.append(-1);
+        else:
+            merge_ranks.append(score_rank[tokenizer.sp_model.get_score(i)]);
+    fo.write(struct.pack('i', 5));
     writeString(fo, "bos");
     writeString(fo, str(tokenizer.sp_model.bos_id()));
     writeString(fo, "eos");
     writeString(fo, str(tokenizer.sp_model.eos_id()));
+    writeString(fo, "tokenizer_type");
+    writeString(fo, "bpe");
+    writeString(fo, "tokenizer_add_dummy_prefix");
+    writeString(fo, "1");
+    writeString(fo, "tokenizer_merge_ranks");
+    writeString(fo, " ".join([str(x) for x in merge_ranks]));
 
     # 1. vocab
-    piece_size = tokenizer.sp_model.piece_size();
     fo.write(struct.pack('i', piece_size));
     for i in range(piece_size):
         s = tokenizer.sp_model.id_to_piece(i).encode();
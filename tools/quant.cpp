@@ -5,6 +5,7 @@
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <thread>
 
 #include "moss.h"
 #include "chatglm.h"
@@ -16,6 +17,8 @@ struct QuantConfig {
     std::string path; // 模型文件路径
     std::string output; // 输出文件路径
     int bits; // 量化位数
+    int groupSize = -1; // 分组量化时每组的大小, -1代表按通道量化
+    int threads = std::max(1, (int)std::thread::hardware_concurrency()); // 线程数, 默认使用全部核
 };
 
 void Usage() {
@@ -24,7 +27,9 @@ void Usage() {
     std::cout << "<-m|--model> <args>:              模型类型，默认为chatglm, 可以设置为chatglm, moss, vicuna, baichuan" << std::endl;
     std::cout << "<-p|--path> <args>:               模型文件的路径" << std::endl;
     std::cout << "<-b|--bits> <args>:               量化位数, 4 = int4, 8 = int8, 16 = fp16" << std::endl;
+    std::cout << "<-g|--group> <args>:              int4分组量化时每组的大小, 可以设置为32, 64, 128, 默认按通道量化" << std::endl;
     std::cout << "<-o|--output> <args>:             输出文件路径" << std::endl;
+    std::cout << "<-t|--threads> <args>:            使用的线程数量, 默认为CPU核数" << std::endl;
 }
 
 void ParseArgs(int argc, char **argv, QuantConfig &config) {
@@ -42,8 +47,12 @@ void ParseArgs(int argc, char **argv, QuantConfig &config) {
 			config.path = sargv[++i];
 		} else if (sargv[i] == "-b" || sargv[i] == "--bits") {
 			config.bits = atoi(sargv[++i].c_str());
+		} else if (sargv[i] == "-g" || sargv[i] == "--group") {
+			config.groupSize = atoi(sargv[++i].c_str());
 		} else if (sargv[i] == "-o" || sargv[i] == "--output") {
 			config.output = sargv[++i];
+		} else if (sargv[i] == "-t" || sargv[i] == "--threads") {
+			config.threads = atoi(sargv[++i].c_str());
 		} else {
 			Usage();
 			exit(-1);
@@ -54,27 +63,23 @@ void ParseArgs(int argc, char **argv, QuantConfig &config) {
 int main(int argc, char **argv) {
     QuantConfig config;
     ParseArgs(argc, argv, config);
+    fastllm::SetThreads(config.threads);
 
+    // 只用模型对象提供embedding的名字, 权重逐个从输入文件读取、量化后写出, 不会把整个模型读入内存
+    fastllm::basellm *model = nullptr;
     if (config.model == "moss") {
-        fastllm::MOSSModel moss;
-        moss.LoadFromFile(config.path);
-        moss.SaveLowBitModel(config.output, config.bits);
+        model = new fastllm::MOSSModel();
     } else if (config.model == "chatglm") {
-        fastllm::ChatGLMModel chatGlm;
-        chatGlm.LoadFromFile(config.path);
-        chatGlm.SaveLowBitModel(config.output, config.bits);
+        model = new fastllm::ChatGLMModel();
     } else if (config.model == "vicuna") {
-        fastllm::VicunaModel vicuna;
-        vicuna.LoadFromFile(config.path);
-        vicuna.SaveLowBitModel(config.output, config.bits);
+        model = new fastllm::VicunaModel();
     } else if (config.model == "baichuan") {
-        fastllm::BaichuanModel baichuan;
-        baichuan.LoadFromFile(config.path);
-        baichuan.SaveLowBitModel(config.output, config.bits);
+        model = new fastllm::BaichuanModel();
     } else {
         Usage();
         exit(-1);
     }
-
+    model->weight.SaveLowBitModelFromFile(config.path, config.output, config.bits, config.groupSize);
+    delete model;
     return 0;
-}
\ No newline at end of file
+}